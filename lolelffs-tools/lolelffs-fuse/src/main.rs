@@ -7,10 +7,13 @@ use fuser::{
 use libc::{c_int, EEXIST, EISDIR, ENOENT, ENOSPC, ENOTDIR, ENOTEMPTY, ENOTSUP};
 use log::{debug, error, info, warn};
 use lolelffs_tools::{Inode, LolelfFs, LOLELFFS_BLOCK_SIZE, LOLELFFS_ROOT_INO};
-use std::collections::HashMap;
+use std::collections::{HashMap, HashSet};
 use std::ffi::OsStr;
+use std::fs::File;
+use std::io::Write;
 use std::path::PathBuf;
-use std::sync::{Arc, Mutex};
+use std::sync::{mpsc, Arc, Mutex, RwLock};
+use std::thread;
 use std::time::{Duration, SystemTime, UNIX_EPOCH};
 
 // FUSE uses inode 1 as root, but lolelffs uses inode 0
@@ -54,26 +57,113 @@ struct Args {
     /// Enable debug logging
     #[arg(short, long)]
     debug: bool,
+
+    /// Number of worker threads serving read requests (defaults to the CPU count)
+    #[arg(short = 'j', long)]
+    threads: Option<usize>,
+
+    /// Append the inode number of each file to this file the first time it
+    /// is read, to feed `lolelffs relayout`
+    #[arg(long)]
+    trace: Option<PathBuf>,
+}
+
+/// Read trace: the files read since mount, in the order of their first read,
+/// written a line at a time so that it survives an unclean unmount
+struct Trace {
+    seen: HashSet<u32>,
+    out: File,
+}
+
+impl Trace {
+    fn create(path: &PathBuf) -> Result<Self> {
+        let file = File::options()
+            .create(true)
+            .append(true)
+            .open(path)
+            .with_context(|| format!("Failed to open trace file {:?}", path))?;
+        Ok(Trace {
+            seen: HashSet::new(),
+            out: file,
+        })
+    }
+
+    fn record(&mut self, inode_num: u32) {
+        if self.seen.insert(inode_num) {
+            if let Err(e) = writeln!(self.out, "{}", inode_num) {
+                warn!("Failed to write trace: {}", e);
+            }
+        }
+    }
+}
+
+/// Request handler queued for a worker thread
+type Job = Box<dyn FnOnce() + Send + 'static>;
+
+/// Fixed pool of threads that serve read-only requests. fuser dispatches
+/// every request from a single session thread, so handing lookups, reads and
+/// directory listings to the pool lets requests on different files proceed
+/// in parallel under the shared filesystem lock.
+struct Workers {
+    tx: mpsc::Sender<Job>,
+}
+
+impl Workers {
+    fn new(threads: usize) -> Self {
+        let (tx, rx) = mpsc::channel::<Job>();
+        let rx = Arc::new(Mutex::new(rx));
+
+        for i in 0..threads.max(1) {
+            let rx = Arc::clone(&rx);
+            thread::Builder::new()
+                .name(format!("lolelffs-worker-{}", i))
+                .spawn(move || loop {
+                    // The queue lock is released before the job runs
+                    let job = rx.lock().unwrap().recv();
+                    match job {
+                        Ok(job) => job(),
+                        Err(_) => break,
+                    }
+                })
+                .expect("Failed to spawn worker thread");
+        }
+
+        Workers { tx }
+    }
+
+    fn spawn<F: FnOnce() + Send + 'static>(&self, job: F) {
+        // Workers only exit once the sender is dropped, so this cannot fail
+        let _ = self.tx.send(Box::new(job));
+    }
 }
 
 /// Main FUSE filesystem structure
+///
+/// Read-only requests take a shared lock on the filesystem and run on the
+/// worker pool; requests that modify it take the exclusive lock on the
+/// session thread. Block I/O is positional, so concurrent readers do not
+/// contend on a file cursor.
 struct LolelfFuseFs {
-    fs: Arc<Mutex<LolelfFs>>,
+    fs: Arc<RwLock<LolelfFs>>,
     read_only: bool,
     /// Maps child inode number to parent inode number for directory traversal
     parent_map: Arc<Mutex<HashMap<u64, u64>>>,
+    workers: Workers,
+    trace: Option<Trace>,
 }
 
 impl LolelfFuseFs {
-    fn new(fs: LolelfFs, read_only: bool) -> Self {
+    fn new(fs: LolelfFs, read_only: bool, threads: usize, trace: Option<Trace>) -> Self {
         let mut parent_map = HashMap::new();
         // Root directory is its own parent
         parent_map.insert(FUSE_ROOT_INO, FUSE_ROOT_INO);
 
         LolelfFuseFs {
-            fs: Arc::new(Mutex::new(fs)),
+            fs: Arc::new(RwLock::new(fs)),
             read_only,
             parent_map: Arc::new(Mutex::new(parent_map)),
+            workers: Workers::new(threads),
+            trace,
         }
     }
 }
@@ -154,40 +244,95 @@ fn update_times(inode: &mut Inode, atime: bool, mtime: bool, ctime: bool) {
     }
 }
 
+/// Check whether a read should update atime. Like relatime, the update is
+/// only made when the last access is older than the last change or more than
+/// a day old, so most reads never need the exclusive lock.
+fn atime_stale(inode: &Inode) -> bool {
+    let now = SystemTime::now()
+        .duration_since(UNIX_EPOCH)
+        .unwrap()
+        .as_secs() as u32;
+
+    inode.i_atime <= inode.i_mtime
+        || inode.i_atime <= inode.i_ctime
+        || now.saturating_sub(inode.i_atime) >= 24 * 60 * 60
+}
+
+/// Update atime after a read, if it is still stale once the exclusive lock is held
+fn touch_atime(fs: &RwLock<LolelfFs>, inode_num: u32) {
+    let mut fs = fs.write().unwrap();
+    if let Ok(mut inode) = fs.read_inode(inode_num) {
+        if atime_stale(&inode) {
+            update_times(&mut inode, true, false, false);
+            if let Err(e) = fs.write_inode(inode_num, &inode) {
+                warn!("Failed to update atime: {}", e);
+            }
+        }
+    }
+}
+
 impl Filesystem for LolelfFuseFs {
     fn init(&mut self, _req: &Request<'_>, _config: &mut fuser::KernelConfig) -> Result<(), c_int> {
         info!("Initializing lolelffs FUSE filesystem");
         Ok(())
     }
 
+    fn destroy(&mut self) {
+        info!("Flushing lolelffs FUSE filesystem");
+        if let Err(e) = self.fs.write().unwrap().sync() {
+            error!("Failed to flush filesystem: {}", e);
+        }
+    }
+
+    fn fsync(
+        &mut self,
+        _req: &Request,
+        ino: u64,
+        _fh: u64,
+        _datasync: bool,
+        reply: fuser::ReplyEmpty,
+    ) {
+        debug!("fsync(ino={})", ino);
+
+        if self.read_only {
+            reply.ok();
+            return;
+        }
+
+        // Dirty blocks are not tracked per file, so write back all of them
+        match self.fs.write().unwrap().sync() {
+            Ok(()) => reply.ok(),
+            Err(e) => {
+                error!("fsync failed: {}", e);
+                reply.error(map_error(&e));
+            }
+        }
+    }
+
     fn lookup(&mut self, _req: &Request, parent: u64, name: &OsStr, reply: ReplyEntry) {
         debug!("lookup(parent={}, name={:?})", parent, name);
 
         let name_str = match name.to_str() {
-            Some(s) => s,
+            Some(s) => s.to_string(),
             None => {
                 reply.error(ENOENT);
                 return;
             }
         };
 
-        let parent_ino = fuse_to_lolelffs_ino(parent);
-        let mut fs = self.fs.lock().unwrap();
-        match fs.lookup(parent_ino, name_str) {
-            Ok(Some(inode_num)) => {
-                match fs.read_inode(inode_num) {
-                    Ok(mut inode) => {
-                        // Update atime
-                        update_times(&mut inode, true, false, false);
-                        if let Err(e) = fs.write_inode(inode_num, &inode) {
-                            warn!("Failed to update atime: {}", e);
-                        }
-
+        let fs = Arc::clone(&self.fs);
+        let parent_map = Arc::clone(&self.parent_map);
+        self.workers.spawn(move || {
+            let parent_ino = fuse_to_lolelffs_ino(parent);
+            let fs = fs.read().unwrap();
+            match fs.lookup(parent_ino, &name_str) {
+                Ok(Some(inode_num)) => match fs.read_inode(inode_num) {
+                    Ok(inode) => {
                         let fuse_ino = lolelffs_to_fuse_ino(inode_num);
 
                         // Track parent relationship (skip . and .. to avoid confusion)
                         if name_str != "." && name_str != ".." {
-                            let mut parent_map = self.parent_map.lock().unwrap();
+                            let mut parent_map = parent_map.lock().unwrap();
                             parent_map.insert(fuse_ino, parent);
                         }
 
@@ -199,35 +344,38 @@ impl Filesystem for LolelfFuseFs {
                         error!("Failed to read inode {}: {}", inode_num, e);
                         reply.error(map_error(&e));
                     }
+                },
+                Ok(None) => {
+                    debug!("lookup: file not found");
+                    reply.error(ENOENT);
+                }
+                Err(e) => {
+                    debug!("lookup failed: {}", e);
+                    reply.error(map_error(&e));
                 }
             }
-            Ok(None) => {
-                debug!("lookup: file not found");
-                reply.error(ENOENT);
-            }
-            Err(e) => {
-                debug!("lookup failed: {}", e);
-                reply.error(map_error(&e));
-            }
-        }
+        });
     }
 
     fn getattr(&mut self, _req: &Request, ino: u64, reply: ReplyAttr) {
         debug!("getattr(ino={})", ino);
 
-        let lolelffs_ino = fuse_to_lolelffs_ino(ino);
-        let mut fs = self.fs.lock().unwrap();
-        match fs.read_inode(lolelffs_ino) {
-            Ok(inode) => {
-                let attr = inode_to_attr(ino, &inode);
-                let ttl = Duration::from_secs(1);
-                reply.attr(&ttl, &attr);
-            }
-            Err(e) => {
-                error!("Failed to get attr for inode {}: {}", ino, e);
-                reply.error(map_error(&e));
+        let fs = Arc::clone(&self.fs);
+        self.workers.spawn(move || {
+            let lolelffs_ino = fuse_to_lolelffs_ino(ino);
+            let fs = fs.read().unwrap();
+            match fs.read_inode(lolelffs_ino) {
+                Ok(inode) => {
+                    let attr = inode_to_attr(ino, &inode);
+                    let ttl = Duration::from_secs(1);
+                    reply.attr(&ttl, &attr);
+                }
+                Err(e) => {
+                    error!("Failed to get attr for inode {}: {}", ino, e);
+                    reply.error(map_error(&e));
+                }
             }
-        }
+        });
     }
 
     fn readdir(
@@ -240,67 +388,71 @@ impl Filesystem for LolelfFuseFs {
     ) {
         debug!("readdir(ino={}, offset={})", ino, offset);
 
-        let mut fs = self.fs.lock().unwrap();
-        match fs.list_dir(fuse_to_lolelffs_ino(ino)) {
-            Ok(entries) => {
-                let mut idx = offset;
-
-                // Add . and .. entries
-                // The offset parameter in reply.add is the offset of the NEXT entry
-                if offset == 0 {
-                    if reply.add(ino, 1, FileType::Directory, ".") {
-                        // Next offset is 1
-                        reply.ok();
-                        return;
+        let fs = Arc::clone(&self.fs);
+        let parent_map = Arc::clone(&self.parent_map);
+        self.workers.spawn(move || {
+            let fs = fs.read().unwrap();
+            match fs.list_dir(fuse_to_lolelffs_ino(ino)) {
+                Ok(entries) => {
+                    let mut idx = offset;
+
+                    // Add . and .. entries
+                    // The offset parameter in reply.add is the offset of the NEXT entry
+                    if offset == 0 {
+                        if reply.add(ino, 1, FileType::Directory, ".") {
+                            // Next offset is 1
+                            reply.ok();
+                            return;
+                        }
+                        idx += 1;
                     }
-                    idx += 1;
-                }
 
-                if offset <= 1 {
-                    // Look up parent from parent_map, default to root if not found
-                    let parent_ino = {
-                        let parent_map = self.parent_map.lock().unwrap();
-                        *parent_map.get(&ino).unwrap_or(&FUSE_ROOT_INO)
-                    };
+                    if offset <= 1 {
+                        // Look up parent from parent_map, default to root if not found
+                        let parent_ino = {
+                            let parent_map = parent_map.lock().unwrap();
+                            *parent_map.get(&ino).unwrap_or(&FUSE_ROOT_INO)
+                        };
 
-                    if reply.add(parent_ino, 2, FileType::Directory, "..") {
-                        // Next offset is 2
-                        reply.ok();
-                        return;
+                        if reply.add(parent_ino, 2, FileType::Directory, "..") {
+                            // Next offset is 2
+                            reply.ok();
+                            return;
+                        }
+                        idx += 1;
                     }
-                    idx += 1;
-                }
 
-                // Add actual entries
-                for entry in entries.iter().skip((offset - 2).max(0) as usize) {
-                    let file_ino = lolelffs_to_fuse_ino(entry.inode_num);
-                    let kind = if entry.inode.is_dir() {
-                        FileType::Directory
-                    } else if entry.inode.is_symlink() {
-                        FileType::Symlink
-                    } else {
-                        FileType::RegularFile
-                    };
-
-                    // Track parent relationship for this entry
-                    {
-                        let mut parent_map = self.parent_map.lock().unwrap();
-                        parent_map.insert(file_ino, ino);
-                    }
+                    // Add actual entries
+                    for entry in entries.iter().skip((offset - 2).max(0) as usize) {
+                        let file_ino = lolelffs_to_fuse_ino(entry.inode_num);
+                        let kind = if entry.inode.is_dir() {
+                            FileType::Directory
+                        } else if entry.inode.is_symlink() {
+                            FileType::Symlink
+                        } else {
+                            FileType::RegularFile
+                        };
+
+                        // Track parent relationship for this entry
+                        {
+                            let mut parent_map = parent_map.lock().unwrap();
+                            parent_map.insert(file_ino, ino);
+                        }
 
-                    if reply.add(file_ino, idx + 1, kind, &entry.filename) {
-                        break;
+                        if reply.add(file_ino, idx + 1, kind, &entry.filename) {
+                            break;
+                        }
+                        idx += 1;
                     }
-                    idx += 1;
-                }
 
-                reply.ok();
-            }
-            Err(e) => {
-                error!("Failed to read directory {}: {}", ino, e);
-                reply.error(map_error(&e));
+                    reply.ok();
+                }
+                Err(e) => {
+                    error!("Failed to read directory {}: {}", ino, e);
+                    reply.error(map_error(&e));
+                }
             }
-        }
+        });
     }
 
     fn read(
@@ -316,37 +468,48 @@ impl Filesystem for LolelfFuseFs {
     ) {
         debug!("read(ino={}, offset={}, size={})", ino, offset, size);
 
-        let mut fs = self.fs.lock().unwrap();
-        match fs.read_file(fuse_to_lolelffs_ino(ino)) {
-            Ok(data) => {
-                let offset = offset as usize;
-                let end = (offset + size as usize).min(data.len());
-
-                if offset >= data.len() {
-                    reply.data(&[]);
-                } else {
-                    reply.data(&data[offset..end]);
-                }
+        if let Some(trace) = &mut self.trace {
+            trace.record(fuse_to_lolelffs_ino(ino));
+        }
 
-                // Update atime
-                if let Ok(mut inode) = fs.read_inode(fuse_to_lolelffs_ino(ino)) {
-                    update_times(&mut inode, true, false, false);
-                    if let Err(e) = fs.write_inode(fuse_to_lolelffs_ino(ino), &inode) {
-                        warn!("Failed to update atime: {}", e);
+        let fs = Arc::clone(&self.fs);
+        let read_only = self.read_only;
+        self.workers.spawn(move || {
+            let lolelffs_ino = fuse_to_lolelffs_ino(ino);
+            let mut buf = vec![0u8; size as usize];
+            let (result, stale) = {
+                let fs = fs.read().unwrap();
+                let result = fs.read_at(lolelffs_ino, offset as u64, &mut buf);
+                let stale = result.is_ok()
+                    && !read_only
+                    && fs
+                        .read_inode(lolelffs_ino)
+                        .map(|inode| atime_stale(&inode))
+                        .unwrap_or(false);
+                (result, stale)
+            };
+
+            match result {
+                Ok(read) => {
+                    reply.data(&buf[..read]);
+
+                    // Update atime
+                    if stale {
+                        touch_atime(&fs, lolelffs_ino);
                     }
                 }
+                Err(e) => {
+                    error!("Failed to read file {}: {}", ino, e);
+                    reply.error(map_error(&e));
+                }
             }
-            Err(e) => {
-                error!("Failed to read file {}: {}", ino, e);
-                reply.error(map_error(&e));
-            }
-        }
+        });
     }
 
     fn readlink(&mut self, _req: &Request, ino: u64, reply: ReplyData) {
         debug!("readlink(ino={})", ino);
 
-        let mut fs = self.fs.lock().unwrap();
+        let fs = self.fs.read().unwrap();
         match fs.read_inode(fuse_to_lolelffs_ino(ino)) {
             Ok(inode) => {
                 if !inode.is_symlink() {
@@ -402,7 +565,7 @@ impl Filesystem for LolelfFuseFs {
             return;
         }
 
-        let mut fs = self.fs.lock().unwrap();
+        let mut fs = self.fs.write().unwrap();
         match fs.create_file(fuse_to_lolelffs_ino(parent), name_str) {
             Ok(inode_num) => {
                 match fs.read_inode(inode_num) {
@@ -462,7 +625,7 @@ impl Filesystem for LolelfFuseFs {
             }
         };
 
-        let mut fs = self.fs.lock().unwrap();
+        let mut fs = self.fs.write().unwrap();
         match fs.mkdir(fuse_to_lolelffs_ino(parent), name_str) {
             Ok(inode_num) => {
                 match fs.read_inode(inode_num) {
@@ -514,7 +677,7 @@ impl Filesystem for LolelfFuseFs {
             }
         };
 
-        let mut fs = self.fs.lock().unwrap();
+        let mut fs = self.fs.write().unwrap();
 
         // Look up inode number before unlinking
         let inode_to_remove = match fs.lookup(fuse_to_lolelffs_ino(parent), name_str) {
@@ -554,7 +717,7 @@ impl Filesystem for LolelfFuseFs {
             }
         };
 
-        let mut fs = self.fs.lock().unwrap();
+        let mut fs = self.fs.write().unwrap();
 
         // Look up inode number before removing
         let inode_to_remove = match fs.lookup(fuse_to_lolelffs_ino(parent), name_str) {
@@ -612,7 +775,7 @@ impl Filesystem for LolelfFuseFs {
             }
         };
 
-        let mut fs = self.fs.lock().unwrap();
+        let mut fs = self.fs.write().unwrap();
         match fs.symlink(fuse_to_lolelffs_ino(parent), name_str, link_str) {
             Ok(inode_num) => match fs.read_inode(inode_num) {
                 Ok(inode) => {
@@ -666,7 +829,7 @@ impl Filesystem for LolelfFuseFs {
             }
         };
 
-        let mut fs = self.fs.lock().unwrap();
+        let mut fs = self.fs.write().unwrap();
         match fs.link(
             fuse_to_lolelffs_ino(ino),
             fuse_to_lolelffs_ino(newparent),
@@ -709,31 +872,9 @@ impl Filesystem for LolelfFuseFs {
             return;
         }
 
-        let mut fs = self.fs.lock().unwrap();
-
-        // Read current file contents
-        let mut file_data = match fs.read_file(fuse_to_lolelffs_ino(ino)) {
-            Ok(d) => d,
-            Err(e) => {
-                // If file doesn't exist or is empty, start with empty vec
-                debug!("File read returned error (may be empty): {}", e);
-                Vec::new()
-            }
-        };
-
-        // Extend file if necessary
-        let offset = offset as usize;
-        let end_pos = offset + data.len();
-        if end_pos > file_data.len() {
-            file_data.resize(end_pos, 0);
-        }
-
-        // Write data at offset
-        file_data[offset..end_pos].copy_from_slice(data);
-
-        // Write back to filesystem
-        match fs.write_file(fuse_to_lolelffs_ino(ino), &file_data) {
-            Ok(()) => {
+        let mut fs = self.fs.write().unwrap();
+        match fs.write_at(fuse_to_lolelffs_ino(ino), offset as u64, data) {
+            Ok(_) => {
                 // Update mtime and ctime
                 if let Ok(mut inode) = fs.read_inode(fuse_to_lolelffs_ino(ino)) {
                     update_times(&mut inode, false, true, true);
@@ -776,7 +917,7 @@ impl Filesystem for LolelfFuseFs {
             return;
         }
 
-        let mut fs = self.fs.lock().unwrap();
+        let mut fs = self.fs.write().unwrap();
         match fs.read_inode(fuse_to_lolelffs_ino(ino)) {
             Ok(mut inode) => {
                 let mut modified = false;
@@ -873,7 +1014,7 @@ impl Filesystem for LolelfFuseFs {
     fn statfs(&mut self, _req: &Request, _ino: u64, reply: ReplyStatfs) {
         debug!("statfs()");
 
-        let fs = self.fs.lock().unwrap();
+        let fs = self.fs.read().unwrap();
         let stats = fs.statfs();
 
         reply.statfs(
@@ -906,7 +1047,7 @@ impl Filesystem for LolelfFuseFs {
             }
         };
 
-        let mut fs = self.fs.lock().unwrap();
+        let fs = self.fs.read().unwrap();
         let lolelffs_ino = fuse_to_lolelffs_ino(ino);
 
         match fs.get_xattr(lolelffs_ino, name_str) {
@@ -959,7 +1100,7 @@ impl Filesystem for LolelfFuseFs {
             }
         };
 
-        let mut fs = self.fs.lock().unwrap();
+        let mut fs = self.fs.write().unwrap();
         let lolelffs_ino = fuse_to_lolelffs_ino(ino);
 
         match fs.set_xattr(lolelffs_ino, name_str, value) {
@@ -974,7 +1115,7 @@ impl Filesystem for LolelfFuseFs {
     fn listxattr(&mut self, _req: &Request, ino: u64, size: u32, reply: fuser::ReplyXattr) {
         debug!("listxattr(ino={}, size={})", ino, size);
 
-        let mut fs = self.fs.lock().unwrap();
+        let fs = self.fs.read().unwrap();
         let lolelffs_ino = fuse_to_lolelffs_ino(ino);
 
         match fs.list_xattrs(lolelffs_ino) {
@@ -1021,7 +1162,7 @@ impl Filesystem for LolelfFuseFs {
             }
         };
 
-        let mut fs = self.fs.lock().unwrap();
+        let mut fs = self.fs.write().unwrap();
         let lolelffs_ino = fuse_to_lolelffs_ino(ino);
 
         match fs.remove_xattr(lolelffs_ino, name_str) {
@@ -1062,7 +1203,22 @@ fn main() -> Result<()> {
         }
     };
 
-    let fuse_fs = LolelfFuseFs::new(fs, args.ro);
+    let threads = args.threads.unwrap_or_else(|| {
+        thread::available_parallelism()
+            .map(|n| n.get())
+            .unwrap_or(1)
+    });
+    info!("Serving reads with {} worker threads", threads);
+
+    let trace = match &args.trace {
+        Some(path) => {
+            info!("Tracing file reads to {:?}", path);
+            Some(Trace::create(path)?)
+        }
+        None => None,
+    };
+
+    let fuse_fs = LolelfFuseFs::new(fs, args.ro, threads, trace);
 
     let mut mount_options = vec![MountOption::FSName("lolelffs".to_string())];
 
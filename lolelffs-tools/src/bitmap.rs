@@ -143,6 +143,38 @@ impl LolelfFs {
         Ok(start)
     }
 
+    /// Allocate the `count` blocks starting at `start` if they are all free,
+    /// and return whether they were allocated
+    pub fn alloc_blocks_at(&mut self, start: u32, count: u32) -> Result<bool> {
+        if count == 0 || start as u64 + count as u64 > self.superblock.nr_blocks as u64 {
+            return Ok(false);
+        }
+
+        for block_num in start..start + count {
+            if !self.is_block_free(block_num)? {
+                return Ok(false);
+            }
+        }
+
+        let bfree_start = self.superblock.bfree_bitmap_start();
+
+        for block_num in start..start + count {
+            let block_idx = block_num / LOLELFFS_BITS_PER_BLOCK;
+            let bit_idx = block_num % LOLELFFS_BITS_PER_BLOCK;
+            let byte_idx = (bit_idx / 8) as usize;
+            let bit_offset = bit_idx % 8;
+
+            let mut block = self.read_block(bfree_start + block_idx)?;
+            block[byte_idx] &= !(1 << bit_offset);
+            self.write_block(bfree_start + block_idx, &block)?;
+        }
+
+        self.superblock.nr_free_blocks -= count;
+        self.write_superblock()?;
+
+        Ok(true)
+    }
+
     /// Free blocks
     pub fn free_blocks(&mut self, start: u32, count: u32) -> Result<()> {
         if count == 0 {
@@ -175,7 +207,7 @@ impl LolelfFs {
     }
 
     /// Check if a block is free
-    pub fn is_block_free(&mut self, block_num: u32) -> Result<bool> {
+    pub fn is_block_free(&self, block_num: u32) -> Result<bool> {
         if block_num >= self.superblock.nr_blocks {
             bail!("Invalid block number {}", block_num);
         }
@@ -191,7 +223,7 @@ impl LolelfFs {
     }
 
     /// Check if an inode is free
-    pub fn is_inode_free(&mut self, inode_num: u32) -> Result<bool> {
+    pub fn is_inode_free(&self, inode_num: u32) -> Result<bool> {
         if inode_num >= self.superblock.nr_inodes {
             bail!("Invalid inode number {}", inode_num);
         }
@@ -15,6 +15,30 @@ pub fn compress_block(algo: u8, data: &[u8]) -> Result<Option<Vec<u8>>> {
         bail!("Data must be exactly {} bytes", LOLELFFS_BLOCK_SIZE);
     }
 
+    compress_data(algo, data)
+}
+
+/// Compress a whole cluster of a packed extent as a single stream
+///
+/// The data must be a non-empty multiple of the block size, at most
+/// `LOLELFFS_COMP_CLUSTER_SIZE` bytes. As for single blocks, `None` is
+/// returned when compression does not save space.
+pub fn compress_cluster(algo: u8, data: &[u8]) -> Result<Option<Vec<u8>>> {
+    if data.is_empty()
+        || data.len() > LOLELFFS_COMP_CLUSTER_SIZE as usize
+        || data.len() % LOLELFFS_BLOCK_SIZE as usize != 0
+    {
+        bail!(
+            "Cluster must be a multiple of {} bytes, at most {} bytes",
+            LOLELFFS_BLOCK_SIZE,
+            LOLELFFS_COMP_CLUSTER_SIZE
+        );
+    }
+
+    compress_data(algo, data)
+}
+
+fn compress_data(algo: u8, data: &[u8]) -> Result<Option<Vec<u8>>> {
     match algo {
         LOLELFFS_COMP_NONE => Ok(None),
         LOLELFFS_COMP_LZ4 => compress_lz4(data),
@@ -131,6 +155,88 @@ fn decompress_zstd(compressed: &[u8], expected_size: usize) -> Result<Vec<u8>> {
     Ok(decompressed)
 }
 
+/// 4 * log2(x) rounded down: log2 of x^4 keeps two fractional bits
+fn log2_q2(x: u64) -> u32 {
+    (x * x * x * x).ilog2()
+}
+
+/// Estimate the byte entropy of data, in quarter bits per byte from 0 to 32,
+/// from `LOLELFFS_COMP_SAMPLE_SIZE` bytes in runs of
+/// `LOLELFFS_COMP_SAMPLE_RUN` contiguous bytes taken at even intervals.
+/// Single bytes at a stride that is a multiple of
+/// the record size of the data would only see one field of the records.
+pub fn entropy(data: &[u8]) -> u32 {
+    let n = data.len().min(LOLELFFS_COMP_SAMPLE_SIZE);
+    if n == 0 {
+        return 0;
+    }
+    let stride = if n < data.len() {
+        data.len() / (n / LOLELFFS_COMP_SAMPLE_RUN)
+    } else {
+        LOLELFFS_COMP_SAMPLE_RUN
+    };
+
+    let mut hist = [0u32; 256];
+    for i in 0..n {
+        let at = i / LOLELFFS_COMP_SAMPLE_RUN * stride + i % LOLELFFS_COMP_SAMPLE_RUN;
+        hist[data[at] as usize] += 1;
+    }
+
+    let log_n = log2_q2(n as u64);
+    let sum: u32 = hist
+        .iter()
+        .filter(|&&c| c != 0)
+        .map(|&c| c * (log_n - log2_q2(c as u64)))
+        .sum();
+    sum / n as u32
+}
+
+/// Whether data may compress, false for data that looks already compressed
+/// or encrypted
+pub fn worth_compressing(data: &[u8]) -> bool {
+    entropy(data) <= LOLELFFS_COMP_ENTROPY_MAX
+}
+
+/// Algorithm of a `LOLELFFS_COMP_HINT_XATTR` value, ignoring a trailing
+/// newline or NUL, or `None` for an unknown hint
+pub fn hint_algo(value: &[u8]) -> Option<u8> {
+    let mut value = value;
+    while let [rest @ .., b'\n' | 0] = value {
+        value = rest;
+    }
+
+    match value {
+        b"none" => Some(LOLELFFS_COMP_NONE),
+        b"lz4" | b"hot" => Some(LOLELFFS_COMP_LZ4),
+        b"zlib" => Some(LOLELFFS_COMP_ZLIB),
+        b"zstd" | b"cold" => Some(LOLELFFS_COMP_ZSTD),
+        _ => None,
+    }
+}
+
+/// Blocks of a file the compressor could not shrink, to give up on it after
+/// `LOLELFFS_COMP_MAX_FAILS` in a row until one compresses again
+#[derive(Debug, Default)]
+pub struct FailTracker {
+    fails: u32,
+}
+
+impl FailTracker {
+    /// Whether the compressor has been given up on
+    pub fn gave_up(&self) -> bool {
+        self.fails >= LOLELFFS_COMP_MAX_FAILS
+    }
+
+    /// Record whether the compressor shrank a block
+    pub fn record(&mut self, compressed: bool) {
+        self.fails = if compressed {
+            0
+        } else {
+            (self.fails + 1).min(LOLELFFS_COMP_MAX_FAILS)
+        };
+    }
+}
+
 /// Get the name of a compression algorithm
 pub fn get_algo_name(algo: u8) -> &'static str {
     match algo {
@@ -169,6 +275,78 @@ mod tests {
         }
     }
 
+    #[test]
+    fn test_cluster_roundtrip() {
+        let data: Vec<u8> = (0..LOLELFFS_COMP_CLUSTER_SIZE)
+            .map(|i| (i / 64) as u8)
+            .collect();
+
+        for algo in [LOLELFFS_COMP_LZ4, LOLELFFS_COMP_ZLIB, LOLELFFS_COMP_ZSTD] {
+            let compressed = compress_cluster(algo, &data).unwrap().unwrap();
+            assert!(compressed.len() < u16::MAX as usize);
+            let decompressed = decompress_block(algo, &compressed, data.len()).unwrap();
+            assert_eq!(data, decompressed);
+        }
+
+        assert!(compress_cluster(LOLELFFS_COMP_LZ4, &data[..100]).is_err());
+    }
+
+    #[test]
+    fn test_entropy() {
+        assert_eq!(entropy(&[]), 0);
+        assert_eq!(entropy(&[7u8; 4096]), 0);
+
+        let text = b"the quick brown fox jumps over the lazy dog ".repeat(100);
+        assert!(worth_compressing(&text));
+
+        // xorshift output stands in for compressed or encrypted data
+        let mut x = 0x2545f4914f6cdd1du64;
+        let random: Vec<u8> = (0..LOLELFFS_BLOCK_SIZE)
+            .map(|_| {
+                x ^= x << 13;
+                x ^= x >> 7;
+                x ^= x << 17;
+                x as u8
+            })
+            .collect();
+        assert!(!worth_compressing(&random));
+        assert!(entropy(&random) <= 32);
+
+        // 32-bit records whose first byte is random and the others zero:
+        // a cluster sampled at a stride of 4 bytes or a multiple of it
+        // would only see the random bytes
+        let records: Vec<u8> = (0..LOLELFFS_COMP_CLUSTER_SIZE as usize)
+            .map(|i| {
+                if i % 4 == 0 {
+                    x ^= x << 13;
+                    x ^= x >> 7;
+                    x ^= x << 17;
+                    x as u8
+                } else {
+                    0
+                }
+            })
+            .collect();
+        assert!(worth_compressing(&records));
+    }
+
+    #[test]
+    fn test_hint_algo() {
+        assert_eq!(hint_algo(b"hot"), Some(LOLELFFS_COMP_LZ4));
+        assert_eq!(hint_algo(b"cold\n"), Some(LOLELFFS_COMP_ZSTD));
+        assert_eq!(hint_algo(b"none\0"), Some(LOLELFFS_COMP_NONE));
+        assert_eq!(hint_algo(b"brotli"), None);
+
+        let mut tracker = FailTracker::default();
+        for _ in 0..LOLELFFS_COMP_MAX_FAILS {
+            assert!(!tracker.gave_up());
+            tracker.record(false);
+        }
+        assert!(tracker.gave_up());
+        tracker.record(true);
+        assert!(!tracker.gave_up());
+    }
+
     #[test]
     fn test_zstd_roundtrip() {
         let data = vec![0u8; LOLELFFS_BLOCK_SIZE as usize];
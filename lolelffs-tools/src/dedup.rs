@@ -0,0 +1,533 @@
+//! Block deduplication: files with identical blocks are made to share them
+//! through extents flagged `LOLELFFS_EXT_SHARED`.
+//!
+//! No reference counts are stored on disk: a block mapped by several
+//! extents is only ever mapped by shared extents, so the references to a
+//! block are found by scanning the shared extents of the files.
+
+use crate::fs::LolelfFs;
+use crate::types::*;
+use anyhow::Result;
+use std::collections::hash_map::{DefaultHasher, Entry};
+use std::collections::HashMap;
+use std::hash::{Hash, Hasher};
+
+/// Shortest run of matching blocks shared within an extent, unless it is
+/// the whole extent: shorter runs would split files into many extents
+/// for little space
+const MIN_SHARED_RUN: u32 = 16;
+
+/// Outcome of [`LolelfFs::dedup`]
+#[derive(Debug, Clone, Copy, Default, PartialEq, Eq)]
+pub struct DedupStats {
+    /// Orphans freed: files unlinked by the kernel module while shared
+    pub orphans: u32,
+    /// Files scanned
+    pub files: u32,
+    /// Files whose extents were changed
+    pub changed: u32,
+    /// Blocks freed
+    pub blocks: u32,
+    /// Shared extents after deduplication
+    pub shared: u32,
+}
+
+/// How a block is stored: blocks can only be shared between extents that
+/// decode them the same way. Encrypted blocks also depend on their logical
+/// block number, `u32::MAX` for unencrypted ones.
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Hash)]
+struct BlockClass {
+    flags: u16,
+    comp_algo: u16,
+    enc_algo: u8,
+    logical: u32,
+}
+
+impl BlockClass {
+    fn of(extent: &Extent, logical: u32) -> Self {
+        BlockClass {
+            flags: extent.ee_flags & !LOLELFFS_EXT_SHARED,
+            comp_algo: extent.ee_comp_algo,
+            enc_algo: extent.ee_enc_algo,
+            logical: if extent.ee_enc_algo != LOLELFFS_ENC_NONE {
+                logical
+            } else {
+                u32::MAX
+            },
+        }
+    }
+}
+
+fn hash_bytes(data: &[u8], hasher: &mut DefaultHasher) {
+    data.hash(hasher);
+}
+
+/// Sort `blocks` and merge them into runs
+fn block_runs(mut blocks: Vec<u32>) -> Vec<(u32, u32)> {
+    blocks.sort_unstable();
+    blocks.dedup();
+    let mut runs: Vec<(u32, u32)> = Vec::new();
+    for block in blocks {
+        match runs.last_mut() {
+            Some((start, count)) if *start + *count == block => *count += 1,
+            _ => runs.push((block, 1)),
+        }
+    }
+    runs
+}
+
+impl LolelfFs {
+    /// Regular files stored in extents, with their used extents
+    fn extent_files(&self) -> Result<Vec<(u32, Inode, Vec<Extent>)>> {
+        let mut files = Vec::new();
+        for inode_num in 0..self.superblock.nr_inodes {
+            if self.is_inode_free(inode_num)? {
+                continue;
+            }
+            let inode = self.read_inode(inode_num)?;
+            if !inode.is_file() || inode.ei_block == 0 {
+                continue;
+            }
+            let extents = self
+                .read_extent_index(&inode)?
+                .extents
+                .into_iter()
+                .take_while(|e| !e.is_empty())
+                .collect();
+            files.push((inode_num, inode, extents));
+        }
+        Ok(files)
+    }
+
+    /// Physical blocks of a file extent: its data blocks, and for packed
+    /// extents its compression metadata block
+    pub(crate) fn extent_blocks(&self, extent: &Extent) -> Result<Vec<u32>> {
+        if extent.has_metadata() {
+            let nr_phys = self.read_comp_metadata(extent)?.nr_phys;
+            let mut blocks: Vec<u32> = (extent.ee_start..extent.ee_start + nr_phys).collect();
+            blocks.push(extent.ee_meta);
+            Ok(blocks)
+        } else {
+            Ok((extent.ee_start..extent.ee_start + extent.ee_len).collect())
+        }
+    }
+
+    /// Number of shared extents mapping each block, over the regular files
+    /// other than `skip_inode`
+    fn shared_block_refs(&self, skip_inode: u32) -> Result<HashMap<u32, u32>> {
+        let mut refs = HashMap::new();
+        for (inode_num, _, extents) in self.extent_files()? {
+            if inode_num == skip_inode {
+                continue;
+            }
+            for extent in extents.iter().filter(|e| e.is_shared()) {
+                for block in self.extent_blocks(extent)? {
+                    *refs.entry(block).or_insert(0) += 1;
+                }
+            }
+        }
+        Ok(refs)
+    }
+
+    /// Free the extents `freed` removed from the regular file `inode_num`.
+    /// The blocks of shared extents are only freed if no other file maps
+    /// them, nor the extents `kept` the file still has.
+    pub fn free_file_extents(
+        &mut self,
+        inode_num: u32,
+        freed: &[Extent],
+        kept: &[Extent],
+    ) -> Result<()> {
+        let mut shared = Vec::new();
+        for extent in freed {
+            if extent.is_shared() {
+                shared.extend(self.extent_blocks(extent)?);
+            } else {
+                self.free_extent(extent)?;
+            }
+        }
+        if shared.is_empty() {
+            return Ok(());
+        }
+
+        let mut refs = self.shared_block_refs(inode_num)?;
+        for extent in kept.iter().filter(|e| e.is_shared()) {
+            for block in self.extent_blocks(extent)? {
+                *refs.entry(block).or_insert(0) += 1;
+            }
+        }
+        shared.retain(|block| !refs.contains_key(block));
+        for (start, count) in block_runs(shared) {
+            self.free_blocks(start, count)?;
+        }
+        Ok(())
+    }
+
+    fn block_hash(&self, block: u32) -> Result<u64> {
+        self.with_block(block, |data| {
+            let mut hasher = DefaultHasher::new();
+            hash_bytes(data, &mut hasher);
+            hasher.finish()
+        })
+    }
+
+    fn same_blocks(&self, a: u32, b: u32, count: u32) -> Result<bool> {
+        // Blocks are borrowed under the cache lock: copy one out
+        for i in 0..count {
+            let x = self.read_block(a + i)?;
+            if !self.with_block(b + i, |y| x == y)? {
+                return Ok(false);
+            }
+        }
+        Ok(true)
+    }
+
+    /// Share the blocks of the regular files of the filesystem that are
+    /// stored identically.
+    ///
+    /// The kernel module cannot tell whether other files still map the
+    /// blocks of a shared extent, so it keeps the files it unlinks with
+    /// shared extents allocated with no link: these orphans are freed
+    /// first.
+    ///
+    /// Each block of a plain extent is looked up by content among the
+    /// blocks seen before it and compared byte for byte with its match.
+    /// Matching runs of at least `MIN_SHARED_RUN` blocks, or covering a
+    /// whole extent, are remapped to the blocks they match, which splits
+    /// the extent around them; packed extents are shared whole. Extents
+    /// mapping a block that is mapped more than once are flagged shared,
+    /// other extents unflagged, and the blocks no longer mapped are freed.
+    pub fn dedup(&mut self) -> Result<DedupStats> {
+        let mut stats = DedupStats::default();
+        for (inode_num, inode, _) in self.extent_files()? {
+            if inode.i_nlink == 0 {
+                self.free_file(inode_num, &inode)?;
+                stats.orphans += 1;
+            }
+        }
+        let files = self.extent_files()?;
+        let max_extents = self.max_file_extents();
+
+        let mut refs: HashMap<u32, u32> = HashMap::new();
+        for (_, _, extents) in &files {
+            for extent in extents {
+                for block in self.extent_blocks(extent)? {
+                    *refs.entry(block).or_insert(0) += 1;
+                }
+            }
+        }
+
+        // Blocks mapped for good, by class: the targets runs may continue to
+        let mut canon: HashMap<u32, BlockClass> = HashMap::new();
+        let mut index: HashMap<(u64, BlockClass), u32> = HashMap::new();
+        let mut packed: HashMap<(u64, BlockClass, u32), Extent> = HashMap::new();
+        let mut remapped = Vec::with_capacity(files.len());
+
+        for (_, _, old) in &files {
+            let mut new: Vec<Extent> = Vec::with_capacity(old.len());
+            for (idx, extent) in old.iter().enumerate() {
+                if extent.has_metadata() {
+                    new.push(self.dedup_packed(extent, &mut packed, &mut refs)?);
+                    continue;
+                }
+
+                // Map each block to its own, or to a stored block it matches,
+                // preferring the one continuing the previous block's run
+                let mut map = Vec::with_capacity(extent.ee_len as usize);
+                let mut keys = Vec::with_capacity(extent.ee_len as usize);
+                for i in 0..extent.ee_len {
+                    let own = extent.ee_start + i;
+                    let class = BlockClass::of(extent, extent.ee_block + i);
+                    let key = (self.block_hash(own)?, class);
+                    let mut target = own;
+                    if i > 0 && map[i as usize - 1] != own - 1 {
+                        let next = map[i as usize - 1] + 1;
+                        if canon.get(&next) == Some(&class) && self.same_blocks(own, next, 1)? {
+                            target = next;
+                        }
+                    }
+                    if target == own {
+                        if let Some(&found) = index.get(&key) {
+                            if found != own && self.same_blocks(own, found, 1)? {
+                                target = found;
+                            }
+                        }
+                    }
+                    map.push(target);
+                    keys.push(key);
+                }
+
+                // Keep the remapped runs worth an extent of their own
+                let mut i = 0;
+                while i < map.len() {
+                    let mut j = i + 1;
+                    while j < map.len() && map[j] == map[j - 1] + 1 {
+                        j += 1;
+                    }
+                    let own = extent.ee_start + i as u32;
+                    let len = (j - i) as u32;
+                    if map[i] != own && len < MIN_SHARED_RUN && len != extent.ee_len {
+                        for (k, target) in map[i..j].iter_mut().enumerate() {
+                            *target = own + k as u32;
+                        }
+                    }
+                    i = j;
+                }
+                let mut pieces = Vec::new();
+                let mut i = 0;
+                while i < map.len() {
+                    let mut j = i + 1;
+                    while j < map.len() && map[j] == map[j - 1] + 1 {
+                        j += 1;
+                    }
+                    pieces.push(Extent {
+                        ee_block: extent.ee_block + i as u32,
+                        ee_len: (j - i) as u32,
+                        ee_start: map[i],
+                        ..*extent
+                    });
+                    i = j;
+                }
+                if new.len() + pieces.len() + (old.len() - idx - 1) > max_extents {
+                    for (i, target) in map.iter_mut().enumerate() {
+                        *target = extent.ee_start + i as u32;
+                    }
+                    pieces = vec![*extent];
+                }
+
+                for (i, (&target, key)) in map.iter().zip(keys).enumerate() {
+                    let own = extent.ee_start + i as u32;
+                    if target == own {
+                        canon.insert(own, key.1);
+                        index.entry(key).or_insert(own);
+                    } else {
+                        *refs.entry(target).or_insert(0) += 1;
+                        *refs.entry(own).or_insert(1) -= 1;
+                    }
+                }
+                new.extend(pieces);
+            }
+            remapped.push(new);
+        }
+
+        // Flag the extents mapping a block mapped more than once, and write
+        // the extent indexes that changed
+        let mut any_shared = false;
+        for ((_, inode, old), mut new) in files.iter().zip(remapped) {
+            stats.files += 1;
+            for extent in &mut new {
+                let shared = self
+                    .extent_blocks(extent)?
+                    .iter()
+                    .any(|block| refs.get(block).copied().unwrap_or(0) > 1);
+                if shared {
+                    extent.ee_flags |= LOLELFFS_EXT_SHARED;
+                    stats.shared += 1;
+                    any_shared = true;
+                } else {
+                    extent.ee_flags &= !LOLELFFS_EXT_SHARED;
+                }
+            }
+            if new == *old {
+                continue;
+            }
+
+            for node in self.extent_tree_nodes(inode)? {
+                self.free_blocks(node, 1)?;
+            }
+            if new.len() < LOLELFFS_MAX_EXTENTS {
+                new.resize(LOLELFFS_MAX_EXTENTS, Extent::default());
+            }
+            self.write_extent_index(
+                inode.ei_block,
+                &ExtentIndex {
+                    nr_files: 0,
+                    extents: new,
+                    dx_block: 0,
+                },
+            )?;
+            stats.changed += 1;
+        }
+
+        let unmapped: Vec<u32> = refs
+            .iter()
+            .filter(|&(_, &count)| count == 0)
+            .map(|(&block, _)| block)
+            .collect();
+        stats.blocks = unmapped.len() as u32;
+        for (start, count) in block_runs(unmapped) {
+            self.free_blocks(start, count)?;
+        }
+
+        if any_shared && self.superblock.comp_features & LOLELFFS_FEATURE_SHARED_EXTENTS == 0 {
+            self.superblock.comp_features |= LOLELFFS_FEATURE_SHARED_EXTENTS;
+            self.write_superblock()?;
+        }
+
+        Ok(stats)
+    }
+
+    /// Map a packed extent to the blocks of an identical one seen before,
+    /// or record it for the packed extents that follow
+    fn dedup_packed(
+        &self,
+        extent: &Extent,
+        packed: &mut HashMap<(u64, BlockClass, u32), Extent>,
+        refs: &mut HashMap<u32, u32>,
+    ) -> Result<Extent> {
+        let nr_phys = self.read_comp_metadata(extent)?.nr_phys;
+        let mut hasher = DefaultHasher::new();
+        self.with_block(extent.ee_meta, |data| hash_bytes(data, &mut hasher))?;
+        for block in extent.ee_start..extent.ee_start + nr_phys {
+            self.with_block(block, |data| hash_bytes(data, &mut hasher))?;
+        }
+        let key = (
+            hasher.finish(),
+            BlockClass::of(extent, extent.ee_block),
+            extent.ee_len,
+        );
+
+        let found = match packed.entry(key) {
+            Entry::Vacant(slot) => {
+                slot.insert(*extent);
+                return Ok(*extent);
+            }
+            Entry::Occupied(slot) => *slot.get(),
+        };
+        if found.ee_start == extent.ee_start
+            || !self.same_blocks(extent.ee_meta, found.ee_meta, 1)?
+            || !self.same_blocks(extent.ee_start, found.ee_start, nr_phys)?
+        {
+            return Ok(*extent);
+        }
+
+        for block in self.extent_blocks(extent)? {
+            *refs.entry(block).or_insert(1) -= 1;
+        }
+        for block in self.extent_blocks(&found)? {
+            *refs.entry(block).or_insert(0) += 1;
+        }
+        Ok(Extent {
+            ee_start: found.ee_start,
+            ee_meta: found.ee_meta,
+            ..*extent
+        })
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    /// A filesystem image in the temporary directory, removed on drop
+    struct TestFs {
+        fs: LolelfFs,
+        path: std::path::PathBuf,
+    }
+
+    impl TestFs {
+        fn new(name: &str) -> Self {
+            let path = std::env::temp_dir().join(format!(
+                "lolelffs-dedup-{}-{}.img",
+                name,
+                std::process::id()
+            ));
+            let mut fs = LolelfFs::create(&path, 16 * 1024 * 1024).unwrap();
+            fs.superblock.comp_enabled = 0;
+            TestFs { fs, path }
+        }
+    }
+
+    impl Drop for TestFs {
+        fn drop(&mut self) {
+            let _ = std::fs::remove_file(&self.path);
+        }
+    }
+
+    fn test_data(len: usize) -> Vec<u8> {
+        (0..len)
+            .map(|i| (i as u32).wrapping_mul(2654435761).rotate_left(7) as u8)
+            .collect()
+    }
+
+    /// Two files of the same 200 KiB, deduplicated: one copy of their blocks.
+    /// Also returns the free blocks once both files are removed.
+    fn dedup_pair(fs: &mut LolelfFs, data: &[u8]) -> (u32, u32, u32) {
+        let a = fs.create_file(LOLELFFS_ROOT_INO, "a").unwrap();
+        let b = fs.create_file(LOLELFFS_ROOT_INO, "b").unwrap();
+        // The root directory keeps the block of their entries
+        let empty = fs.superblock.nr_free_blocks;
+        fs.write_file(a, data).unwrap();
+        fs.write_file(b, data).unwrap();
+        let free = fs.superblock.nr_free_blocks;
+        let stats = fs.dedup().unwrap();
+        assert_eq!(stats.blocks, 50);
+        assert_eq!(stats.shared, 2);
+        assert_eq!(fs.superblock.nr_free_blocks, free + 50);
+        (a, b, empty)
+    }
+
+    #[test]
+    fn test_dedup_unlink() {
+        let mut t = TestFs::new("unlink");
+        let fs = &mut t.fs;
+        let data = test_data(50 * LOLELFFS_BLOCK_SIZE as usize);
+        let (_, b, free) = dedup_pair(fs, &data);
+
+        // The blocks stay mapped by b, and are freed with it
+        fs.unlink(LOLELFFS_ROOT_INO, "a").unwrap();
+        assert_eq!(fs.read_file(b).unwrap(), data);
+        let stats = fs.dedup().unwrap();
+        assert_eq!(stats.blocks, 0);
+        assert_eq!(stats.shared, 0);
+        assert_eq!(fs.read_file(b).unwrap(), data);
+        fs.unlink(LOLELFFS_ROOT_INO, "b").unwrap();
+        assert_eq!(fs.superblock.nr_free_blocks, free);
+    }
+
+    #[test]
+    fn test_dedup_overwrite() {
+        let mut t = TestFs::new("overwrite");
+        let fs = &mut t.fs;
+        let data = test_data(50 * LOLELFFS_BLOCK_SIZE as usize);
+        let (a, b, free) = dedup_pair(fs, &data);
+
+        // Writes into a copy the blocks they change, b keeps the old ones
+        let mut changed = data.clone();
+        changed[10 * LOLELFFS_BLOCK_SIZE as usize + 3..][..5].copy_from_slice(b"hello");
+        fs.write_at(a, 10 * LOLELFFS_BLOCK_SIZE as u64 + 3, b"hello")
+            .unwrap();
+        assert_eq!(fs.read_file(a).unwrap(), changed);
+        assert_eq!(fs.read_file(b).unwrap(), data);
+
+        fs.write_file(a, b"replaced").unwrap();
+        assert_eq!(fs.read_file(a).unwrap(), b"replaced");
+        assert_eq!(fs.read_file(b).unwrap(), data);
+
+        fs.unlink(LOLELFFS_ROOT_INO, "a").unwrap();
+        fs.unlink(LOLELFFS_ROOT_INO, "b").unwrap();
+        assert_eq!(fs.superblock.nr_free_blocks, free);
+    }
+
+    #[test]
+    fn test_dedup_frees_orphans() {
+        let mut t = TestFs::new("orphans");
+        let fs = &mut t.fs;
+        let data = test_data(50 * LOLELFFS_BLOCK_SIZE as usize);
+        let (a, b, free) = dedup_pair(fs, &data);
+
+        // What the kernel module does when it unlinks a file with shared
+        // extents: the blocks stay allocated until the next dedup
+        fs.remove_dir_entry(LOLELFFS_ROOT_INO, "a").unwrap();
+        let mut inode = fs.read_inode(a).unwrap();
+        inode.i_nlink = 0;
+        fs.write_inode(a, &inode).unwrap();
+
+        let stats = fs.dedup().unwrap();
+        assert_eq!(stats.orphans, 1);
+        assert_eq!(stats.shared, 0);
+        assert_eq!(fs.read_file(b).unwrap(), data);
+        fs.unlink(LOLELFFS_ROOT_INO, "b").unwrap();
+        assert_eq!(fs.superblock.nr_free_blocks, free);
+    }
+}
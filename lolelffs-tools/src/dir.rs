@@ -14,7 +14,7 @@ pub struct DirEntry {
 
 impl LolelfFs {
     /// List all entries in a directory
-    pub fn list_dir(&mut self, dir_inode_num: u32) -> Result<Vec<DirEntry>> {
+    pub fn list_dir(&self, dir_inode_num: u32) -> Result<Vec<DirEntry>> {
         let dir_inode = self.read_inode(dir_inode_num)?;
 
         if !dir_inode.is_dir() {
@@ -60,7 +60,7 @@ impl LolelfFs {
     }
 
     /// Look up a file in a directory by name
-    pub fn lookup(&mut self, dir_inode_num: u32, name: &str) -> Result<Option<u32>> {
+    pub fn lookup(&self, dir_inode_num: u32, name: &str) -> Result<Option<u32>> {
         let dir_inode = self.read_inode(dir_inode_num)?;
 
         if !dir_inode.is_dir() {
@@ -72,6 +72,18 @@ impl LolelfFs {
         }
 
         let ei = self.read_extent_index(&dir_inode)?;
+        Ok(self.find_dir_entry(&ei, name)?.map(|(inode, _)| inode))
+    }
+
+    /// Find an entry of a directory by name, through its hashed index when it
+    /// is up to date. Return the inode number and slot of the entry.
+    fn find_dir_entry(&self, ei: &ExtentIndex, name: &str) -> Result<Option<(u32, u32)>> {
+        if ei.dx_block != 0 {
+            // A stale or unreadable index is worked around, and dropped on change
+            if let Ok(found) = self.dx_find(ei, name) {
+                return Ok(found);
+            }
+        }
 
         // Search through all extents
         for extent in &ei.extents {
@@ -89,7 +101,10 @@ impl LolelfFs {
 
                     if let Some(entry) = FileEntry::from_bytes(entry_data) {
                         if entry.filename == name {
-                            return Ok(Some(entry.inode));
+                            let slot = (extent.ee_block + block_offset)
+                                * LOLELFFS_FILES_PER_BLOCK as u32
+                                + file_idx as u32;
+                            return Ok(Some((entry.inode, slot)));
                         }
                     }
                 }
@@ -99,8 +114,250 @@ impl LolelfFs {
         Ok(None)
     }
 
+    /// Block number and byte offset of the entry at slot of a directory
+    fn dir_slot(ei: &ExtentIndex, slot: u32) -> Option<(u32, usize)> {
+        let logical_block = slot / LOLELFFS_FILES_PER_BLOCK as u32;
+        let extent = ei.find_extent(logical_block)?;
+        Some((
+            extent.ee_start + logical_block - extent.ee_block,
+            (slot as usize % LOLELFFS_FILES_PER_BLOCK) * FileEntry::SIZE,
+        ))
+    }
+
+    /// Read the entry at slot of a directory, None if empty or not mapped
+    fn read_dir_slot(&self, ei: &ExtentIndex, slot: u32) -> Result<Option<FileEntry>> {
+        match Self::dir_slot(ei, slot) {
+            Some((block_num, offset)) => {
+                let block = self.read_block(block_num)?;
+                Ok(FileEntry::from_bytes(
+                    &block[offset..offset + FileEntry::SIZE],
+                ))
+            }
+            None => Ok(None),
+        }
+    }
+
+    /// Overwrite the entry at slot of a directory
+    fn write_dir_slot(&mut self, ei: &ExtentIndex, slot: u32, entry_data: &[u8]) -> Result<()> {
+        let (block_num, offset) = Self::dir_slot(ei, slot)
+            .ok_or_else(|| anyhow::anyhow!("Directory slot {} not mapped", slot))?;
+        let mut block = self.read_block(block_num)?;
+        block[offset..offset + FileEntry::SIZE].copy_from_slice(entry_data);
+        self.write_block(block_num, &block)
+    }
+
+    /// Find a mapped empty slot for a new entry, None if all are used
+    fn free_dir_slot(&mut self, ei: &ExtentIndex) -> Result<Option<u32>> {
+        // Entries are kept packed, so the slot past the last one is free
+        if Self::dir_slot(ei, ei.nr_files).is_none() {
+            return Ok(None);
+        }
+        if self.read_dir_slot(ei, ei.nr_files)?.is_none() {
+            return Ok(Some(ei.nr_files));
+        }
+
+        // Older versions left holes when removing entries: reuse the first one
+        let nr_slots = ei.total_blocks() * LOLELFFS_FILES_PER_BLOCK as u32;
+        for slot in 0..nr_slots {
+            if self.read_dir_slot(ei, slot)?.is_none() {
+                return Ok(Some(slot));
+            }
+        }
+
+        Ok(None)
+    }
+
+    /// Read the root of the index at dx_block and the leaf covering hash.
+    /// Fail if the index does not hold nr_records records, as it is stale.
+    fn dx_get_leaf(
+        &self,
+        dx_block: u32,
+        nr_records: u32,
+        hash: u32,
+    ) -> Result<(DxRoot, usize, u32, DxLeaf)> {
+        let root = DxRoot::from_bytes(&self.read_block(dx_block)?)
+            .ok_or_else(|| anyhow::anyhow!("Invalid directory index root {}", dx_block))?;
+        if root.nr_records != nr_records {
+            bail!("Stale directory index {}", dx_block);
+        }
+
+        let pos = root.find_leaf(hash);
+        let leaf_block = root.entries[pos].value;
+        if leaf_block == 0 || leaf_block >= self.superblock.nr_blocks {
+            bail!("Invalid directory index leaf {}", leaf_block);
+        }
+        let leaf = DxLeaf::from_bytes(&self.read_block(leaf_block)?)
+            .ok_or_else(|| anyhow::anyhow!("Invalid directory index leaf {}", leaf_block))?;
+
+        Ok((root, pos, leaf_block, leaf))
+    }
+
+    /// Look up name through the index of a directory, only reading the
+    /// entries whose name has the same hash
+    fn dx_find(&self, ei: &ExtentIndex, name: &str) -> Result<Option<(u32, u32)>> {
+        let hash = dx_hash(name.as_bytes());
+        let (_, _, _, leaf) = self.dx_get_leaf(ei.dx_block, ei.nr_files, hash)?;
+
+        for record in leaf.entries.iter().filter(|r| r.hash == hash) {
+            if record.value >= ei.nr_files {
+                bail!("Directory index points past the last entry");
+            }
+            if let Some(entry) = self.read_dir_slot(ei, record.value)? {
+                if entry.filename == name {
+                    return Ok(Some((entry.inode, record.value)));
+                }
+            }
+        }
+
+        Ok(None)
+    }
+
+    /// Add the record of the entry at slot to the index at dx_block. A full
+    /// leaf is split around its median hash, never separating equal hashes.
+    fn dx_insert(&mut self, dx_block: u32, nr_records: u32, hash: u32, slot: u32) -> Result<()> {
+        let (mut root, pos, leaf_block, mut leaf) = self.dx_get_leaf(dx_block, nr_records, hash)?;
+        let record = DxEntry { hash, value: slot };
+
+        if leaf.entries.len() < LOLELFFS_DX_LEAF_ENTRIES {
+            leaf.entries.push(record);
+        } else {
+            if root.entries.len() == LOLELFFS_DX_ROOT_ENTRIES {
+                bail!("Directory index is full");
+            }
+
+            let mut records = std::mem::take(&mut leaf.entries);
+            records.push(record);
+            records.sort_by_key(|r| r.hash);
+
+            let n = records.len();
+            let mut split = n / 2;
+            while split < n && records[split].hash == records[split - 1].hash {
+                split += 1;
+            }
+            if split == n {
+                split = n / 2;
+                while split > 0 && records[split].hash == records[split - 1].hash {
+                    split -= 1;
+                }
+            }
+            if split == 0 {
+                bail!("Directory index cannot split names sharing one hash");
+            }
+
+            let new_block = self.alloc_blocks(1)?;
+            let upper = DxLeaf {
+                entries: records.split_off(split),
+            };
+            self.write_block(new_block, &upper.to_bytes())?;
+            root.entries.insert(
+                pos + 1,
+                DxEntry {
+                    hash: upper.entries[0].hash,
+                    value: new_block,
+                },
+            );
+            leaf.entries = records;
+        }
+
+        root.nr_records += 1;
+        self.write_block(leaf_block, &leaf.to_bytes())?;
+        self.write_block(dx_block, &root.to_bytes())
+    }
+
+    /// Find the record of the entry at slot in the index at dx_block, then
+    /// point it to new_slot, or remove it if there is none
+    fn dx_change(
+        &mut self,
+        dx_block: u32,
+        nr_records: u32,
+        hash: u32,
+        slot: u32,
+        new_slot: Option<u32>,
+    ) -> Result<()> {
+        let (mut root, _, leaf_block, mut leaf) = self.dx_get_leaf(dx_block, nr_records, hash)?;
+        let i = leaf
+            .entries
+            .iter()
+            .position(|r| r.hash == hash && r.value == slot)
+            .ok_or_else(|| anyhow::anyhow!("Directory index is missing slot {}", slot))?;
+
+        match new_slot {
+            Some(new_slot) => leaf.entries[i].value = new_slot,
+            None => {
+                leaf.entries.swap_remove(i);
+                root.nr_records -= 1;
+                self.write_block(dx_block, &root.to_bytes())?;
+            }
+        }
+        self.write_block(leaf_block, &leaf.to_bytes())
+    }
+
+    /// Free the blocks of the index of a directory, if any, and detach it
+    fn dx_free(&mut self, ei: &mut ExtentIndex) -> Result<()> {
+        if ei.dx_block == 0 {
+            return Ok(());
+        }
+
+        let dx_block = std::mem::take(&mut ei.dx_block);
+        if let Some(root) = DxRoot::from_bytes(&self.read_block(dx_block)?) {
+            for leaf in &root.entries {
+                if leaf.value != 0 && leaf.value < self.superblock.nr_blocks {
+                    self.free_blocks(leaf.value, 1)?;
+                }
+            }
+        }
+        self.free_blocks(dx_block, 1)
+    }
+
+    /// Index all the entries of a directory, which must be packed
+    fn dx_build(&mut self, ei: &mut ExtentIndex) -> Result<()> {
+        let mut hashes = Vec::with_capacity(ei.nr_files as usize);
+        for slot in 0..ei.nr_files {
+            match self.read_dir_slot(ei, slot)? {
+                Some(entry) => hashes.push(dx_hash(entry.filename.as_bytes())),
+                None => bail!("Directory entries are not packed"),
+            }
+        }
+
+        let dx_block = self.alloc_blocks(1)?;
+        let leaf_block = match self.alloc_blocks(1) {
+            Ok(block) => block,
+            Err(e) => {
+                self.free_blocks(dx_block, 1)?;
+                return Err(e);
+            }
+        };
+        self.write_block(leaf_block, &DxLeaf::default().to_bytes())?;
+        let root = DxRoot {
+            nr_records: 0,
+            entries: vec![DxEntry {
+                hash: 0,
+                value: leaf_block,
+            }],
+        };
+        self.write_block(dx_block, &root.to_bytes())?;
+        ei.dx_block = dx_block;
+
+        for (slot, hash) in hashes.into_iter().enumerate() {
+            if let Err(e) = self.dx_insert(dx_block, slot as u32, hash, slot as u32) {
+                self.dx_free(ei)?;
+                return Err(e);
+            }
+        }
+
+        Ok(())
+    }
+
+    /// Forget an index that could not be kept up to date, so that the
+    /// directory falls back to scanning its entries
+    fn dx_drop(&mut self, ei: &mut ExtentIndex) {
+        if self.dx_free(ei).is_err() {
+            ei.dx_block = 0;
+        }
+    }
+
     /// Resolve a path to an inode number
-    pub fn resolve_path(&mut self, path: &str) -> Result<u32> {
+    pub fn resolve_path(&self, path: &str) -> Result<u32> {
         let path = path.trim_matches('/');
 
         if path.is_empty() {
@@ -161,105 +418,82 @@ impl LolelfFs {
             ExtentIndex {
                 nr_files: 0,
                 extents: vec![Extent::default(); LOLELFFS_MAX_EXTENTS],
+                dx_block: 0,
             }
         } else {
             self.read_extent_index(&dir_inode)?
         };
 
-        // Find a slot for the new entry
-        let mut slot_found = false;
-        let mut target_block = 0u32;
-        let mut target_offset = 0usize;
-
-        // Search for empty slot in existing blocks
-        for (ext_idx, extent) in ei.extents.iter().enumerate() {
-            if extent.is_empty() && (ext_idx == 0 || ei.extents[ext_idx - 1].is_empty()) {
-                // Need to allocate first block
-                break;
-            }
-
-            for block_offset in 0..extent.ee_len {
-                let block_num = extent.ee_start + block_offset;
-                let block = self.read_block(block_num)?;
-
-                for file_idx in 0..LOLELFFS_FILES_PER_BLOCK {
-                    let offset = file_idx * FileEntry::SIZE;
-                    let entry_data = &block[offset..offset + FileEntry::SIZE];
-
-                    // Check if slot is empty (inode 0 and no filename)
-                    if entry_data[0..4] == [0, 0, 0, 0] && entry_data[4] == 0 {
-                        target_block = block_num;
-                        target_offset = offset;
-                        slot_found = true;
+        // Find a slot for the new entry, or allocate a new block
+        let slot = match self.free_dir_slot(&ei)? {
+            Some(slot) => slot,
+            None => {
+                // Find extent with space or create new extent
+                let mut extent_idx = None;
+                let mut next_logical = 0u32;
+
+                for (idx, extent) in ei.extents.iter().enumerate() {
+                    if extent.is_empty() {
+                        extent_idx = Some(idx);
                         break;
                     }
+                    next_logical = extent.ee_block + extent.ee_len;
                 }
 
-                if slot_found {
-                    break;
-                }
-            }
-
-            if slot_found {
-                break;
-            }
-        }
-
-        // If no slot found, need to allocate new block
-        if !slot_found {
-            // Find extent with space or create new extent
-            let mut extent_idx = None;
-            let mut next_logical = 0u32;
-
-            for (idx, extent) in ei.extents.iter().enumerate() {
-                if extent.is_empty() {
-                    extent_idx = Some(idx);
-                    break;
-                }
-                next_logical = extent.ee_block + extent.ee_len;
+                let extent_idx = extent_idx.ok_or_else(|| anyhow::anyhow!("Directory full"))?;
+
+                // Allocate a new block
+                let new_block = self.alloc_blocks(1)?;
+
+                // Update extent
+                ei.extents[extent_idx] = Extent {
+                    ee_block: next_logical,
+                    ee_len: 1,
+                    ee_start: new_block,
+                    ee_comp_algo: LOLELFFS_COMP_NONE as u16,
+                    ee_enc_algo: LOLELFFS_ENC_NONE,
+                    ee_reserved: 0,
+                    ee_flags: 0,
+                    ee_reserved2: 0,
+                    ee_meta: 0,
+                };
+
+                // Initialize the new block
+                let empty_block = vec![0u8; LOLELFFS_BLOCK_SIZE as usize];
+                self.write_block(new_block, &empty_block)?;
+
+                dir_inode.i_blocks += 1;
+                next_logical * LOLELFFS_FILES_PER_BLOCK as u32
             }
-
-            let extent_idx = extent_idx.ok_or_else(|| anyhow::anyhow!("Directory full"))?;
-
-            // Allocate a new block
-            let new_block = self.alloc_blocks(1)?;
-
-            // Update extent
-            ei.extents[extent_idx] = Extent {
-                ee_block: next_logical,
-                ee_len: 1,
-                ee_start: new_block,
-                ee_comp_algo: LOLELFFS_COMP_NONE as u16,
-                ee_enc_algo: LOLELFFS_ENC_NONE,
-                ee_reserved: 0,
-                ee_flags: 0,
-                ee_reserved2: 0,
-                ee_meta: 0,
-            };
-
-            // Initialize the new block
-            let empty_block = vec![0u8; LOLELFFS_BLOCK_SIZE as usize];
-            self.write_block(new_block, &empty_block)?;
-
-            target_block = new_block;
-            target_offset = 0;
-
-            dir_inode.i_blocks += 1;
-        }
+        };
 
         // Write the directory entry
         let entry = FileEntry {
             inode: file_inode_num,
             filename: filename.to_string(),
         };
-        let entry_data = entry.to_bytes();
-
-        let mut block = self.read_block(target_block)?;
-        block[target_offset..target_offset + FileEntry::SIZE].copy_from_slice(&entry_data);
-        self.write_block(target_block, &block)?;
+        self.write_dir_slot(&ei, slot, &entry.to_bytes())?;
+
+        // Update hashed index, building it once the directory outgrows one
+        // block, or each time it doubles if it had to be dropped
+        if ei.dx_block != 0
+            && self
+                .dx_insert(ei.dx_block, ei.nr_files, dx_hash(filename.as_bytes()), slot)
+                .is_err()
+        {
+            self.dx_drop(&mut ei);
+        }
+        ei.nr_files += 1;
+        if ei.dx_block == 0
+            && self.superblock.comp_features & LOLELFFS_FEATURE_DIR_INDEX != 0
+            && ei.nr_files > LOLELFFS_DX_MIN_FILES
+            && ei.nr_files.is_power_of_two()
+        {
+            // Lookups scan the entries of directories left unindexed
+            let _ = self.dx_build(&mut ei);
+        }
 
         // Update extent index
-        ei.nr_files += 1;
         self.write_extent_index(dir_inode.ei_block, &ei)?;
 
         // Update directory inode
@@ -288,41 +522,48 @@ impl LolelfFs {
         }
 
         let mut ei = self.read_extent_index(&dir_inode)?;
-        let mut removed_inode = None;
+        let (removed_inode, slot) = self
+            .find_dir_entry(&ei, filename)?
+            .ok_or_else(|| anyhow::anyhow!("File '{}' not found", filename))?;
+
+        // Keep entries packed by moving the last one into the hole
+        let last = ei.nr_files.saturating_sub(1);
+        let moved = if slot < last {
+            self.read_dir_slot(&ei, last)?
+        } else {
+            None
+        };
 
-        // Search for the entry
-        'outer: for extent in &ei.extents {
-            if extent.is_empty() {
-                break;
+        if ei.dx_block != 0 {
+            let mut res = self.dx_change(
+                ei.dx_block,
+                ei.nr_files,
+                dx_hash(filename.as_bytes()),
+                slot,
+                None,
+            );
+            if let Some(entry) = moved.as_ref().filter(|_| res.is_ok()) {
+                res = self.dx_change(
+                    ei.dx_block,
+                    ei.nr_files - 1,
+                    dx_hash(entry.filename.as_bytes()),
+                    last,
+                    Some(slot),
+                );
             }
-
-            for block_offset in 0..extent.ee_len {
-                let block_num = extent.ee_start + block_offset;
-                let mut block = self.read_block(block_num)?;
-
-                for file_idx in 0..LOLELFFS_FILES_PER_BLOCK {
-                    let offset = file_idx * FileEntry::SIZE;
-                    let entry_data = &block[offset..offset + FileEntry::SIZE];
-
-                    if let Some(entry) = FileEntry::from_bytes(entry_data) {
-                        if entry.filename == filename {
-                            removed_inode = Some(entry.inode);
-
-                            // Clear the entry
-                            for byte in &mut block[offset..offset + FileEntry::SIZE] {
-                                *byte = 0;
-                            }
-                            self.write_block(block_num, &block)?;
-
-                            break 'outer;
-                        }
-                    }
-                }
+            if res.is_err() {
+                self.dx_drop(&mut ei);
             }
         }
 
-        let removed_inode =
-            removed_inode.ok_or_else(|| anyhow::anyhow!("File '{}' not found", filename))?;
+        let empty = vec![0u8; FileEntry::SIZE];
+        match moved {
+            Some(entry) => {
+                self.write_dir_slot(&ei, slot, &entry.to_bytes())?;
+                self.write_dir_slot(&ei, last, &empty)?;
+            }
+            None => self.write_dir_slot(&ei, slot, &empty)?,
+        }
 
         // Update extent index
         ei.nr_files = ei.nr_files.saturating_sub(1);
@@ -375,6 +616,7 @@ impl LolelfFs {
         let ei = ExtentIndex {
             nr_files: 0,
             extents: vec![Extent::default(); LOLELFFS_MAX_EXTENTS],
+            dx_block: 0,
         };
         self.write_extent_index(ei_block, &ei)?;
 
@@ -421,9 +663,10 @@ impl LolelfFs {
             self.free_blocks(dir_inode.ei_block, 1)?;
         }
 
-        // Free any data blocks
+        // Free any data blocks and the hashed index
         if dir_inode.ei_block != 0 {
-            let ei = self.read_extent_index(&dir_inode)?;
+            let mut ei = self.read_extent_index(&dir_inode)?;
+            self.dx_free(&mut ei)?;
             for extent in &ei.extents {
                 if extent.is_empty() {
                     break;
@@ -4,10 +4,176 @@ use crate::compress;
 use crate::fs::LolelfFs;
 use crate::types::*;
 use anyhow::{bail, Result};
+use std::io::{self, Read, Seek, SeekFrom};
+use std::thread;
+
+/// Smallest number of chunks worth spreading over worker threads
+const PARALLEL_MIN_CHUNKS: usize = 16;
+
+/// Apply `f` to every `chunk_size` chunk of `data` along with its index,
+/// spreading the chunks over the available cores, and return the results in
+/// order
+fn par_chunks<T, F>(data: &[u8], chunk_size: usize, f: F) -> Vec<T>
+where
+    T: Send,
+    F: Fn(usize, &[u8]) -> T + Sync,
+{
+    let chunks: Vec<&[u8]> = data.chunks(chunk_size).collect();
+    let threads = thread::available_parallelism()
+        .map(|n| n.get())
+        .unwrap_or(1)
+        .min(chunks.len());
+
+    if threads <= 1 || chunks.len() < PARALLEL_MIN_CHUNKS {
+        return chunks.iter().enumerate().map(|(i, c)| f(i, c)).collect();
+    }
+
+    let per_thread = chunks.len().div_ceil(threads);
+    let f = &f;
+    thread::scope(|scope| {
+        let workers: Vec<_> = chunks
+            .chunks(per_thread)
+            .enumerate()
+            .map(|(n, group)| {
+                scope.spawn(move || {
+                    group
+                        .iter()
+                        .enumerate()
+                        .map(|(i, c)| f(n * per_thread + i, c))
+                        .collect::<Vec<T>>()
+                })
+            })
+            .collect();
+        workers
+            .into_iter()
+            .flat_map(|worker| worker.join().unwrap())
+            .collect()
+    })
+}
+
+/// Encrypt one block of file data, sized back to a whole block
+fn encrypt_file_block(
+    enc_algo: u8,
+    key: &[u8; 32],
+    logical_block: u32,
+    block: &[u8],
+) -> Result<Vec<u8>> {
+    let encrypted = crate::encrypt::encrypt_block(enc_algo, key, logical_block as u64, block)?;
+    let mut enc_block = vec![0u8; LOLELFFS_BLOCK_SIZE as usize];
+    let copy_len = encrypted.len().min(LOLELFFS_BLOCK_SIZE as usize);
+    enc_block[..copy_len].copy_from_slice(&encrypted[..copy_len]);
+    Ok(enc_block)
+}
+
+/// Target of a symbolic link, stored in `i_data`
+fn symlink_target(inode: &Inode) -> &[u8] {
+    let len = inode
+        .i_data
+        .iter()
+        .position(|&b| b == 0)
+        .unwrap_or(inode.i_data.len());
+    &inode.i_data[..len]
+}
+
+/// Copy the target of a symbolic link from byte `offset` into `buf`
+fn read_symlink_at(inode: &Inode, offset: u64, buf: &mut [u8]) -> usize {
+    let target = symlink_target(inode);
+    let start = (offset.min(target.len() as u64)) as usize;
+    let len = buf.len().min(target.len() - start);
+    buf[..len].copy_from_slice(&target[start..start + len]);
+    len
+}
+
+/// Copy the part of `data`, to be written at byte `offset` of a file, that
+/// falls into `buf`, which holds the file bytes from `buf_offset`
+fn patch_range(buf: &mut [u8], buf_offset: u64, offset: u64, data: &[u8]) {
+    let start = offset.max(buf_offset);
+    let end = (offset + data.len() as u64).min(buf_offset + buf.len() as u64);
+    if start < end {
+        buf[(start - buf_offset) as usize..(end - buf_offset) as usize]
+            .copy_from_slice(&data[(start - offset) as usize..(end - offset) as usize]);
+    }
+}
+
+/// Copy the bytes of an inline file `data` from byte `offset` into `buf`
+fn read_inline_at(data: &[u8], offset: u64, buf: &mut [u8]) -> usize {
+    let start = (offset.min(data.len() as u64)) as usize;
+    let len = buf.len().min(data.len() - start);
+    buf[..len].copy_from_slice(&data[start..start + len]);
+    len
+}
+
+/// Last metadata block and cluster decoded from a packed extent, kept across
+/// the reads of a file
+#[derive(Default)]
+struct ReadCache {
+    meta: Option<(u32, CompressionMetadata)>,
+    cluster: Option<((u32, usize), Vec<u8>)>,
+}
+
+/// Streaming reader over the contents of a file, returned by
+/// [`LolelfFs::open_reader`]. The inode and its extent index are read once,
+/// so each read only costs the blocks it covers.
+pub struct FileReader<'a> {
+    fs: &'a LolelfFs,
+    inode: Inode,
+    ei: ExtentIndex,
+    inline: Option<Vec<u8>>,
+    cache: ReadCache,
+    pos: u64,
+}
+
+impl FileReader<'_> {
+    /// Size of the file in bytes
+    pub fn len(&self) -> u64 {
+        self.inode.i_size as u64
+    }
+
+    /// Check if the file is empty
+    pub fn is_empty(&self) -> bool {
+        self.inode.i_size == 0
+    }
+}
+
+impl Read for FileReader<'_> {
+    fn read(&mut self, buf: &mut [u8]) -> io::Result<usize> {
+        let read = if self.inode.is_symlink() {
+            read_symlink_at(&self.inode, self.pos, buf)
+        } else if let Some(data) = &self.inline {
+            read_inline_at(data, self.pos, buf)
+        } else {
+            self.fs
+                .read_range(&self.inode, &self.ei, &mut self.cache, self.pos, buf)
+                .map_err(io::Error::other)?
+        };
+        self.pos += read as u64;
+        Ok(read)
+    }
+}
+
+impl Seek for FileReader<'_> {
+    fn seek(&mut self, pos: SeekFrom) -> io::Result<u64> {
+        let new_pos = match pos {
+            SeekFrom::Start(offset) => Some(offset),
+            SeekFrom::End(delta) => self.len().checked_add_signed(delta),
+            SeekFrom::Current(delta) => self.pos.checked_add_signed(delta),
+        };
+        match new_pos {
+            Some(new_pos) => {
+                self.pos = new_pos;
+                Ok(new_pos)
+            }
+            None => Err(io::Error::new(
+                io::ErrorKind::InvalidInput,
+                "invalid seek to a negative position",
+            )),
+        }
+    }
+}
 
 impl LolelfFs {
     /// Read file contents
-    pub fn read_file(&mut self, inode_num: u32) -> Result<Vec<u8>> {
+    pub fn read_file(&self, inode_num: u32) -> Result<Vec<u8>> {
         let inode = self.read_inode(inode_num)?;
 
         if inode.is_dir() {
@@ -16,70 +182,367 @@ impl LolelfFs {
 
         if inode.is_symlink() {
             // Return symlink target from i_data
-            let target = inode
-                .i_data
-                .iter()
-                .take_while(|&&b| b != 0)
-                .copied()
-                .collect();
-            return Ok(target);
+            return Ok(symlink_target(&inode).to_vec());
+        }
+
+        let mut data = vec![0u8; inode.i_size as usize];
+        let read = self.read_at(inode_num, 0, &mut data)?;
+        data.truncate(read);
+        Ok(data)
+    }
+
+    /// Read up to `buf.len()` bytes of a file starting at byte `offset`, and
+    /// return how many bytes were read (0 at or past the end of the file).
+    ///
+    /// Only the extents covering the range are looked up, and only their
+    /// blocks are read, decrypted and decompressed.
+    pub fn read_at(&self, inode_num: u32, offset: u64, buf: &mut [u8]) -> Result<usize> {
+        let inode = self.read_inode(inode_num)?;
+
+        if inode.is_dir() {
+            bail!("Cannot read directory as file");
+        }
+
+        if inode.is_symlink() {
+            return Ok(read_symlink_at(&inode, offset, buf));
+        }
+
+        if inode.is_inline() {
+            return Ok(read_inline_at(&self.read_inline(&inode)?, offset, buf));
+        }
+
+        if inode.ei_block == 0 || offset >= inode.i_size as u64 {
+            return Ok(0);
+        }
+
+        let ei = self.read_extent_index(&inode)?;
+        self.read_range(&inode, &ei, &mut ReadCache::default(), offset, buf)
+    }
+
+    /// Locate the contents of a regular file in the image, as `(offset in
+    /// the file, offset in the image, length)` ranges in file order. Ranges
+    /// between them are holes.
+    ///
+    /// Returns `None` if the file is stored inline, or any extent of the
+    /// file is compressed or encrypted; use [`LolelfFs::open_reader`] then.
+    pub fn file_ranges(&self, inode_num: u32) -> Result<Option<Vec<(u64, u64, usize)>>> {
+        let inode = self.read_inode(inode_num)?;
+
+        if inode.is_dir() {
+            bail!("Cannot read directory as file");
+        }
+
+        if inode.is_symlink() {
+            return Ok(None);
         }
 
-        if inode.ei_block == 0 || inode.i_size == 0 {
-            return Ok(Vec::new());
+        if inode.ei_block == 0 {
+            return Ok((inode.i_size == 0).then(Vec::new));
         }
 
         let ei = self.read_extent_index(&inode)?;
-        let mut data = Vec::with_capacity(inode.i_size as usize);
+        let size = inode.i_size as u64;
+        let block_size = LOLELFFS_BLOCK_SIZE as u64;
+        let mut ranges = Vec::new();
+
+        for extent in ei.extents.iter().take_while(|e| !e.is_empty()) {
+            if extent.ee_flags != 0
+                || extent.ee_enc_algo != LOLELFFS_ENC_NONE
+                || extent.ee_comp_algo != LOLELFFS_COMP_NONE as u16
+            {
+                return Ok(None);
+            }
 
-        let num_blocks = inode.i_size.div_ceil(LOLELFFS_BLOCK_SIZE);
+            let start = extent.ee_block as u64 * block_size;
+            if start >= size {
+                continue;
+            }
+            let len = (extent.ee_len as u64 * block_size).min(size - start) as usize;
+            ranges.push((start, extent.ee_start as u64 * block_size, len));
+        }
 
-        for logical_block in 0..num_blocks {
-            if let Some(extent) = ei.find_extent(logical_block) {
-                if let Some(phys_block) = extent.get_physical(logical_block) {
-                    let raw_block = self.read_block(phys_block)?;
+        Ok(Some(ranges))
+    }
 
-                    // Step 1: Decrypt if needed (decrypt-then-decompress pipeline)
-                    let decrypted_block = if extent.ee_enc_algo != LOLELFFS_ENC_NONE {
-                        // Check if filesystem is unlocked
-                        if !self.enc_unlocked {
-                            bail!("Cannot read encrypted block: filesystem is locked");
-                        }
+    /// Borrow the contents of a regular file straight from the mapping of an
+    /// image opened with [`LolelfFs::open_readonly`]. Each slice is paired
+    /// with its byte offset in the file, and ranges between slices are holes.
+    ///
+    /// Returns `None` if the image is not mapped, or in the cases where
+    /// [`LolelfFs::file_ranges`] does; use [`LolelfFs::open_reader`] then.
+    pub fn file_slices(&self, inode_num: u32) -> Result<Option<Vec<(u64, &[u8])>>> {
+        if !self.is_mapped() {
+            if self.read_inode(inode_num)?.is_dir() {
+                bail!("Cannot read directory as file");
+            }
+            return Ok(None);
+        }
 
-                        crate::encrypt::decrypt_block(
-                            extent.ee_enc_algo,
-                            &self.enc_master_key,
-                            logical_block as u64,
-                            &raw_block,
-                        )?
-                    } else {
-                        raw_block
-                    };
-
-                    // Step 2: Decompress if needed
-                    let block = if extent.ee_comp_algo != LOLELFFS_COMP_NONE as u16 {
-                        compress::decompress_block(
-                            extent.ee_comp_algo as u8,
-                            &decrypted_block,
-                            LOLELFFS_BLOCK_SIZE as usize,
-                        )?
-                    } else {
-                        decrypted_block
-                    };
+        let Some(ranges) = self.file_ranges(inode_num)? else {
+            return Ok(None);
+        };
+        let block_size = LOLELFFS_BLOCK_SIZE as u64;
+
+        ranges
+            .into_iter()
+            .map(|(offset, image_offset, len)| {
+                let blocks = self
+                    .mapped_blocks(
+                        (image_offset / block_size) as u32,
+                        (len as u64).div_ceil(block_size) as u32,
+                    )
+                    .unwrap()?;
+                Ok((offset, &blocks[..len]))
+            })
+            .collect::<Result<Vec<_>>>()
+            .map(Some)
+    }
+
+    /// Open a file for streaming reads
+    pub fn open_reader(&self, inode_num: u32) -> Result<FileReader<'_>> {
+        let inode = self.read_inode(inode_num)?;
+
+        if inode.is_dir() {
+            bail!("Cannot read directory as file");
+        }
+
+        let ei = if inode.ei_block != 0 && !inode.is_symlink() {
+            self.read_extent_index(&inode)?
+        } else {
+            ExtentIndex {
+                nr_files: 0,
+                extents: vec![Extent::default(); LOLELFFS_MAX_EXTENTS],
+                dx_block: 0,
+            }
+        };
+        let inline = if inode.is_inline() {
+            Some(self.read_inline(&inode)?)
+        } else {
+            None
+        };
 
-                    // Calculate how much data to read from this block
-                    let block_start = logical_block * LOLELFFS_BLOCK_SIZE;
-                    let block_end = (block_start + LOLELFFS_BLOCK_SIZE).min(inode.i_size);
-                    let bytes_to_read = (block_end - block_start) as usize;
+        Ok(FileReader {
+            fs: self,
+            inode,
+            ei,
+            inline,
+            cache: ReadCache::default(),
+            pos: 0,
+        })
+    }
+
+    /// Contents of a regular file stored inline, in `i_data` or in a tail
+    /// block
+    pub(crate) fn read_inline(&self, inode: &Inode) -> Result<Vec<u8>> {
+        let size = inode.i_size as usize;
+        let tail = match inode.tail_ref() {
+            Some(tail) => tail,
+            None => return Ok(inode.i_data[..size].to_vec()),
+        };
+        if size > LOLELFFS_TAIL_MAX_SIZE as usize {
+            bail!("Inline file of {} bytes is too large", size);
+        }
+        if tail.tr_block < self.superblock.data_block_start()
+            || tail.tr_block >= self.superblock.nr_blocks
+        {
+            bail!("Tail block {} outside the data area", tail.tr_block);
+        }
+
+        self.with_block(tail.tr_block, |block| {
+            let th = TailHeader::from_bytes(block);
+            let start = tail.tr_offset as usize;
+            if !th.is_valid()
+                || start < LOLELFFS_TAIL_HEADER_SIZE as usize
+                || start + size > th.th_used as usize
+            {
+                bail!(
+                    "Invalid reference to tail block {} at offset {}",
+                    tail.tr_block,
+                    tail.tr_offset
+                );
+            }
+            Ok(block[start..start + size].to_vec())
+        })?
+    }
+
+    /// Whether new small files are stored inline: never on encrypted
+    /// filesystems, where inline data would be left in clear
+    fn inline_allowed(&self) -> bool {
+        self.superblock.comp_features & LOLELFFS_FEATURE_INLINE_DATA != 0
+            && self.superblock.enc_enabled == 0
+    }
+
+    /// Pack `data` into the last tail block if it has room, or into a new
+    /// tail block otherwise
+    fn alloc_tail(&mut self, data: &[u8]) -> Result<TailRef> {
+        let len = data.len() as u32;
+        let last = self.superblock.tail_block;
+
+        if last >= self.superblock.data_block_start()
+            && last < self.superblock.nr_blocks
+            && !self.is_block_free(last)?
+        {
+            let mut block = self.read_block(last)?;
+            let mut th = TailHeader::from_bytes(&block);
+            if th.is_valid() && th.th_nr_tails > 0 && th.th_used + len <= LOLELFFS_BLOCK_SIZE {
+                let offset = th.th_used;
+                block[offset as usize..(offset + len) as usize].copy_from_slice(data);
+                th.th_nr_tails += 1;
+                th.th_used += len;
+                th.write_to(&mut block);
+                self.write_block(last, &block)?;
+                return Ok(TailRef {
+                    tr_block: last,
+                    tr_offset: offset,
+                });
+            }
+        }
+
+        let tail_block = self.alloc_blocks(1)?;
+        let mut block = vec![0u8; LOLELFFS_BLOCK_SIZE as usize];
+        let offset = LOLELFFS_TAIL_HEADER_SIZE;
+        block[offset as usize..(offset + len) as usize].copy_from_slice(data);
+        TailHeader {
+            th_magic: LOLELFFS_TAIL_MAGIC,
+            th_nr_tails: 1,
+            th_used: offset + len,
+        }
+        .write_to(&mut block);
+        self.write_block(tail_block, &block)?;
+
+        self.superblock.tail_block = tail_block;
+        self.write_superblock()?;
+        Ok(TailRef {
+            tr_block: tail_block,
+            tr_offset: offset,
+        })
+    }
+
+    /// Drop a file from its tail block, freeing the block with its last file
+    fn free_tail(&mut self, tail: TailRef) -> Result<()> {
+        let mut block = self.read_block(tail.tr_block)?;
+        let mut th = TailHeader::from_bytes(&block);
+        if !th.is_valid() || th.th_nr_tails == 0 {
+            bail!("Invalid tail block {}", tail.tr_block);
+        }
+
+        th.th_nr_tails -= 1;
+        if th.th_nr_tails > 0 {
+            th.write_to(&mut block);
+            return self.write_block(tail.tr_block, &block);
+        }
 
-                    data.extend_from_slice(&block[..bytes_to_read]);
+        TailHeader::default().write_to(&mut block);
+        self.write_block(tail.tr_block, &block)?;
+        if self.superblock.tail_block == tail.tr_block {
+            self.superblock.tail_block = 0;
+            self.write_superblock()?;
+        }
+        self.free_blocks(tail.tr_block, 1)
+    }
+
+    /// Read the bytes of a regular file from `offset` into `buf`, up to the
+    /// end of the file. Blocks not covered by any extent read as zeroes.
+    fn read_range(
+        &self,
+        inode: &Inode,
+        ei: &ExtentIndex,
+        cache: &mut ReadCache,
+        offset: u64,
+        buf: &mut [u8],
+    ) -> Result<usize> {
+        let size = inode.i_size as u64;
+        if offset >= size {
+            return Ok(0);
+        }
+        let end = size.min(offset + buf.len() as u64);
+        let block_size = LOLELFFS_BLOCK_SIZE as u64;
+
+        let mut pos = offset;
+        while pos < end {
+            let logical_block = (pos / block_size) as u32;
+            let in_block = (pos % block_size) as usize;
+            let len = (block_size - pos % block_size).min(end - pos) as usize;
+            let out = &mut buf[(pos - offset) as usize..][..len];
+            pos += len as u64;
+
+            let extent = match ei.find_extent(logical_block) {
+                Some(extent) => extent,
+                None => {
+                    out.fill(0);
+                    continue;
+                }
+            };
+
+            // Packed extents: decode each cluster once for all its blocks
+            if extent.has_metadata() {
+                if cache.meta.as_ref().map(|(block, _)| *block) != Some(extent.ee_meta) {
+                    cache.meta = Some((extent.ee_meta, self.read_comp_metadata(extent)?));
                 }
+                let meta = &cache.meta.as_ref().unwrap().1;
+
+                let rel = logical_block - extent.ee_block;
+                let cluster = (rel >> meta.cluster_shift) as usize;
+                let key = (extent.ee_meta, cluster);
+                if cache.cluster.as_ref().map(|(k, _)| *k) != Some(key) {
+                    let data = self.read_cluster(extent, meta, cluster)?;
+                    cache.cluster = Some((key, data));
+                }
+                let cluster_data = &cache.cluster.as_ref().unwrap().1;
+
+                let start = ((rel - ((cluster as u32) << meta.cluster_shift)) * LOLELFFS_BLOCK_SIZE)
+                    as usize
+                    + in_block;
+                out.copy_from_slice(&cluster_data[start..start + len]);
+                continue;
             }
+
+            let phys_block = extent.get_physical(logical_block).unwrap();
+
+            // Plain blocks of a mapped image are copied straight from the mapping
+            if extent.ee_enc_algo == LOLELFFS_ENC_NONE
+                && extent.ee_comp_algo == LOLELFFS_COMP_NONE as u16
+            {
+                if let Some(block) = self.mapped_blocks(phys_block, 1) {
+                    out.copy_from_slice(&block?[in_block..in_block + len]);
+                    continue;
+                }
+            }
+
+            let raw_block = self.read_block(phys_block)?;
+
+            // Step 1: Decrypt if needed (decrypt-then-decompress pipeline)
+            let decrypted_block = if extent.ee_enc_algo != LOLELFFS_ENC_NONE {
+                // Check if filesystem is unlocked
+                if !self.enc_unlocked {
+                    bail!("Cannot read encrypted block: filesystem is locked");
+                }
+
+                crate::encrypt::decrypt_block(
+                    extent.ee_enc_algo,
+                    &self.enc_master_key,
+                    logical_block as u64,
+                    &raw_block,
+                )?
+            } else {
+                raw_block
+            };
+
+            // Step 2: Decompress if needed
+            let block = if extent.ee_comp_algo != LOLELFFS_COMP_NONE as u16 {
+                compress::decompress_block(
+                    extent.ee_comp_algo as u8,
+                    &decrypted_block,
+                    LOLELFFS_BLOCK_SIZE as usize,
+                )?
+            } else {
+                decrypted_block
+            };
+
+            out.copy_from_slice(&block[in_block..in_block + len]);
         }
 
-        // Truncate to exact file size
-        data.truncate(inode.i_size as usize);
-        Ok(data)
+        Ok((end - offset) as usize)
     }
 
     /// Write data to a file
@@ -97,12 +560,47 @@ impl LolelfFs {
         // Free existing blocks
         if inode.ei_block != 0 {
             let ei = self.read_extent_index(&inode)?;
-            for extent in &ei.extents {
-                if extent.is_empty() {
-                    break;
+            let used = ei.count_extents();
+            self.free_file_extents(inode_num, &ei.extents[..used], &[])?;
+            for node in self.extent_tree_nodes(&inode)? {
+                self.free_blocks(node, 1)?;
+            }
+        } else if let Some(tail) = inode.tail_ref() {
+            self.free_tail(tail)?;
+        }
+        inode.i_data = [0; 28];
+
+        // Small files are stored inline, without an extent index block
+        if self.inline_allowed() && data.len() as u32 <= LOLELFFS_TAIL_MAX_SIZE {
+            if inode.ei_block != 0 {
+                self.free_blocks(inode.ei_block, 1)?;
+                inode.ei_block = 0;
+            }
+            if data.len() as u32 <= LOLELFFS_INLINE_DATA_SIZE {
+                inode.i_data[..data.len()].copy_from_slice(data);
+            } else {
+                match self.alloc_tail(data) {
+                    Ok(tail) => inode.set_tail_ref(tail),
+                    Err(e) => {
+                        // The old contents are gone: leave an empty file
+                        inode.i_size = 0;
+                        inode.i_blocks = 0;
+                        self.write_inode(inode_num, &inode)?;
+                        return Err(e);
+                    }
                 }
-                self.free_blocks(extent.ee_start, extent.ee_len)?;
             }
+
+            inode.i_size = data.len() as u32;
+            inode.i_blocks = 0;
+            let now = std::time::SystemTime::now()
+                .duration_since(std::time::UNIX_EPOCH)
+                .unwrap()
+                .as_secs() as u32;
+            inode.i_mtime = now;
+            inode.i_ctime = now;
+            self.write_inode(inode_num, &inode)?;
+            return Ok(());
         }
 
         // Handle empty file
@@ -111,6 +609,7 @@ impl LolelfFs {
                 let ei = ExtentIndex {
                     nr_files: 0,
                     extents: vec![Extent::default(); LOLELFFS_MAX_EXTENTS],
+                    dx_block: 0,
                 };
                 self.write_extent_index(inode.ei_block, &ei)?;
             }
@@ -136,173 +635,784 @@ impl LolelfFs {
         // Calculate needed blocks
         let num_blocks = (data.len() as u32).div_ceil(LOLELFFS_BLOCK_SIZE);
 
-        // Allocate blocks using extents
-        let mut extents = Vec::new();
-        let mut allocated = 0u32;
-        let mut logical_block = 0u32;
+        // Compressed files are stored as packed clusters
+        if let Some(algo) = self.packed_algo(&inode)?.filter(|_| {
+            num_blocks as u64
+                <= LOLELFFS_MAX_BLOCKS_PER_EXTENT as u64 * self.max_file_extents() as u64
+        }) {
+            let extents = self.write_packed_extents(0, data, algo)?;
+            let ei = ExtentIndex {
+                nr_files: 0,
+                extents,
+                dx_block: 0,
+            };
+            self.write_extent_index(inode.ei_block, &ei)?;
 
-        while allocated < num_blocks {
-            let remaining = num_blocks - allocated;
+            inode.i_size = data.len() as u32;
+            inode.i_blocks = num_blocks;
+            let now = std::time::SystemTime::now()
+                .duration_since(std::time::UNIX_EPOCH)
+                .unwrap()
+                .as_secs() as u32;
+            inode.i_mtime = now;
+            inode.i_ctime = now;
+            self.write_inode(inode_num, &inode)?;
+            return Ok(());
+        }
 
-            // Determine if we need metadata for this extent
-            let needs_metadata = false; // Currently always false - no per-block metadata
+        // Plain extents, encrypted if enabled
+        let max_extents = self.max_file_extents();
+        let (mut extents, fits) = self.write_plain_extents(0, data, max_extents)?;
+        if !fits {
+            for extent in &extents {
+                self.free_extent(extent)?;
+            }
+            extents.clear();
+        }
+        let ei = ExtentIndex {
+            nr_files: 0,
+            extents,
+            dx_block: 0,
+        };
+        self.write_extent_index(inode.ei_block, &ei)?;
 
-            let max_extent_size = if needs_metadata {
-                LOLELFFS_MAX_BLOCKS_PER_EXTENT
-            } else {
-                let large = self.superblock.max_extent_blocks_large;
-                if large == 0 || large > LOLELFFS_MAX_BLOCKS_PER_EXTENT_LARGE {
-                    LOLELFFS_MAX_BLOCKS_PER_EXTENT_LARGE
+        if !fits {
+            inode.i_size = 0;
+            inode.i_blocks = 0;
+            self.write_inode(inode_num, &inode)?;
+            bail!(
+                "No free space: too fragmented to hold the file in {} extents",
+                max_extents
+            );
+        }
+
+        // Update inode
+        inode.i_size = data.len() as u32;
+        inode.i_blocks = num_blocks;
+        let now = std::time::SystemTime::now()
+            .duration_since(std::time::UNIX_EPOCH)
+            .unwrap()
+            .as_secs() as u32;
+        inode.i_mtime = now;
+        inode.i_ctime = now;
+        self.write_inode(inode_num, &inode)?;
+
+        Ok(())
+    }
+
+    /// Write `data` into a file at byte `offset`, extending the file if
+    /// needed, and return the number of bytes written
+    ///
+    /// Only the logical blocks covered by the write are touched: blocks of
+    /// plain extents are rewritten in place, while compressed extents, whose
+    /// blocks cannot be updated one by one, are re-encoded as a whole. An
+    /// append grows the last extent when the blocks after it are free, and
+    /// adds new extents otherwise. The extent index and `i_size` are updated
+    /// to match. Files out of extent slots, or with a hole the write covers,
+    /// are rewritten whole.
+    pub fn write_at(&mut self, inode_num: u32, offset: u64, data: &[u8]) -> Result<usize> {
+        let mut inode = self.read_inode(inode_num)?;
+
+        if inode.is_dir() {
+            bail!("Cannot write to directory");
+        }
+
+        if inode.is_symlink() {
+            bail!("Cannot write to symlink");
+        }
+
+        if data.is_empty() {
+            return Ok(0);
+        }
+
+        let end = offset + data.len() as u64;
+        if end > u32::MAX as u64 {
+            bail!("File too large: {} bytes", end);
+        }
+
+        // Inline files are rewritten whole, inline again if they still fit
+        if inode.is_inline() {
+            let mut file = self.read_inline(&inode)?;
+            if file.len() < end as usize {
+                file.resize(end as usize, 0);
+            }
+            file[offset as usize..end as usize].copy_from_slice(data);
+            self.write_file(inode_num, &file)?;
+            return Ok(data.len());
+        }
+
+        // Allocate extent index block if needed
+        let mut old_nodes = Vec::new();
+        let ei = if inode.ei_block != 0 {
+            old_nodes = self.extent_tree_nodes(&inode)?;
+            self.read_extent_index(&inode)?
+        } else {
+            inode.ei_block = self.alloc_blocks(1)?;
+            ExtentIndex {
+                nr_files: 0,
+                extents: vec![Extent::default(); LOLELFFS_MAX_EXTENTS],
+                dx_block: 0,
+            }
+        };
+
+        let (extents, complete) = self.write_extents_at(inode_num, &inode, &ei, offset, data)?;
+
+        let nr_blocks = extents.iter().map(|e| e.ee_len).sum::<u32>();
+        for node in old_nodes {
+            self.free_blocks(node, 1)?;
+        }
+        self.write_extent_index(
+            inode.ei_block,
+            &ExtentIndex {
+                nr_files: 0,
+                extents,
+                dx_block: 0,
+            },
+        )?;
+
+        let mapped = nr_blocks as u64 * LOLELFFS_BLOCK_SIZE as u64;
+        inode.i_size = inode.i_size.max(end.min(mapped) as u32);
+        inode.i_blocks = nr_blocks;
+        let now = std::time::SystemTime::now()
+            .duration_since(std::time::UNIX_EPOCH)
+            .unwrap()
+            .as_secs() as u32;
+        inode.i_mtime = now;
+        inode.i_ctime = now;
+        self.write_inode(inode_num, &inode)?;
+
+        if !complete {
+            // Out of extent slots, or into a hole: rewrite the whole file,
+            // which merges the extents and maps the holes
+            let mut file = self.read_file(inode_num)?;
+            if file.len() < end as usize {
+                file.resize(end as usize, 0);
+            }
+            file[offset as usize..end as usize].copy_from_slice(data);
+            self.write_file(inode_num, &file)?;
+        }
+
+        Ok(data.len())
+    }
+
+    /// Write the blocks covered by a write at `offset` and return the new
+    /// used extents of the file, and whether the whole write fit in them
+    fn write_extents_at(
+        &mut self,
+        inode_num: u32,
+        inode: &Inode,
+        ei: &ExtentIndex,
+        offset: u64,
+        data: &[u8],
+    ) -> Result<(Vec<Extent>, bool)> {
+        let block_size = LOLELFFS_BLOCK_SIZE as u64;
+        let end = offset + data.len() as u64;
+        let first = (offset / block_size) as u32;
+        let last = ((end - 1) / block_size) as u32;
+
+        let old: Vec<Extent> = ei
+            .extents
+            .iter()
+            .take_while(|e| !e.is_empty())
+            .copied()
+            .collect();
+        let mapped_end = old.last().map_or(0, |e| e.ee_block + e.ee_len);
+        let packed_algo = self.packed_algo(inode)?;
+
+        // Holes below the mapped end have no extent to write into: leave
+        // the file to be rewritten whole, which maps them
+        let below = last.min(mapped_end.saturating_sub(1));
+        if first <= below {
+            let covered: u32 = old
+                .iter()
+                .map(|e| {
+                    (e.ee_block + e.ee_len)
+                        .min(below + 1)
+                        .saturating_sub(e.ee_block.max(first))
+                })
+                .sum();
+            if covered < below + 1 - first {
+                return Ok((old, false));
+            }
+        }
+
+        // Appends to a packed extent with room left re-encode it with the new
+        // data rather than starting a new extent
+        let grow_last = last >= mapped_end
+            && packed_algo.is_some()
+            && old
+                .last()
+                .is_some_and(|e| e.has_metadata() && e.ee_len < LOLELFFS_MAX_BLOCKS_PER_EXTENT);
+        let nr_kept = old.len() - grow_last as usize;
+
+        // Overwrite the blocks already mapped
+        let mut extents = Vec::with_capacity(old.len());
+        let mut complete = true;
+        for (idx, extent) in old[..nr_kept].iter().enumerate() {
+            let ext_end = extent.ee_block + extent.ee_len;
+            if extent.ee_block > last || ext_end <= first {
+                extents.push(*extent);
+                continue;
+            }
+
+            if extent.has_metadata()
+                || extent.ee_comp_algo != LOLELFFS_COMP_NONE as u16
+                || extent.is_shared()
+            {
+                // Re-encode the extent, which must still take a single slot.
+                // Shared extents are copied this way so that the other files
+                // mapping their blocks are left alone.
+                let mut buf = self.read_blocks(inode, ei, extent.ee_block, extent.ee_len)?;
+                patch_range(&mut buf, extent.ee_block as u64 * block_size, offset, data);
+                let (new, fits) = self.write_new_extents(extent.ee_block, &buf, 1, packed_algo)?;
+                if fits {
+                    let kept = [&extents[..], &old[idx + 1..]].concat();
+                    self.free_file_extents(inode_num, &[*extent], &kept)?;
+                    extents.extend(new);
                 } else {
-                    large
+                    for new_extent in &new {
+                        self.free_extent(new_extent)?;
+                    }
+                    extents.push(*extent);
+                    complete = false;
                 }
-            };
+                continue;
+            }
+
+            for logical_block in first.max(extent.ee_block)..=last.min(ext_end - 1) {
+                let block_start = logical_block as u64 * block_size;
+                let mut block = if offset <= block_start && block_start + block_size <= end {
+                    vec![0u8; LOLELFFS_BLOCK_SIZE as usize]
+                } else {
+                    self.read_blocks(inode, ei, logical_block, 1)?
+                };
+                patch_range(&mut block, block_start, offset, data);
+
+                let block = self.encode_block(extent.ee_enc_algo, logical_block, block)?;
+                self.write_block(extent.get_physical(logical_block).unwrap(), &block)?;
+            }
+            extents.push(*extent);
+        }
+
+        if last < mapped_end {
+            return Ok((extents, complete));
+        }
 
-            let extent_size = self
-                .calc_optimal_extent_size(allocated, needs_metadata)
-                .min(remaining)
-                .min(max_extent_size);
+        // Append the blocks past the mapped ones, zero-filling any gap
+        let tail_start = if grow_last {
+            old[nr_kept].ee_block
+        } else {
+            mapped_end
+        };
+        let mut tail = if grow_last {
+            self.read_blocks(inode, ei, tail_start, old[nr_kept].ee_len)?
+        } else {
+            Vec::new()
+        };
+        tail.resize((last + 1 - tail_start) as usize * block_size as usize, 0);
+        patch_range(&mut tail, tail_start as u64 * block_size, offset, data);
+
+        if tail_start == mapped_end && packed_algo.is_none() {
+            if let Some(extent) = extents.last_mut() {
+                if self.grow_extent(extent, &tail)? {
+                    return Ok((extents, complete));
+                }
+            }
+        }
 
-            let start_block = self.alloc_blocks(extent_size)?;
+        let slots = self.max_file_extents().saturating_sub(extents.len());
+        let (new, fits) = self.write_new_extents(tail_start, &tail, slots, packed_algo)?;
+        if grow_last {
+            if new.is_empty() {
+                extents.push(old[nr_kept]);
+            } else {
+                self.free_file_extents(inode_num, &[old[nr_kept]], &extents)?;
+            }
+        }
+        extents.extend(new);
+
+        Ok((extents, complete && fits))
+    }
+
+    /// Read `nr_blocks` logical blocks of a file from `first_block`, as
+    /// zeroes past the end of the file
+    fn read_blocks(
+        &self,
+        inode: &Inode,
+        ei: &ExtentIndex,
+        first_block: u32,
+        nr_blocks: u32,
+    ) -> Result<Vec<u8>> {
+        let mut buf = vec![0u8; (nr_blocks * LOLELFFS_BLOCK_SIZE) as usize];
+        let offset = first_block as u64 * LOLELFFS_BLOCK_SIZE as u64;
+        self.read_range(inode, ei, &mut ReadCache::default(), offset, &mut buf)?;
+        Ok(buf)
+    }
+
+    /// Grow a plain extent in place with the blocks of `data`, if the blocks
+    /// following it are free and the extent can hold them. Return whether
+    /// the extent was grown.
+    fn grow_extent(&mut self, extent: &mut Extent, data: &[u8]) -> Result<bool> {
+        let nr_blocks = (data.len() / LOLELFFS_BLOCK_SIZE as usize) as u32;
+
+        if extent.has_metadata()
+            || extent.is_shared()
+            || extent.ee_comp_algo != LOLELFFS_COMP_NONE as u16
+            || extent.ee_enc_algo != self.new_enc_algo()
+            || extent.ee_len + nr_blocks > self.max_extent_blocks()
+            || !self.alloc_blocks_at(extent.ee_start + extent.ee_len, nr_blocks)?
+        {
+            return Ok(false);
+        }
+
+        self.write_encoded_blocks(
+            extent.ee_enc_algo,
+            extent.ee_block + extent.ee_len,
+            extent.ee_start + extent.ee_len,
+            data,
+        )?;
+        extent.ee_len += nr_blocks;
+
+        Ok(true)
+    }
+
+    /// Write file data as new extents covering the logical blocks from
+    /// `first_block`: packed with `packed_algo` if set, plain (and encrypted
+    /// if enabled) otherwise, with a partial last block zero-padded. At most
+    /// `slots` extents are written; return them, and whether all the data
+    /// fit.
+    fn write_new_extents(
+        &mut self,
+        first_block: u32,
+        data: &[u8],
+        slots: usize,
+        packed_algo: Option<u8>,
+    ) -> Result<(Vec<Extent>, bool)> {
+        let block_size = LOLELFFS_BLOCK_SIZE as usize;
+
+        if let Some(algo) = packed_algo {
+            let per_extent = LOLELFFS_MAX_BLOCKS_PER_EXTENT as usize * block_size;
+            let len = data.len().min(slots.saturating_mul(per_extent));
+            let extents = self.write_packed_extents(first_block, &data[..len], algo)?;
+            return Ok((extents, len == data.len()));
+        }
+
+        self.write_plain_extents(first_block, data, slots)
+    }
+
+    /// Write file data as plain extents, encrypted if the filesystem encrypts
+    /// new data, as for [`LolelfFs::write_new_extents`]. Each extent is as
+    /// long as contiguous free space allows.
+    fn write_plain_extents(
+        &mut self,
+        first_block: u32,
+        data: &[u8],
+        slots: usize,
+    ) -> Result<(Vec<Extent>, bool)> {
+        let block_size = LOLELFFS_BLOCK_SIZE as usize;
+        let enc_algo = self.new_enc_algo();
+        let nr_blocks = data.len().div_ceil(block_size) as u32;
+        let mut extents = Vec::new();
+        let mut written = 0u32;
+
+        while written < nr_blocks {
+            if extents.len() == slots {
+                return Ok((extents, false));
+            }
+
+            // Shrink the extent to what contiguous free space allows
+            let mut len = (nr_blocks - written).min(self.max_extent_blocks());
+            let ee_start = loop {
+                match self.alloc_blocks(len) {
+                    Ok(start) => break start,
+                    Err(_) if len > 1 => len /= 2,
+                    Err(e) => return Err(e),
+                }
+            };
+
+            let ee_block = first_block + written;
+            let run_end = ((written + len) as usize * block_size).min(data.len());
+            let run = &data[written as usize * block_size..run_end];
+            self.write_encoded_blocks(enc_algo, ee_block, ee_start, run)?;
 
             extents.push(Extent {
-                ee_block: logical_block,
-                ee_len: extent_size,
-                ee_start: start_block,
-                ee_comp_algo: LOLELFFS_COMP_NONE as u16,
-                ee_enc_algo: LOLELFFS_ENC_NONE,
-                ee_reserved: 0,
-                ee_flags: 0,
-                ee_reserved2: 0,
-                ee_meta: 0,
+                ee_block,
+                ee_len: len,
+                ee_start,
+                ee_enc_algo: enc_algo,
+                ee_flags: if enc_algo != LOLELFFS_ENC_NONE {
+                    LOLELFFS_EXT_ENCRYPTED
+                } else {
+                    0
+                },
+                ..Extent::default()
             });
+            written += len;
+        }
+
+        Ok((extents, true))
+    }
 
-            logical_block += extent_size;
-            allocated += extent_size;
+    /// Encrypt a block of file data for an extent using `enc_algo`
+    fn encode_block(&self, enc_algo: u8, logical_block: u32, block: Vec<u8>) -> Result<Vec<u8>> {
+        if enc_algo == LOLELFFS_ENC_NONE {
+            return Ok(block);
         }
 
-        // Pad extents to LOLELFFS_MAX_EXTENTS
-        while extents.len() < LOLELFFS_MAX_EXTENTS {
-            extents.push(Extent::default());
+        // Check if filesystem is unlocked
+        if !self.enc_unlocked {
+            bail!("Cannot write encrypted data: filesystem is locked");
         }
 
-        // Write extent index
-        let ei = ExtentIndex {
-            nr_files: 0,
-            extents,
+        encrypt_file_block(enc_algo, &self.enc_master_key, logical_block, &block)
+    }
+
+    /// Write file data for an extent to consecutive blocks from
+    /// `phys_block`, the first one holding logical block `logical_block`.
+    /// Blocks are encrypted in parallel when `enc_algo` is set, and the run
+    /// is written in one batch. A partial last block is zero-padded.
+    fn write_encoded_blocks(
+        &mut self,
+        enc_algo: u8,
+        logical_block: u32,
+        phys_block: u32,
+        data: &[u8],
+    ) -> Result<()> {
+        let block_size = LOLELFFS_BLOCK_SIZE as usize;
+        let whole = data.len() - data.len() % block_size;
+        if whole < data.len() {
+            let mut last = data[whole..].to_vec();
+            last.resize(block_size, 0);
+            let at = (whole / block_size) as u32;
+            let last = self.encode_block(enc_algo, logical_block + at, last)?;
+            self.write_block(phys_block + at, &last)?;
+        }
+        let data = &data[..whole];
+
+        if enc_algo == LOLELFFS_ENC_NONE {
+            return self.write_blocks(phys_block, data);
+        }
+
+        // Check if filesystem is unlocked
+        if !self.enc_unlocked {
+            bail!("Cannot write encrypted data: filesystem is locked");
+        }
+
+        let key = &self.enc_master_key;
+        let blocks = par_chunks(data, LOLELFFS_BLOCK_SIZE as usize, |i, block| {
+            encrypt_file_block(enc_algo, key, logical_block + i as u32, block)
+        });
+        let mut encoded = Vec::with_capacity(data.len());
+        for block in blocks {
+            encoded.extend_from_slice(&block?);
+        }
+        self.write_blocks(phys_block, &encoded)
+    }
+
+    /// Compression algorithm new data of a file is packed with, if any: that
+    /// of its `LOLELFFS_COMP_HINT_XATTR` xattr, or the filesystem default.
+    /// Packed clusters are encrypted after compression, which needs a cipher
+    /// without a tag: ChaCha20-Poly1305 filesystems use the per-block
+    /// pipeline instead.
+    fn packed_algo(&self, inode: &Inode) -> Result<Option<u8>> {
+        if self.superblock.comp_enabled == 0
+            || crate::encrypt::get_tag_size(self.new_enc_algo()) != 0
+        {
+            return Ok(None);
+        }
+
+        let comp_algo = match self.comp_hint(inode)? {
+            Some(algo) => algo,
+            None => self.superblock.comp_default_algo as u8,
         };
-        self.write_extent_index(inode.ei_block, &ei)?;
+        Ok(Some(comp_algo).filter(|&algo| algo != LOLELFFS_COMP_NONE))
+    }
 
-        // Write data to blocks with optional compression and encryption
-        let comp_algo = self.superblock.comp_default_algo as u8;
-        let comp_enabled = self.superblock.comp_enabled != 0;
-        let enc_algo = self.superblock.enc_default_algo as u8;
-        let enc_enabled = self.superblock.enc_enabled != 0;
-        let mut updated_extents = ei.extents.clone();
-
-        for (idx, chunk) in data.chunks(LOLELFFS_BLOCK_SIZE as usize).enumerate() {
-            let logical_block = idx as u32;
-
-            if let Some((extent_idx, extent)) = ei.extents.iter().enumerate().find(|(_i, e)| {
-                logical_block >= e.ee_block
-                    && logical_block < e.ee_block + e.ee_len
-                    && !e.is_empty()
-            }) {
-                if let Some(phys_block) = extent.get_physical(logical_block) {
-                    // Prepare block data (pad to full block size)
-                    let mut block = vec![0u8; LOLELFFS_BLOCK_SIZE as usize];
-                    block[..chunk.len()].copy_from_slice(chunk);
-
-                    // Step 1: Compress if enabled
-                    let (work_buf, used_comp_algo) = if comp_enabled
-                        && comp_algo != LOLELFFS_COMP_NONE
-                        && chunk.len() == LOLELFFS_BLOCK_SIZE as usize
-                    {
-                        match crate::compress::compress_block(comp_algo, &block) {
-                            Ok(Some(compressed)) => {
-                                // Compression succeeded and saved space
-                                let mut comp_block = vec![0u8; LOLELFFS_BLOCK_SIZE as usize];
-                                comp_block[..compressed.len()].copy_from_slice(&compressed);
-                                (comp_block, comp_algo)
-                            }
-                            _ => {
-                                // Compression failed or didn't save space
-                                (block.clone(), LOLELFFS_COMP_NONE)
-                            }
-                        }
-                    } else {
-                        (block.clone(), LOLELFFS_COMP_NONE)
-                    };
-
-                    // Step 2: Encrypt if enabled (compress-then-encrypt)
-                    let (final_block, used_enc_algo) = if enc_enabled
-                        && enc_algo != LOLELFFS_ENC_NONE
-                    {
-                        // Check if filesystem is unlocked
-                        if !self.enc_unlocked {
-                            bail!("Cannot write encrypted data: filesystem is locked");
-                        }
-
-                        match crate::encrypt::encrypt_block(
-                            enc_algo,
-                            &self.enc_master_key,
-                            logical_block as u64,
-                            &work_buf,
-                        ) {
-                            Ok(encrypted) => {
-                                // For AES-XTS, encrypted size == block size
-                                // For ChaCha20-Poly1305, add 16-byte tag
-                                let mut enc_block = vec![0u8; LOLELFFS_BLOCK_SIZE as usize];
-                                let copy_len = encrypted.len().min(LOLELFFS_BLOCK_SIZE as usize);
-                                enc_block[..copy_len].copy_from_slice(&encrypted[..copy_len]);
-                                (enc_block, enc_algo)
-                            }
-                            Err(e) => {
-                                bail!("Encryption failed: {}", e);
-                            }
-                        }
-                    } else {
-                        (work_buf, LOLELFFS_ENC_NONE)
-                    };
+    /// Algorithm of the compression hint of a file, if it has a valid one
+    fn comp_hint(&self, inode: &Inode) -> Result<Option<u8>> {
+        if inode.xattr_block == 0 {
+            return Ok(None);
+        }
+
+        let index = crate::xattr::read_xattr_index(self, inode.xattr_block)?;
+        let data = crate::xattr::read_xattr_data(self, &index)?;
+        Ok(crate::xattr::parse_xattr_entries(&data)?
+            .into_iter()
+            .find(|e| e.name_index == XattrNamespace::User && e.name == LOLELFFS_COMP_HINT_XATTR)
+            .and_then(|e| compress::hint_algo(&e.value)))
+    }
+
+    /// Encryption algorithm of new file data
+    fn new_enc_algo(&self) -> u8 {
+        if self.superblock.enc_enabled != 0 {
+            self.superblock.enc_default_algo as u8
+        } else {
+            LOLELFFS_ENC_NONE
+        }
+    }
+
+    /// Largest extent without metadata allowed by the superblock
+    pub(crate) fn max_extent_blocks(&self) -> u32 {
+        let large = self.superblock.max_extent_blocks_large;
+        if large == 0 || large > LOLELFFS_MAX_BLOCKS_PER_EXTENT_LARGE {
+            LOLELFFS_MAX_BLOCKS_PER_EXTENT_LARGE
+        } else {
+            large
+        }
+    }
 
-                    self.write_block(phys_block, &final_block)?;
+    /// Most extents a regular file can have: those of its extent index
+    /// block, or of the deepest extent tree if the filesystem has them
+    pub(crate) fn max_file_extents(&self) -> usize {
+        if self.superblock.comp_features & LOLELFFS_FEATURE_EXTENT_TREE != 0 {
+            LOLELFFS_EXT_TREE_LEAF_ENTRIES
+                * LOLELFFS_EXT_TREE_IDX_ENTRIES.pow(LOLELFFS_EXT_TREE_MAX_DEPTH as u32 - 1)
+        } else {
+            LOLELFFS_MAX_EXTENTS
+        }
+    }
 
-                    // Update extent metadata
-                    updated_extents[extent_idx].ee_comp_algo = used_comp_algo as u16;
-                    updated_extents[extent_idx].ee_enc_algo = used_enc_algo;
+    /// Write data as packed compressed extents, the first one starting at
+    /// logical block `first_block`
+    ///
+    /// Each extent covers up to `LOLELFFS_MAX_BLOCKS_PER_EXTENT` logical blocks,
+    /// compressed in clusters of `LOLELFFS_COMP_CLUSTER_BLOCKS` blocks whose
+    /// streams are stored back to back, so only the compressed bytes take up
+    /// disk space. Clusters that look incompressible are stored without
+    /// running the compressor, which is given up on after repeated failures
+    /// as in the kernel module. An extent that would not save a block is
+    /// written plain.
+    ///
+    /// On encrypted filesystems the packed blocks are encrypted like the
+    /// logical blocks at the same offset in the extent: physical block `i`
+    /// uses the tweak of logical block `ee_block + i`.
+    fn write_packed_extents(
+        &mut self,
+        first_block: u32,
+        data: &[u8],
+        algo: u8,
+    ) -> Result<Vec<Extent>> {
+        let block_size = LOLELFFS_BLOCK_SIZE as usize;
+        let extent_size = LOLELFFS_MAX_BLOCKS_PER_EXTENT as usize * block_size;
+        let cluster_size = LOLELFFS_COMP_CLUSTER_SIZE as usize;
+        let enc_algo = self.new_enc_algo();
+        let enc_flags = if enc_algo != LOLELFFS_ENC_NONE {
+            LOLELFFS_EXT_ENCRYPTED
+        } else {
+            0
+        };
+
+        // Compress every cluster up front, in parallel, a window at a time:
+        // once given up on, only the first cluster of a window is tried.
+        // Extents hold a whole number of clusters, so the clusters line up
+        // with the extents.
+        let window = cluster_size * LOLELFFS_COMP_RETRY_INTERVAL as usize;
+        let mut tracker = compress::FailTracker::default();
+        let mut compressed = Vec::with_capacity(data.len().div_ceil(cluster_size));
+        for clusters in data.chunks(window) {
+            let probe = tracker.gave_up();
+            let results = par_chunks(clusters, cluster_size, |i, cluster| {
+                if (probe && i != 0) || !compress::worth_compressing(cluster) {
+                    return None;
+                }
+                Some(if cluster.len() % block_size == 0 {
+                    compress::compress_cluster(algo, cluster)
+                } else {
+                    let mut padded = cluster.to_vec();
+                    padded.resize(cluster.len().next_multiple_of(block_size), 0);
+                    compress::compress_cluster(algo, &padded)
+                })
+            });
+            for result in results {
+                match result {
+                    Some(result) => {
+                        tracker.record(matches!(result, Ok(Some(_))));
+                        compressed.push(result);
+                    }
+                    None => compressed.push(Ok(None)),
+                }
+            }
+        }
+        let mut compressed = compressed.into_iter();
+        let mut extents = Vec::new();
 
-                    // Set flags
-                    let mut flags = 0u16;
-                    if used_comp_algo != LOLELFFS_COMP_NONE {
-                        flags |= LOLELFFS_EXT_COMPRESSED;
+        for (idx, chunk) in data.chunks(extent_size).enumerate() {
+            let ee_block = first_block + idx as u32 * LOLELFFS_MAX_BLOCKS_PER_EXTENT;
+            let ee_len = chunk.len().div_ceil(block_size) as u32;
+
+            let mut packed = Vec::with_capacity(chunk.len());
+            let mut clusters = Vec::new();
+            for cluster in chunk.chunks(cluster_size) {
+                match compressed.next().unwrap() {
+                    Ok(Some(stream)) => {
+                        clusters.push(CompressionBlockMeta {
+                            comp_size: stream.len() as u16,
+                            comp_algo: 0,
+                            flags: 0,
+                        });
+                        packed.extend_from_slice(&stream);
                     }
-                    if used_enc_algo != LOLELFFS_ENC_NONE {
-                        flags |= LOLELFFS_EXT_ENCRYPTED;
+                    _ => {
+                        // Compression failed or didn't save space. Only the
+                        // last cluster can be short, and padding the packed
+                        // data below zero-fills it.
+                        clusters.push(CompressionBlockMeta::default());
+                        packed.extend_from_slice(cluster);
                     }
-                    updated_extents[extent_idx].ee_flags = flags;
                 }
             }
+
+            let nr_phys = packed.len().div_ceil(block_size) as u32;
+
+            // The metadata block must be paid for by the blocks saved
+            if nr_phys + 1 >= ee_len {
+                let mut raw = chunk.to_vec();
+                raw.resize(ee_len as usize * block_size, 0);
+                let ee_start = self.alloc_blocks(ee_len)?;
+                self.write_encoded_blocks(enc_algo, ee_block, ee_start, &raw)?;
+                extents.push(Extent {
+                    ee_block,
+                    ee_len,
+                    ee_start,
+                    ee_enc_algo: enc_algo,
+                    ee_flags: enc_flags,
+                    ..Extent::default()
+                });
+                continue;
+            }
+
+            packed.resize(nr_phys as usize * block_size, 0);
+            let ee_start = self.alloc_blocks(nr_phys)?;
+            let ee_meta = match self.alloc_blocks(1) {
+                Ok(block) => block,
+                Err(e) => {
+                    self.free_blocks(ee_start, nr_phys)?;
+                    return Err(e);
+                }
+            };
+            self.write_encoded_blocks(enc_algo, ee_block, ee_start, &packed)?;
+
+            let meta = CompressionMetadata {
+                magic: LOLELFFS_COMP_META_MAGIC,
+                nr_blocks: ee_len,
+                nr_phys,
+                cluster_shift: LOLELFFS_COMP_CLUSTER_SHIFT,
+                clusters,
+            };
+            self.write_block(ee_meta, &meta.to_bytes())?;
+
+            extents.push(Extent {
+                ee_block,
+                ee_len,
+                ee_start,
+                ee_comp_algo: algo as u16,
+                ee_enc_algo: enc_algo,
+                ee_reserved: 0,
+                ee_flags: LOLELFFS_EXT_COMPRESSED | LOLELFFS_EXT_HAS_META | enc_flags,
+                ee_reserved2: 0,
+                ee_meta,
+            });
         }
 
-        // Rewrite extent index with updated compression info
-        let updated_ei = ExtentIndex {
-            nr_files: 0,
-            extents: updated_extents,
+        Ok(extents)
+    }
+
+    /// Read the compression metadata block of a packed extent
+    pub(crate) fn read_comp_metadata(&self, extent: &Extent) -> Result<CompressionMetadata> {
+        match self.with_block(extent.ee_meta, CompressionMetadata::from_bytes)? {
+            Some(meta) if meta.nr_blocks == extent.ee_len && meta.nr_phys <= extent.ee_len => {
+                Ok(meta)
+            }
+            _ => bail!("Corrupted compression metadata in block {}", extent.ee_meta),
+        }
+    }
+
+    /// Read and decompress one cluster of a packed extent
+    fn read_cluster(
+        &self,
+        extent: &Extent,
+        meta: &CompressionMetadata,
+        cluster: usize,
+    ) -> Result<Vec<u8>> {
+        let block_size = LOLELFFS_BLOCK_SIZE as usize;
+        let offset = meta.cluster_offset(cluster);
+        let size = meta.stored_size(cluster);
+        let first = offset / block_size;
+        let last = (offset + size - 1) / block_size;
+
+        if last as u32 >= meta.nr_phys {
+            bail!(
+                "Cluster {} of extent at block {} exceeds its packed data",
+                cluster,
+                extent.ee_start
+            );
+        }
+
+        // A mapped image is decompressed in place, unless it is encrypted
+        let encrypted = extent.ee_enc_algo != LOLELFFS_ENC_NONE;
+        if encrypted && !self.enc_unlocked {
+            bail!("Cannot read encrypted block: filesystem is locked");
+        }
+        let mapped = if encrypted {
+            None
+        } else {
+            self.mapped_blocks(extent.ee_start + first as u32, (last - first + 1) as u32)
+        };
+        let packed;
+        let blocks = match mapped {
+            Some(blocks) => blocks?,
+            None => {
+                let mut data = Vec::with_capacity((last - first + 1) * block_size);
+                for block in first..=last {
+                    let raw = self.read_block(extent.ee_start + block as u32)?;
+                    if encrypted {
+                        // See write_packed_extents() for the tweak
+                        data.extend_from_slice(&crate::encrypt::decrypt_block(
+                            extent.ee_enc_algo,
+                            &self.enc_master_key,
+                            (extent.ee_block + block as u32) as u64,
+                            &raw,
+                        )?);
+                    } else {
+                        data.extend_from_slice(&raw);
+                    }
+                }
+                packed = data;
+                &packed[..]
+            }
         };
-        self.write_extent_index(inode.ei_block, &updated_ei)?;
 
-        // Update inode
-        inode.i_size = data.len() as u32;
-        inode.i_blocks = num_blocks;
-        let now = std::time::SystemTime::now()
-            .duration_since(std::time::UNIX_EPOCH)
-            .unwrap()
-            .as_secs() as u32;
-        inode.i_mtime = now;
-        inode.i_ctime = now;
-        self.write_inode(inode_num, &inode)?;
+        let start = offset % block_size;
+        let stream = &blocks[start..start + size];
+        let entry = meta.clusters[cluster];
 
-        Ok(())
+        if entry.comp_size == 0 {
+            return Ok(stream.to_vec());
+        }
+
+        let algo = if entry.comp_algo != 0 {
+            entry.comp_algo
+        } else {
+            extent.ee_comp_algo as u8
+        };
+        compress::decompress_block(
+            algo,
+            stream,
+            (meta.cluster_blocks(cluster) * LOLELFFS_BLOCK_SIZE) as usize,
+        )
+    }
+
+    /// Free the blocks of a file extent, including the packed data and the
+    /// compression metadata block of packed extents. Shared extents are
+    /// freed with [`Self::free_file_extents`] instead.
+    pub fn free_extent(&mut self, extent: &Extent) -> Result<()> {
+        if extent.has_metadata() {
+            let meta = self.read_comp_metadata(extent)?;
+            self.free_blocks(extent.ee_start, meta.nr_phys)?;
+            self.free_blocks(extent.ee_meta, 1)
+        } else {
+            self.free_blocks(extent.ee_start, extent.ee_len)
+        }
     }
 
     /// Create a new regular file
@@ -310,8 +1420,12 @@ impl LolelfFs {
         // Allocate new inode
         let new_inode_num = self.alloc_inode()?;
 
-        // Allocate extent index block
-        let ei_block = self.alloc_blocks(1)?;
+        // Allocate extent index block, unless the file starts inline
+        let ei_block = if self.inline_allowed() {
+            0
+        } else {
+            self.alloc_blocks(1)?
+        };
 
         // Create the inode
         let now = std::time::SystemTime::now()
@@ -336,17 +1450,22 @@ impl LolelfFs {
         self.write_inode(new_inode_num, &new_inode)?;
 
         // Initialize extent index block
-        let ei = ExtentIndex {
-            nr_files: 0,
-            extents: vec![Extent::default(); LOLELFFS_MAX_EXTENTS],
-        };
-        self.write_extent_index(ei_block, &ei)?;
+        if ei_block != 0 {
+            let ei = ExtentIndex {
+                nr_files: 0,
+                extents: vec![Extent::default(); LOLELFFS_MAX_EXTENTS],
+                dx_block: 0,
+            };
+            self.write_extent_index(ei_block, &ei)?;
+        }
 
         // Add entry to parent directory
         if let Err(e) = self.add_dir_entry(parent_inode_num, name, new_inode_num) {
             // Rollback on failure
             self.free_inode(new_inode_num)?;
-            self.free_blocks(ei_block, 1)?;
+            if ei_block != 0 {
+                self.free_blocks(ei_block, 1)?;
+            }
             return Err(e);
         }
 
@@ -375,25 +1494,7 @@ impl LolelfFs {
 
         // If link count is 0, free the file's resources
         if file_inode.i_nlink == 0 {
-            // Free data blocks
-            if file_inode.ei_block != 0 {
-                let ei = self.read_extent_index(&file_inode)?;
-                for extent in &ei.extents {
-                    if extent.is_empty() {
-                        break;
-                    }
-                    self.free_blocks(extent.ee_start, extent.ee_len)?;
-                }
-
-                // Free extent index block
-                self.free_blocks(file_inode.ei_block, 1)?;
-            }
-
-            // Free xattr blocks
-            self.free_inode_xattrs(file_inode_num)?;
-
-            // Free the inode
-            self.free_inode(file_inode_num)?;
+            self.free_file(file_inode_num, &file_inode)?;
         } else {
             // Just update the link count
             self.write_inode(file_inode_num, &file_inode)?;
@@ -402,6 +1503,30 @@ impl LolelfFs {
         Ok(())
     }
 
+    /// Free a file with no link left: its blocks, xattrs and inode
+    pub(crate) fn free_file(&mut self, inode_num: u32, inode: &Inode) -> Result<()> {
+        // Free data blocks
+        if inode.ei_block != 0 {
+            let ei = self.read_extent_index(inode)?;
+            let used = ei.count_extents();
+            self.free_file_extents(inode_num, &ei.extents[..used], &[])?;
+
+            // Free extent tree nodes and extent index block
+            for node in self.extent_tree_nodes(inode)? {
+                self.free_blocks(node, 1)?;
+            }
+            self.free_blocks(inode.ei_block, 1)?;
+        } else if let Some(tail) = inode.tail_ref() {
+            self.free_tail(tail)?;
+        }
+
+        // Free xattr blocks
+        self.free_inode_xattrs(inode_num)?;
+
+        // Free the inode
+        self.free_inode(inode_num)
+    }
+
     /// Create a symbolic link
     pub fn symlink(&mut self, parent_inode_num: u32, name: &str, target: &str) -> Result<u32> {
         if target.len() > 27 {
@@ -492,10 +1617,188 @@ impl LolelfFs {
             data.resize(size as usize, 0);
             self.write_file(inode_num, &data)
         } else {
-            // Shrinking file - read and truncate
-            let mut data = self.read_file(inode_num)?;
-            data.truncate(size as usize);
+            // Shrinking file - read only what is kept
+            let mut data = vec![0u8; size as usize];
+            self.read_at(inode_num, 0, &mut data)?;
             self.write_file(inode_num, &data)
         }
     }
 }
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    const BLOCK: usize = LOLELFFS_BLOCK_SIZE as usize;
+
+    /// A filesystem image in the temporary directory, removed on drop
+    struct TestFs {
+        fs: LolelfFs,
+        path: std::path::PathBuf,
+    }
+
+    impl TestFs {
+        fn new(name: &str, comp: bool) -> Self {
+            let path = std::env::temp_dir().join(format!(
+                "lolelffs-write-at-{}-{}.img",
+                name,
+                std::process::id()
+            ));
+            let mut fs = LolelfFs::create(&path, 16 * 1024 * 1024).unwrap();
+            fs.superblock.comp_enabled = comp as u32;
+            TestFs { fs, path }
+        }
+    }
+
+    impl Drop for TestFs {
+        fn drop(&mut self) {
+            let _ = std::fs::remove_file(&self.path);
+        }
+    }
+
+    fn test_data(len: usize, seed: u32) -> Vec<u8> {
+        (0..len as u32)
+            .map(|i| i.wrapping_mul(2654435761).rotate_left(seed) as u8)
+            .collect()
+    }
+
+    /// Write `data` at `offset` to the file and to `reference`, then check
+    /// that the file reads back as `reference`
+    fn write_and_check(
+        fs: &mut LolelfFs,
+        ino: u32,
+        reference: &mut Vec<u8>,
+        offset: usize,
+        data: &[u8],
+    ) {
+        assert_eq!(fs.write_at(ino, offset as u64, data).unwrap(), data.len());
+        if reference.len() < offset + data.len() {
+            reference.resize(offset + data.len(), 0);
+        }
+        reference[offset..offset + data.len()].copy_from_slice(data);
+        assert_eq!(fs.read_file(ino).unwrap(), *reference);
+    }
+
+    fn extents(fs: &LolelfFs, ino: u32) -> Vec<Extent> {
+        let inode = fs.read_inode(ino).unwrap();
+        fs.read_extent_index(&inode)
+            .unwrap()
+            .extents
+            .into_iter()
+            .take_while(|e| !e.is_empty())
+            .collect()
+    }
+
+    #[test]
+    fn test_write_at_unaligned() {
+        let mut t = TestFs::new("unaligned", false);
+        let fs = &mut t.fs;
+        let ino = fs.create_file(LOLELFFS_ROOT_INO, "f").unwrap();
+        let mut reference = test_data(10 * BLOCK, 3);
+        fs.write_file(ino, &reference).unwrap();
+
+        // Within a block, across blocks, and over the end of the file
+        write_and_check(fs, ino, &mut reference, 3 * BLOCK + 100, &test_data(50, 5));
+        write_and_check(
+            fs,
+            ino,
+            &mut reference,
+            5 * BLOCK - 7,
+            &test_data(2 * BLOCK + 20, 7),
+        );
+        write_and_check(fs, ino, &mut reference, 10 * BLOCK - 10, &test_data(30, 9));
+
+        // Past the mapped end, leaving a gap that reads as zeroes
+        write_and_check(
+            fs,
+            ino,
+            &mut reference,
+            14 * BLOCK + 1,
+            &test_data(BLOCK, 11),
+        );
+        assert_eq!(fs.read_inode(ino).unwrap().i_size as usize, reference.len());
+    }
+
+    #[test]
+    fn test_write_at_hole() {
+        let mut t = TestFs::new("hole", false);
+        let fs = &mut t.fs;
+        let ino = fs.create_file(LOLELFFS_ROOT_INO, "f").unwrap();
+        let mut reference = test_data(4 * BLOCK, 3);
+        fs.write_file(ino, &reference).unwrap();
+
+        // Unmap block 1
+        let mut inode = fs.read_inode(ino).unwrap();
+        let mut ei = fs.read_extent_index(&inode).unwrap();
+        let start = ei.extents[0].ee_start;
+        ei.extents[0].ee_len = 1;
+        ei.extents[1] = Extent {
+            ee_block: 2,
+            ee_len: 2,
+            ee_start: start + 2,
+            ..Extent::default()
+        };
+        fs.write_extent_index(inode.ei_block, &ei).unwrap();
+        fs.free_blocks(start + 1, 1).unwrap();
+        inode.i_blocks = 3;
+        fs.write_inode(ino, &inode).unwrap();
+        reference[BLOCK..2 * BLOCK].fill(0);
+        assert_eq!(fs.read_file(ino).unwrap(), reference);
+
+        // Into the hole alone, then over it and its neighbours
+        write_and_check(fs, ino, &mut reference, BLOCK + 10, &test_data(100, 5));
+        let mapped: u32 = extents(fs, ino).iter().map(|e| e.ee_len).sum();
+        assert_eq!(mapped, 4);
+        write_and_check(fs, ino, &mut reference, BLOCK / 2, &test_data(2 * BLOCK, 7));
+    }
+
+    #[test]
+    fn test_write_at_packed() {
+        let mut t = TestFs::new("packed", true);
+        let fs = &mut t.fs;
+        let ino = fs.create_file(LOLELFFS_ROOT_INO, "f").unwrap();
+
+        // Mostly zeroes, compressible whatever the algorithm
+        let mut reference = vec![0u8; 4 * LOLELFFS_COMP_CLUSTER_SIZE as usize];
+        for cluster in reference.chunks_mut(LOLELFFS_COMP_CLUSTER_SIZE as usize) {
+            cluster[..64].copy_from_slice(&test_data(64, 3));
+        }
+        fs.write_file(ino, &reference).unwrap();
+        assert!(extents(fs, ino).iter().all(|e| e.has_metadata()));
+
+        write_and_check(fs, ino, &mut reference, 3 * BLOCK + 17, b"packed");
+        write_and_check(fs, ino, &mut reference, 5 * BLOCK - 3, b"across blocks");
+        assert!(extents(fs, ino).iter().all(|e| e.has_metadata()));
+
+        // Appends grow the last packed extent
+        let len = reference.len();
+        write_and_check(fs, ino, &mut reference, len, b"appended");
+    }
+
+    #[test]
+    fn test_write_at_shared() {
+        let mut t = TestFs::new("shared", false);
+        let fs = &mut t.fs;
+        let data = test_data(20 * BLOCK, 3);
+        let a = fs.create_file(LOLELFFS_ROOT_INO, "a").unwrap();
+        let b = fs.create_file(LOLELFFS_ROOT_INO, "b").unwrap();
+        fs.write_file(a, &data).unwrap();
+        fs.write_file(b, &data).unwrap();
+        fs.dedup().unwrap();
+        assert!(extents(fs, a).iter().all(|e| e.is_shared()));
+
+        // Only a changes, through a copy of the shared blocks
+        let mut reference = data.clone();
+        write_and_check(
+            fs,
+            a,
+            &mut reference,
+            7 * BLOCK + 5,
+            &test_data(3 * BLOCK, 9),
+        );
+        assert_eq!(fs.read_file(b).unwrap(), data);
+        let len = reference.len();
+        write_and_check(fs, a, &mut reference, len - 1, b"end");
+        assert_eq!(fs.read_file(b).unwrap(), data);
+    }
+}
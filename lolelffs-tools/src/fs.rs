@@ -1,20 +1,166 @@
 //! Filesystem operations for lolelffs
 
+use crate::mmap::Mmap;
 use crate::types::*;
 use anyhow::{bail, Context, Result};
 use byteorder::{LittleEndian, ReadBytesExt, WriteBytesExt};
+use std::collections::{BTreeMap, BTreeSet, HashMap};
 use std::fs::{File, OpenOptions};
 use std::io::{Read, Seek, SeekFrom, Write};
+use std::os::unix::fs::FileExt;
 use std::path::Path;
+use std::sync::Mutex;
+
+/// Number of blocks kept by the buffer cache (16 MiB)
+pub const BLOCK_CACHE_BLOCKS: usize = 4096;
+
+/// Number of decoded inodes kept by the inode cache
+pub const INODE_CACHE_ENTRIES: usize = 4096;
+
+/// Longest run of contiguous dirty blocks written back with a single call
+const MAX_FLUSH_RUN: usize = 256;
+
+/// Bounded map that evicts its least recently used entry
+struct Lru<V> {
+    map: HashMap<u32, (V, u64)>,
+    order: BTreeMap<u64, u32>,
+    tick: u64,
+    capacity: usize,
+}
+
+impl<V> Lru<V> {
+    fn new(capacity: usize) -> Self {
+        Lru {
+            map: HashMap::new(),
+            order: BTreeMap::new(),
+            tick: 0,
+            capacity,
+        }
+    }
+
+    /// Look up an entry and mark it as most recently used
+    fn get(&mut self, key: u32) -> Option<&V> {
+        let (value, used) = self.map.get_mut(&key)?;
+        self.order.remove(used);
+        self.tick += 1;
+        *used = self.tick;
+        self.order.insert(self.tick, key);
+        Some(value)
+    }
+
+    /// Look up an entry without changing the eviction order
+    fn peek(&self, key: u32) -> Option<&V> {
+        self.map.get(&key).map(|(value, _)| value)
+    }
+
+    /// Key that inserting `key` would evict, if any
+    fn victim(&self, key: u32) -> Option<u32> {
+        if self.map.len() < self.capacity || self.map.contains_key(&key) {
+            return None;
+        }
+        self.order.values().next().copied()
+    }
+
+    fn insert(&mut self, key: u32, value: V) {
+        if let Some(victim) = self.victim(key) {
+            self.remove(victim);
+        }
+        if let Some((_, used)) = self.map.get(&key) {
+            self.order.remove(used);
+        }
+        self.tick += 1;
+        self.order.insert(self.tick, key);
+        self.map.insert(key, (value, self.tick));
+    }
+
+    fn remove(&mut self, key: u32) -> Option<V> {
+        let (value, used) = self.map.remove(&key)?;
+        self.order.remove(&used);
+        Some(value)
+    }
+}
+
+/// Write-back buffer cache of filesystem blocks
+struct BlockCache {
+    blocks: Lru<Vec<u8>>,
+    dirty: BTreeSet<u32>,
+}
+
+impl BlockCache {
+    fn new(capacity: usize) -> Self {
+        BlockCache {
+            blocks: Lru::new(capacity),
+            dirty: BTreeSet::new(),
+        }
+    }
+
+    /// Insert a block. Dirty blocks are only written back when evicted or
+    /// flushed; evicting one writes back every dirty block so that the
+    /// writes stay coalesced.
+    fn insert(&mut self, file: &File, block_num: u32, data: Vec<u8>, dirty: bool) -> Result<()> {
+        if let Some(victim) = self.blocks.victim(block_num) {
+            if self.dirty.contains(&victim) {
+                self.flush(file)?;
+            }
+        }
+        self.blocks.insert(block_num, data);
+        if dirty {
+            self.dirty.insert(block_num);
+        }
+        Ok(())
+    }
+
+    /// Write back all dirty blocks, one call per contiguous run
+    fn flush(&mut self, file: &File) -> Result<()> {
+        let dirty = std::mem::take(&mut self.dirty);
+        let mut pending = dirty.iter().copied().peekable();
+        let mut run = Vec::with_capacity(MAX_FLUSH_RUN * LOLELFFS_BLOCK_SIZE as usize);
+
+        while let Some(start) = pending.next() {
+            let mut end = start + 1;
+            run.clear();
+            run.extend_from_slice(self.blocks.peek(start).expect("dirty block not cached"));
+            while (end - start) < MAX_FLUSH_RUN as u32 && pending.peek() == Some(&end) {
+                pending.next();
+                run.extend_from_slice(self.blocks.peek(end).expect("dirty block not cached"));
+                end += 1;
+            }
+
+            if let Err(e) = file.write_all_at(&run, start as u64 * LOLELFFS_BLOCK_SIZE as u64) {
+                // Keep the failed run and everything after it dirty
+                self.dirty = dirty.range(start..).copied().collect();
+                return Err(e.into());
+            }
+        }
+        Ok(())
+    }
+}
 
 /// Main filesystem handle
+///
+/// Blocks go through a bounded LRU write-back cache, and decoded inodes are
+/// cached as well. Writes reach the image when dirty blocks are evicted, on
+/// [`LolelfFs::flush`] or [`LolelfFs::sync`], and when the handle is dropped.
+/// Images opened read-only are memory-mapped when possible and read straight
+/// from the mapping instead.
 pub struct LolelfFs {
     file: File,
+    map: Option<Mmap>,
+    read_only: bool,
+    cache: Mutex<BlockCache>,
+    inodes: Mutex<Lru<Inode>>,
     pub superblock: Superblock,
     pub enc_unlocked: bool,
     pub enc_master_key: [u8; 32],
 }
 
+impl Drop for LolelfFs {
+    fn drop(&mut self) {
+        // Errors cannot be reported from here; callers that care use flush()
+        let _ = self.flush();
+    }
+}
+
 impl LolelfFs {
     /// Open an existing lolelffs filesystem image
     pub fn open<P: AsRef<Path>>(path: P) -> Result<Self> {
@@ -42,12 +188,7 @@ impl LolelfFs {
             );
         }
 
-        Ok(LolelfFs {
-            file,
-            superblock,
-            enc_unlocked: false,
-            enc_master_key: [0; 32],
-        })
+        Ok(LolelfFs::new(file, superblock, false))
     }
 
     /// Open filesystem in read-only mode
@@ -73,12 +214,23 @@ impl LolelfFs {
             );
         }
 
-        Ok(LolelfFs {
+        let mut fs = LolelfFs::new(file, superblock, true);
+        // Fall back to positional reads if the image cannot be mapped
+        fs.map = Mmap::map(&fs.file).ok();
+        Ok(fs)
+    }
+
+    fn new(file: File, superblock: Superblock, read_only: bool) -> Self {
+        LolelfFs {
             file,
+            map: None,
+            read_only,
+            cache: Mutex::new(BlockCache::new(BLOCK_CACHE_BLOCKS)),
+            inodes: Mutex::new(Lru::new(INODE_CACHE_ENTRIES)),
             superblock,
             enc_unlocked: false,
             enc_master_key: [0; 32],
-        })
+        }
     }
 
     /// Read superblock from file
@@ -111,10 +263,9 @@ impl LolelfFs {
         let mut enc_master_key = [0u8; 32];
         file.read_exact(&mut enc_master_key)?;
         let enc_features = file.read_u32::<LittleEndian>()?;
-        let mut reserved = [0u32; 3];
-        for item in &mut reserved {
-            *item = file.read_u32::<LittleEndian>()?;
-        }
+        let hot_start = file.read_u32::<LittleEndian>()?;
+        let hot_len = file.read_u32::<LittleEndian>()?;
+        let tail_block = file.read_u32::<LittleEndian>()?;
 
         Ok(Superblock {
             magic,
@@ -141,74 +292,106 @@ impl LolelfFs {
             enc_salt,
             enc_master_key,
             enc_features,
-            reserved,
+            hot_start,
+            hot_len,
+            tail_block,
         })
     }
 
     /// Write superblock to disk
     pub fn write_superblock(&mut self) -> Result<()> {
-        self.file.seek(SeekFrom::Start(0))?;
+        let mut buf = Vec::with_capacity(LOLELFFS_BLOCK_SIZE as usize);
+
+        buf.write_u32::<LittleEndian>(self.superblock.magic)?;
+        buf.write_u32::<LittleEndian>(self.superblock.nr_blocks)?;
+        buf.write_u32::<LittleEndian>(self.superblock.nr_inodes)?;
+        buf.write_u32::<LittleEndian>(self.superblock.nr_istore_blocks)?;
+        buf.write_u32::<LittleEndian>(self.superblock.nr_ifree_blocks)?;
+        buf.write_u32::<LittleEndian>(self.superblock.nr_bfree_blocks)?;
+        buf.write_u32::<LittleEndian>(self.superblock.nr_free_inodes)?;
+        buf.write_u32::<LittleEndian>(self.superblock.nr_free_blocks)?;
+        buf.write_u32::<LittleEndian>(self.superblock.version)?;
+        buf.write_u32::<LittleEndian>(self.superblock.comp_default_algo)?;
+        buf.write_u32::<LittleEndian>(self.superblock.comp_enabled)?;
+        buf.write_u32::<LittleEndian>(self.superblock.comp_min_block_size)?;
+        buf.write_u32::<LittleEndian>(self.superblock.comp_features)?;
+        buf.write_u32::<LittleEndian>(self.superblock.max_extent_blocks)?;
+        buf.write_u32::<LittleEndian>(self.superblock.max_extent_blocks_large)?;
+        buf.write_u32::<LittleEndian>(self.superblock.enc_enabled)?;
+        buf.write_u32::<LittleEndian>(self.superblock.enc_default_algo)?;
+        buf.write_u32::<LittleEndian>(self.superblock.enc_kdf_algo)?;
+        buf.write_u32::<LittleEndian>(self.superblock.enc_kdf_iterations)?;
+        buf.write_u32::<LittleEndian>(self.superblock.enc_kdf_memory)?;
+        buf.write_u32::<LittleEndian>(self.superblock.enc_kdf_parallelism)?;
+        buf.write_all(&self.superblock.enc_salt)?;
+        buf.write_all(&self.superblock.enc_master_key)?;
+        buf.write_u32::<LittleEndian>(self.superblock.enc_features)?;
+        buf.write_u32::<LittleEndian>(self.superblock.hot_start)?;
+        buf.write_u32::<LittleEndian>(self.superblock.hot_len)?;
+        buf.write_u32::<LittleEndian>(self.superblock.tail_block)?;
+
+        let mut block = self.read_block(0)?;
+        block[..buf.len()].copy_from_slice(&buf);
+        self.write_block(0, &block)
+    }
 
-        self.file.write_u32::<LittleEndian>(self.superblock.magic)?;
-        self.file
-            .write_u32::<LittleEndian>(self.superblock.nr_blocks)?;
-        self.file
-            .write_u32::<LittleEndian>(self.superblock.nr_inodes)?;
-        self.file
-            .write_u32::<LittleEndian>(self.superblock.nr_istore_blocks)?;
-        self.file
-            .write_u32::<LittleEndian>(self.superblock.nr_ifree_blocks)?;
-        self.file
-            .write_u32::<LittleEndian>(self.superblock.nr_bfree_blocks)?;
-        self.file
-            .write_u32::<LittleEndian>(self.superblock.nr_free_inodes)?;
-        self.file
-            .write_u32::<LittleEndian>(self.superblock.nr_free_blocks)?;
-        self.file
-            .write_u32::<LittleEndian>(self.superblock.version)?;
-        self.file
-            .write_u32::<LittleEndian>(self.superblock.comp_default_algo)?;
-        self.file
-            .write_u32::<LittleEndian>(self.superblock.comp_enabled)?;
-        self.file
-            .write_u32::<LittleEndian>(self.superblock.comp_min_block_size)?;
-        self.file
-            .write_u32::<LittleEndian>(self.superblock.comp_features)?;
-        self.file
-            .write_u32::<LittleEndian>(self.superblock.max_extent_blocks)?;
-        self.file
-            .write_u32::<LittleEndian>(self.superblock.max_extent_blocks_large)?;
-        self.file
-            .write_u32::<LittleEndian>(self.superblock.enc_enabled)?;
-        self.file
-            .write_u32::<LittleEndian>(self.superblock.enc_default_algo)?;
-        self.file
-            .write_u32::<LittleEndian>(self.superblock.enc_kdf_algo)?;
-        self.file
-            .write_u32::<LittleEndian>(self.superblock.enc_kdf_iterations)?;
-        self.file
-            .write_u32::<LittleEndian>(self.superblock.enc_kdf_memory)?;
-        self.file
-            .write_u32::<LittleEndian>(self.superblock.enc_kdf_parallelism)?;
-        self.file.write_all(&self.superblock.enc_salt)?;
-        self.file.write_all(&self.superblock.enc_master_key)?;
-        self.file
-            .write_u32::<LittleEndian>(self.superblock.enc_features)?;
-        for &r in &self.superblock.reserved {
-            self.file.write_u32::<LittleEndian>(r)?;
-        }
+    /// Check if the image is read through a memory mapping
+    pub fn is_mapped(&self) -> bool {
+        self.map.is_some()
+    }
 
-        self.file.flush()?;
-        Ok(())
+    /// The image file, for copying blocks located by
+    /// [`LolelfFs::file_ranges`] without going through a buffer
+    pub fn image_file(&self) -> &File {
+        &self.file
+    }
+
+    /// Borrow `count` blocks starting at `block_num` from the mapping of a
+    /// read-only image, or return `None` if the image is not mapped
+    pub(crate) fn mapped_blocks(&self, block_num: u32, count: u32) -> Option<Result<&[u8]>> {
+        let map = self.map.as_ref()?;
+        let start = block_num as usize * LOLELFFS_BLOCK_SIZE as usize;
+        let end = start + count as usize * LOLELFFS_BLOCK_SIZE as usize;
+        Some(match map.get(start..end) {
+            Some(blocks) => Ok(blocks),
+            None => Err(anyhow::anyhow!(
+                "Block {} is past the end of the image",
+                block_num + count - 1
+            )),
+        })
+    }
+
+    /// Run `f` on the contents of a block without copying it out of the
+    /// mapping or the cache
+    pub(crate) fn with_block<R>(&self, block_num: u32, f: impl FnOnce(&[u8]) -> R) -> Result<R> {
+        if let Some(block) = self.mapped_blocks(block_num, 1) {
+            return Ok(f(block?));
+        }
+        if let Some(block) = self.cache.lock().unwrap().blocks.get(block_num) {
+            return Ok(f(block));
+        }
+        Ok(f(&self.read_block(block_num)?))
     }
 
     /// Read a block from the filesystem
-    pub fn read_block(&mut self, block_num: u32) -> Result<Vec<u8>> {
-        let offset = block_num as u64 * LOLELFFS_BLOCK_SIZE as u64;
-        self.file.seek(SeekFrom::Start(offset))?;
+    pub fn read_block(&self, block_num: u32) -> Result<Vec<u8>> {
+        if let Some(block) = self.mapped_blocks(block_num, 1) {
+            return Ok(block?.to_vec());
+        }
+
+        if let Some(data) = self.cache.lock().unwrap().blocks.get(block_num) {
+            return Ok(data.clone());
+        }
 
+        let offset = block_num as u64 * LOLELFFS_BLOCK_SIZE as u64;
         let mut data = vec![0u8; LOLELFFS_BLOCK_SIZE as usize];
-        self.file.read_exact(&mut data)?;
+        self.file.read_exact_at(&mut data, offset)?;
+
+        // Another reader may have cached the block while the lock was dropped
+        let mut cache = self.cache.lock().unwrap();
+        if cache.blocks.peek(block_num).is_none() {
+            cache.insert(&self.file, block_num, data.clone(), false)?;
+        }
         Ok(data)
     }
 
@@ -222,15 +405,74 @@ impl LolelfFs {
             );
         }
 
-        let offset = block_num as u64 * LOLELFFS_BLOCK_SIZE as u64;
-        self.file.seek(SeekFrom::Start(offset))?;
-        self.file.write_all(data)?;
-        self.file.flush()?;
+        if self.read_only {
+            bail!("Filesystem is opened read-only");
+        }
+
+        // Decoded inodes from a rewritten inode store block are stale
+        let istore_start = self.superblock.inode_store_start();
+        if (istore_start..istore_start + self.superblock.nr_istore_blocks).contains(&block_num) {
+            let first = (block_num - istore_start) * LOLELFFS_INODES_PER_BLOCK;
+            let inodes = self.inodes.get_mut().unwrap();
+            for inode_num in first..first + LOLELFFS_INODES_PER_BLOCK {
+                inodes.remove(inode_num);
+            }
+        }
+
+        let cache = self.cache.get_mut().unwrap();
+        cache.insert(&self.file, block_num, data.to_vec(), true)
+    }
+
+    /// Write whole blocks starting at `block_num`. Long runs of data blocks
+    /// bypass the cache and reach the image in a single write; shorter ones
+    /// go through [`LolelfFs::write_block`].
+    pub fn write_blocks(&mut self, block_num: u32, data: &[u8]) -> Result<()> {
+        let block_size = LOLELFFS_BLOCK_SIZE as usize;
+        if data.len() % block_size != 0 {
+            bail!(
+                "Block data must be a multiple of {} bytes, got {}",
+                LOLELFFS_BLOCK_SIZE,
+                data.len()
+            );
+        }
+
+        let count = (data.len() / block_size) as u32;
+        if (count as usize) < MAX_FLUSH_RUN || block_num < self.superblock.data_block_start() {
+            for (i, block) in data.chunks(block_size).enumerate() {
+                self.write_block(block_num + i as u32, block)?;
+            }
+            return Ok(());
+        }
+
+        if self.read_only {
+            bail!("Filesystem is opened read-only");
+        }
+
+        // The new contents supersede any cached copy, dirty or not
+        let cache = self.cache.get_mut().unwrap();
+        for block in block_num..block_num + count {
+            cache.blocks.remove(block);
+            cache.dirty.remove(&block);
+        }
+        self.file
+            .write_all_at(data, block_num as u64 * LOLELFFS_BLOCK_SIZE as u64)?;
+        Ok(())
+    }
+
+    /// Write all dirty cached blocks back to the image
+    pub fn flush(&mut self) -> Result<()> {
+        self.cache.get_mut().unwrap().flush(&self.file)
+    }
+
+    /// Write back all dirty blocks and wait for them to reach stable storage
+    pub fn sync(&mut self) -> Result<()> {
+        self.flush()?;
+        self.file.sync_data()?;
         Ok(())
     }
 
     /// Read an inode from the filesystem
-    pub fn read_inode(&mut self, inode_num: u32) -> Result<Inode> {
+    pub fn read_inode(&self, inode_num: u32) -> Result<Inode> {
         if inode_num >= self.superblock.nr_inodes {
             bail!(
                 "Invalid inode number {} (max {})",
@@ -239,14 +481,19 @@ impl LolelfFs {
             );
         }
 
+        if let Some(inode) = self.inodes.lock().unwrap().get(inode_num) {
+            return Ok(inode.clone());
+        }
+
         let block_num =
             self.superblock.inode_store_start() + (inode_num / LOLELFFS_INODES_PER_BLOCK);
         let offset_in_block = (inode_num % LOLELFFS_INODES_PER_BLOCK) * Inode::SIZE as u32;
 
-        let block = self.read_block(block_num)?;
-        let inode_data = &block[offset_in_block as usize..offset_in_block as usize + Inode::SIZE];
-
-        Self::parse_inode(inode_data)
+        let inode = self.with_block(block_num, |block| {
+            Self::parse_inode(&block[offset_in_block as usize..][..Inode::SIZE])
+        })??;
+        self.inodes.lock().unwrap().insert(inode_num, inode.clone());
+        Ok(inode)
     }
 
     /// Parse inode from raw bytes
@@ -305,6 +552,10 @@ impl LolelfFs {
         block[offset_in_block as usize..offset_in_block as usize + Inode::SIZE]
             .copy_from_slice(&inode_data);
         self.write_block(block_num, &block)?;
+        self.inodes
+            .get_mut()
+            .unwrap()
+            .insert(inode_num, inode.clone());
 
         Ok(())
     }
@@ -327,23 +578,151 @@ impl LolelfFs {
         data
     }
 
-    /// Read extent index block for an inode
-    pub fn read_extent_index(&mut self, inode: &Inode) -> Result<ExtentIndex> {
+    /// Read extent index block for an inode. The extents of a regular file
+    /// stored as an extent tree are gathered from its leaves.
+    pub fn read_extent_index(&self, inode: &Inode) -> Result<ExtentIndex> {
         if inode.ei_block == 0 {
             bail!("Inode has no extent index block");
         }
-        let block = self.read_block(inode.ei_block)?;
-        Ok(ExtentIndex::from_bytes(&block))
+        if let Some(root) = self.read_extent_tree_root(inode)? {
+            let mut extents = Vec::new();
+            self.walk_extent_tree(&root, &mut extents, &mut Vec::new())?;
+            if extents.len() < LOLELFFS_MAX_EXTENTS {
+                extents.resize(LOLELFFS_MAX_EXTENTS, Extent::default());
+            }
+            return Ok(ExtentIndex {
+                nr_files: 0,
+                extents,
+                dx_block: 0,
+            });
+        }
+        self.with_block(inode.ei_block, ExtentIndex::from_bytes)
     }
 
-    /// Write extent index block
+    /// Root of the extent tree of a regular file, or None if its extent
+    /// index block is a plain one
+    fn read_extent_tree_root(&self, inode: &Inode) -> Result<Option<ExtTreeNode>> {
+        if !inode.is_file() || inode.ei_block == 0 {
+            return Ok(None);
+        }
+        let root = self.with_block(inode.ei_block, |data| {
+            ExtTreeNode::is_tree(data).then(|| ExtTreeNode::from_bytes(data))
+        })?;
+        match root {
+            Some(Some(root)) if root.depth > 0 => Ok(Some(root)),
+            Some(_) => bail!("Invalid extent tree root {}", inode.ei_block),
+            None => Ok(None),
+        }
+    }
+
+    /// Append the extents below `node` to `extents`, and its descendants
+    /// to `nodes`
+    fn walk_extent_tree(
+        &self,
+        node: &ExtTreeNode,
+        extents: &mut Vec<Extent>,
+        nodes: &mut Vec<u32>,
+    ) -> Result<()> {
+        if node.depth == 0 {
+            extents.extend_from_slice(&node.extents);
+            return Ok(());
+        }
+        for idx in &node.idx {
+            let child = self
+                .with_block(idx.ei_child, ExtTreeNode::from_bytes)?
+                .filter(|child| child.depth + 1 == node.depth)
+                .ok_or_else(|| anyhow::anyhow!("Invalid extent tree node {}", idx.ei_child))?;
+            nodes.push(idx.ei_child);
+            self.walk_extent_tree(&child, extents, nodes)?;
+        }
+        Ok(())
+    }
+
+    /// Blocks of the extent tree of a regular file, its extent index block
+    /// excluded, or none if the file has a plain extent index
+    pub fn extent_tree_nodes(&self, inode: &Inode) -> Result<Vec<u32>> {
+        let mut nodes = Vec::new();
+        if let Some(root) = self.read_extent_tree_root(inode)? {
+            self.walk_extent_tree(&root, &mut Vec::new(), &mut nodes)?;
+        }
+        Ok(nodes)
+    }
+
+    /// Write extent index block. Past `LOLELFFS_MAX_EXTENTS` used extents,
+    /// the block becomes the root of an extent tree whose other nodes are
+    /// newly allocated.
     pub fn write_extent_index(&mut self, block_num: u32, ei: &ExtentIndex) -> Result<()> {
-        let data = ei.to_bytes();
-        self.write_block(block_num, &data)
+        self.write_extent_index_with(block_num, ei, |fs| fs.alloc_blocks(1))
+    }
+
+    /// Write extent index block, taking the blocks of extent tree nodes
+    /// from `alloc_node`
+    pub(crate) fn write_extent_index_with(
+        &mut self,
+        block_num: u32,
+        ei: &ExtentIndex,
+        mut alloc_node: impl FnMut(&mut Self) -> Result<u32>,
+    ) -> Result<()> {
+        let count = ei.count_extents();
+        if count <= LOLELFFS_MAX_EXTENTS {
+            let data = ei.to_bytes();
+            return self.write_block(block_num, &data);
+        }
+        if self.superblock.comp_features & LOLELFFS_FEATURE_EXTENT_TREE == 0 {
+            bail!(
+                "{} extents do not fit in the extent index, and the filesystem has no extent trees",
+                count
+            );
+        }
+
+        // Bulk load: full leaves, then full interior nodes up to the root
+        let mut level = Vec::new();
+        for chunk in ei.extents[..count].chunks(LOLELFFS_EXT_TREE_LEAF_ENTRIES) {
+            let block = alloc_node(self)?;
+            let leaf = ExtTreeNode {
+                depth: 0,
+                extents: chunk.to_vec(),
+                idx: Vec::new(),
+            };
+            self.write_block(block, &leaf.to_bytes())?;
+            level.push(ExtTreeIdx {
+                ei_block: chunk[0].ee_block,
+                ei_child: block,
+            });
+        }
+        let mut depth = 1;
+        while level.len() > LOLELFFS_EXT_TREE_IDX_ENTRIES {
+            let mut parents = Vec::new();
+            for chunk in level.chunks(LOLELFFS_EXT_TREE_IDX_ENTRIES) {
+                let block = alloc_node(self)?;
+                let node = ExtTreeNode {
+                    depth,
+                    extents: Vec::new(),
+                    idx: chunk.to_vec(),
+                };
+                self.write_block(block, &node.to_bytes())?;
+                parents.push(ExtTreeIdx {
+                    ei_block: chunk[0].ei_block,
+                    ei_child: block,
+                });
+            }
+            level = parents;
+            depth += 1;
+        }
+        if depth > LOLELFFS_EXT_TREE_MAX_DEPTH {
+            bail!("{} extents do not fit in an extent tree", count);
+        }
+
+        let root = ExtTreeNode {
+            depth,
+            extents: Vec::new(),
+            idx: level,
+        };
+        self.write_block(block_num, &root.to_bytes())
     }
 
     /// Get the physical block number for a logical block in a file
-    pub fn get_physical_block(&mut self, inode: &Inode, logical_block: u32) -> Result<Option<u32>> {
+    pub fn get_physical_block(&self, inode: &Inode, logical_block: u32) -> Result<Option<u32>> {
         let ei = self.read_extent_index(inode)?;
 
         if let Some(extent) = ei.find_extent(logical_block) {
@@ -448,7 +827,11 @@ impl LolelfFs {
             comp_default_algo: LOLELFFS_COMP_LZ4 as u32,
             comp_enabled: 1, // Compression enabled by default
             comp_min_block_size: 128,
-            comp_features: LOLELFFS_FEATURE_LARGE_EXTENTS,
+            comp_features: LOLELFFS_FEATURE_LARGE_EXTENTS
+                | LOLELFFS_FEATURE_DIR_INDEX
+                | LOLELFFS_FEATURE_EXTENT_TREE
+                | LOLELFFS_FEATURE_INLINE_DATA
+                | LOLELFFS_FEATURE_XATTR_INLINE,
             max_extent_blocks: LOLELFFS_MAX_BLOCKS_PER_EXTENT,
             max_extent_blocks_large: LOLELFFS_MAX_BLOCKS_PER_EXTENT_LARGE,
             enc_enabled,
@@ -460,18 +843,18 @@ impl LolelfFs {
             enc_salt,
             enc_master_key,
             enc_features: 0,
-            reserved: [0; 3],
+            hot_start: 0,
+            hot_len: 0,
+            tail_block: 0,
         };
 
-        let mut fs = LolelfFs {
-            file,
-            superblock,
-            enc_unlocked: enc_enabled != 0, // If encrypted, start unlocked
-            enc_master_key: master_key_plain,
-        };
+        let mut fs = LolelfFs::new(file, superblock, false);
+        fs.enc_unlocked = enc_enabled != 0; // If encrypted, start unlocked
+        fs.enc_master_key = master_key_plain;
 
         // Initialize the filesystem
         fs.init_filesystem()?;
+        fs.flush()?;
 
         Ok(fs)
     }
@@ -553,6 +936,7 @@ impl LolelfFs {
         let root_ei = ExtentIndex {
             nr_files: 0,
             extents: vec![Extent::default(); LOLELFFS_MAX_EXTENTS],
+            dx_block: 0,
         };
         self.write_extent_index(data_start, &root_ei)?;
 
@@ -560,7 +944,7 @@ impl LolelfFs {
     }
 
     /// Get an extended attribute value
-    pub fn get_xattr(&mut self, inode_num: u32, name: &str) -> Result<Vec<u8>> {
+    pub fn get_xattr(&self, inode_num: u32, name: &str) -> Result<Vec<u8>> {
         let inode = self.read_inode(inode_num)?;
 
         if inode.xattr_block == 0 {
@@ -626,88 +1010,7 @@ impl LolelfFs {
             });
         }
 
-        // Serialize entries
-        let data = crate::xattr::serialize_xattr_entries(&entries)?;
-
-        // Allocate extent index block if needed
-        if inode.xattr_block == 0 {
-            inode.xattr_block = self.alloc_blocks(1)?;
-        }
-
-        // Calculate number of blocks needed
-        let num_blocks = (data.len() as u32).div_ceil(LOLELFFS_BLOCK_SIZE);
-
-        // Allocate blocks using extents
-        let mut extents = Vec::new();
-        let mut allocated = 0u32;
-
-        while allocated < num_blocks {
-            let remaining = num_blocks - allocated;
-
-            // Determine if we need metadata for this extent
-            let needs_metadata = false; // Currently always false - no per-block metadata
-
-            let max_extent_size = if needs_metadata {
-                LOLELFFS_MAX_BLOCKS_PER_EXTENT
-            } else {
-                let large = self.superblock.max_extent_blocks_large;
-                if large == 0 || large > LOLELFFS_MAX_BLOCKS_PER_EXTENT_LARGE {
-                    LOLELFFS_MAX_BLOCKS_PER_EXTENT_LARGE
-                } else {
-                    large
-                }
-            };
-
-            let extent_size = self
-                .calc_optimal_extent_size(allocated, needs_metadata)
-                .min(remaining)
-                .min(max_extent_size);
-
-            let start_block = self.alloc_blocks(extent_size)?;
-
-            extents.push(Extent {
-                ee_block: allocated,
-                ee_len: extent_size,
-                ee_start: start_block,
-                ee_comp_algo: LOLELFFS_COMP_NONE as u16,
-                ee_enc_algo: LOLELFFS_ENC_NONE,
-                ee_reserved: 0,
-                ee_flags: 0,
-                ee_reserved2: 0,
-                ee_meta: 0,
-            });
-
-            allocated += extent_size;
-        }
-
-        // Pad extents to LOLELFFS_MAX_EXTENTS
-        while extents.len() < LOLELFFS_MAX_EXTENTS {
-            extents.push(Extent::default());
-        }
-
-        // Write xattr index
-        let index = XattrIndex {
-            total_size: data.len() as u32,
-            count: entries.len() as u32,
-            extents,
-        };
-        crate::xattr::write_xattr_index(self, inode.xattr_block, &index)?;
-
-        // Write data to blocks
-        for (idx, chunk) in data.chunks(LOLELFFS_BLOCK_SIZE as usize).enumerate() {
-            let logical_block = idx as u32;
-
-            if let Some(extent) = index.extents.iter().find(|e| {
-                !e.is_empty()
-                    && logical_block >= e.ee_block
-                    && logical_block < e.ee_block + e.ee_len
-            }) {
-                let phys_block = extent.ee_start + (logical_block - extent.ee_block);
-                let mut block = vec![0u8; LOLELFFS_BLOCK_SIZE as usize];
-                block[..chunk.len()].copy_from_slice(chunk);
-                self.write_block(phys_block, &block)?;
-            }
-        }
+        self.store_xattrs(&mut inode, &entries)?;
 
         // Update inode
         let now = std::time::SystemTime::now()
@@ -721,7 +1024,7 @@ impl LolelfFs {
     }
 
     /// List all extended attribute names
-    pub fn list_xattrs(&mut self, inode_num: u32) -> Result<Vec<String>> {
+    pub fn list_xattrs(&self, inode_num: u32) -> Result<Vec<String>> {
         let inode = self.read_inode(inode_num)?;
 
         if inode.xattr_block == 0 {
@@ -777,97 +1080,89 @@ impl LolelfFs {
             self.free_blocks(extent.ee_start, extent.ee_len)?;
         }
 
-        // If no entries left, free the xattr block
-        if entries.is_empty() {
-            self.free_blocks(inode.xattr_block, 1)?;
-            inode.xattr_block = 0;
-        } else {
-            // Serialize remaining entries and write them back
-            let data = crate::xattr::serialize_xattr_entries(&entries)?;
-            let num_blocks = (data.len() as u32).div_ceil(LOLELFFS_BLOCK_SIZE);
+        self.store_xattrs(&mut inode, &entries)?;
 
-            // Allocate blocks using extents
-            let mut extents = Vec::new();
-            let mut allocated = 0u32;
+        // Update inode
+        let now = std::time::SystemTime::now()
+            .duration_since(std::time::UNIX_EPOCH)
+            .unwrap()
+            .as_secs() as u32;
+        inode.i_ctime = now;
+        self.write_inode(inode_num, &inode)?;
 
-            while allocated < num_blocks {
-                let remaining = num_blocks - allocated;
+        Ok(())
+    }
 
-                // Determine if we need metadata for this extent
-                let needs_metadata = false; // Currently always false - no per-block metadata
+    /// Store the xattr set `entries` of `inode`, whose old data blocks are
+    /// already freed: in its index block if it fits there, or in new data
+    /// blocks otherwise. The index block of an empty set is freed.
+    fn store_xattrs(&mut self, inode: &mut Inode, entries: &[XattrEntry]) -> Result<()> {
+        if entries.is_empty() {
+            if inode.xattr_block != 0 {
+                self.free_blocks(inode.xattr_block, 1)?;
+                inode.xattr_block = 0;
+            }
+            return Ok(());
+        }
 
-                let max_extent_size = if needs_metadata {
-                    LOLELFFS_MAX_BLOCKS_PER_EXTENT
-                } else {
-                    let large = self.superblock.max_extent_blocks_large;
-                    if large == 0 || large > LOLELFFS_MAX_BLOCKS_PER_EXTENT_LARGE {
-                        LOLELFFS_MAX_BLOCKS_PER_EXTENT_LARGE
-                    } else {
-                        large
-                    }
-                };
+        let data = crate::xattr::serialize_xattr_entries(entries)?;
+        if inode.xattr_block == 0 {
+            inode.xattr_block = self.alloc_blocks(1)?;
+        }
+        let mut index = XattrIndex {
+            total_size: data.len() as u32,
+            count: entries.len() as u32,
+            extents: vec![Extent::default(); LOLELFFS_MAX_EXTENTS],
+            inline: Vec::new(),
+        };
 
-                let extent_size = self
-                    .calc_optimal_extent_size(allocated, needs_metadata)
-                    .min(remaining)
-                    .min(max_extent_size);
-
-                let start_block = self.alloc_blocks(extent_size)?;
-
-                extents.push(Extent {
-                    ee_block: allocated,
-                    ee_len: extent_size,
-                    ee_start: start_block,
-                    ee_comp_algo: LOLELFFS_COMP_NONE as u16,
-                    ee_enc_algo: LOLELFFS_ENC_NONE,
-                    ee_reserved: 0,
-                    ee_flags: 0,
-                    ee_reserved2: 0,
-                    ee_meta: 0,
-                });
+        // Small sets take no block of their own
+        if self.superblock.comp_features & LOLELFFS_FEATURE_XATTR_INLINE != 0
+            && data.len() <= LOLELFFS_XATTR_INLINE_SIZE
+        {
+            index.inline = data;
+            return crate::xattr::write_xattr_index(self, inode.xattr_block, &index);
+        }
 
-                allocated += extent_size;
-            }
+        // Allocate blocks using extents
+        let num_blocks = (data.len() as u32).div_ceil(LOLELFFS_BLOCK_SIZE);
+        let large = self.superblock.max_extent_blocks_large;
+        let max_extent_size = if large == 0 || large > LOLELFFS_MAX_BLOCKS_PER_EXTENT_LARGE {
+            LOLELFFS_MAX_BLOCKS_PER_EXTENT_LARGE
+        } else {
+            large
+        };
+        let mut allocated = 0u32;
+        let mut slot = 0;
 
-            // Pad extents
-            while extents.len() < LOLELFFS_MAX_EXTENTS {
-                extents.push(Extent::default());
-            }
+        while allocated < num_blocks {
+            let extent_size = self
+                .calc_optimal_extent_size(allocated, false)
+                .min(num_blocks - allocated)
+                .min(max_extent_size);
+            let start_block = self.alloc_blocks(extent_size)?;
 
-            // Write xattr index
-            let new_index = XattrIndex {
-                total_size: data.len() as u32,
-                count: entries.len() as u32,
-                extents,
+            index.extents[slot] = Extent {
+                ee_block: allocated,
+                ee_len: extent_size,
+                ee_start: start_block,
+                ..Extent::default()
             };
-            crate::xattr::write_xattr_index(self, inode.xattr_block, &new_index)?;
-
-            // Write data to blocks
-            for (idx, chunk) in data.chunks(LOLELFFS_BLOCK_SIZE as usize).enumerate() {
-                let logical_block = idx as u32;
-
-                if let Some(extent) = new_index.extents.iter().find(|e| {
-                    !e.is_empty()
-                        && logical_block >= e.ee_block
-                        && logical_block < e.ee_block + e.ee_len
-                }) {
-                    let phys_block = extent.ee_start + (logical_block - extent.ee_block);
-                    let mut block = vec![0u8; LOLELFFS_BLOCK_SIZE as usize];
-                    block[..chunk.len()].copy_from_slice(chunk);
-                    self.write_block(phys_block, &block)?;
-                }
+            for (i, chunk) in data[(allocated * LOLELFFS_BLOCK_SIZE) as usize..]
+                .chunks(LOLELFFS_BLOCK_SIZE as usize)
+                .take(extent_size as usize)
+                .enumerate()
+            {
+                let mut block = vec![0u8; LOLELFFS_BLOCK_SIZE as usize];
+                block[..chunk.len()].copy_from_slice(chunk);
+                self.write_block(start_block + i as u32, &block)?;
             }
-        }
 
-        // Update inode
-        let now = std::time::SystemTime::now()
-            .duration_since(std::time::UNIX_EPOCH)
-            .unwrap()
-            .as_secs() as u32;
-        inode.i_ctime = now;
-        self.write_inode(inode_num, &inode)?;
+            allocated += extent_size;
+            slot += 1;
+        }
 
-        Ok(())
+        crate::xattr::write_xattr_index(self, inode.xattr_block, &index)
     }
 
     /// Free xattr blocks for an inode (called during inode deletion)
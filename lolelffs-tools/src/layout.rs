@@ -0,0 +1,396 @@
+//! Block layout of files: moving the files read together next to each
+//! other, and merging the extents of fragmented files
+
+use crate::fs::LolelfFs;
+use crate::types::*;
+use anyhow::Result;
+use std::collections::HashSet;
+
+/// Blocks copied at a time when moving a file
+const MOVE_CHUNK_BLOCKS: u32 = 256;
+
+/// Outcome of [`LolelfFs::relayout`]
+#[derive(Debug, Clone, Copy, Default, PartialEq, Eq)]
+pub struct RelayoutStats {
+    /// Files moved
+    pub files: u32,
+    /// Entries skipped because they are not regular files, have shared
+    /// extents, or are repeated
+    pub skipped: u32,
+    /// Blocks moved, extent index and compression metadata blocks included
+    pub blocks: u32,
+    /// First block of the moved files, if they were placed in a single run
+    pub hot_start: Option<u32>,
+}
+
+/// Outcome of [`LolelfFs::defrag`]
+#[derive(Debug, Clone, Copy, Default, PartialEq, Eq)]
+pub struct DefragStats {
+    /// Files whose extents were merged
+    pub files: u32,
+    /// Extents of the files before merging
+    pub extents_before: u32,
+    /// Extents of the files after merging
+    pub extents_after: u32,
+    /// Data blocks copied to a new location
+    pub blocks: u32,
+}
+
+/// Whether `b` can be appended to `a`: it must map the logical blocks right
+/// after those of `a`, so that no hole of a sparse file is closed up. Packed
+/// and shared extents are never merged.
+fn mergeable(a: &Extent, b: &Extent) -> bool {
+    !a.has_metadata()
+        && !a.is_shared()
+        && a.ee_flags == b.ee_flags
+        && a.ee_comp_algo == b.ee_comp_algo
+        && a.ee_enc_algo == b.ee_enc_algo
+        && b.ee_block == a.ee_block + a.ee_len
+}
+
+impl LolelfFs {
+    /// Physical block runs of a regular file, in the order a read visits
+    /// them: the extent index block and extent tree nodes, then the
+    /// compression metadata block and data blocks of each extent
+    pub fn file_runs(&self, inode: &Inode) -> Result<Vec<(u32, u32)>> {
+        let ei = self.read_extent_index(inode)?;
+        let mut runs = vec![(inode.ei_block, 1)];
+        runs.extend(
+            self.extent_tree_nodes(inode)?
+                .into_iter()
+                .map(|node| (node, 1)),
+        );
+
+        for extent in ei.extents.iter().take_while(|e| !e.is_empty()) {
+            if extent.has_metadata() {
+                let meta = self.read_comp_metadata(extent)?;
+                runs.push((extent.ee_meta, 1));
+                runs.push((extent.ee_start, meta.nr_phys));
+            } else {
+                runs.push((extent.ee_start, extent.ee_len));
+            }
+        }
+
+        Ok(runs)
+    }
+
+    /// Blocks taken by a regular file once moved by [`Self::move_file`],
+    /// which rebuilds its extent tree from full nodes
+    fn moved_blocks(&self, inode: &Inode) -> Result<u32> {
+        let runs: u32 = self.file_runs(inode)?.iter().map(|&(_, n)| n).sum();
+        let old_nodes = self.extent_tree_nodes(inode)?.len() as u32;
+        let new_nodes = ExtTreeNode::tree_size(self.read_extent_index(inode)?.count_extents());
+        Ok(runs - old_nodes + new_nodes)
+    }
+
+    /// Copy `count` blocks from `src` to `dest`
+    fn copy_blocks(&mut self, src: u32, dest: u32, count: u32) -> Result<()> {
+        let mut done = 0;
+        while done < count {
+            let n = (count - done).min(MOVE_CHUNK_BLOCKS);
+            let mut data = Vec::with_capacity((n * LOLELFFS_BLOCK_SIZE) as usize);
+            for i in 0..n {
+                data.extend_from_slice(&self.read_block(src + done + i)?);
+            }
+            self.write_blocks(dest + done, &data)?;
+            done += n;
+        }
+        Ok(())
+    }
+
+    /// Move all the blocks of the regular file `inode_num` to the allocated
+    /// blocks from `dest`, in read order, and free the old ones. Blocks are
+    /// copied as stored: encryption depends on logical block numbers only.
+    /// Return the number of blocks moved.
+    pub fn move_file(&mut self, inode_num: u32, dest: u32) -> Result<u32> {
+        let mut inode = self.read_inode(inode_num)?;
+        let mut ei = self.read_extent_index(&inode)?;
+        let old_runs = self.file_runs(&inode)?;
+
+        // Extent tree nodes follow the extent index block
+        let nr_nodes = ExtTreeNode::tree_size(ei.count_extents());
+        let mut next = dest + 1 + nr_nodes;
+        for extent in ei.extents.iter_mut().take_while(|e| !e.is_empty()) {
+            if extent.has_metadata() {
+                let nr_phys = self.read_comp_metadata(extent)?.nr_phys;
+                self.copy_blocks(extent.ee_meta, next, 1)?;
+                extent.ee_meta = next;
+                self.copy_blocks(extent.ee_start, next + 1, nr_phys)?;
+                extent.ee_start = next + 1;
+                next += 1 + nr_phys;
+            } else {
+                self.copy_blocks(extent.ee_start, next, extent.ee_len)?;
+                extent.ee_start = next;
+                next += extent.ee_len;
+            }
+        }
+        let mut node = dest + 1;
+        self.write_extent_index_with(dest, &ei, |_| {
+            node += 1;
+            Ok(node - 1)
+        })?;
+
+        inode.ei_block = dest;
+        self.write_inode(inode_num, &inode)?;
+
+        for (start, count) in old_runs {
+            self.free_blocks(start, count)?;
+        }
+
+        Ok(next - dest)
+    }
+
+    /// Lay the regular files `inodes` out back to back, in the given order,
+    /// so that reading them in that order is one forward sweep of the image.
+    ///
+    /// The files are placed in a single run of free blocks if there is one
+    /// large enough, or each in the first run that can hold it otherwise.
+    /// Directories, symlinks, files with shared extents and repeated inodes
+    /// are skipped.
+    pub fn relayout(&mut self, inodes: &[u32]) -> Result<RelayoutStats> {
+        let mut stats = RelayoutStats::default();
+        let mut seen = HashSet::new();
+        let mut files = Vec::new();
+        let mut total = 0u32;
+
+        for &inode_num in inodes {
+            let inode = self.read_inode(inode_num)?;
+            if !inode.is_file() || inode.ei_block == 0 || !seen.insert(inode_num) {
+                stats.skipped += 1;
+                continue;
+            }
+            // Moving frees the old blocks, which other files may still map
+            let ei = self.read_extent_index(&inode)?;
+            if ei.extents.iter().any(|e| e.is_shared()) {
+                stats.skipped += 1;
+                continue;
+            }
+            let blocks = self.moved_blocks(&inode)?;
+            files.push((inode_num, blocks));
+            total += blocks;
+        }
+        if files.is_empty() {
+            return Ok(stats);
+        }
+
+        // The new blocks are taken before the old ones are freed
+        match self.alloc_blocks(total) {
+            Ok(start) => {
+                let mut dest = start;
+                for &(inode_num, _) in &files {
+                    dest += self.move_file(inode_num, dest)?;
+                }
+                stats.hot_start = Some(start);
+            }
+            Err(_) => {
+                for &(inode_num, blocks) in &files {
+                    let dest = self.alloc_blocks(blocks)?;
+                    self.move_file(inode_num, dest)?;
+                }
+            }
+        }
+        stats.files = files.len() as u32;
+        stats.blocks = total;
+
+        Ok(stats)
+    }
+
+    /// Record the block range to prefetch at mount, or clear it with a
+    /// length of 0
+    pub fn set_hot_range(&mut self, start: u32, len: u32) -> Result<()> {
+        self.superblock.hot_start = if len == 0 { 0 } else { start };
+        self.superblock.hot_len = len;
+        self.write_superblock()
+    }
+
+    /// Merge the extents of the regular file `inode_num` into as few as the
+    /// free space allows, like the kernel's `LOLELFFS_IOC_DEFRAG`.
+    ///
+    /// Runs of plain extents with the same encoding that map consecutive
+    /// logical blocks are merged up to the large extent limit: in place if
+    /// they are physically contiguous, or copied to a new run of free blocks
+    /// otherwise, which shrinks by whole extents when free space is short.
+    /// Packed extents are left as they are.
+    pub fn defrag_file(&mut self, inode_num: u32) -> Result<DefragStats> {
+        let inode = self.read_inode(inode_num)?;
+        let mut stats = DefragStats::default();
+        if !inode.is_file() || inode.ei_block == 0 {
+            return Ok(stats);
+        }
+
+        let mut ei = self.read_extent_index(&inode)?;
+        let old: Vec<Extent> = ei
+            .extents
+            .iter()
+            .take_while(|e| !e.is_empty())
+            .copied()
+            .collect();
+        let max_len = self.max_extent_blocks();
+        let mut new: Vec<Extent> = Vec::with_capacity(old.len());
+        let mut freed = Vec::new();
+
+        let mut i = 0;
+        while i < old.len() {
+            let mut len = old[i].ee_len;
+            let mut contig = true;
+            let mut j = i + 1;
+            while j < old.len() && mergeable(&old[j - 1], &old[j]) && len + old[j].ee_len <= max_len
+            {
+                if old[j].ee_start != old[j - 1].ee_start + old[j - 1].ee_len {
+                    contig = false;
+                }
+                len += old[j].ee_len;
+                j += 1;
+            }
+
+            let mut dest = None;
+            if j - i > 1 && !contig {
+                // Continue the previous extent on disk when possible
+                let goal = match new.last() {
+                    Some(prev) if !prev.has_metadata() => prev.ee_start + prev.ee_len,
+                    _ => inode.ei_block + 1,
+                };
+                loop {
+                    dest = if self.alloc_blocks_at(goal, len)? {
+                        Some(goal)
+                    } else {
+                        self.alloc_blocks(len).ok()
+                    };
+                    if dest.is_some() || j - i <= 2 {
+                        break;
+                    }
+                    j -= 1;
+                    len -= old[j].ee_len;
+                }
+                if dest.is_none() {
+                    j = i + 1;
+                    len = old[i].ee_len;
+                }
+            }
+
+            let mut extent = old[i];
+            extent.ee_len = len;
+            if let Some(dest) = dest {
+                let mut off = 0;
+                for e in &old[i..j] {
+                    self.copy_blocks(e.ee_start, dest + off, e.ee_len)?;
+                    freed.push((e.ee_start, e.ee_len));
+                    off += e.ee_len;
+                }
+                extent.ee_start = dest;
+                stats.blocks += len;
+            }
+            new.push(extent);
+            i = j;
+        }
+
+        stats.extents_before = old.len() as u32;
+        stats.extents_after = new.len() as u32;
+        if new.len() == old.len() {
+            return Ok(stats);
+        }
+
+        for (slot, extent) in ei.extents.iter_mut().enumerate() {
+            *extent = new.get(slot).copied().unwrap_or_default();
+        }
+        for node in self.extent_tree_nodes(&inode)? {
+            self.free_blocks(node, 1)?;
+        }
+        self.write_extent_index(inode.ei_block, &ei)?;
+        for (start, count) in freed {
+            self.free_blocks(start, count)?;
+        }
+        stats.files = 1;
+
+        Ok(stats)
+    }
+
+    /// Merge the extents of the regular files `inodes`, or of all the
+    /// regular files of the filesystem if `inodes` is empty
+    pub fn defrag(&mut self, inodes: &[u32]) -> Result<DefragStats> {
+        let all: Vec<u32>;
+        let inodes = if inodes.is_empty() {
+            all = (1..self.superblock.nr_inodes)
+                .filter(|&i| matches!(self.is_inode_free(i), Ok(false)))
+                .collect();
+            &all
+        } else {
+            inodes
+        };
+
+        let mut stats = DefragStats::default();
+        let mut seen = HashSet::new();
+        for &inode_num in inodes {
+            if !seen.insert(inode_num) {
+                continue;
+            }
+            let file = self.defrag_file(inode_num)?;
+            stats.files += file.files;
+            stats.extents_before += file.extents_before;
+            stats.extents_after += file.extents_after;
+            stats.blocks += file.blocks;
+        }
+
+        Ok(stats)
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_defrag_keeps_holes() {
+        let path = std::env::temp_dir().join(format!("lolelffs-defrag-{}.img", std::process::id()));
+        let mut fs = LolelfFs::create(&path, 16 * 1024 * 1024).unwrap();
+        fs.superblock.comp_enabled = 0;
+        let f = fs.create_file(LOLELFFS_ROOT_INO, "sparse").unwrap();
+        let block = LOLELFFS_BLOCK_SIZE as usize;
+        let data: Vec<u8> = (0..8 * block).map(|i| (i / block + 1) as u8).collect();
+        fs.write_file(f, &data).unwrap();
+
+        // Punch blocks 2-3 and drop block 7: the extents of blocks 0-1 and
+        // 4-5 are contiguous on disk, that of block 6 is not
+        let mut inode = fs.read_inode(f).unwrap();
+        let mut ei = fs.read_extent_index(&inode).unwrap();
+        let start = ei.extents[0].ee_start;
+        assert_eq!(ei.extents[0].ee_len, 8);
+        for (slot, (ee_block, ee_len, ee_start)) in
+            [(0, 2, start), (4, 2, start + 2), (6, 1, start + 7)]
+                .into_iter()
+                .enumerate()
+        {
+            ei.extents[slot] = Extent {
+                ee_block,
+                ee_len,
+                ee_start,
+                ..Extent::default()
+            };
+        }
+        fs.write_extent_index(inode.ei_block, &ei).unwrap();
+        fs.free_blocks(start + 4, 3).unwrap();
+        inode.i_size = 7 * LOLELFFS_BLOCK_SIZE;
+        inode.i_blocks = 5;
+        fs.write_inode(f, &inode).unwrap();
+
+        let before = fs.read_file(f).unwrap();
+        assert!(before[2 * block..4 * block].iter().all(|&b| b == 0));
+
+        let stats = fs.defrag_file(f).unwrap();
+        assert_eq!((stats.extents_before, stats.extents_after), (3, 2));
+        assert_eq!(fs.read_file(f).unwrap(), before);
+
+        let inode = fs.read_inode(f).unwrap();
+        let ei = fs.read_extent_index(&inode).unwrap();
+        let mapped: Vec<(u32, u32)> = ei
+            .extents
+            .iter()
+            .take_while(|e| !e.is_empty())
+            .map(|e| (e.ee_block, e.ee_len))
+            .collect();
+        assert_eq!(mapped, vec![(0, 2), (4, 3)]);
+
+        drop(fs);
+        std::fs::remove_file(&path).unwrap();
+    }
+}
@@ -5,10 +5,13 @@
 
 pub mod bitmap;
 pub mod compress;
+pub mod dedup;
 pub mod dir;
 pub mod encrypt;
 pub mod file;
 pub mod fs;
+pub mod layout;
+mod mmap;
 pub mod types;
 pub mod xattr;
 
@@ -4,8 +4,14 @@ use anyhow::{bail, Context, Result};
 use chrono::{TimeZone, Utc};
 use clap::{Parser, Subcommand};
 use lolelffs_tools::*;
+use sha2::{Digest, Sha256};
+use std::collections::HashMap;
 use std::io::{self, Read, Write};
-use std::path::PathBuf;
+use std::os::unix::fs::FileExt;
+use std::path::{Path, PathBuf};
+use std::sync::atomic::{AtomicBool, AtomicUsize, Ordering};
+use std::sync::mpsc;
+use std::thread;
 
 #[derive(Parser)]
 #[command(name = "lolelffs")]
@@ -219,6 +225,14 @@ enum Commands {
         /// Destination path in filesystem
         dest: String,
 
+        /// Copy directories recursively
+        #[arg(short, long)]
+        recursive: bool,
+
+        /// Share the blocks of identical file data once copied
+        #[arg(long)]
+        dedup: bool,
+
         /// Password for encrypted filesystem
         #[arg(short = 'P', long)]
         password: Option<String>,
@@ -235,6 +249,54 @@ enum Commands {
 
         /// Destination file on host
         dest: PathBuf,
+
+        /// Extract directories recursively
+        #[arg(short, long)]
+        recursive: bool,
+
+        /// Files extracted in parallel (default: one per CPU)
+        #[arg(short, long)]
+        jobs: Option<usize>,
+
+        /// Hash each file while extracting it, then check the written copy
+        #[arg(long)]
+        verify: bool,
+
+        /// Password for encrypted filesystem
+        #[arg(short = 'P', long)]
+        password: Option<String>,
+    },
+
+    /// Lay out the files of a read trace contiguously, in trace order
+    Relayout {
+        /// Filesystem image path
+        #[arg(short, long)]
+        image: PathBuf,
+
+        /// Trace file: one path or inode number per line, in read order
+        /// (as written by `lolelffs-fuse --trace`)
+        trace: PathBuf,
+
+        /// Don't record the moved range in the superblock for prefetching
+        #[arg(long)]
+        no_hint: bool,
+    },
+
+    /// Merge the extents of fragmented files
+    Defrag {
+        /// Filesystem image path
+        #[arg(short, long)]
+        image: PathBuf,
+
+        /// Files to defragment (default: all regular files)
+        paths: Vec<String>,
+    },
+
+    /// Share the blocks of identical file data between files
+    Dedup {
+        /// Filesystem image path
+        #[arg(short, long)]
+        image: PathBuf,
     },
 
     /// Get an extended attribute value
@@ -353,13 +415,28 @@ fn main() -> Result<()> {
             image,
             source,
             dest,
+            recursive,
+            dedup,
             password,
-        } => cmd_cp(&image, &source, &dest, password),
+        } => cmd_cp(&image, &source, &dest, recursive, dedup, password),
         Commands::Extract {
             image,
             source,
             dest,
-        } => cmd_extract(&image, &source, &dest),
+            recursive,
+            jobs,
+            verify,
+            password,
+        } => cmd_extract(&image, &source, &dest, recursive, jobs, verify, password),
+        Commands::Relayout {
+            image,
+            trace,
+            no_hint,
+        } => cmd_relayout(&image, &trace, !no_hint),
+
+        Commands::Defrag { image, paths } => cmd_defrag(&image, &paths),
+
+        Commands::Dedup { image } => cmd_dedup(&image),
 
         Commands::Getfattr {
             image,
@@ -382,7 +459,7 @@ fn main() -> Result<()> {
 }
 
 fn cmd_ls(image: &PathBuf, path: &str, long: bool, all: bool) -> Result<()> {
-    let mut fs = LolelfFs::open_readonly(image)?;
+    let fs = LolelfFs::open_readonly(image)?;
     let inode_num = fs.resolve_path(path)?;
 
     let inode = fs.read_inode(inode_num)?;
@@ -443,8 +520,8 @@ fn cmd_cat(image: &PathBuf, path: &str, password: Option<String>) -> Result<()>
 
     let inode_num = fs.resolve_path(path)?;
 
-    let data = fs.read_file(inode_num)?;
-    io::stdout().write_all(&data)?;
+    let mut reader = fs.open_reader(inode_num)?;
+    io::copy(&mut reader, &mut io::stdout().lock())?;
 
     Ok(())
 }
@@ -486,6 +563,7 @@ fn cmd_write(
         Err(e) => return Err(e),
     }
 
+    fs.flush()?;
     Ok(())
 }
 
@@ -514,6 +592,7 @@ fn cmd_mkdir(image: &PathBuf, path: &str, parents: bool) -> Result<()> {
         fs.mkdir(parent_inode, dirname)?;
     }
 
+    fs.flush()?;
     Ok(())
 }
 
@@ -543,6 +622,7 @@ fn cmd_rm(image: &PathBuf, path: &str, recursive: bool, dir: bool) -> Result<()>
         fs.unlink(parent_inode, name)?;
     }
 
+    fs.flush()?;
     Ok(())
 }
 
@@ -583,11 +663,12 @@ fn cmd_touch(image: &PathBuf, path: &str) -> Result<()> {
         }
     }
 
+    fs.flush()?;
     Ok(())
 }
 
 fn cmd_stat(image: &PathBuf, path: &str) -> Result<()> {
-    let mut fs = LolelfFs::open_readonly(image)?;
+    let fs = LolelfFs::open_readonly(image)?;
     let inode_num = fs.resolve_path(path)?;
     let inode = fs.read_inode(inode_num)?;
 
@@ -634,6 +715,10 @@ fn cmd_stat(image: &PathBuf, path: &str) -> Result<()> {
 
     if inode.ei_block != 0 {
         println!("Extent Block: {}", inode.ei_block);
+    } else if let Some(tail) = inode.tail_ref() {
+        println!("Tail Block: {} (offset {})", tail.tr_block, tail.tr_offset);
+    } else if inode.is_inline() {
+        println!("Inline: in inode");
     }
 
     Ok(())
@@ -716,7 +801,7 @@ fn cmd_mkfs(
 }
 
 fn cmd_fsck(image: &PathBuf, verbose: bool) -> Result<()> {
-    let mut fs = LolelfFs::open_readonly(image)?;
+    let fs = LolelfFs::open_readonly(image)?;
     let mut errors = 0;
     let mut warnings = 0;
 
@@ -779,6 +864,46 @@ fn cmd_fsck(image: &PathBuf, verbose: bool) -> Result<()> {
             // Check each entry
             for entry in &entries {
                 match fs.read_inode(entry.inode_num) {
+                    Ok(inode) if inode.is_file() && inode.ei_block != 0 => {
+                        match fs.read_extent_index(&inode) {
+                            Ok(ei) => {
+                                if verbose {
+                                    println!(
+                                        "  {}: inode {} OK, {} extents",
+                                        entry.filename,
+                                        entry.inode_num,
+                                        ei.count_extents()
+                                    );
+                                }
+                            }
+                            Err(e) => {
+                                println!(
+                                    "ERROR: Cannot read extents of inode {} for '{}': {}",
+                                    entry.inode_num, entry.filename, e
+                                );
+                                errors += 1;
+                            }
+                        }
+                    }
+                    Ok(inode) if inode.tail_ref().is_some() => {
+                        match fs.read_file(entry.inode_num) {
+                            Ok(_) => {
+                                if verbose {
+                                    println!(
+                                        "  {}: inode {} OK, in a tail block",
+                                        entry.filename, entry.inode_num
+                                    );
+                                }
+                            }
+                            Err(e) => {
+                                println!(
+                                    "ERROR: Cannot read tail of inode {} for '{}': {}",
+                                    entry.inode_num, entry.filename, e
+                                );
+                                errors += 1;
+                            }
+                        }
+                    }
                     Ok(_) => {
                         if verbose {
                             println!("  {}: inode {} OK", entry.filename, entry.inode_num);
@@ -870,6 +995,7 @@ fn cmd_ln(image: &PathBuf, target: &str, link: &str, symbolic: bool) -> Result<(
         fs.link(target_inode, parent_inode, link_name)?;
     }
 
+    fs.flush()?;
     Ok(())
 }
 
@@ -902,6 +1028,28 @@ fn cmd_super(image: &PathBuf) -> Result<()> {
     if sb.comp_features & LOLELFFS_FEATURE_LARGE_EXTENTS != 0 {
         println!("    - Large extents support enabled");
     }
+    if sb.comp_features & LOLELFFS_FEATURE_DIR_INDEX != 0 {
+        println!("    - Hashed directory index enabled");
+    }
+    if sb.comp_features & LOLELFFS_FEATURE_EXTENT_TREE != 0 {
+        println!("    - Multi-level extent trees enabled");
+    }
+    if sb.comp_features & LOLELFFS_FEATURE_INLINE_DATA != 0 {
+        println!("    - Inline data for small files enabled");
+    }
+    if sb.comp_features & LOLELFFS_FEATURE_XATTR_INLINE != 0 {
+        println!("    - Small xattr sets in their index block enabled");
+    }
+    if sb.tail_block != 0 {
+        println!("  Tail block with room: {}", sb.tail_block);
+    }
+    if sb.hot_len != 0 {
+        println!(
+            "  Startup prefetch: blocks {}-{}",
+            sb.hot_start,
+            sb.hot_start + sb.hot_len - 1
+        );
+    }
     println!();
     println!("Layout:");
     println!("  Block 0: Superblock");
@@ -968,12 +1116,31 @@ fn cmd_unlock(image: &PathBuf, password: Option<String>) -> Result<()> {
     Ok(())
 }
 
-fn cmd_cp(image: &PathBuf, source: &PathBuf, dest: &str, password: Option<String>) -> Result<()> {
+fn cmd_cp(
+    image: &PathBuf,
+    source: &PathBuf,
+    dest: &str,
+    recursive: bool,
+    dedup: bool,
+    password: Option<String>,
+) -> Result<()> {
     let mut fs = LolelfFs::open(image)?;
 
     // Unlock if encrypted and password provided
     unlock_if_needed(&mut fs, password)?;
 
+    if source.is_dir() {
+        if !recursive {
+            bail!("'{}' is a directory (use --recursive)", source.display());
+        }
+        import_tree(&mut fs, source, dest)?;
+        if dedup {
+            print_dedup_stats(&fs.dedup()?);
+        }
+        fs.flush()?;
+        return Ok(());
+    }
+
     // Read source file from host
     let content =
         std::fs::read(source).with_context(|| format!("Failed to read '{}'", source.display()))?;
@@ -1002,22 +1169,650 @@ fn cmd_cp(image: &PathBuf, source: &PathBuf, dest: &str, password: Option<String
             fs.write_file(inode_num, &content)?;
         }
     }
+    if dedup {
+        print_dedup_stats(&fs.dedup()?);
+    }
+
+    fs.flush()?;
+    Ok(())
+}
+
+/// Number of host files read ahead of the one being written by `cp -r`
+const IMPORT_READ_AHEAD: usize = 8;
 
+/// Host entry to import, with its path relative to the source directory
+enum ImportEntry {
+    Dir(PathBuf),
+    File(PathBuf),
+    Symlink(PathBuf, String),
+}
+
+/// Collect the entries of a host directory tree, sorted by name, with each
+/// directory before its contents. Special files are skipped.
+fn walk_host_tree(root: &Path, rel: &Path, entries: &mut Vec<ImportEntry>) -> Result<()> {
+    let dir = root.join(rel);
+    let mut children = std::fs::read_dir(&dir)
+        .with_context(|| format!("Failed to read directory '{}'", dir.display()))?
+        .collect::<io::Result<Vec<_>>>()?;
+    children.sort_by_key(|child| child.file_name());
+
+    for child in children {
+        let rel = rel.join(child.file_name());
+        let file_type = child.file_type()?;
+        if file_type.is_symlink() {
+            let target = std::fs::read_link(child.path())?;
+            entries.push(ImportEntry::Symlink(
+                rel,
+                target.to_string_lossy().into_owned(),
+            ));
+        } else if file_type.is_dir() {
+            entries.push(ImportEntry::Dir(rel.clone()));
+            walk_host_tree(root, &rel, entries)?;
+        } else if file_type.is_file() {
+            entries.push(ImportEntry::File(rel));
+        }
+    }
     Ok(())
 }
 
-fn cmd_extract(image: &PathBuf, source: &str, dest: &PathBuf) -> Result<()> {
+/// Copy a host directory tree into the filesystem, as `cp -r` does: into
+/// `dest` under the source's name if `dest` is a directory, as `dest`
+/// otherwise. Existing files are overwritten and existing directories merged.
+///
+/// A reader thread loads the host files ahead of the writer, so reading the
+/// host tree overlaps with compressing, encrypting and writing the image.
+fn import_tree(fs: &mut LolelfFs, source: &Path, dest: &str) -> Result<()> {
+    let into_dir = dest.ends_with('/')
+        || matches!(fs.resolve_path(dest), Ok(ino) if fs.read_inode(ino)?.is_dir());
+    let dest_path = if into_dir {
+        let name = source
+            .file_name()
+            .ok_or_else(|| anyhow::anyhow!("Invalid source directory name"))?
+            .to_string_lossy();
+        format!("{}/{}", dest.trim_end_matches('/'), name)
+    } else {
+        dest.to_string()
+    };
+
+    let root_inode = match fs.resolve_path(&dest_path) {
+        Ok(ino) if fs.read_inode(ino)?.is_dir() => ino,
+        Ok(_) => bail!("'{}' exists and is not a directory", dest_path),
+        Err(_) => {
+            let (parent_path, dirname) = split_path(&dest_path);
+            let parent_inode = fs.resolve_path(&parent_path)?;
+            fs.mkdir(parent_inode, dirname)?
+        }
+    };
+
+    let mut entries = Vec::new();
+    walk_host_tree(source, Path::new(""), &mut entries)?;
+
+    let (tx, rx) = mpsc::sync_channel(IMPORT_READ_AHEAD);
+    let entries = &entries;
+    thread::scope(|scope| {
+        scope.spawn(move || {
+            for entry in entries {
+                if let ImportEntry::File(rel) = entry {
+                    let path = source.join(rel);
+                    let content = std::fs::read(&path)
+                        .with_context(|| format!("Failed to read '{}'", path.display()));
+                    // The writer hung up after an error
+                    if tx.send(content).is_err() {
+                        break;
+                    }
+                }
+            }
+        });
+        import_entries(fs, root_inode, entries, rx)
+    })
+}
+
+/// Create the entries collected by [`walk_host_tree`] under `root_inode`,
+/// taking the contents of each file from `contents` in order
+fn import_entries(
+    fs: &mut LolelfFs,
+    root_inode: u32,
+    entries: &[ImportEntry],
+    contents: mpsc::Receiver<Result<Vec<u8>>>,
+) -> Result<()> {
+    let mut dirs = HashMap::new();
+    dirs.insert(PathBuf::new(), root_inode);
+
+    for entry in entries {
+        let rel = match entry {
+            ImportEntry::Dir(rel) | ImportEntry::File(rel) | ImportEntry::Symlink(rel, _) => rel,
+        };
+        let parent_inode = dirs[rel.parent().unwrap()];
+        let name = rel
+            .file_name()
+            .and_then(|name| name.to_str())
+            .ok_or_else(|| anyhow::anyhow!("Invalid filename '{}'", rel.display()))?;
+        let existing = fs.lookup(parent_inode, name)?;
+
+        match entry {
+            ImportEntry::Dir(rel) => {
+                let inode_num = match existing {
+                    Some(ino) if fs.read_inode(ino)?.is_dir() => ino,
+                    Some(_) => bail!("'{}' exists and is not a directory", rel.display()),
+                    None => fs.mkdir(parent_inode, name)?,
+                };
+                dirs.insert(rel.clone(), inode_num);
+            }
+            ImportEntry::File(rel) => {
+                let content = contents.recv()??;
+                let inode_num = match existing {
+                    Some(ino) if fs.read_inode(ino)?.is_dir() => {
+                        bail!("'{}' exists and is a directory", rel.display())
+                    }
+                    Some(ino) => ino,
+                    None => fs.create_file(parent_inode, name)?,
+                };
+                fs.write_file(inode_num, &content)?;
+            }
+            ImportEntry::Symlink(rel, target) => {
+                if let Some(ino) = existing {
+                    if fs.read_inode(ino)?.is_dir() {
+                        bail!("'{}' exists and is a directory", rel.display());
+                    }
+                    fs.unlink(parent_inode, name)?;
+                }
+                fs.symlink(parent_inode, name, target)?;
+            }
+        }
+    }
+    Ok(())
+}
+
+fn cmd_extract(
+    image: &PathBuf,
+    source: &str,
+    dest: &Path,
+    recursive: bool,
+    jobs: Option<usize>,
+    verify: bool,
+    password: Option<String>,
+) -> Result<()> {
     let mut fs = LolelfFs::open_readonly(image)?;
+    unlock_if_needed(&mut fs, password)?;
     let inode_num = fs.resolve_path(source)?;
-    let data = fs.read_file(inode_num)?;
+    let inode = fs.read_inode(inode_num)?;
+
+    // Like cp, into an existing directory under the source's name
+    let name = Path::new(source.trim_end_matches('/')).file_name();
+    let dest_path = match name {
+        Some(name) if dest.is_dir() => dest.join(name),
+        _ => dest.to_path_buf(),
+    };
+
+    if inode.is_dir() {
+        if !recursive {
+            bail!("'{}' is a directory (use --recursive)", source);
+        }
+        let jobs = jobs.unwrap_or_else(|| thread::available_parallelism().map_or(1, |n| n.get()));
+        let stats = extract_tree(&fs, inode_num, &dest_path, jobs.max(1), verify)?;
+        println!(
+            "Extracted {} files ({}), {} directories, {} symlinks{}",
+            stats.files,
+            format_size(stats.bytes),
+            stats.dirs,
+            stats.symlinks,
+            if verify { ", verified" } else { "" }
+        );
+        return Ok(());
+    }
+
+    if inode.is_symlink() {
+        let target = fs.read_file(inode_num)?;
+        std::os::unix::fs::symlink(String::from_utf8_lossy(&target).as_ref(), &dest_path)
+            .with_context(|| format!("Failed to create '{}'", dest_path.display()))?;
+        return Ok(());
+    }
+
+    extract_file(
+        &fs,
+        inode_num,
+        &dest_path,
+        verify,
+        &mut vec![0; EXTRACT_BUF_SIZE],
+    )?;
+    Ok(())
+}
 
-    std::fs::write(dest, &data).with_context(|| format!("Failed to write '{}'", dest.display()))?;
+/// Size of the buffers through which `extract` reads and writes file data
+const EXTRACT_BUF_SIZE: usize = 1 << 20;
+
+/// Image entry to extract, with its path relative to the destination
+enum ExtractEntry {
+    Dir(PathBuf, u32),
+    File(PathBuf, u32),
+    Symlink(PathBuf, u32),
+}
+
+#[derive(Default)]
+struct ExtractStats {
+    files: u64,
+    dirs: u64,
+    symlinks: u64,
+    bytes: u64,
+}
 
+/// Collect the entries of an image directory tree, sorted by name, with
+/// each directory before its contents
+fn walk_image_tree(
+    fs: &LolelfFs,
+    dir_inode: u32,
+    rel: &Path,
+    entries: &mut Vec<ExtractEntry>,
+) -> Result<()> {
+    let mut children = fs.list_dir(dir_inode)?;
+    children.sort_by(|a, b| a.filename.cmp(&b.filename));
+
+    for child in children {
+        let rel = rel.join(&child.filename);
+        if child.inode.is_dir() {
+            entries.push(ExtractEntry::Dir(rel.clone(), child.inode_num));
+            walk_image_tree(fs, child.inode_num, &rel, entries)?;
+        } else if child.inode.is_symlink() {
+            entries.push(ExtractEntry::Symlink(rel, child.inode_num));
+        } else {
+            entries.push(ExtractEntry::File(rel, child.inode_num));
+        }
+    }
     Ok(())
 }
 
-fn cmd_getfattr(image: &PathBuf, path: &str, name: &str, hex: bool) -> Result<()> {
+/// Extract the tree of the directory `dir_inode` to `dest`, merging into
+/// what is already there.
+///
+/// The tree is walked once, and its directories and symlinks created first.
+/// Files are then shared among `jobs` threads, largest first so that the
+/// threads finish together, each decoding and writing whole files. Further
+/// links to an inode already extracted become hard links.
+fn extract_tree(
+    fs: &LolelfFs,
+    dir_inode: u32,
+    dest: &Path,
+    jobs: usize,
+    verify: bool,
+) -> Result<ExtractStats> {
+    let mut entries = Vec::new();
+    walk_image_tree(fs, dir_inode, Path::new(""), &mut entries)?;
+
+    let mut stats = ExtractStats::default();
+    let mut dirs = vec![(dest.to_path_buf(), dir_inode)];
+    let mut files = Vec::new();
+    let mut links = Vec::new();
+    let mut first_paths: HashMap<u32, PathBuf> = HashMap::new();
+
+    std::fs::create_dir_all(dest)
+        .with_context(|| format!("Failed to create '{}'", dest.display()))?;
+    for entry in &entries {
+        match entry {
+            ExtractEntry::Dir(rel, ino) => {
+                let path = dest.join(rel);
+                match std::fs::create_dir(&path) {
+                    Err(e) if e.kind() != io::ErrorKind::AlreadyExists => {
+                        return Err(e)
+                            .with_context(|| format!("Failed to create '{}'", path.display()));
+                    }
+                    _ => {}
+                }
+                dirs.push((path, *ino));
+                stats.dirs += 1;
+            }
+            ExtractEntry::Symlink(rel, ino) => {
+                let path = dest.join(rel);
+                let target = fs.read_file(*ino)?;
+                if path.symlink_metadata().is_ok() {
+                    std::fs::remove_file(&path)
+                        .with_context(|| format!("Failed to replace '{}'", path.display()))?;
+                }
+                std::os::unix::fs::symlink(String::from_utf8_lossy(&target).as_ref(), &path)
+                    .with_context(|| format!("Failed to create '{}'", path.display()))?;
+                stats.symlinks += 1;
+            }
+            ExtractEntry::File(rel, ino) => {
+                let path = dest.join(rel);
+                match first_paths.entry(*ino) {
+                    std::collections::hash_map::Entry::Occupied(first) => {
+                        links.push((first.get().clone(), path));
+                    }
+                    std::collections::hash_map::Entry::Vacant(slot) => {
+                        slot.insert(path.clone());
+                        let size = fs.read_inode(*ino)?.i_size as u64;
+                        files.push((path, *ino, size));
+                    }
+                }
+                stats.files += 1;
+            }
+        }
+    }
+    files.sort_by(|a, b| b.2.cmp(&a.2));
+    stats.bytes = files.iter().map(|f| f.2).sum();
+
+    let next = AtomicUsize::new(0);
+    let failed = AtomicBool::new(false);
+    let files = &files;
+    thread::scope(|scope| -> Result<()> {
+        let workers: Vec<_> = (0..jobs.min(files.len()))
+            .map(|_| {
+                scope.spawn(|| -> Result<()> {
+                    let mut buf = vec![0; EXTRACT_BUF_SIZE];
+                    while !failed.load(Ordering::Relaxed) {
+                        let Some((path, ino, _)) = files.get(next.fetch_add(1, Ordering::Relaxed))
+                        else {
+                            break;
+                        };
+                        if let Err(e) = extract_file(fs, *ino, path, verify, &mut buf) {
+                            // Stop the other workers at their next file
+                            failed.store(true, Ordering::Relaxed);
+                            return Err(e);
+                        }
+                    }
+                    Ok(())
+                })
+            })
+            .collect();
+        for worker in workers {
+            worker.join().expect("extract worker panicked")?;
+        }
+        Ok(())
+    })?;
+
+    for (first, path) in links {
+        if path.symlink_metadata().is_ok() {
+            std::fs::remove_file(&path)
+                .with_context(|| format!("Failed to replace '{}'", path.display()))?;
+        }
+        std::fs::hard_link(&first, &path)
+            .with_context(|| format!("Failed to link '{}'", path.display()))?;
+    }
+
+    // Last, and innermost first, as a mode may forbid writing into a directory
+    for (path, ino) in dirs.iter().rev() {
+        set_mode(path, &fs.read_inode(*ino)?)?;
+    }
+
+    Ok(stats)
+}
+
+/// Give the host file at `path` the permission bits of `inode`
+fn set_mode(path: &Path, inode: &Inode) -> Result<()> {
+    use std::os::unix::fs::PermissionsExt;
+
+    std::fs::set_permissions(path, std::fs::Permissions::from_mode(inode.i_mode & 0o7777))
+        .with_context(|| format!("Failed to set the mode of '{}'", path.display()))
+}
+
+/// Extract a regular file to `dest`, through `buf`. Plain files are
+/// copied from the image by the kernel when it can; others are decrypted
+/// and decompressed as they are read. With `verify`, the data is hashed on
+/// its way out and the written file is read back and checked against it.
+fn extract_file(
+    fs: &LolelfFs,
+    inode_num: u32,
+    dest: &Path,
+    verify: bool,
+    buf: &mut [u8],
+) -> Result<()> {
+    let inode = fs.read_inode(inode_num)?;
+    let size = inode.i_size as u64;
+    // Replace rather than truncate: the file may be read-only, as extracted
+    // before, or a hard link to another file
+    if dest.symlink_metadata().is_ok() {
+        std::fs::remove_file(dest)
+            .with_context(|| format!("Failed to replace '{}'", dest.display()))?;
+    }
+    let file = std::fs::File::create(dest)
+        .with_context(|| format!("Failed to create '{}'", dest.display()))?;
+    let mut hasher = verify.then(Sha256::new);
+    let write_err = || format!("Failed to write '{}'", dest.display());
+
+    if let Some(ranges) = fs.file_ranges(inode_num)? {
+        let image = fs.image_file();
+        let mut pos = 0;
+        for (offset, image_offset, len) in ranges {
+            if let Some(hasher) = hasher.as_mut() {
+                hash_zeros(hasher, offset - pos);
+            }
+            copy_range(
+                image,
+                &file,
+                image_offset,
+                offset,
+                len,
+                buf,
+                hasher.as_mut(),
+            )
+            .with_context(write_err)?;
+            pos = offset + len as u64;
+        }
+        if let Some(hasher) = hasher.as_mut() {
+            hash_zeros(hasher, size - pos);
+        }
+    } else {
+        let mut reader = fs.open_reader(inode_num)?;
+        let mut offset = 0;
+        loop {
+            let n = reader.read(buf)?;
+            if n == 0 {
+                break;
+            }
+            if let Some(hasher) = hasher.as_mut() {
+                hasher.update(&buf[..n]);
+            }
+            file.write_all_at(&buf[..n], offset)
+                .with_context(write_err)?;
+            offset += n as u64;
+        }
+    }
+    file.set_len(size).with_context(write_err)?;
+    set_mode(dest, &inode)?;
+
+    if let Some(hasher) = hasher {
+        let expected = hasher.finalize();
+        let mut written = Sha256::new();
+        let mut file = std::fs::File::open(dest)
+            .with_context(|| format!("Failed to read back '{}'", dest.display()))?;
+        loop {
+            let n = file.read(buf)?;
+            if n == 0 {
+                break;
+            }
+            written.update(&buf[..n]);
+        }
+        if written.finalize() != expected {
+            bail!(
+                "'{}' does not match the image after extraction",
+                dest.display()
+            );
+        }
+    }
+    Ok(())
+}
+
+/// Feed `len` zero bytes, a hole of a file, to `hasher`
+fn hash_zeros(hasher: &mut Sha256, mut len: u64) {
+    let zeros = [0u8; LOLELFFS_BLOCK_SIZE as usize];
+    while len > 0 {
+        let n = len.min(zeros.len() as u64) as usize;
+        hasher.update(&zeros[..n]);
+        len -= n as u64;
+    }
+}
+
+/// Copy `len` bytes at `image_offset` of the image to `offset` of `out`.
+/// Without a hasher the kernel copies them with copy_file_range(2), which
+/// may share the blocks on filesystems with reflinks; through `buf`
+/// otherwise, or when the kernel cannot copy between the two files.
+fn copy_range(
+    image: &std::fs::File,
+    out: &std::fs::File,
+    mut image_offset: u64,
+    mut offset: u64,
+    mut len: usize,
+    buf: &mut [u8],
+    mut hasher: Option<&mut Sha256>,
+) -> io::Result<()> {
+    use std::os::unix::io::AsRawFd;
+
+    if hasher.is_none() {
+        while len > 0 {
+            let mut off_in = image_offset as libc::loff_t;
+            let mut off_out = offset as libc::loff_t;
+            // SAFETY: both descriptors stay open for the call, and the offsets
+            // are valid for writes
+            let n = unsafe {
+                libc::copy_file_range(
+                    image.as_raw_fd(),
+                    &mut off_in,
+                    out.as_raw_fd(),
+                    &mut off_out,
+                    len,
+                    0,
+                )
+            };
+            if n < 0 {
+                let err = io::Error::last_os_error();
+                match err.raw_os_error() {
+                    // Not between these two files: copy the rest by hand
+                    Some(libc::EXDEV | libc::ENOSYS | libc::EOPNOTSUPP | libc::EINVAL) => break,
+                    Some(libc::EINTR) => continue,
+                    _ => return Err(err),
+                }
+            }
+            if n == 0 {
+                return Err(io::ErrorKind::UnexpectedEof.into());
+            }
+            image_offset += n as u64;
+            offset += n as u64;
+            len -= n as usize;
+        }
+        if len == 0 {
+            return Ok(());
+        }
+    }
+
+    while len > 0 {
+        let n = len.min(buf.len());
+        image.read_exact_at(&mut buf[..n], image_offset)?;
+        if let Some(hasher) = hasher.as_mut() {
+            hasher.update(&buf[..n]);
+        }
+        out.write_all_at(&buf[..n], offset)?;
+        image_offset += n as u64;
+        offset += n as u64;
+        len -= n;
+    }
+    Ok(())
+}
+
+/// Read a trace file into inode numbers. Lines hold a path or an inode
+/// number; blank lines and lines starting with '#' are ignored.
+fn read_trace(fs: &LolelfFs, trace: &PathBuf) -> Result<Vec<u32>> {
+    let text = std::fs::read_to_string(trace)
+        .with_context(|| format!("Failed to read '{}'", trace.display()))?;
+    let mut inodes = Vec::new();
+
+    for (i, line) in text.lines().enumerate() {
+        let line = line.trim();
+        if line.is_empty() || line.starts_with('#') {
+            continue;
+        }
+        let inode_num = match line.parse::<u32>() {
+            Ok(inode_num) => inode_num,
+            Err(_) => match fs.resolve_path(line) {
+                Ok(inode_num) => inode_num,
+                Err(e) => {
+                    eprintln!("{}:{}: skipping '{}': {}", trace.display(), i + 1, line, e);
+                    continue;
+                }
+            },
+        };
+        inodes.push(inode_num);
+    }
+
+    Ok(inodes)
+}
+
+fn cmd_relayout(image: &PathBuf, trace: &PathBuf, hint: bool) -> Result<()> {
     let mut fs = LolelfFs::open(image)?;
+    let inodes = read_trace(&fs, trace)?;
+
+    let stats = fs.relayout(&inodes)?;
+    println!(
+        "Moved {} files ({} blocks), skipped {} entries",
+        stats.files, stats.blocks, stats.skipped
+    );
+    match stats.hot_start {
+        Some(start) => {
+            println!(
+                "Files laid out in blocks {}-{}",
+                start,
+                start + stats.blocks - 1
+            );
+            if hint {
+                fs.set_hot_range(start, stats.blocks)?;
+                println!(
+                    "Recorded blocks {}-{} for prefetching at mount",
+                    start,
+                    start + stats.blocks - 1
+                );
+            }
+        }
+        None if stats.files > 0 => {
+            eprintln!(
+                "Warning: no free run of {} blocks, files were placed separately",
+                stats.blocks
+            );
+            if hint {
+                fs.set_hot_range(0, 0)?;
+            }
+        }
+        None => {}
+    }
+
+    fs.flush()?;
+    Ok(())
+}
+
+fn cmd_defrag(image: &PathBuf, paths: &[String]) -> Result<()> {
+    let mut fs = LolelfFs::open(image)?;
+    let inodes = paths
+        .iter()
+        .map(|path| fs.resolve_path(path))
+        .collect::<Result<Vec<_>>>()?;
+
+    let stats = fs.defrag(&inodes)?;
+    println!(
+        "Defragmented {} files: {} extents -> {}, {} blocks moved",
+        stats.files, stats.extents_before, stats.extents_after, stats.blocks
+    );
+
+    fs.flush()?;
+    Ok(())
+}
+
+fn cmd_dedup(image: &PathBuf) -> Result<()> {
+    let mut fs = LolelfFs::open(image)?;
+    print_dedup_stats(&fs.dedup()?);
+
+    fs.flush()?;
+    Ok(())
+}
+
+fn print_dedup_stats(stats: &dedup::DedupStats) {
+    if stats.orphans > 0 {
+        println!("Freed {} unlinked files with shared extents", stats.orphans);
+    }
+    println!(
+        "Deduplicated {} files: {} changed, {} blocks freed, {} shared extents",
+        stats.files, stats.changed, stats.blocks, stats.shared
+    );
+}
+
+fn cmd_getfattr(image: &PathBuf, path: &str, name: &str, hex: bool) -> Result<()> {
+    let fs = LolelfFs::open(image)?;
     let inode_num = fs.resolve_path(path)?;
 
     let value = fs.get_xattr(inode_num, name)?;
@@ -1052,13 +1847,14 @@ fn cmd_setfattr(image: &PathBuf, path: &str, name: &str, value: &str) -> Result<
     let inode_num = fs.resolve_path(path)?;
 
     fs.set_xattr(inode_num, name, value.as_bytes())?;
+    fs.flush()?;
     println!("Set {} on {}", name, path);
 
     Ok(())
 }
 
 fn cmd_listxattr(image: &PathBuf, path: &str) -> Result<()> {
-    let mut fs = LolelfFs::open(image)?;
+    let fs = LolelfFs::open(image)?;
     let inode_num = fs.resolve_path(path)?;
 
     let xattrs = fs.list_xattrs(inode_num)?;
@@ -1081,6 +1877,7 @@ fn cmd_removexattr(image: &PathBuf, path: &str, name: &str) -> Result<()> {
     let inode_num = fs.resolve_path(path)?;
 
     fs.remove_xattr(inode_num, name)?;
+    fs.flush()?;
     println!("Removed {} from {}", name, path);
 
     Ok(())
@@ -1155,3 +1952,87 @@ fn format_timestamp(ts: u32) -> String {
         .map(|dt| dt.format("%Y-%m-%d %H:%M:%S").to_string())
         .unwrap_or_else(|| "???".to_string())
 }
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::os::unix::fs::MetadataExt;
+
+    /// A tree with a file with a hole, a compressed file, a hard link and a
+    /// symlink, extracted twice over by 4 threads with verification
+    #[test]
+    fn test_extract_tree_round_trip() {
+        let dir = std::env::temp_dir().join(format!("lolelffs-extract-{}", std::process::id()));
+        let _ = std::fs::remove_dir_all(&dir);
+        std::fs::create_dir_all(&dir).unwrap();
+        let path = dir.join("fs.img");
+        let dest = dir.join("out");
+        let block = LOLELFFS_BLOCK_SIZE as usize;
+
+        let mut fs = LolelfFs::create(&path, 16 * 1024 * 1024).unwrap();
+        let sub = fs.mkdir(LOLELFFS_ROOT_INO, "sub").unwrap();
+        let mut text = b"lolelffs extract round trip\n".repeat(block / 32);
+        text.resize(16 * block, 0);
+        let comp = fs.create_file(sub, "text").unwrap();
+        fs.write_file(comp, &text).unwrap();
+        let ei = fs.read_extent_index(&fs.read_inode(comp).unwrap()).unwrap();
+        assert!(ei.extents[0].is_compressed());
+        fs.link(comp, LOLELFFS_ROOT_INO, "text-link").unwrap();
+        fs.symlink(LOLELFFS_ROOT_INO, "text-sym", "sub/text")
+            .unwrap();
+
+        // Blocks 0 and 2 of "sparse", block 1 a hole; read-only, so that
+        // the second extraction has to replace it
+        fs.superblock.comp_enabled = 0;
+        let sparse = fs.create_file(LOLELFFS_ROOT_INO, "sparse").unwrap();
+        let mut data: Vec<u8> = (0..3 * block).map(|i| (i / block + 1) as u8).collect();
+        fs.write_file(sparse, &data).unwrap();
+        let mut inode = fs.read_inode(sparse).unwrap();
+        let mut ei = fs.read_extent_index(&inode).unwrap();
+        let start = ei.extents[0].ee_start;
+        ei.extents[0].ee_len = 1;
+        ei.extents[1] = Extent {
+            ee_block: 2,
+            ee_len: 1,
+            ee_start: start + 2,
+            ..Extent::default()
+        };
+        fs.write_extent_index(inode.ei_block, &ei).unwrap();
+        fs.free_blocks(start + 1, 1).unwrap();
+        inode.i_mode = mode::S_IFREG | 0o444;
+        inode.i_blocks -= 1;
+        fs.write_inode(sparse, &inode).unwrap();
+        data[block..2 * block].fill(0);
+        fs.flush().unwrap();
+        drop(fs);
+
+        let fs = LolelfFs::open_readonly(&path).unwrap();
+        let stats = extract_tree(&fs, LOLELFFS_ROOT_INO, &dest, 4, true).unwrap();
+        assert_eq!((stats.files, stats.dirs, stats.symlinks), (3, 1, 1));
+
+        // Over the first extraction, where "sub/text" is now a hard link to
+        // a host file that must be left alone
+        let keep = dir.join("keep");
+        std::fs::write(&keep, b"keep").unwrap();
+        std::fs::remove_file(dest.join("sub/text")).unwrap();
+        std::fs::hard_link(&keep, dest.join("sub/text")).unwrap();
+        extract_tree(&fs, LOLELFFS_ROOT_INO, &dest, 4, true).unwrap();
+        assert_eq!(std::fs::read(&keep).unwrap(), b"keep");
+
+        assert_eq!(std::fs::read(dest.join("sparse")).unwrap(), data);
+        assert_eq!(std::fs::read(dest.join("sub/text")).unwrap(), text);
+        let meta = std::fs::metadata(dest.join("sparse")).unwrap();
+        assert_eq!(meta.mode() & 0o7777, 0o444);
+        let link = std::fs::metadata(dest.join("text-link")).unwrap();
+        assert_eq!(
+            link.ino(),
+            std::fs::metadata(dest.join("sub/text")).unwrap().ino()
+        );
+        assert_eq!(
+            std::fs::read_link(dest.join("text-sym")).unwrap(),
+            Path::new("sub/text")
+        );
+
+        std::fs::remove_dir_all(&dir).unwrap();
+    }
+}
@@ -0,0 +1,70 @@
+//! Read-only memory mapping of filesystem images
+
+use std::fs::File;
+use std::io;
+use std::ops::Deref;
+use std::os::unix::io::AsRawFd;
+use std::ptr;
+use std::slice;
+
+/// Read-only shared mapping of a whole image file
+///
+/// The image must not be truncated while it is mapped; touching pages past
+/// the new end of the file raises SIGBUS.
+pub(crate) struct Mmap {
+    ptr: *mut libc::c_void,
+    len: usize,
+}
+
+// The mapping is never written through and lives until drop
+unsafe impl Send for Mmap {}
+unsafe impl Sync for Mmap {}
+
+impl Mmap {
+    /// Map `file` read-only
+    pub(crate) fn map(file: &File) -> io::Result<Self> {
+        let len = file.metadata()?.len() as usize;
+        if len == 0 {
+            return Err(io::Error::new(
+                io::ErrorKind::InvalidInput,
+                "cannot map an empty file",
+            ));
+        }
+
+        // SAFETY: a fresh read-only mapping of a valid descriptor; the result
+        // is checked before use.
+        let ptr = unsafe {
+            libc::mmap(
+                ptr::null_mut(),
+                len,
+                libc::PROT_READ,
+                libc::MAP_SHARED,
+                file.as_raw_fd(),
+                0,
+            )
+        };
+        if ptr == libc::MAP_FAILED {
+            return Err(io::Error::last_os_error());
+        }
+
+        Ok(Mmap { ptr, len })
+    }
+}
+
+impl Deref for Mmap {
+    type Target = [u8];
+
+    fn deref(&self) -> &[u8] {
+        // SAFETY: the mapping covers `len` readable bytes until drop
+        unsafe { slice::from_raw_parts(self.ptr as *const u8, self.len) }
+    }
+}
+
+impl Drop for Mmap {
+    fn drop(&mut self) {
+        // SAFETY: unmaps exactly the region returned by mmap
+        unsafe {
+            libc::munmap(self.ptr, self.len);
+        }
+    }
+}
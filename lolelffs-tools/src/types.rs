@@ -23,6 +23,11 @@ pub const LOLELFFS_MAX_EXTENTS: usize = 170;
 
 /// Feature flags for comp_features field
 pub const LOLELFFS_FEATURE_LARGE_EXTENTS: u32 = 0x0001;
+pub const LOLELFFS_FEATURE_DIR_INDEX: u32 = 0x0002; // Hashed directory index
+pub const LOLELFFS_FEATURE_EXTENT_TREE: u32 = 0x0004; // Multi-level file extent trees
+pub const LOLELFFS_FEATURE_INLINE_DATA: u32 = 0x0008; // Small files in the inode store
+pub const LOLELFFS_FEATURE_XATTR_INLINE: u32 = 0x0010; // Small xattr sets in their index block
+pub const LOLELFFS_FEATURE_SHARED_EXTENTS: u32 = 0x0020; // Extents sharing blocks, from dedup
 
 /// Maximum filename length
 pub const LOLELFFS_MAX_FILENAME: usize = 255;
@@ -36,6 +41,22 @@ pub const LOLELFFS_COMP_LZ4: u8 = 1; // LZ4 (fast, good ratio)
 pub const LOLELFFS_COMP_ZLIB: u8 = 2; // zlib/deflate (moderate speed, better ratio)
 pub const LOLELFFS_COMP_ZSTD: u8 = 3; // zstd (configurable, best ratio)
 
+/// Adaptive compression policy of the tools, the only writers of compressed
+/// extents (the kernel module writes new data uncompressed): data whose
+/// sampled byte entropy is above `LOLELFFS_COMP_ENTROPY_MAX` is stored
+/// without running the compressor, and after `LOLELFFS_COMP_MAX_FAILS`
+/// blocks in a row that did not compress, only one in
+/// `LOLELFFS_COMP_RETRY_INTERVAL` is tried
+pub const LOLELFFS_COMP_SAMPLE_SIZE: usize = 1024; // Bytes sampled per estimate
+pub const LOLELFFS_COMP_SAMPLE_RUN: usize = 16; // Contiguous bytes per sampled run
+pub const LOLELFFS_COMP_ENTROPY_MAX: u32 = 30; // Quarter bits per byte: 7.5 bits
+pub const LOLELFFS_COMP_MAX_FAILS: u32 = 8;
+pub const LOLELFFS_COMP_RETRY_INTERVAL: u32 = 64;
+
+/// User xattr overriding the compression algorithm of new data of a file:
+/// "none", "lz4", "zlib", "zstd", "hot" (fastest) or "cold" (best ratio)
+pub const LOLELFFS_COMP_HINT_XATTR: &str = "lolelffs.compress";
+
 /// Encryption algorithm IDs
 pub const LOLELFFS_ENC_NONE: u8 = 0; // No encryption
 pub const LOLELFFS_ENC_AES256_XTS: u8 = 1; // AES-256-XTS (block device encryption)
@@ -49,11 +70,19 @@ pub const LOLELFFS_KDF_PBKDF2: u8 = 2; // PBKDF2-HMAC-SHA256
 /// Compression metadata magic
 pub const LOLELFFS_COMP_META_MAGIC: u32 = 0xC04FFEE5;
 
+/// Compressed cluster geometry of packed extents (16 blocks = 64 KiB per cluster)
+pub const LOLELFFS_COMP_CLUSTER_SHIFT: u16 = 4;
+pub const LOLELFFS_COMP_CLUSTER_BLOCKS: u32 = 1 << LOLELFFS_COMP_CLUSTER_SHIFT;
+pub const LOLELFFS_COMP_CLUSTER_SIZE: u32 = LOLELFFS_COMP_CLUSTER_BLOCKS * LOLELFFS_BLOCK_SIZE;
+
 /// Extent flags
 pub const LOLELFFS_EXT_COMPRESSED: u16 = 0x0001; // Extent contains compressed blocks
 pub const LOLELFFS_EXT_ENCRYPTED: u16 = 0x0002; // Extent contains encrypted blocks
 pub const LOLELFFS_EXT_HAS_META: u16 = 0x0004; // Has per-block metadata
 pub const LOLELFFS_EXT_MIXED: u16 = 0x0008; // Mixed compressed/uncompressed/encrypted
+/// The physical blocks of the extent may be mapped by other extents too:
+/// they are copied before being written, and freed once no extent maps them
+pub const LOLELFFS_EXT_SHARED: u16 = 0x0010;
 
 /// Size of file entry structure
 pub const LOLELFFS_FILE_ENTRY_SIZE: usize = 259;
@@ -61,6 +90,46 @@ pub const LOLELFFS_FILE_ENTRY_SIZE: usize = 259;
 /// Number of file entries per block
 pub const LOLELFFS_FILES_PER_BLOCK: usize = 15;
 
+/// Hashed directory index magic
+pub const LOLELFFS_DX_MAGIC: u32 = 0xD12EC7ED;
+
+/// Directories are indexed once they outgrow one block of entries
+pub const LOLELFFS_DX_MIN_FILES: u32 = LOLELFFS_FILES_PER_BLOCK as u32;
+
+/// Leaves per index root, and records per index leaf
+pub const LOLELFFS_DX_ROOT_ENTRIES: usize = 510;
+pub const LOLELFFS_DX_LEAF_ENTRIES: usize = 511;
+
+/// Extent tree node magic, in place of nr_files in the root of a tree
+pub const LOLELFFS_EXT_TREE_MAGIC: u16 = 0xE7EE;
+
+/// Deepest extent tree root
+pub const LOLELFFS_EXT_TREE_MAX_DEPTH: u16 = 4;
+
+/// Extents per extent tree leaf, and children per interior node
+pub const LOLELFFS_EXT_TREE_LEAF_ENTRIES: usize = 170;
+pub const LOLELFFS_EXT_TREE_IDX_ENTRIES: usize = 511;
+
+/// Largest regular file stored in i_data itself
+pub const LOLELFFS_INLINE_DATA_SIZE: u32 = 28;
+
+/// Tail block magic
+pub const LOLELFFS_TAIL_MAGIC: u32 = 0x7A11B10C;
+
+/// Size of the tail block header
+pub const LOLELFFS_TAIL_HEADER_SIZE: u32 = 16;
+
+/// Largest regular file packed into a tail block
+pub const LOLELFFS_TAIL_MAX_SIZE: u32 = LOLELFFS_BLOCK_SIZE - LOLELFFS_TAIL_HEADER_SIZE;
+
+/// Offset of the entries of an xattr set stored in its index block, after
+/// the header and the first extent, left empty
+pub const LOLELFFS_XATTR_INLINE_OFFSET: usize = 8 + 24;
+
+/// Largest xattr set stored in its index block
+pub const LOLELFFS_XATTR_INLINE_SIZE: usize =
+    LOLELFFS_BLOCK_SIZE as usize - LOLELFFS_XATTR_INLINE_OFFSET;
+
 /// Bits per bitmap block
 pub const LOLELFFS_BITS_PER_BLOCK: u32 = LOLELFFS_BLOCK_SIZE * 8;
 
@@ -129,8 +198,12 @@ pub struct Superblock {
     pub enc_master_key: [u8; 32],
     /// Encryption feature flags
     pub enc_features: u32,
-    /// Reserved for future use
-    pub reserved: [u32; 3],
+    /// First block of the range read at startup, prefetched at mount
+    pub hot_start: u32,
+    /// Number of blocks in the startup range (0 = none)
+    pub hot_len: u32,
+    /// Last tail block, with room for small files (0 = none)
+    pub tail_block: u32,
 }
 
 impl Superblock {
@@ -188,7 +261,8 @@ pub struct Inode {
     pub ei_block: u32,
     /// Block number for xattr extent index (0 = no xattrs)
     pub xattr_block: u32,
-    /// Inline data (symlink target, max 27 chars + NUL)
+    /// Inline data (symlink target, max 27 chars + NUL, small file contents
+    /// or tail reference)
     pub i_data: [u8; 28],
 }
 
@@ -211,6 +285,30 @@ impl Inode {
         (self.i_mode & mode::S_IFMT) == mode::S_IFLNK
     }
 
+    /// Check if this inode is a regular file stored inline, in i_data or
+    /// in a tail block, rather than behind an extent index block
+    pub fn is_inline(&self) -> bool {
+        self.is_file() && self.ei_block == 0
+    }
+
+    /// Tail block reference of an inline file too large for i_data
+    pub fn tail_ref(&self) -> Option<TailRef> {
+        if !self.is_inline() || self.i_size <= LOLELFFS_INLINE_DATA_SIZE {
+            return None;
+        }
+        Some(TailRef {
+            tr_block: u32::from_le_bytes(self.i_data[0..4].try_into().unwrap()),
+            tr_offset: u32::from_le_bytes(self.i_data[4..8].try_into().unwrap()),
+        })
+    }
+
+    /// Point i_data at a tail block
+    pub fn set_tail_ref(&mut self, tail: TailRef) {
+        self.i_data = [0; 28];
+        self.i_data[0..4].copy_from_slice(&tail.tr_block.to_le_bytes());
+        self.i_data[4..8].copy_from_slice(&tail.tr_offset.to_le_bytes());
+    }
+
     /// Get the file type character for display
     pub fn type_char(&self) -> char {
         if self.is_dir() {
@@ -261,8 +359,55 @@ impl fmt::Display for Inode {
     }
 }
 
+/// Location of an inline file in a tail block
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct TailRef {
+    /// Tail block holding the file
+    pub tr_block: u32,
+    /// Byte offset of the file in the block
+    pub tr_offset: u32,
+}
+
+/// Header of a tail block, which packs the data of small files
+#[derive(Debug, Clone, Copy, Default, PartialEq, Eq)]
+pub struct TailHeader {
+    /// Magic number (0x7A11B10C)
+    pub th_magic: u32,
+    /// Number of files stored in the block
+    pub th_nr_tails: u32,
+    /// Bytes used from the start, header included
+    pub th_used: u32,
+}
+
+impl TailHeader {
+    /// Parse the header at the start of a tail block
+    pub fn from_bytes(data: &[u8]) -> Self {
+        let word = |i: usize| u32::from_le_bytes(data[i * 4..i * 4 + 4].try_into().unwrap());
+        TailHeader {
+            th_magic: word(0),
+            th_nr_tails: word(1),
+            th_used: word(2),
+        }
+    }
+
+    /// Serialize the header into the start of a tail block
+    pub fn write_to(&self, data: &mut [u8]) {
+        data[0..4].copy_from_slice(&self.th_magic.to_le_bytes());
+        data[4..8].copy_from_slice(&self.th_nr_tails.to_le_bytes());
+        data[8..12].copy_from_slice(&self.th_used.to_le_bytes());
+        data[12..16].fill(0);
+    }
+
+    /// Whether this is a valid tail block header
+    pub fn is_valid(&self) -> bool {
+        self.th_magic == LOLELFFS_TAIL_MAGIC
+            && self.th_used >= LOLELFFS_TAIL_HEADER_SIZE
+            && self.th_used <= LOLELFFS_BLOCK_SIZE
+    }
+}
+
 /// Extent structure with compression and encryption support (24 bytes)
-#[derive(Debug, Clone, Copy, Default)]
+#[derive(Debug, Clone, Copy, Default, PartialEq, Eq)]
 pub struct Extent {
     /// First logical block number (in file)
     pub ee_block: u32,
@@ -321,12 +466,17 @@ impl Extent {
     pub fn is_mixed(&self) -> bool {
         self.ee_flags & LOLELFFS_EXT_MIXED != 0
     }
+
+    /// Check if the blocks of the extent may be shared with other extents
+    pub fn is_shared(&self) -> bool {
+        self.ee_flags & LOLELFFS_EXT_SHARED != 0
+    }
 }
 
-/// Compression metadata for a single block (4 bytes)
+/// Compression metadata for a single cluster (4 bytes)
 #[derive(Debug, Clone, Copy, Default)]
 pub struct CompressionBlockMeta {
-    /// Compressed size (0 = uncompressed)
+    /// Compressed size in bytes (0 = stored uncompressed)
     pub comp_size: u16,
     /// Algorithm override (0 = use extent default)
     pub comp_algo: u8,
@@ -338,19 +488,27 @@ impl CompressionBlockMeta {
     /// Size of compression block metadata on disk
     pub const SIZE: usize = 4;
 
-    /// Maximum number of blocks that can fit in a metadata block
-    pub const MAX_BLOCKS: usize = 2040;
+    /// Maximum number of clusters that can fit in a metadata block
+    pub const MAX_CLUSTERS: usize = 1020;
 }
 
-/// Compression metadata block (4096 bytes, supports up to 2040 blocks)
+/// Compression metadata block of a packed extent (4096 bytes), found at ee_meta
+///
+/// The extent's logical blocks are compressed in clusters of
+/// `1 << cluster_shift` blocks, whose streams are stored back to back in the
+/// `nr_phys` blocks starting at ee_start.
 #[derive(Debug, Clone)]
 pub struct CompressionMetadata {
     /// Magic number (LOLELFFS_COMP_META_MAGIC)
     pub magic: u32,
-    /// Number of blocks with metadata
+    /// Number of logical blocks covered (ee_len)
     pub nr_blocks: u32,
-    /// Per-block metadata entries
-    pub blocks: Vec<CompressionBlockMeta>,
+    /// Number of physical data blocks at ee_start
+    pub nr_phys: u32,
+    /// log2 of logical blocks per cluster
+    pub cluster_shift: u16,
+    /// Per-cluster metadata entries
+    pub clusters: Vec<CompressionBlockMeta>,
 }
 
 impl CompressionMetadata {
@@ -371,17 +529,23 @@ impl CompressionMetadata {
         }
 
         let nr_blocks = cursor.read_u32::<LittleEndian>().ok()?;
-
-        if nr_blocks as usize > CompressionBlockMeta::MAX_BLOCKS {
+        let nr_phys = cursor.read_u32::<LittleEndian>().ok()?;
+        let cluster_shift = cursor.read_u16::<LittleEndian>().ok()?;
+        let nr_clusters = cursor.read_u16::<LittleEndian>().ok()?;
+
+        if cluster_shift > LOLELFFS_COMP_CLUSTER_SHIFT
+            || nr_clusters as usize > CompressionBlockMeta::MAX_CLUSTERS
+            || nr_clusters as u32 != nr_blocks.div_ceil(1 << cluster_shift)
+        {
             return None;
         }
 
-        let mut blocks = Vec::with_capacity(nr_blocks as usize);
-        for _ in 0..nr_blocks {
+        let mut clusters = Vec::with_capacity(nr_clusters as usize);
+        for _ in 0..nr_clusters {
             let comp_size = cursor.read_u16::<LittleEndian>().ok()?;
             let comp_algo = cursor.read_u8().ok()?;
             let flags = cursor.read_u8().ok()?;
-            blocks.push(CompressionBlockMeta {
+            clusters.push(CompressionBlockMeta {
                 comp_size,
                 comp_algo,
                 flags,
@@ -391,7 +555,9 @@ impl CompressionMetadata {
         Some(CompressionMetadata {
             magic,
             nr_blocks,
-            blocks,
+            nr_phys,
+            cluster_shift,
+            clusters,
         })
     }
 
@@ -402,17 +568,88 @@ impl CompressionMetadata {
         let mut data = Vec::with_capacity(LOLELFFS_BLOCK_SIZE as usize);
         data.write_u32::<LittleEndian>(self.magic).unwrap();
         data.write_u32::<LittleEndian>(self.nr_blocks).unwrap();
-
-        for block in &self.blocks {
-            data.write_u16::<LittleEndian>(block.comp_size).unwrap();
-            data.write_u8(block.comp_algo).unwrap();
-            data.write_u8(block.flags).unwrap();
+        data.write_u32::<LittleEndian>(self.nr_phys).unwrap();
+        data.write_u16::<LittleEndian>(self.cluster_shift).unwrap();
+        data.write_u16::<LittleEndian>(self.clusters.len() as u16)
+            .unwrap();
+
+        for cluster in &self.clusters {
+            data.write_u16::<LittleEndian>(cluster.comp_size).unwrap();
+            data.write_u8(cluster.comp_algo).unwrap();
+            data.write_u8(cluster.flags).unwrap();
         }
 
         // Pad to block size
         data.resize(LOLELFFS_BLOCK_SIZE as usize, 0);
         data
     }
+
+    /// Number of logical blocks in a cluster (the last one may be short)
+    pub fn cluster_blocks(&self, cluster: usize) -> u32 {
+        let per_cluster = 1u32 << self.cluster_shift;
+        per_cluster.min(self.nr_blocks - ((cluster as u32) << self.cluster_shift))
+    }
+
+    /// Number of bytes a cluster occupies in the packed data area
+    pub fn stored_size(&self, cluster: usize) -> usize {
+        match self.clusters[cluster].comp_size {
+            0 => (self.cluster_blocks(cluster) * LOLELFFS_BLOCK_SIZE) as usize,
+            size => size as usize,
+        }
+    }
+
+    /// Byte offset of a cluster in the packed data area
+    pub fn cluster_offset(&self, cluster: usize) -> usize {
+        (0..cluster).map(|i| self.stored_size(i)).sum()
+    }
+}
+
+/// Read `count` extents
+fn read_extents(cursor: &mut std::io::Cursor<&[u8]>, count: usize) -> Vec<Extent> {
+    use byteorder::{LittleEndian, ReadBytesExt};
+
+    let mut extents = Vec::with_capacity(count);
+    for _ in 0..count {
+        let ee_block = cursor.read_u32::<LittleEndian>().unwrap_or(0);
+        let ee_len = cursor.read_u32::<LittleEndian>().unwrap_or(0);
+        let ee_start = cursor.read_u32::<LittleEndian>().unwrap_or(0);
+        let ee_comp_algo = cursor.read_u16::<LittleEndian>().unwrap_or(0);
+        let ee_enc_algo = cursor.read_u8().unwrap_or(0);
+        let ee_reserved = cursor.read_u8().unwrap_or(0);
+        let ee_flags = cursor.read_u16::<LittleEndian>().unwrap_or(0);
+        let ee_reserved2 = cursor.read_u16::<LittleEndian>().unwrap_or(0);
+        let ee_meta = cursor.read_u32::<LittleEndian>().unwrap_or(0);
+        extents.push(Extent {
+            ee_block,
+            ee_len,
+            ee_start,
+            ee_comp_algo,
+            ee_enc_algo,
+            ee_reserved,
+            ee_flags,
+            ee_reserved2,
+            ee_meta,
+        });
+    }
+    extents
+}
+
+/// Write `count` extents, padding `extents` with empty ones
+fn write_extents(data: &mut Vec<u8>, extents: &[Extent], count: usize) {
+    use byteorder::{LittleEndian, WriteBytesExt};
+
+    for i in 0..count {
+        let extent = extents.get(i).copied().unwrap_or_default();
+        data.write_u32::<LittleEndian>(extent.ee_block).unwrap();
+        data.write_u32::<LittleEndian>(extent.ee_len).unwrap();
+        data.write_u32::<LittleEndian>(extent.ee_start).unwrap();
+        data.write_u16::<LittleEndian>(extent.ee_comp_algo).unwrap();
+        data.write_u8(extent.ee_enc_algo).unwrap();
+        data.write_u8(extent.ee_reserved).unwrap();
+        data.write_u16::<LittleEndian>(extent.ee_flags).unwrap();
+        data.write_u16::<LittleEndian>(extent.ee_reserved2).unwrap();
+        data.write_u32::<LittleEndian>(extent.ee_meta).unwrap();
+    }
 }
 
 /// Extent index block structure
@@ -422,6 +659,8 @@ pub struct ExtentIndex {
     pub nr_files: u32,
     /// Array of extents
     pub extents: Vec<Extent>,
+    /// Root block of the hashed directory index (0 = none)
+    pub dx_block: u32,
 }
 
 impl ExtentIndex {
@@ -433,31 +672,15 @@ impl ExtentIndex {
         let mut cursor = Cursor::new(data);
         let nr_files = cursor.read_u32::<LittleEndian>().unwrap_or(0);
 
-        let mut extents = Vec::with_capacity(LOLELFFS_MAX_EXTENTS);
-        for _ in 0..LOLELFFS_MAX_EXTENTS {
-            let ee_block = cursor.read_u32::<LittleEndian>().unwrap_or(0);
-            let ee_len = cursor.read_u32::<LittleEndian>().unwrap_or(0);
-            let ee_start = cursor.read_u32::<LittleEndian>().unwrap_or(0);
-            let ee_comp_algo = cursor.read_u16::<LittleEndian>().unwrap_or(0);
-            let ee_enc_algo = cursor.read_u8().unwrap_or(0);
-            let ee_reserved = cursor.read_u8().unwrap_or(0);
-            let ee_flags = cursor.read_u16::<LittleEndian>().unwrap_or(0);
-            let ee_reserved2 = cursor.read_u16::<LittleEndian>().unwrap_or(0);
-            let ee_meta = cursor.read_u32::<LittleEndian>().unwrap_or(0);
-            extents.push(Extent {
-                ee_block,
-                ee_len,
-                ee_start,
-                ee_comp_algo,
-                ee_enc_algo,
-                ee_reserved,
-                ee_flags,
-                ee_reserved2,
-                ee_meta,
-            });
-        }
+        let extents = read_extents(&mut cursor, LOLELFFS_MAX_EXTENTS);
+
+        let dx_block = cursor.read_u32::<LittleEndian>().unwrap_or(0);
 
-        ExtentIndex { nr_files, extents }
+        ExtentIndex {
+            nr_files,
+            extents,
+            dx_block,
+        }
     }
 
     /// Serialize extent index to bytes
@@ -467,18 +690,8 @@ impl ExtentIndex {
         let mut data = Vec::with_capacity(LOLELFFS_BLOCK_SIZE as usize);
         data.write_u32::<LittleEndian>(self.nr_files).unwrap();
 
-        for i in 0..LOLELFFS_MAX_EXTENTS {
-            let extent = self.extents.get(i).copied().unwrap_or_default();
-            data.write_u32::<LittleEndian>(extent.ee_block).unwrap();
-            data.write_u32::<LittleEndian>(extent.ee_len).unwrap();
-            data.write_u32::<LittleEndian>(extent.ee_start).unwrap();
-            data.write_u16::<LittleEndian>(extent.ee_comp_algo).unwrap();
-            data.write_u8(extent.ee_enc_algo).unwrap();
-            data.write_u8(extent.ee_reserved).unwrap();
-            data.write_u16::<LittleEndian>(extent.ee_flags).unwrap();
-            data.write_u16::<LittleEndian>(extent.ee_reserved2).unwrap();
-            data.write_u32::<LittleEndian>(extent.ee_meta).unwrap();
-        }
+        write_extents(&mut data, &self.extents, LOLELFFS_MAX_EXTENTS);
+        data.write_u32::<LittleEndian>(self.dx_block).unwrap();
 
         // Pad to block size
         data.resize(LOLELFFS_BLOCK_SIZE as usize, 0);
@@ -518,6 +731,116 @@ impl ExtentIndex {
     }
 }
 
+/// Child of an interior extent tree node: the first logical block it
+/// covers, and its block
+#[derive(Debug, Clone, Copy, Default, PartialEq, Eq)]
+pub struct ExtTreeIdx {
+    pub ei_block: u32,
+    pub ei_child: u32,
+}
+
+/// Node of the extent tree of a regular file, the root being its extent
+/// index block and holding no file count
+#[derive(Debug, Clone, Default)]
+pub struct ExtTreeNode {
+    /// Depth above the leaves (0 = leaf)
+    pub depth: u16,
+    /// Extents of a leaf, sorted by logical block
+    pub extents: Vec<Extent>,
+    /// Children of an interior node, sorted by logical block
+    pub idx: Vec<ExtTreeIdx>,
+}
+
+impl ExtTreeNode {
+    /// Whether a block of a regular file's extents is a tree node rather
+    /// than a plain extent index
+    pub fn is_tree(data: &[u8]) -> bool {
+        use byteorder::{ByteOrder, LittleEndian};
+
+        data.len() >= 2 && LittleEndian::read_u16(&data[0..2]) == LOLELFFS_EXT_TREE_MAGIC
+    }
+
+    /// Nodes below the root of the extent tree holding `count` extents in
+    /// full nodes, 0 when they fit in a plain extent index
+    pub fn tree_size(count: usize) -> u32 {
+        if count <= LOLELFFS_MAX_EXTENTS {
+            return 0;
+        }
+        let mut level = count.div_ceil(LOLELFFS_EXT_TREE_LEAF_ENTRIES);
+        let mut nodes = level;
+        while level > LOLELFFS_EXT_TREE_IDX_ENTRIES {
+            level = level.div_ceil(LOLELFFS_EXT_TREE_IDX_ENTRIES);
+            nodes += level;
+        }
+        nodes as u32
+    }
+
+    /// Read a tree node, or None if the block is not a valid one
+    pub fn from_bytes(data: &[u8]) -> Option<Self> {
+        use byteorder::{ByteOrder, LittleEndian};
+        use std::io::Cursor;
+
+        if data.len() < LOLELFFS_BLOCK_SIZE as usize || !Self::is_tree(data) {
+            return None;
+        }
+        let depth = LittleEndian::read_u16(&data[2..4]);
+        let entries = LittleEndian::read_u32(&data[4..8]) as usize;
+        if depth > LOLELFFS_EXT_TREE_MAX_DEPTH {
+            return None;
+        }
+
+        let mut node = ExtTreeNode {
+            depth,
+            ..Default::default()
+        };
+        if depth == 0 {
+            if entries > LOLELFFS_EXT_TREE_LEAF_ENTRIES {
+                return None;
+            }
+            let mut cursor = Cursor::new(&data[8..]);
+            node.extents = read_extents(&mut cursor, entries);
+        } else {
+            if entries > LOLELFFS_EXT_TREE_IDX_ENTRIES {
+                return None;
+            }
+            node.idx = read_dx_entries(data, 8, entries)
+                .into_iter()
+                .map(|e| ExtTreeIdx {
+                    ei_block: e.hash,
+                    ei_child: e.value,
+                })
+                .collect();
+        }
+        Some(node)
+    }
+
+    /// Serialize tree node to bytes
+    pub fn to_bytes(&self) -> Vec<u8> {
+        use byteorder::{LittleEndian, WriteBytesExt};
+
+        let entries = if self.depth == 0 {
+            self.extents.len()
+        } else {
+            self.idx.len()
+        };
+        let mut data = Vec::with_capacity(LOLELFFS_BLOCK_SIZE as usize);
+        data.write_u16::<LittleEndian>(LOLELFFS_EXT_TREE_MAGIC)
+            .unwrap();
+        data.write_u16::<LittleEndian>(self.depth).unwrap();
+        data.write_u32::<LittleEndian>(entries as u32).unwrap();
+        if self.depth == 0 {
+            write_extents(&mut data, &self.extents, self.extents.len());
+        } else {
+            for idx in &self.idx {
+                data.write_u32::<LittleEndian>(idx.ei_block).unwrap();
+                data.write_u32::<LittleEndian>(idx.ei_child).unwrap();
+            }
+        }
+        data.resize(LOLELFFS_BLOCK_SIZE as usize, 0);
+        data
+    }
+}
+
 /// Directory file entry (259 bytes)
 #[derive(Debug, Clone)]
 pub struct FileEntry {
@@ -577,6 +900,139 @@ impl FileEntry {
     }
 }
 
+/// 32-bit FNV-1a hash of a file name, stopping at its NUL
+pub fn dx_hash(name: &[u8]) -> u32 {
+    let mut hash: u32 = 2166136261;
+    for &b in name.iter().take(LOLELFFS_MAX_FILENAME) {
+        if b == 0 {
+            break;
+        }
+        hash ^= b as u32;
+        hash = hash.wrapping_mul(16777619);
+    }
+    hash
+}
+
+/// Record of the hashed directory index: the lowest hash and block of a leaf
+/// in the root, or the hash and slot of a directory entry in a leaf
+#[derive(Debug, Clone, Copy, Default, PartialEq, Eq)]
+pub struct DxEntry {
+    pub hash: u32,
+    pub value: u32,
+}
+
+fn read_dx_entries(data: &[u8], offset: usize, count: usize) -> Vec<DxEntry> {
+    use byteorder::{ByteOrder, LittleEndian};
+
+    (0..count)
+        .map(|i| {
+            let at = offset + i * 8;
+            DxEntry {
+                hash: LittleEndian::read_u32(&data[at..at + 4]),
+                value: LittleEndian::read_u32(&data[at + 4..at + 8]),
+            }
+        })
+        .collect()
+}
+
+fn write_dx_entries(data: &mut Vec<u8>, entries: &[DxEntry]) {
+    use byteorder::{LittleEndian, WriteBytesExt};
+
+    for entry in entries {
+        data.write_u32::<LittleEndian>(entry.hash).unwrap();
+        data.write_u32::<LittleEndian>(entry.value).unwrap();
+    }
+}
+
+/// Root block of a hashed directory index, with its leaves sorted by hash
+#[derive(Debug, Clone)]
+pub struct DxRoot {
+    /// Records in all leaves, equal to nr_files of an up to date index
+    pub nr_records: u32,
+    /// Leaves, the first one starting at hash 0
+    pub entries: Vec<DxEntry>,
+}
+
+impl DxRoot {
+    /// Read an index root, or None if the block is not one
+    pub fn from_bytes(data: &[u8]) -> Option<Self> {
+        use byteorder::{ByteOrder, LittleEndian};
+
+        if data.len() < LOLELFFS_BLOCK_SIZE as usize
+            || LittleEndian::read_u32(&data[0..4]) != LOLELFFS_DX_MAGIC
+        {
+            return None;
+        }
+        let nr_entries = LittleEndian::read_u32(&data[4..8]) as usize;
+        if nr_entries == 0 || nr_entries > LOLELFFS_DX_ROOT_ENTRIES {
+            return None;
+        }
+
+        Some(DxRoot {
+            nr_records: LittleEndian::read_u32(&data[8..12]),
+            entries: read_dx_entries(data, 16, nr_entries),
+        })
+    }
+
+    /// Serialize index root to bytes
+    pub fn to_bytes(&self) -> Vec<u8> {
+        use byteorder::{LittleEndian, WriteBytesExt};
+
+        let mut data = Vec::with_capacity(LOLELFFS_BLOCK_SIZE as usize);
+        data.write_u32::<LittleEndian>(LOLELFFS_DX_MAGIC).unwrap();
+        data.write_u32::<LittleEndian>(self.entries.len() as u32)
+            .unwrap();
+        data.write_u32::<LittleEndian>(self.nr_records).unwrap();
+        data.write_u32::<LittleEndian>(0).unwrap();
+        write_dx_entries(&mut data, &self.entries);
+        data.resize(LOLELFFS_BLOCK_SIZE as usize, 0);
+        data
+    }
+
+    /// Position of the leaf covering hash
+    pub fn find_leaf(&self, hash: u32) -> usize {
+        self.entries[1..].partition_point(|e| e.hash <= hash)
+    }
+}
+
+/// Leaf block of a hashed directory index, records in no particular order
+#[derive(Debug, Clone, Default)]
+pub struct DxLeaf {
+    pub entries: Vec<DxEntry>,
+}
+
+impl DxLeaf {
+    /// Read an index leaf, or None if its record count is invalid
+    pub fn from_bytes(data: &[u8]) -> Option<Self> {
+        use byteorder::{ByteOrder, LittleEndian};
+
+        if data.len() < LOLELFFS_BLOCK_SIZE as usize {
+            return None;
+        }
+        let nr_entries = LittleEndian::read_u32(&data[0..4]) as usize;
+        if nr_entries > LOLELFFS_DX_LEAF_ENTRIES {
+            return None;
+        }
+
+        Some(DxLeaf {
+            entries: read_dx_entries(data, 8, nr_entries),
+        })
+    }
+
+    /// Serialize index leaf to bytes
+    pub fn to_bytes(&self) -> Vec<u8> {
+        use byteorder::{LittleEndian, WriteBytesExt};
+
+        let mut data = Vec::with_capacity(LOLELFFS_BLOCK_SIZE as usize);
+        data.write_u32::<LittleEndian>(self.entries.len() as u32)
+            .unwrap();
+        data.write_u32::<LittleEndian>(0).unwrap();
+        write_dx_entries(&mut data, &self.entries);
+        data.resize(LOLELFFS_BLOCK_SIZE as usize, 0);
+        data
+    }
+}
+
 /// Extended attribute namespace
 #[derive(Debug, Clone, Copy, PartialEq, Eq)]
 pub enum XattrNamespace {
@@ -645,6 +1101,8 @@ pub struct XattrIndex {
     pub count: u32,
     /// Array of extents
     pub extents: Vec<Extent>,
+    /// Entries stored in the index block itself, with no extent
+    pub inline: Vec<u8>,
 }
 
 impl XattrIndex {
@@ -681,10 +1139,21 @@ impl XattrIndex {
             });
         }
 
+        let inline_len = total_size as usize;
+        let inline = if extents[0].ee_start == 0
+            && inline_len > 0
+            && inline_len <= LOLELFFS_XATTR_INLINE_SIZE
+        {
+            data[LOLELFFS_XATTR_INLINE_OFFSET..LOLELFFS_XATTR_INLINE_OFFSET + inline_len].to_vec()
+        } else {
+            Vec::new()
+        };
+
         XattrIndex {
             total_size,
             count,
             extents,
+            inline,
         }
     }
 
@@ -711,6 +1180,46 @@ impl XattrIndex {
 
         // Pad to block size
         data.resize(LOLELFFS_BLOCK_SIZE as usize, 0);
+        if !self.inline.is_empty() {
+            data[LOLELFFS_XATTR_INLINE_OFFSET..LOLELFFS_XATTR_INLINE_OFFSET + self.inline.len()]
+                .copy_from_slice(&self.inline);
+        }
         data
     }
 }
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_dx_hash_matches_kernel() {
+        assert_eq!(dx_hash(b""), 0x811c9dc5);
+        assert_eq!(dx_hash(b"a"), 0xe40c292c);
+        assert_eq!(dx_hash(b"foobar"), 0xbf9cf968);
+        assert_eq!(dx_hash(b"ab\0cd"), dx_hash(b"ab"));
+    }
+
+    #[test]
+    fn test_dx_root_roundtrip() {
+        let root = DxRoot {
+            nr_records: 3,
+            entries: vec![
+                DxEntry { hash: 0, value: 10 },
+                DxEntry {
+                    hash: 0x8000_0000,
+                    value: 11,
+                },
+            ],
+        };
+        let data = root.to_bytes();
+        assert_eq!(data.len(), LOLELFFS_BLOCK_SIZE as usize);
+
+        let back = DxRoot::from_bytes(&data).unwrap();
+        assert_eq!(back.nr_records, 3);
+        assert_eq!(back.entries, root.entries);
+        assert_eq!(back.find_leaf(0x7fff_ffff), 0);
+        assert_eq!(back.find_leaf(0x8000_0000), 1);
+        assert!(DxRoot::from_bytes(&vec![0u8; LOLELFFS_BLOCK_SIZE as usize]).is_none());
+    }
+}
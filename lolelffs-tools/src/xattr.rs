@@ -23,105 +23,21 @@ pub fn parse_xattr_name(name: &str) -> Result<(XattrNamespace, String)> {
 }
 
 /// Read xattr extent index block
-pub fn read_xattr_index(fs: &mut LolelfFs, block_num: u32) -> Result<XattrIndex> {
-    let block = fs.read_block(block_num)?;
-
-    let total_size = u32::from_le_bytes([block[0], block[1], block[2], block[3]]);
-    let count = u32::from_le_bytes([block[4], block[5], block[6], block[7]]);
-
-    let mut extents = Vec::new();
-    let mut offset = 8;
-
-    for _ in 0..LOLELFFS_MAX_EXTENTS {
-        if offset + 20 > block.len() {
-            break;
-        }
-
-        let ee_block = u32::from_le_bytes([
-            block[offset],
-            block[offset + 1],
-            block[offset + 2],
-            block[offset + 3],
-        ]);
-        let ee_len = u32::from_le_bytes([
-            block[offset + 4],
-            block[offset + 5],
-            block[offset + 6],
-            block[offset + 7],
-        ]);
-        let ee_start = u32::from_le_bytes([
-            block[offset + 8],
-            block[offset + 9],
-            block[offset + 10],
-            block[offset + 11],
-        ]);
-        let ee_comp_algo = u16::from_le_bytes([block[offset + 12], block[offset + 13]]);
-        let ee_enc_algo = block[offset + 14];
-        let ee_reserved = block[offset + 15];
-        let ee_flags = u16::from_le_bytes([block[offset + 16], block[offset + 17]]);
-        let ee_reserved2 = u16::from_le_bytes([block[offset + 18], block[offset + 19]]);
-        let ee_meta = u32::from_le_bytes([
-            block[offset + 20],
-            block[offset + 21],
-            block[offset + 22],
-            block[offset + 23],
-        ]);
-
-        extents.push(Extent {
-            ee_block,
-            ee_len,
-            ee_start,
-            ee_comp_algo,
-            ee_enc_algo,
-            ee_reserved,
-            ee_flags,
-            ee_reserved2,
-            ee_meta,
-        });
-
-        offset += 24;
-    }
-
-    Ok(XattrIndex {
-        total_size,
-        count,
-        extents,
-    })
+pub fn read_xattr_index(fs: &LolelfFs, block_num: u32) -> Result<XattrIndex> {
+    fs.with_block(block_num, XattrIndex::from_bytes)
 }
 
 /// Write xattr extent index block
 pub fn write_xattr_index(fs: &mut LolelfFs, block_num: u32, index: &XattrIndex) -> Result<()> {
-    let mut block = vec![0u8; LOLELFFS_BLOCK_SIZE as usize];
-
-    // Write total_size and count
-    block[0..4].copy_from_slice(&index.total_size.to_le_bytes());
-    block[4..8].copy_from_slice(&index.count.to_le_bytes());
-
-    // Write extents
-    let mut offset = 8;
-    for extent in &index.extents {
-        if offset + 24 > block.len() {
-            break;
-        }
+    fs.write_block(block_num, &index.to_bytes())
+}
 
-        block[offset..offset + 4].copy_from_slice(&extent.ee_block.to_le_bytes());
-        block[offset + 4..offset + 8].copy_from_slice(&extent.ee_len.to_le_bytes());
-        block[offset + 8..offset + 12].copy_from_slice(&extent.ee_start.to_le_bytes());
-        block[offset + 12..offset + 14].copy_from_slice(&extent.ee_comp_algo.to_le_bytes());
-        block[offset + 14] = extent.ee_enc_algo;
-        block[offset + 15] = extent.ee_reserved;
-        block[offset + 16..offset + 18].copy_from_slice(&extent.ee_flags.to_le_bytes());
-        block[offset + 18..offset + 20].copy_from_slice(&extent.ee_reserved2.to_le_bytes());
-        block[offset + 20..offset + 24].copy_from_slice(&extent.ee_meta.to_le_bytes());
-
-        offset += 24;
+/// Read all xattr data, from the index block or its extents
+pub fn read_xattr_data(fs: &LolelfFs, index: &XattrIndex) -> Result<Vec<u8>> {
+    if !index.inline.is_empty() {
+        return Ok(index.inline.clone());
     }
 
-    fs.write_block(block_num, &block)
-}
-
-/// Read all xattr data from extents
-pub fn read_xattr_data(fs: &mut LolelfFs, index: &XattrIndex) -> Result<Vec<u8>> {
     let mut data = Vec::with_capacity(index.total_size as usize);
 
     for extent in &index.extents {
@@ -208,8 +124,9 @@ pub fn parse_xattr_entries(data: &[u8]) -> Result<Vec<XattrEntry>> {
         });
 
         // Advance offset past the value to get to the next entry
-        // Value is stored inline right after name+NUL
+        // Value is stored inline right after name+NUL, entries are 4-byte aligned
         offset += value_len as usize;
+        offset = (offset + 3) & !3;
     }
 
     Ok(entries)
@@ -244,8 +161,9 @@ pub fn serialize_xattr_entries(entries: &[XattrEntry]) -> Result<Vec<u8>> {
         data.extend_from_slice(entry.name.as_bytes());
         data.push(0); // NUL terminator
 
-        // Write value
+        // Write value, padded to the 4-byte alignment of entries
         data.extend_from_slice(&entry.value);
+        data.resize((data.len() + 3) & !3, 0);
     }
 
     Ok(data)
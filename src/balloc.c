@@ -0,0 +1,529 @@
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/bitmap.h>
+#include <linux/buffer_head.h>
+#include <linux/cpumask.h>
+#include <linux/fs.h>
+#include <linux/kernel.h>
+#include <linux/percpu.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+
+#include "lolelffs.h"
+#include "trace.h"
+
+/*
+ * Block allocator.
+ *
+ * The free blocks bitmap is split in groups of the blocks covered by one
+ * bitmap block. Each group keeps its number of free blocks and an upper
+ * bound of the longest run of free blocks starting in it, which becomes
+ * exact every time the group is scanned without success. A search for len
+ * blocks skips the groups that cannot hold them, instead of walking the
+ * bitmap bit by bit.
+ *
+ * Allocations start from a goal block, usually right after the last extent
+ * of the file, so that growing files stay contiguous. Small allocations
+ * without a goal (inode extent blocks, directory and xattr blocks) are
+ * carved from a per-CPU window of blocks taken from the bitmap in advance,
+ * without sbi->lock. Blocks left in a window still count as free, see
+ * lolelffs_nr_free_blocks(), and are written as free by sync_fs.
+ *
+ * Bitmap blocks are read on demand, the first time the allocator looks
+ * into their group, so that mounting does not read the whole bitmap and a
+ * read-only mount reads none of it. Until then, a group is assumed to be
+ * entirely free, which keeps its summary an upper bound, and its bits read
+ * as used.
+ */
+
+#define LOLELFFS_BLOCKS_PER_GROUP (LOLELFFS_BLOCK_SIZE * 8)
+#define LOLELFFS_ALLOC_WINDOW 64        /* Blocks taken by a window refill */
+#define LOLELFFS_ALLOC_WINDOW_MAX_LEN 8 /* Largest request served by windows */
+
+struct lolelffs_group_info {
+    uint32_t nr_free; /* Free blocks in the group */
+    uint32_t max_run; /* Upper bound of the longest free run starting here */
+    bool loaded;      /* The bitmap block of the group was read */
+};
+
+struct lolelffs_alloc_window {
+    spinlock_t lock;
+    uint32_t start; /* First free block of the window */
+    uint32_t end;   /* First block past the window */
+};
+
+static inline uint32_t group_first(uint32_t group)
+{
+    return group * LOLELFFS_BLOCKS_PER_GROUP;
+}
+
+static inline uint32_t group_end(struct lolelffs_sb_info *sbi, uint32_t group)
+{
+    return min_t(uint32_t, group_first(group + 1), sbi->nr_blocks);
+}
+
+/*
+ * Return the first block of a run of at least len free blocks starting in
+ * [from, to). Return 0 if there is none, and store in max_run, if not NULL,
+ * the length of the longest run seen.
+ */
+static uint32_t lolelffs_find_run(struct lolelffs_sb_info *sbi,
+                                  uint32_t from,
+                                  uint32_t to,
+                                  uint32_t len,
+                                  uint32_t *max_run)
+{
+    unsigned long *map = sbi->bfree_bitmap;
+    uint32_t start, end, best = 0;
+
+    start = find_next_bit(map, to, from);
+    while (start < to) {
+        /* A run may go on past to, up to the end of the bitmap */
+        end = find_next_zero_bit(map, sbi->nr_blocks, start);
+        if (end - start >= len)
+            return start;
+        best = max(best, end - start);
+        if (end >= to)
+            break;
+        start = find_next_bit(map, to, end);
+    }
+
+    if (max_run)
+        *max_run = best;
+    return 0;
+}
+
+/* Compute the summary of a group from the bitmap */
+static void lolelffs_scan_group(struct lolelffs_sb_info *sbi, uint32_t group)
+{
+    unsigned long *map = sbi->bfree_bitmap;
+    struct lolelffs_group_info *gi = &sbi->groups[group];
+    uint32_t start, end, gend = group_end(sbi, group);
+
+    gi->nr_free = 0;
+    gi->max_run = 0;
+    start = find_next_bit(map, gend, group_first(group));
+    while (start < gend) {
+        end = find_next_zero_bit(map, sbi->nr_blocks, start);
+        gi->nr_free += min(end, gend) - start;
+        gi->max_run = max(gi->max_run, end - start);
+        if (end >= gend)
+            break;
+        start = find_next_bit(map, gend, end);
+    }
+}
+
+/*
+ * Read the bitmap block of a group the first time it is used. The caller
+ * holds sbi->lock. A group whose block cannot be read is then skipped by
+ * searches.
+ */
+static int lolelffs_load_group(struct lolelffs_sb_info *sbi, uint32_t group)
+{
+    struct lolelffs_group_info *gi = &sbi->groups[group];
+    struct buffer_head *bh;
+
+    if (gi->loaded)
+        return 0;
+
+    bh = LOLELFFS_SB_BREAD(sbi->sb, 1 + sbi->nr_istore_blocks +
+                                        sbi->nr_ifree_blocks + group);
+    if (!bh) {
+        pr_err("failed to read the bitmap of block group %u\n", group);
+        gi->nr_free = 0;
+        gi->max_run = 0;
+        return -EIO;
+    }
+    memcpy((void *) sbi->bfree_bitmap + group * LOLELFFS_BLOCK_SIZE,
+           bh->b_data, LOLELFFS_BLOCK_SIZE);
+    brelse(bh);
+
+    gi->loaded = true;
+    lolelffs_scan_group(sbi, group);
+    /* Runs at the end of the previous group may go on in this one */
+    if (group && sbi->groups[group - 1].loaded)
+        lolelffs_scan_group(sbi, group - 1);
+
+    return 0;
+}
+
+/* Read the bitmap blocks of the groups of [bno, bno + len) */
+static int lolelffs_load_range(struct lolelffs_sb_info *sbi,
+                               uint32_t bno,
+                               uint32_t len)
+{
+    uint32_t group;
+    int ret;
+
+    for (group = bno / LOLELFFS_BLOCKS_PER_GROUP;
+         group <= (bno + len - 1) / LOLELFFS_BLOCKS_PER_GROUP; group++) {
+        ret = lolelffs_load_group(sbi, group);
+        if (ret)
+            return ret;
+    }
+    return 0;
+}
+
+/*
+ * Find len free blocks, as close as possible after goal. Return the first
+ * block, or 0 if there is no such run, and count the groups scanned in
+ * groups. The caller holds sbi->lock and marks the blocks used.
+ */
+static uint32_t __lolelffs_search(struct lolelffs_sb_info *sbi,
+                                  uint32_t goal,
+                                  uint32_t len,
+                                  uint32_t *groups)
+{
+    struct lolelffs_group_info *gi;
+    uint32_t i, j, group, first, end, run, bno;
+
+    if (goal >= sbi->nr_blocks)
+        goal = 0;
+
+    /* Best case: the blocks right at goal are free */
+    if (goal && goal + len <= sbi->nr_blocks &&
+        !lolelffs_load_range(sbi, goal, len) &&
+        find_next_zero_bit(sbi->bfree_bitmap, goal + len, goal) >= goal + len)
+        return goal;
+
+    if (len <= LOLELFFS_BLOCKS_PER_GROUP) {
+        for (i = 0; i < sbi->nr_groups; i++) {
+            group = (goal / LOLELFFS_BLOCKS_PER_GROUP + i) % sbi->nr_groups;
+            gi = &sbi->groups[group];
+            if (gi->nr_free < len || gi->max_run < len)
+                continue;
+            if (!gi->loaded && (lolelffs_load_group(sbi, group) ||
+                                gi->nr_free < len || gi->max_run < len))
+                continue;
+
+            first = group_first(group);
+            end = group_end(sbi, group);
+            (*groups)++;
+            if (i == 0 && goal > first) {
+                bno = lolelffs_find_run(sbi, goal, end, len, NULL);
+                if (bno)
+                    return bno;
+            }
+            bno = lolelffs_find_run(sbi, first, end, len, &run);
+            if (bno)
+                return bno;
+
+            /* Scanned in full, the bound is now exact */
+            gi->max_run = run;
+        }
+    }
+
+    /*
+     * No group holds the run on its own. It can still span consecutive
+     * groups, as long as there are enough free blocks in them.
+     */
+    for (group = 0; group < sbi->nr_groups; group++) {
+        uint32_t nr_free = 0;
+
+        for (i = group; i < sbi->nr_groups && nr_free < len; i++)
+            nr_free += sbi->groups[i].nr_free;
+        if (nr_free < len)
+            break;
+        if (!sbi->groups[group].nr_free)
+            continue;
+        /* Bits of the groups that cannot be read stay used */
+        for (j = group; j < i; j++)
+            lolelffs_load_group(sbi, j);
+        *groups += i - group;
+
+        /* Runs starting in the group, ending in the following ones */
+        bno = lolelffs_find_run(sbi, group_first(group), group_end(sbi, group),
+                                len, NULL);
+        if (bno)
+            return bno;
+    }
+
+    return 0;
+}
+
+/* __lolelffs_search(), accounted in the statistics of the mount */
+static uint32_t lolelffs_search(struct lolelffs_sb_info *sbi,
+                                uint32_t goal,
+                                uint32_t len)
+{
+    u64 start = lolelffs_trace_start(lolelffs_new_blocks);
+    uint32_t groups = 0, bno;
+
+    bno = __lolelffs_search(sbi, goal, len, &groups);
+    lolelffs_stat_add(sbi, LOLELFFS_STAT_ALLOC_SEARCHES, 1);
+    lolelffs_stat_add(sbi, LOLELFFS_STAT_ALLOC_GROUPS, groups);
+    if (start)
+        trace_lolelffs_new_blocks(sbi->sb, goal, len, bno, groups,
+                                  ktime_get_ns() - start);
+    return bno;
+}
+
+/* Mark [bno, bno + len) used in the bitmap and the group summaries */
+static void lolelffs_take(struct lolelffs_sb_info *sbi,
+                          uint32_t bno,
+                          uint32_t len)
+{
+    uint32_t end = bno + len, group, n;
+
+    bitmap_clear(sbi->bfree_bitmap, bno, len);
+    sbi->nr_free_blocks -= len;
+    lolelffs_mark_bitmap_dirty(sbi, true, bno, len);
+
+    for (group = bno / LOLELFFS_BLOCKS_PER_GROUP; bno < end; group++) {
+        n = min(end, group_end(sbi, group)) - bno;
+        sbi->groups[group].nr_free -= n;
+        bno += n;
+    }
+}
+
+/*
+ * Mark [bno, bno + len) free in the bitmap and the group summaries. The
+ * longest run of a group can only grow by merging with the runs on both
+ * sides of the freed blocks, which may start in the groups before: the
+ * bound of every group the merged run covers is raised.
+ */
+static void lolelffs_release(struct lolelffs_sb_info *sbi,
+                             uint32_t bno,
+                             uint32_t len)
+{
+    unsigned long *map = sbi->bfree_bitmap;
+    uint32_t end = bno + len, group, first, start, n, left, run_end;
+
+    if (lolelffs_load_range(sbi, bno, len)) {
+        pr_err("lost %u blocks from %u\n", len, bno);
+        return;
+    }
+
+    bitmap_set(map, bno, len);
+    sbi->nr_free_blocks += len;
+    lolelffs_mark_bitmap_dirty(sbi, true, bno, len);
+
+    for (group = bno / LOLELFFS_BLOCKS_PER_GROUP, start = bno; start < end;
+         group++) {
+        n = min(end, group_end(sbi, group)) - start;
+        sbi->groups[group].nr_free += n;
+        start += n;
+    }
+
+    /*
+     * Find where the run on the left starts, group by group: its part in a
+     * group is no longer than the previous bound of the group
+     */
+    start = bno;
+    for (group = bno / LOLELFFS_BLOCKS_PER_GROUP;; group--) {
+        first = group_first(group);
+        for (left = 0; left < sbi->groups[group].max_run && start > first &&
+                       test_bit(start - 1, map);
+             left++)
+            start--;
+        if (start > first || !group || !test_bit(start - 1, map))
+            break;
+    }
+    run_end = find_next_zero_bit(map, sbi->nr_blocks, end);
+
+    for (group = start / LOLELFFS_BLOCKS_PER_GROUP; group_first(group) < end;
+         group++) {
+        n = run_end - max(start, group_first(group));
+        sbi->groups[group].max_run = max(sbi->groups[group].max_run, n);
+    }
+}
+
+/*
+ * Move the free blocks of all windows back to the bitmap. The caller holds
+ * sbi->lock.
+ */
+static void lolelffs_drain_windows(struct lolelffs_sb_info *sbi)
+{
+    struct lolelffs_alloc_window *w;
+    uint32_t start, end;
+    int cpu;
+
+    for_each_possible_cpu (cpu) {
+        w = per_cpu_ptr(sbi->windows, cpu);
+        spin_lock(&w->lock);
+        start = w->start;
+        end = w->end;
+        w->start = w->end = 0;
+        spin_unlock(&w->lock);
+
+        if (end > start) {
+            atomic_sub(end - start, &sbi->nr_window_blocks);
+            lolelffs_release(sbi, start, end - start);
+        }
+    }
+}
+
+/*
+ * Carve len blocks from the window of the current CPU, refilling it from
+ * the bitmap when it is too small. Return 0 if no window could be filled.
+ */
+static uint32_t lolelffs_window_alloc(struct lolelffs_sb_info *sbi,
+                                      uint32_t len)
+{
+    struct lolelffs_alloc_window *w = raw_cpu_ptr(sbi->windows);
+    uint32_t bno = 0, old_start, old_end;
+
+    spin_lock(&w->lock);
+    if (w->end - w->start >= len) {
+        bno = w->start;
+        w->start += len;
+    }
+    old_end = w->end;
+    spin_unlock(&w->lock);
+    if (bno) {
+        /* The blocks are no longer written as free by sync_fs */
+        atomic_sub(len, &sbi->nr_window_blocks);
+        lolelffs_mark_bitmap_dirty(sbi, true, bno, len);
+        return bno;
+    }
+
+    lolelffs_sb_lock(sbi);
+    bno = lolelffs_search(sbi, old_end, sbi->window_blocks);
+    if (!bno) {
+        mutex_unlock(&sbi->lock);
+        return 0;
+    }
+    lolelffs_take(sbi, bno, sbi->window_blocks);
+    atomic_add(sbi->window_blocks - len, &sbi->nr_window_blocks);
+
+    spin_lock(&w->lock);
+    old_start = w->start;
+    old_end = w->end;
+    w->start = bno + len;
+    w->end = bno + sbi->window_blocks;
+    spin_unlock(&w->lock);
+
+    /* Give back what was left of the previous window */
+    if (old_end > old_start) {
+        atomic_sub(old_end - old_start, &sbi->nr_window_blocks);
+        lolelffs_release(sbi, old_start, old_end - old_start);
+    }
+    mutex_unlock(&sbi->lock);
+
+    return bno;
+}
+
+/*
+ * Allocate len contiguous blocks, as close as possible after goal (0 for no
+ * preference), and return the first one. Return 0 if there is no run of len
+ * free blocks.
+ */
+uint32_t lolelffs_new_blocks(struct lolelffs_sb_info *sbi,
+                             uint32_t goal,
+                             uint32_t len)
+{
+    uint32_t bno;
+
+    if (!goal && sbi->window_blocks && len <= LOLELFFS_ALLOC_WINDOW_MAX_LEN) {
+        bno = lolelffs_window_alloc(sbi, len);
+        if (bno)
+            return bno;
+    }
+
+    lolelffs_sb_lock(sbi);
+    bno = lolelffs_search(sbi, goal, len);
+    if (!bno && atomic_read(&sbi->nr_window_blocks)) {
+        lolelffs_drain_windows(sbi);
+        bno = lolelffs_search(sbi, goal, len);
+    }
+    if (bno)
+        lolelffs_take(sbi, bno, len);
+    mutex_unlock(&sbi->lock);
+
+    return bno;
+}
+
+/* Mark len block(s) from bno as unused */
+void lolelffs_free_blocks(struct lolelffs_sb_info *sbi,
+                          uint32_t bno,
+                          uint32_t len)
+{
+    /* bno is past the end of the filesystem */
+    if (!len || bno + len > sbi->nr_blocks)
+        return;
+
+    lolelffs_sb_lock(sbi);
+    lolelffs_release(sbi, bno, len);
+    mutex_unlock(&sbi->lock);
+}
+
+/*
+ * Mark the blocks held by the windows as free in buf, a copy of the nbits
+ * bits of the free blocks bitmap starting at block first. The caller holds
+ * sbi->lock, so that no window is refilled meanwhile.
+ */
+void lolelffs_alloc_fill_bitmap(struct lolelffs_sb_info *sbi,
+                                void *buf,
+                                uint32_t first,
+                                uint32_t nbits)
+{
+    struct lolelffs_alloc_window *w;
+    uint32_t start, end;
+    int cpu;
+
+    if (!sbi->window_blocks)
+        return;
+
+    for_each_possible_cpu (cpu) {
+        w = per_cpu_ptr(sbi->windows, cpu);
+        spin_lock(&w->lock);
+        start = max(w->start, first);
+        end = min(w->end, first + nbits);
+        spin_unlock(&w->lock);
+
+        if (end > start)
+            bitmap_set(buf, start - first, end - start);
+    }
+}
+
+/*
+ * Set up the group summaries, read with their bitmap block, and the
+ * per-CPU windows if the filesystem is large enough for them not to waste
+ * a noticeable part of the free space.
+ */
+int lolelffs_alloc_init(struct lolelffs_sb_info *sbi)
+{
+    uint32_t group;
+    int cpu;
+
+    sbi->nr_groups = DIV_ROUND_UP(sbi->nr_blocks, LOLELFFS_BLOCKS_PER_GROUP);
+    sbi->groups = kcalloc(sbi->nr_groups, sizeof(*sbi->groups), GFP_KERNEL);
+    if (!sbi->groups)
+        return -ENOMEM;
+
+    /* Loaded on first use: until then, every block may be free */
+    for (group = 0; group < sbi->nr_groups; group++) {
+        sbi->groups[group].nr_free =
+            group_end(sbi, group) - group_first(group);
+        sbi->groups[group].max_run = sbi->nr_blocks - group_first(group);
+    }
+
+    atomic_set(&sbi->nr_window_blocks, 0);
+    sbi->window_blocks = 0;
+    if (sbi->nr_blocks / num_possible_cpus() < 16 * LOLELFFS_ALLOC_WINDOW)
+        return 0;
+
+    sbi->windows = alloc_percpu(struct lolelffs_alloc_window);
+    if (!sbi->windows) {
+        kfree(sbi->groups);
+        sbi->groups = NULL;
+        return -ENOMEM;
+    }
+    for_each_possible_cpu (cpu) {
+        struct lolelffs_alloc_window *w = per_cpu_ptr(sbi->windows, cpu);
+
+        spin_lock_init(&w->lock);
+        w->start = w->end = 0;
+    }
+    sbi->window_blocks = LOLELFFS_ALLOC_WINDOW;
+
+    return 0;
+}
+
+void lolelffs_alloc_destroy(struct lolelffs_sb_info *sbi)
+{
+    free_percpu(sbi->windows);
+    sbi->windows = NULL;
+    kfree(sbi->groups);
+    sbi->groups = NULL;
+}
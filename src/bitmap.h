@@ -43,74 +43,6 @@ static inline uint32_t get_first_free_bits(unsigned long *freemap,
     return 0;
 }
 
-/*
- * Search for free bits starting from a hint position.
- * This improves locality for sequential allocations.
- */
-static inline uint32_t get_free_bits_from_hint(unsigned long *freemap,
-                                               unsigned long size,
-                                               uint32_t len,
-                                               uint32_t hint)
-{
-    uint32_t bit, prev = 0, count = 0;
-    uint32_t start = hint;
-
-    /* Ensure hint is within bounds */
-    if (start >= size)
-        start = 0;
-
-    /* Fast path for single bit with hint */
-    if (len == 1) {
-        bit = find_next_bit(freemap, size, start);
-        if (bit < size) {
-            clear_bit(bit, freemap);
-            return bit;
-        }
-        /* Wrap around and search from beginning */
-        if (start > 0) {
-            bit = find_first_bit(freemap, start);
-            if (bit < start) {
-                clear_bit(bit, freemap);
-                return bit;
-            }
-        }
-        return 0;
-    }
-
-    /* Search from hint to end */
-    bit = start;
-    for_each_set_bit_from(bit, freemap, size) {
-        if (bit < start) {
-            bit = start - 1;
-            continue;
-        }
-        if (prev != bit - 1)
-            count = 0;
-        prev = bit;
-        if (++count == len) {
-            bitmap_clear(freemap, bit - len + 1, len);
-            return bit - len + 1;
-        }
-    }
-
-    /* Wrap around and search from beginning to hint */
-    if (start > 0) {
-        prev = 0;
-        count = 0;
-        for_each_set_bit(bit, freemap, start) {
-            if (prev != bit - 1)
-                count = 0;
-            prev = bit;
-            if (++count == len) {
-                bitmap_clear(freemap, bit - len + 1, len);
-                return bit - len + 1;
-            }
-        }
-    }
-
-    return 0;
-}
-
 /*
  * Return an unused inode number and mark it used.
  * Return 0 if no free inode was found.
@@ -118,10 +50,16 @@ static inline uint32_t get_free_bits_from_hint(unsigned long *freemap,
 static inline uint32_t get_free_inode(struct lolelffs_sb_info *sbi)
 {
     uint32_t ret;
-    mutex_lock(&sbi->lock);
+    lolelffs_sb_lock(sbi);
+    if (lolelffs_load_inode_bitmap(sbi)) {
+        mutex_unlock(&sbi->lock);
+        return 0;
+    }
     ret = get_first_free_bits(sbi->ifree_bitmap, sbi->nr_inodes, 1);
-    if (ret)
+    if (ret) {
         sbi->nr_free_inodes--;
+        lolelffs_mark_bitmap_dirty(sbi, false, ret, 1);
+    }
     mutex_unlock(&sbi->lock);
     return ret;
 }
@@ -133,16 +71,9 @@ static inline uint32_t get_free_inode(struct lolelffs_sb_info *sbi)
 static inline uint32_t get_free_blocks(struct lolelffs_sb_info *sbi,
                                        uint32_t len)
 {
-    uint32_t ret;
-    mutex_lock(&sbi->lock);
-    ret = get_first_free_bits(sbi->bfree_bitmap, sbi->nr_blocks, len);
-    if (ret)
-        sbi->nr_free_blocks -= len;
-    mutex_unlock(&sbi->lock);
-    return ret;
+    return lolelffs_new_blocks(sbi, 0, len);
 }
 
-
 /* Mark the `len` bit(s) from i-th bit in freemap as free (i.e. 1) */
 static inline int put_free_bits(unsigned long *freemap,
                                 unsigned long size,
@@ -161,12 +92,14 @@ static inline int put_free_bits(unsigned long *freemap,
 /* Mark an inode as unused */
 static inline void put_inode(struct lolelffs_sb_info *sbi, uint32_t ino)
 {
-    mutex_lock(&sbi->lock);
-    if (put_free_bits(sbi->ifree_bitmap, sbi->nr_inodes, ino, 1)) {
+    lolelffs_sb_lock(sbi);
+    if (lolelffs_load_inode_bitmap(sbi) ||
+        put_free_bits(sbi->ifree_bitmap, sbi->nr_inodes, ino, 1)) {
         mutex_unlock(&sbi->lock);
         return;
     }
     sbi->nr_free_inodes++;
+    lolelffs_mark_bitmap_dirty(sbi, false, ino, 1);
     mutex_unlock(&sbi->lock);
 }
 
@@ -175,13 +108,7 @@ static inline void put_blocks(struct lolelffs_sb_info *sbi,
                               uint32_t bno,
                               uint32_t len)
 {
-    mutex_lock(&sbi->lock);
-    if (put_free_bits(sbi->bfree_bitmap, sbi->nr_blocks, bno, len)) {
-        mutex_unlock(&sbi->lock);
-        return;
-    }
-    sbi->nr_free_blocks += len;
-    mutex_unlock(&sbi->lock);
+    lolelffs_free_blocks(sbi, bno, len);
 }
 
 /*
@@ -223,8 +150,8 @@ static inline uint32_t calc_optimal_extent_size(struct lolelffs_sb_info *sbi,
         alloc_size = max_size;  /* Use maximum for large files */
 
     /* Ensure we don't exceed available blocks */
-    if (alloc_size > sbi->nr_free_blocks)
-        alloc_size = sbi->nr_free_blocks;
+    if (alloc_size > lolelffs_nr_free_blocks(sbi))
+        alloc_size = lolelffs_nr_free_blocks(sbi);
 
     /* Minimum allocation is 1 block */
     if (alloc_size == 0)
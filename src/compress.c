@@ -8,10 +8,13 @@
 #include <linux/kernel.h>
 #include <linux/slab.h>
 #include <linux/fs.h>
+#include <linux/local_lock.h>
+#include <linux/percpu.h>
 #include <linux/vmalloc.h>
 #include <linux/string.h>
 #include <linux/lz4.h>
 #include <linux/zlib.h>
+#include <linux/ktime.h>
 /*
  * ZSTD support status:
  * - Some kernels have CONFIG_ZSTD_COMPRESS but don't export ZSTD_compress/ZSTD_decompress
@@ -29,6 +32,7 @@
 #endif
 #include "lolelffs.h"
 #include "compress.h"
+#include "trace.h"
 
 /* Compression algorithm names */
 static const char *comp_algo_names[] = {
@@ -40,15 +44,36 @@ static const char *comp_algo_names[] = {
 
 #define LOLELFFS_COMP_MAX_ALGO LOLELFFS_COMP_ZSTD
 
+/*
+ * zlib only ever sees a single block, so a window covering LOLELFFS_BLOCK_SIZE
+ * is enough and keeps the per-CPU deflate workspace small. Streams produced
+ * this way remain regular zlib streams that any inflater accepts.
+ */
+#define LOLELFFS_ZLIB_WBITS 12
+#define LOLELFFS_ZLIB_MEMLEVEL DEF_MEM_LEVEL
+
 /* Compression context */
 struct lolelffs_comp_ctx {
-	void *workspace;
-	size_t workspace_size;
+	size_t comp_ws_size;	/* Per-CPU compression workspace size */
+	size_t decomp_ws_size;	/* Per-CPU decompression workspace size (0 = none) */
 	bool available;
 };
 
+/*
+ * Per-CPU workspaces. Each CPU owns one workspace per algorithm and direction,
+ * so concurrent readers and writers never contend on a shared lock. The local
+ * lock only guards against preemption while a workspace is in use.
+ */
+struct lolelffs_comp_pcpu {
+	local_lock_t lock;
+	void *comp_ws[LOLELFFS_COMP_MAX_ALGO + 1];
+	void *decomp_ws[LOLELFFS_COMP_MAX_ALGO + 1];
+};
+
 static struct lolelffs_comp_ctx comp_ctx[LOLELFFS_COMP_MAX_ALGO + 1];
-static DEFINE_MUTEX(comp_mutex);
+static DEFINE_PER_CPU(struct lolelffs_comp_pcpu, comp_pcpu) = {
+	.lock = INIT_LOCAL_LOCK(lock),
+};
 
 /**
  * lolelffs_comp_supported - Check if algorithm is supported
@@ -78,13 +103,13 @@ const char *lolelffs_comp_get_name(u8 algo)
 /**
  * lolelffs_compress_lz4 - Compress using LZ4
  */
-static int lolelffs_compress_lz4(const void *src, size_t src_len,
-				  void *dst, size_t *comp_size)
+static int lolelffs_compress_lz4(void *workspace, const void *src,
+				  size_t src_len, void *dst, size_t *comp_size)
 {
 	int ret;
 
 	ret = LZ4_compress_default(src, dst, src_len, LOLELFFS_BLOCK_SIZE,
-				    comp_ctx[LOLELFFS_COMP_LZ4].workspace);
+				    workspace);
 	if (ret <= 0)
 		return -EIO;
 
@@ -94,6 +119,8 @@ static int lolelffs_compress_lz4(const void *src, size_t src_len,
 
 /**
  * lolelffs_decompress_lz4 - Decompress using LZ4
+ *
+ * LZ4 decompression is stateless, so it needs neither a workspace nor a lock.
  */
 static int lolelffs_decompress_lz4(const void *src, size_t src_len,
 				    void *dst, size_t dst_len)
@@ -113,13 +140,13 @@ static int lolelffs_decompress_lz4(const void *src, size_t src_len,
 /**
  * lolelffs_compress_zlib - Compress using zlib
  */
-static int lolelffs_compress_zlib(const void *src, size_t src_len,
-				   void *dst, size_t *comp_size)
+static int lolelffs_compress_zlib(void *workspace, const void *src,
+				   size_t src_len, void *dst, size_t *comp_size)
 {
 	z_stream stream;
 	int ret;
 
-	stream.workspace = comp_ctx[LOLELFFS_COMP_ZLIB].workspace;
+	stream.workspace = workspace;
 	stream.next_in = (u8 *)src;
 	stream.avail_in = src_len;
 	stream.next_out = dst;
@@ -127,7 +154,9 @@ static int lolelffs_compress_zlib(const void *src, size_t src_len,
 	stream.total_in = 0;
 	stream.total_out = 0;
 
-	ret = zlib_deflateInit(&stream, Z_DEFAULT_COMPRESSION);
+	ret = zlib_deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+				LOLELFFS_ZLIB_WBITS, LOLELFFS_ZLIB_MEMLEVEL,
+				Z_DEFAULT_STRATEGY);
 	if (ret != Z_OK)
 		return -EIO;
 
@@ -148,13 +177,13 @@ static int lolelffs_compress_zlib(const void *src, size_t src_len,
 /**
  * lolelffs_decompress_zlib - Decompress using zlib
  */
-static int lolelffs_decompress_zlib(const void *src, size_t src_len,
-				     void *dst, size_t dst_len)
+static int lolelffs_decompress_zlib(void *workspace, const void *src,
+				     size_t src_len, void *dst, size_t dst_len)
 {
 	z_stream stream;
 	int ret;
 
-	stream.workspace = comp_ctx[LOLELFFS_COMP_ZLIB].workspace;
+	stream.workspace = workspace;
 	stream.next_in = (u8 *)src;
 	stream.avail_in = src_len;
 	stream.next_out = dst;
@@ -228,6 +257,7 @@ static int lolelffs_decompress_zstd(const void *src, size_t src_len,
 int lolelffs_compress_block(u8 algo, const void *src, size_t src_len,
 			     void *dst, size_t *comp_size)
 {
+	void *workspace;
 	int ret;
 
 	if (algo == LOLELFFS_COMP_NONE || algo > LOLELFFS_COMP_MAX_ALGO)
@@ -236,14 +266,15 @@ int lolelffs_compress_block(u8 algo, const void *src, size_t src_len,
 	if (!comp_ctx[algo].available)
 		return -EOPNOTSUPP;
 
-	mutex_lock(&comp_mutex);
+	local_lock(&comp_pcpu.lock);
+	workspace = this_cpu_ptr(&comp_pcpu)->comp_ws[algo];
 
 	switch (algo) {
 	case LOLELFFS_COMP_LZ4:
-		ret = lolelffs_compress_lz4(src, src_len, dst, comp_size);
+		ret = lolelffs_compress_lz4(workspace, src, src_len, dst, comp_size);
 		break;
 	case LOLELFFS_COMP_ZLIB:
-		ret = lolelffs_compress_zlib(src, src_len, dst, comp_size);
+		ret = lolelffs_compress_zlib(workspace, src, src_len, dst, comp_size);
 		break;
 #if HAVE_ZSTD
 	case LOLELFFS_COMP_ZSTD:
@@ -255,7 +286,7 @@ int lolelffs_compress_block(u8 algo, const void *src, size_t src_len,
 		break;
 	}
 
-	mutex_unlock(&comp_mutex);
+	local_unlock(&comp_pcpu.lock);
 
 	if (ret < 0) {
 		pr_debug("lolelffs: compression failed (algo=%s): %d\n",
@@ -279,6 +310,8 @@ int lolelffs_compress_block(u8 algo, const void *src, size_t src_len,
 int lolelffs_decompress_block(u8 algo, const void *src, size_t src_len,
 			       void *dst, size_t dst_len)
 {
+	u64 start = lolelffs_trace_start(lolelffs_decompress);
+	void *workspace;
 	int ret;
 
 	if (algo == LOLELFFS_COMP_NONE || algo > LOLELFFS_COMP_MAX_ALGO)
@@ -287,26 +320,41 @@ int lolelffs_decompress_block(u8 algo, const void *src, size_t src_len,
 	if (!comp_ctx[algo].available)
 		return -EOPNOTSUPP;
 
-	mutex_lock(&comp_mutex);
-
-	switch (algo) {
-	case LOLELFFS_COMP_LZ4:
-		ret = lolelffs_decompress_lz4(src, src_len, dst, dst_len);
-		break;
-	case LOLELFFS_COMP_ZLIB:
-		ret = lolelffs_decompress_zlib(src, src_len, dst, dst_len);
-		break;
+	/* Stateless decompressors run without touching the per-CPU state */
+	if (!comp_ctx[algo].decomp_ws_size) {
+		switch (algo) {
+		case LOLELFFS_COMP_LZ4:
+			ret = lolelffs_decompress_lz4(src, src_len, dst, dst_len);
+			break;
 #if HAVE_ZSTD
-	case LOLELFFS_COMP_ZSTD:
-		ret = lolelffs_decompress_zstd(src, src_len, dst, dst_len);
-		break;
+		case LOLELFFS_COMP_ZSTD:
+			ret = lolelffs_decompress_zstd(src, src_len, dst, dst_len);
+			break;
 #endif
-	default:
-		ret = -EINVAL;
-		break;
+		default:
+			ret = -EINVAL;
+			break;
+		}
+	} else {
+		local_lock(&comp_pcpu.lock);
+		workspace = this_cpu_ptr(&comp_pcpu)->decomp_ws[algo];
+
+		switch (algo) {
+		case LOLELFFS_COMP_ZLIB:
+			ret = lolelffs_decompress_zlib(workspace, src, src_len,
+						       dst, dst_len);
+			break;
+		default:
+			ret = -EINVAL;
+			break;
+		}
+
+		local_unlock(&comp_pcpu.lock);
 	}
 
-	mutex_unlock(&comp_mutex);
+	if (start)
+		trace_lolelffs_decompress(algo, src_len, dst_len, ret,
+					  ktime_get_ns() - start);
 
 	if (ret < 0) {
 		pr_err("lolelffs: decompression failed (algo=%s): %d\n",
@@ -317,6 +365,56 @@ int lolelffs_decompress_block(u8 algo, const void *src, size_t src_len,
 	return 0;
 }
 
+/* Free every per-CPU workspace of an algorithm */
+static void lolelffs_comp_free_workspaces(u8 algo)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct lolelffs_comp_pcpu *pcpu = per_cpu_ptr(&comp_pcpu, cpu);
+
+		kvfree(pcpu->comp_ws[algo]);
+		kvfree(pcpu->decomp_ws[algo]);
+		pcpu->comp_ws[algo] = NULL;
+		pcpu->decomp_ws[algo] = NULL;
+	}
+}
+
+/*
+ * Allocate the per-CPU workspaces of an algorithm. The algorithm is marked
+ * available only if every possible CPU got its workspaces.
+ */
+static void lolelffs_comp_alloc_workspaces(u8 algo, size_t comp_ws_size,
+					   size_t decomp_ws_size)
+{
+	int cpu;
+
+	comp_ctx[algo].comp_ws_size = comp_ws_size;
+	comp_ctx[algo].decomp_ws_size = decomp_ws_size;
+	comp_ctx[algo].available = false;
+
+	for_each_possible_cpu(cpu) {
+		struct lolelffs_comp_pcpu *pcpu = per_cpu_ptr(&comp_pcpu, cpu);
+
+		if (comp_ws_size) {
+			pcpu->comp_ws[algo] = kvmalloc(comp_ws_size, GFP_KERNEL);
+			if (!pcpu->comp_ws[algo])
+				goto fail;
+		}
+		if (decomp_ws_size) {
+			pcpu->decomp_ws[algo] = kvmalloc(decomp_ws_size, GFP_KERNEL);
+			if (!pcpu->decomp_ws[algo])
+				goto fail;
+		}
+	}
+
+	comp_ctx[algo].available = true;
+	return;
+
+fail:
+	lolelffs_comp_free_workspaces(algo);
+}
+
 /**
  * lolelffs_comp_init - Initialize compression subsystem
  */
@@ -327,40 +425,37 @@ int lolelffs_comp_init(void)
 
 	pr_info("lolelffs: initializing compression support\n");
 
-	/* Initialize LZ4 */
-	comp_ctx[LOLELFFS_COMP_LZ4].workspace_size = LZ4_MEM_COMPRESS;
-	comp_ctx[LOLELFFS_COMP_LZ4].workspace = vmalloc(LZ4_MEM_COMPRESS);
-	if (comp_ctx[LOLELFFS_COMP_LZ4].workspace) {
-		comp_ctx[LOLELFFS_COMP_LZ4].available = true;
+	/* Initialize LZ4 - decompression is stateless */
+	lolelffs_comp_alloc_workspaces(LOLELFFS_COMP_LZ4, LZ4_MEM_COMPRESS, 0);
+	if (comp_ctx[LOLELFFS_COMP_LZ4].available) {
 		any_available = true;
 		pr_info("lolelffs: LZ4 compression initialized\n");
 	} else {
 		pr_warn("lolelffs: LZ4 workspace allocation failed\n");
-		comp_ctx[LOLELFFS_COMP_LZ4].available = false;
 	}
 
 	/* Initialize zlib */
-	comp_ctx[LOLELFFS_COMP_ZLIB].workspace_size = zlib_deflate_workspacesize(MAX_WBITS, MAX_MEM_LEVEL);
-	comp_ctx[LOLELFFS_COMP_ZLIB].workspace = vmalloc(comp_ctx[LOLELFFS_COMP_ZLIB].workspace_size);
-	if (comp_ctx[LOLELFFS_COMP_ZLIB].workspace) {
-		comp_ctx[LOLELFFS_COMP_ZLIB].available = true;
+	lolelffs_comp_alloc_workspaces(LOLELFFS_COMP_ZLIB,
+				       zlib_deflate_workspacesize(LOLELFFS_ZLIB_WBITS,
+								  LOLELFFS_ZLIB_MEMLEVEL),
+				       zlib_inflate_workspacesize());
+	if (comp_ctx[LOLELFFS_COMP_ZLIB].available) {
 		any_available = true;
 		pr_info("lolelffs: zlib compression initialized\n");
 	} else {
 		pr_warn("lolelffs: zlib workspace allocation failed\n");
-		comp_ctx[LOLELFFS_COMP_ZLIB].available = false;
 	}
 
 #if HAVE_ZSTD
 	/* Initialize zstd - uses simple API, no workspace needed */
-	comp_ctx[LOLELFFS_COMP_ZSTD].workspace = NULL;
-	comp_ctx[LOLELFFS_COMP_ZSTD].workspace_size = 0;
+	comp_ctx[LOLELFFS_COMP_ZSTD].comp_ws_size = 0;
+	comp_ctx[LOLELFFS_COMP_ZSTD].decomp_ws_size = 0;
 	comp_ctx[LOLELFFS_COMP_ZSTD].available = true;
 	any_available = true;
 	pr_info("lolelffs: zstd compression initialized\n");
 #else
-	comp_ctx[LOLELFFS_COMP_ZSTD].workspace = NULL;
-	comp_ctx[LOLELFFS_COMP_ZSTD].workspace_size = 0;
+	comp_ctx[LOLELFFS_COMP_ZSTD].comp_ws_size = 0;
+	comp_ctx[LOLELFFS_COMP_ZSTD].decomp_ws_size = 0;
 	comp_ctx[LOLELFFS_COMP_ZSTD].available = false;
 	pr_info("lolelffs: zstd compression not available (disabled)\n");
 #endif
@@ -383,10 +478,7 @@ void lolelffs_comp_exit(void)
 	pr_info("lolelffs: cleaning up compression support\n");
 
 	for (i = LOLELFFS_COMP_LZ4; i <= LOLELFFS_COMP_MAX_ALGO; i++) {
-		if (comp_ctx[i].workspace) {
-			vfree(comp_ctx[i].workspace);
-			comp_ctx[i].workspace = NULL;
-			comp_ctx[i].available = false;
-		}
+		lolelffs_comp_free_workspaces(i);
+		comp_ctx[i].available = false;
 	}
 }
@@ -3,15 +3,777 @@
 #include <linux/buffer_head.h>
 #include <linux/fs.h>
 #include <linux/kernel.h>
+#include <linux/log2.h>
 #include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/sort.h>
 #include <linux/uaccess.h>
 
+#include "bitmap.h"
 #include "lolelffs.h"
 #include "encrypt.h"
 
+/* Number of blocks added to a directory when its slots run out */
+#define LOLELFFS_DIR_EXT_BLOCKS 8
+
+/*
+ * Read the directory block holding slot and point f to its entry. Return
+ * NULL if no extent of the directory maps the slot, or on I/O error.
+ */
+static struct buffer_head *lolelffs_dir_slot(struct super_block *sb,
+                                             struct lolelffs_file_ei_block *eblock,
+                                             uint32_t slot,
+                                             struct lolelffs_file **f)
+{
+    uint32_t iblock = slot / LOLELFFS_FILES_PER_BLOCK;
+    uint32_t ei = lolelffs_ext_search(eblock, iblock);
+    struct lolelffs_extent *ext;
+    struct buffer_head *bh;
+
+    if (ei >= LOLELFFS_MAX_EXTENTS)
+        return NULL;
+    ext = &eblock->extents[ei];
+    if (!ext->ee_start || iblock < ext->ee_block ||
+        iblock >= ext->ee_block + ext->ee_len)
+        return NULL;
+
+    bh = LOLELFFS_SB_BREAD(sb, ext->ee_start + iblock - ext->ee_block);
+    if (!bh)
+        return NULL;
+    *f = &((struct lolelffs_dir_block *) bh->b_data)
+              ->files[slot % LOLELFFS_FILES_PER_BLOCK];
+
+    return bh;
+}
+
+static bool lolelffs_dir_match(const struct lolelffs_file *f,
+                               const char *name,
+                               size_t len)
+{
+    return f->inode && strnlen(f->filename, LOLELFFS_FILENAME_LEN) == len &&
+           !memcmp(f->filename, name, len);
+}
+
+/*
+ * Append an extent of zeroed blocks to the directory for more slots.
+ */
+static int lolelffs_dir_extend(struct super_block *sb,
+                               struct lolelffs_file_ei_block *eblock)
+{
+    struct lolelffs_sb_info *sbi = LOLELFFS_SB(sb);
+    struct lolelffs_extent *ext;
+    struct buffer_head *bh;
+    uint32_t ei, bno, i;
+
+    for (ei = 0; ei < LOLELFFS_MAX_EXTENTS; ei++) {
+        if (!eblock->extents[ei].ee_start)
+            break;
+    }
+    if (ei == LOLELFFS_MAX_EXTENTS)
+        return -EMLINK;
+
+    bno = get_free_blocks(sbi, LOLELFFS_DIR_EXT_BLOCKS);
+    if (!bno)
+        return -ENOSPC;
+    for (i = 0; i < LOLELFFS_DIR_EXT_BLOCKS; i++) {
+        bh = LOLELFFS_SB_BREAD(sb, bno + i);
+        if (!bh) {
+            put_blocks(sbi, bno, LOLELFFS_DIR_EXT_BLOCKS);
+            return -EIO;
+        }
+        memset(bh->b_data, 0, LOLELFFS_BLOCK_SIZE);
+        mark_buffer_dirty(bh);
+        brelse(bh);
+    }
+
+    ext = &eblock->extents[ei];
+    ext->ee_block = ei ? eblock->extents[ei - 1].ee_block +
+                             eblock->extents[ei - 1].ee_len
+                       : 0;
+    ext->ee_len = LOLELFFS_DIR_EXT_BLOCKS;
+    ext->ee_start = bno;
+
+    return 0;
+}
+
+/*
+ * Look for name among the nr_files entries of eblock, one slot after the
+ * other. Return 0 and fill ino and slot if found, or a negative error code.
+ */
+static int lolelffs_dir_scan(struct super_block *sb,
+                             struct lolelffs_file_ei_block *eblock,
+                             const char *name,
+                             size_t len,
+                             uint32_t *ino,
+                             uint32_t *slot)
+{
+    struct buffer_head *bh = NULL;
+    struct lolelffs_file *f = NULL;
+    uint32_t s;
+    int ret = -ENOENT;
+
+    for (s = 0; s < eblock->nr_files; s++, f++) {
+        if (!bh || s % LOLELFFS_FILES_PER_BLOCK == 0) {
+            brelse(bh);
+            bh = lolelffs_dir_slot(sb, eblock, s, &f);
+            if (!bh) {
+                ret = -EIO;
+                break;
+            }
+        }
+        if (lolelffs_dir_match(f, name, len)) {
+            *ino = f->inode;
+            *slot = s;
+            ret = 0;
+            break;
+        }
+    }
+    brelse(bh);
+
+    return ret;
+}
+
+/*
+ * Return the position in the root of the leaf covering hash: the last entry
+ * whose lowest hash is not above it.
+ */
+static uint32_t lolelffs_dx_root_search(const struct lolelffs_dx_root *root,
+                                        uint32_t hash)
+{
+    uint32_t left = 1, right = root->nr_entries, mid;
+
+    while (left < right) {
+        mid = left + (right - left) / 2;
+        if (root->entries[mid].hash <= hash)
+            left = mid + 1;
+        else
+            right = mid;
+    }
+
+    return left - 1;
+}
+
+/*
+ * Read the root of the index at dx_block and the leaf covering hash. The
+ * index is stale if its number of records is not nr_records. Return the
+ * position of the leaf in the root, or a negative error code.
+ */
+static int lolelffs_dx_get_leaf(struct super_block *sb,
+                                uint32_t dx_block,
+                                uint32_t nr_records,
+                                uint32_t hash,
+                                struct buffer_head **root_bh,
+                                struct buffer_head **leaf_bh)
+{
+    struct lolelffs_sb_info *sbi = LOLELFFS_SB(sb);
+    struct lolelffs_dx_root *root;
+    uint32_t pos, leaf;
+
+    *root_bh = LOLELFFS_SB_BREAD(sb, dx_block);
+    if (!*root_bh)
+        return -EIO;
+    root = (struct lolelffs_dx_root *) (*root_bh)->b_data;
+    if (root->magic != LOLELFFS_DX_MAGIC || !root->nr_entries ||
+        root->nr_entries > LOLELFFS_DX_ROOT_ENTRIES ||
+        root->nr_records != nr_records)
+        goto corrupted;
+
+    pos = lolelffs_dx_root_search(root, hash);
+    leaf = root->entries[pos].value;
+    if (!leaf || leaf >= sbi->nr_blocks)
+        goto corrupted;
+    *leaf_bh = LOLELFFS_SB_BREAD(sb, leaf);
+    if (!*leaf_bh) {
+        brelse(*root_bh);
+        return -EIO;
+    }
+    if (((struct lolelffs_dx_leaf *) (*leaf_bh)->b_data)->nr_entries >
+        LOLELFFS_DX_LEAF_ENTRIES) {
+        brelse(*leaf_bh);
+        goto corrupted;
+    }
+
+    return pos;
+
+corrupted:
+    brelse(*root_bh);
+    return -EUCLEAN;
+}
+
+/*
+ * Look for name through the index of eblock. Only the entries of the records
+ * with the same hash are read. Return 0 and fill ino and slot if found, or a
+ * negative error code.
+ */
+static int lolelffs_dx_find(struct super_block *sb,
+                            struct lolelffs_file_ei_block *eblock,
+                            const char *name,
+                            size_t len,
+                            uint32_t *ino,
+                            uint32_t *slot)
+{
+    uint32_t hash = lolelffs_dx_hash(name, len);
+    struct buffer_head *root_bh, *leaf_bh, *bh;
+    struct lolelffs_dx_leaf *leaf;
+    struct lolelffs_file *f;
+    uint32_t i;
+    int ret;
+
+    ret = lolelffs_dx_get_leaf(sb, eblock->dx_block, eblock->nr_files, hash,
+                               &root_bh, &leaf_bh);
+    if (ret < 0)
+        return ret;
+    brelse(root_bh);
+
+    leaf = (struct lolelffs_dx_leaf *) leaf_bh->b_data;
+    ret = -ENOENT;
+    for (i = 0; i < leaf->nr_entries; i++) {
+        if (leaf->entries[i].hash != hash)
+            continue;
+        if (leaf->entries[i].value >= eblock->nr_files) {
+            ret = -EUCLEAN;
+            break;
+        }
+        bh = lolelffs_dir_slot(sb, eblock, leaf->entries[i].value, &f);
+        if (!bh) {
+            ret = -EIO;
+            break;
+        }
+        if (lolelffs_dir_match(f, name, len)) {
+            *ino = f->inode;
+            *slot = leaf->entries[i].value;
+            brelse(bh);
+            ret = 0;
+            break;
+        }
+        brelse(bh);
+    }
+    brelse(leaf_bh);
+
+    return ret;
+}
+
+static int lolelffs_dx_cmp(const void *a, const void *b)
+{
+    uint32_t ha = ((const struct lolelffs_dx_entry *) a)->hash;
+    uint32_t hb = ((const struct lolelffs_dx_entry *) b)->hash;
+
+    return ha < hb ? -1 : ha > hb;
+}
+
+/*
+ * Split the full leaf at position pos of root to make room for rec. Records
+ * are divided around the median hash, never separating equal hashes, and the
+ * upper half moves to a new leaf inserted after pos.
+ */
+static int lolelffs_dx_split(struct super_block *sb,
+                             struct lolelffs_dx_root *root,
+                             uint32_t pos,
+                             struct lolelffs_dx_leaf *leaf,
+                             const struct lolelffs_dx_entry *rec)
+{
+    const uint32_t n = LOLELFFS_DX_LEAF_ENTRIES + 1;
+    struct lolelffs_dx_entry *recs;
+    struct lolelffs_dx_leaf *next;
+    struct buffer_head *bh;
+    uint32_t split, bno;
+    int ret = 0;
+
+    if (root->nr_entries == LOLELFFS_DX_ROOT_ENTRIES)
+        return -ENOSPC;
+
+    recs = kmalloc_array(n, sizeof(*recs), GFP_NOFS);
+    if (!recs)
+        return -ENOMEM;
+    memcpy(recs, leaf->entries, LOLELFFS_DX_LEAF_ENTRIES * sizeof(*recs));
+    recs[n - 1] = *rec;
+    sort(recs, n, sizeof(*recs), lolelffs_dx_cmp, NULL);
+
+    for (split = n / 2; split < n && recs[split].hash == recs[split - 1].hash;
+         split++)
+        ;
+    if (split == n) {
+        for (split = n / 2; split && recs[split].hash == recs[split - 1].hash;
+             split--)
+            ;
+    }
+    if (!split) {
+        /* All names share one hash */
+        ret = -ENOSPC;
+        goto out;
+    }
+
+    bno = get_free_blocks(LOLELFFS_SB(sb), 1);
+    if (!bno) {
+        ret = -ENOSPC;
+        goto out;
+    }
+    bh = LOLELFFS_SB_BREAD(sb, bno);
+    if (!bh) {
+        put_blocks(LOLELFFS_SB(sb), bno, 1);
+        ret = -EIO;
+        goto out;
+    }
+    next = (struct lolelffs_dx_leaf *) bh->b_data;
+    memset(next, 0, LOLELFFS_BLOCK_SIZE);
+    next->nr_entries = n - split;
+    memcpy(next->entries, recs + split, (n - split) * sizeof(*recs));
+    mark_buffer_dirty(bh);
+    brelse(bh);
+
+    memset(leaf->entries, 0, sizeof(leaf->entries));
+    leaf->nr_entries = split;
+    memcpy(leaf->entries, recs, split * sizeof(*recs));
+
+    memmove(root->entries + pos + 2, root->entries + pos + 1,
+            (root->nr_entries - pos - 1) * sizeof(*root->entries));
+    root->entries[pos + 1].hash = recs[split].hash;
+    root->entries[pos + 1].value = bno;
+    root->nr_entries++;
+
+out:
+    kfree(recs);
+    return ret;
+}
+
+/*
+ * Add the record of the entry at slot, named with hash, to the index at
+ * dx_block holding nr_records records.
+ */
+static int lolelffs_dx_insert(struct super_block *sb,
+                              uint32_t dx_block,
+                              uint32_t nr_records,
+                              uint32_t hash,
+                              uint32_t slot)
+{
+    struct lolelffs_dx_entry rec = { .hash = hash, .value = slot };
+    struct buffer_head *root_bh, *leaf_bh;
+    struct lolelffs_dx_root *root;
+    struct lolelffs_dx_leaf *leaf;
+    int pos, ret = 0;
+
+    pos = lolelffs_dx_get_leaf(sb, dx_block, nr_records, hash, &root_bh,
+                               &leaf_bh);
+    if (pos < 0)
+        return pos;
+    root = (struct lolelffs_dx_root *) root_bh->b_data;
+    leaf = (struct lolelffs_dx_leaf *) leaf_bh->b_data;
+
+    if (leaf->nr_entries < LOLELFFS_DX_LEAF_ENTRIES)
+        leaf->entries[leaf->nr_entries++] = rec;
+    else
+        ret = lolelffs_dx_split(sb, root, pos, leaf, &rec);
+    if (!ret) {
+        root->nr_records++;
+        mark_buffer_dirty(leaf_bh);
+        mark_buffer_dirty(root_bh);
+    }
+    brelse(leaf_bh);
+    brelse(root_bh);
+
+    return ret;
+}
+
+/*
+ * Find the record of the entry at slot, named with hash, in the index at
+ * dx_block holding nr_records records. Then either remove it, swapping in
+ * the last record of its leaf, or point it to new_slot.
+ */
+static int lolelffs_dx_change(struct super_block *sb,
+                              uint32_t dx_block,
+                              uint32_t nr_records,
+                              uint32_t hash,
+                              uint32_t slot,
+                              bool remove,
+                              uint32_t new_slot)
+{
+    struct buffer_head *root_bh, *leaf_bh;
+    struct lolelffs_dx_root *root;
+    struct lolelffs_dx_leaf *leaf;
+    uint32_t i;
+    int ret;
+
+    ret = lolelffs_dx_get_leaf(sb, dx_block, nr_records, hash, &root_bh,
+                               &leaf_bh);
+    if (ret < 0)
+        return ret;
+    root = (struct lolelffs_dx_root *) root_bh->b_data;
+    leaf = (struct lolelffs_dx_leaf *) leaf_bh->b_data;
+
+    ret = -EUCLEAN;
+    for (i = 0; i < leaf->nr_entries; i++) {
+        if (leaf->entries[i].hash != hash || leaf->entries[i].value != slot)
+            continue;
+        if (remove) {
+            leaf->entries[i] = leaf->entries[--leaf->nr_entries];
+            memset(&leaf->entries[leaf->nr_entries], 0,
+                   sizeof(*leaf->entries));
+            root->nr_records--;
+            mark_buffer_dirty(root_bh);
+        } else {
+            leaf->entries[i].value = new_slot;
+        }
+        mark_buffer_dirty(leaf_bh);
+        ret = 0;
+        break;
+    }
+    brelse(leaf_bh);
+    brelse(root_bh);
+
+    return ret;
+}
+
+/*
+ * Free the blocks of the index of eblock, if any, and detach it.
+ */
+void lolelffs_dir_free_index(struct super_block *sb,
+                             struct lolelffs_file_ei_block *eblock)
+{
+    struct lolelffs_sb_info *sbi = LOLELFFS_SB(sb);
+    struct lolelffs_dx_root *root;
+    struct buffer_head *bh;
+    uint32_t i;
+
+    if (!eblock->dx_block)
+        return;
+
+    bh = LOLELFFS_SB_BREAD(sb, eblock->dx_block);
+    if (bh) {
+        root = (struct lolelffs_dx_root *) bh->b_data;
+        if (root->magic == LOLELFFS_DX_MAGIC &&
+            root->nr_entries <= LOLELFFS_DX_ROOT_ENTRIES) {
+            for (i = 0; i < root->nr_entries; i++) {
+                if (root->entries[i].value &&
+                    root->entries[i].value < sbi->nr_blocks)
+                    put_blocks(sbi, root->entries[i].value, 1);
+            }
+        }
+        memset(root, 0, LOLELFFS_BLOCK_SIZE);
+        mark_buffer_dirty(bh);
+        brelse(bh);
+    }
+    put_blocks(sbi, eblock->dx_block, 1);
+    eblock->dx_block = 0;
+}
+
+/*
+ * Index all the entries of eblock, in a root with one leaf covering all
+ * hashes to begin with.
+ */
+static int lolelffs_dx_build(struct super_block *sb,
+                             struct lolelffs_file_ei_block *eblock)
+{
+    struct lolelffs_sb_info *sbi = LOLELFFS_SB(sb);
+    struct buffer_head *bh = NULL;
+    struct lolelffs_dx_root *root;
+    struct lolelffs_file *f = NULL;
+    uint32_t dx_block, leaf, s;
+    int ret = 0;
+
+    dx_block = get_free_blocks(sbi, 1);
+    if (!dx_block)
+        return -ENOSPC;
+    leaf = get_free_blocks(sbi, 1);
+    if (!leaf) {
+        put_blocks(sbi, dx_block, 1);
+        return -ENOSPC;
+    }
+
+    bh = LOLELFFS_SB_BREAD(sb, leaf);
+    if (!bh)
+        goto free_blocks;
+    memset(bh->b_data, 0, LOLELFFS_BLOCK_SIZE);
+    mark_buffer_dirty(bh);
+    brelse(bh);
+
+    bh = LOLELFFS_SB_BREAD(sb, dx_block);
+    if (!bh)
+        goto free_blocks;
+    root = (struct lolelffs_dx_root *) bh->b_data;
+    memset(root, 0, LOLELFFS_BLOCK_SIZE);
+    root->magic = LOLELFFS_DX_MAGIC;
+    root->nr_entries = 1;
+    root->entries[0].value = leaf;
+    mark_buffer_dirty(bh);
+    brelse(bh);
+    bh = NULL;
+
+    eblock->dx_block = dx_block;
+    for (s = 0; s < eblock->nr_files; s++, f++) {
+        if (!bh || s % LOLELFFS_FILES_PER_BLOCK == 0) {
+            brelse(bh);
+            bh = lolelffs_dir_slot(sb, eblock, s, &f);
+            if (!bh) {
+                ret = -EIO;
+                break;
+            }
+        }
+        ret = lolelffs_dx_insert(sb, dx_block, s,
+                                 lolelffs_dx_hash(f->filename,
+                                                  LOLELFFS_FILENAME_LEN),
+                                 s);
+        if (ret)
+            break;
+    }
+    brelse(bh);
+
+    if (ret)
+        lolelffs_dir_free_index(sb, eblock);
+    return ret;
+
+free_blocks:
+    put_blocks(sbi, leaf, 1);
+    put_blocks(sbi, dx_block, 1);
+    return -EIO;
+}
+
+/*
+ * Forget an index that could not be kept up to date with eblock, so that the
+ * directory falls back to scanning its entries.
+ */
+static void lolelffs_dx_drop(struct super_block *sb,
+                             struct lolelffs_file_ei_block *eblock,
+                             int err)
+{
+    pr_debug("dropping directory index %u: %d\n", eblock->dx_block, err);
+    lolelffs_dir_free_index(sb, eblock);
+}
+
+/*
+ * Find the entry named name in dir, through its index if it has one. Return
+ * 0 and fill ino and slot if found, -ENOENT if not, or another negative error
+ * code.
+ */
+int lolelffs_dir_find(struct inode *dir,
+                      const char *name,
+                      size_t len,
+                      uint32_t *ino,
+                      uint32_t *slot)
+{
+    struct super_block *sb = dir->i_sb;
+    struct lolelffs_file_ei_block *eblock;
+    struct buffer_head *bh;
+    int ret = -ENOENT;
+
+    bh = LOLELFFS_SB_BREAD(sb, LOLELFFS_INODE(dir)->ei_block);
+    if (!bh)
+        return -EIO;
+    eblock = (struct lolelffs_file_ei_block *) bh->b_data;
+
+    if (eblock->dx_block)
+        ret = lolelffs_dx_find(sb, eblock, name, len, ino, slot);
+    /* A stale or unreadable index is worked around, and dropped on change */
+    if (!eblock->dx_block || (ret && ret != -ENOENT))
+        ret = lolelffs_dir_scan(sb, eblock, name, len, ino, slot);
+    brelse(bh);
+
+    return ret;
+}
+
+/*
+ * Add an entry named name for inode ino to dir, in the slot following the
+ * last entry. The index is built when the directory outgrows one block, and
+ * retried each time the directory doubles if it had to be dropped.
+ */
+int lolelffs_dir_add(struct inode *dir,
+                     const char *name,
+                     size_t len,
+                     uint32_t ino)
+{
+    struct super_block *sb = dir->i_sb;
+    struct lolelffs_sb_info *sbi = LOLELFFS_SB(sb);
+    struct lolelffs_file_ei_block *eblock;
+    struct buffer_head *bh, *bh2;
+    struct lolelffs_file *f;
+    uint32_t slot;
+    int ret = 0;
+
+    bh = LOLELFFS_SB_BREAD(sb, LOLELFFS_INODE(dir)->ei_block);
+    if (!bh)
+        return -EIO;
+    eblock = (struct lolelffs_file_ei_block *) bh->b_data;
+
+    if (eblock->nr_files == LOLELFFS_MAX_SUBFILES) {
+        ret = -EMLINK;
+        goto end;
+    }
+
+    slot = eblock->nr_files;
+    bh2 = lolelffs_dir_slot(sb, eblock, slot, &f);
+    if (!bh2) {
+        ret = lolelffs_dir_extend(sb, eblock);
+        if (ret)
+            goto end;
+        bh2 = lolelffs_dir_slot(sb, eblock, slot, &f);
+        if (!bh2) {
+            ret = -EIO;
+            goto end;
+        }
+    }
+
+    memset(f, 0, sizeof(*f));
+    f->inode = ino;
+    memcpy(f->filename, name, len);
+    mark_buffer_dirty(bh2);
+    brelse(bh2);
+
+    if (eblock->dx_block) {
+        ret = lolelffs_dx_insert(sb, eblock->dx_block, eblock->nr_files,
+                                 lolelffs_dx_hash(name, len), slot);
+        if (ret) {
+            lolelffs_dx_drop(sb, eblock, ret);
+            ret = 0;
+        }
+    }
+    eblock->nr_files++;
+
+    if (!eblock->dx_block && (sbi->comp_features & LOLELFFS_FEATURE_DIR_INDEX) &&
+        eblock->nr_files > LOLELFFS_DX_MIN_FILES &&
+        is_power_of_2(eblock->nr_files)) {
+        ret = lolelffs_dx_build(sb, eblock);
+        if (ret)
+            pr_debug("cannot index directory %lu: %d\n", dir->i_ino, ret);
+        ret = 0;
+    }
+    mark_buffer_dirty(bh);
+
+end:
+    brelse(bh);
+    return ret;
+}
+
+/*
+ * Remove the entry at slot from dir. The last entry moves into the hole to
+ * keep the entries packed, so only its index record needs to follow.
+ */
+int lolelffs_dir_remove(struct inode *dir, uint32_t slot)
+{
+    struct super_block *sb = dir->i_sb;
+    struct lolelffs_file_ei_block *eblock;
+    struct buffer_head *bh, *bh2, *bh_last;
+    struct lolelffs_file *f, *last;
+    uint32_t nr_files;
+    int ret = 0;
+
+    bh = LOLELFFS_SB_BREAD(sb, LOLELFFS_INODE(dir)->ei_block);
+    if (!bh)
+        return -EIO;
+    eblock = (struct lolelffs_file_ei_block *) bh->b_data;
+    nr_files = eblock->nr_files;
+    if (slot >= nr_files) {
+        ret = -ENOENT;
+        goto end;
+    }
+
+    bh2 = lolelffs_dir_slot(sb, eblock, slot, &f);
+    if (!bh2) {
+        ret = -EIO;
+        goto end;
+    }
+    bh_last = NULL;
+    if (slot != nr_files - 1) {
+        bh_last = lolelffs_dir_slot(sb, eblock, nr_files - 1, &last);
+        if (!bh_last) {
+            brelse(bh2);
+            ret = -EIO;
+            goto end;
+        }
+    }
+
+    if (eblock->dx_block) {
+        ret = lolelffs_dx_change(sb, eblock->dx_block, nr_files,
+                                 lolelffs_dx_hash(f->filename,
+                                                  LOLELFFS_FILENAME_LEN),
+                                 slot, true, 0);
+        if (!ret && bh_last)
+            ret = lolelffs_dx_change(sb, eblock->dx_block, nr_files - 1,
+                                     lolelffs_dx_hash(last->filename,
+                                                      LOLELFFS_FILENAME_LEN),
+                                     nr_files - 1, false, slot);
+        if (ret) {
+            lolelffs_dx_drop(sb, eblock, ret);
+            ret = 0;
+        }
+    }
+
+    if (bh_last) {
+        *f = *last;
+        memset(last, 0, sizeof(*last));
+        mark_buffer_dirty(bh_last);
+        brelse(bh_last);
+    } else {
+        memset(f, 0, sizeof(*f));
+    }
+    mark_buffer_dirty(bh2);
+    brelse(bh2);
+
+    eblock->nr_files--;
+    mark_buffer_dirty(bh);
+
+end:
+    brelse(bh);
+    return ret;
+}
+
+/*
+ * Rename the entry at slot of dir to name, in place.
+ */
+int lolelffs_dir_rename(struct inode *dir,
+                        uint32_t slot,
+                        const char *name,
+                        size_t len)
+{
+    struct super_block *sb = dir->i_sb;
+    struct lolelffs_file_ei_block *eblock;
+    struct buffer_head *bh, *bh2;
+    struct lolelffs_file *f;
+    int ret = 0;
+
+    bh = LOLELFFS_SB_BREAD(sb, LOLELFFS_INODE(dir)->ei_block);
+    if (!bh)
+        return -EIO;
+    eblock = (struct lolelffs_file_ei_block *) bh->b_data;
+    if (slot >= eblock->nr_files) {
+        ret = -ENOENT;
+        goto end;
+    }
+
+    bh2 = lolelffs_dir_slot(sb, eblock, slot, &f);
+    if (!bh2) {
+        ret = -EIO;
+        goto end;
+    }
+
+    if (eblock->dx_block) {
+        ret = lolelffs_dx_change(sb, eblock->dx_block, eblock->nr_files,
+                                 lolelffs_dx_hash(f->filename,
+                                                  LOLELFFS_FILENAME_LEN),
+                                 slot, true, 0);
+        if (!ret)
+            ret = lolelffs_dx_insert(sb, eblock->dx_block,
+                                     eblock->nr_files - 1,
+                                     lolelffs_dx_hash(name, len), slot);
+        if (ret) {
+            lolelffs_dx_drop(sb, eblock, ret);
+            mark_buffer_dirty(bh);
+            ret = 0;
+        }
+    }
+
+    memset(f->filename, 0, sizeof(f->filename));
+    memcpy(f->filename, name, len);
+    mark_buffer_dirty(bh2);
+    brelse(bh2);
+
+end:
+    brelse(bh);
+    return ret;
+}
+
 /*
  * Iterate over the files contained in dir and commit them in ctx.
- * This function is called by the VFS while ctx->pos changes.
+ * This function is called by the VFS while ctx->pos changes, which is the
+ * slot of the next entry plus 2.
  * Return 0 on success.
  */
 static int lolelffs_iterate(struct file *dir, struct dir_context *ctx)
@@ -21,9 +783,8 @@ static int lolelffs_iterate(struct file *dir, struct dir_context *ctx)
     struct super_block *sb = inode->i_sb;
     struct buffer_head *bh = NULL, *bh2 = NULL;
     struct lolelffs_file_ei_block *eblock = NULL;
-    struct lolelffs_dir_block *dblock = NULL;
     struct lolelffs_file *f = NULL;
-    int ei = 0, bi = 0, fi = 0;
+    uint32_t slot;
     int ret = 0;
 
     /* Check that dir is a directory */
@@ -47,42 +808,23 @@ static int lolelffs_iterate(struct file *dir, struct dir_context *ctx)
         return -EIO;
     eblock = (struct lolelffs_file_ei_block *) bh->b_data;
 
-    ei = (ctx->pos - 2) / LOLELFFS_FILES_PER_EXT;
-    bi = (ctx->pos - 2) % LOLELFFS_FILES_PER_EXT
-         / LOLELFFS_FILES_PER_BLOCK;
-    fi = (ctx->pos - 2) % LOLELFFS_FILES_PER_BLOCK;
-
-    /* Iterate over the index block and commit subfiles */
-    for (; ei < LOLELFFS_MAX_EXTENTS; ei++) {
-        if (eblock->extents[ei].ee_start == 0) {
-            break;
-        }
-        /* Iterate over blocks in one extent */
-        for (; bi < eblock->extents[ei].ee_len; bi++) {
-            bh2 = LOLELFFS_SB_BREAD(sb, eblock->extents[ei].ee_start + bi);
+    /* Entries are packed in the first nr_files slots */
+    for (slot = ctx->pos - 2; slot < eblock->nr_files; slot++, f++) {
+        if (!bh2 || slot % LOLELFFS_FILES_PER_BLOCK == 0) {
+            brelse(bh2);
+            bh2 = lolelffs_dir_slot(sb, eblock, slot, &f);
             if (!bh2) {
                 ret = -EIO;
-                goto release_bh;
-            }
-            dblock = (struct lolelffs_dir_block *) bh2->b_data;
-            if (dblock->files[0].inode == 0) {
                 break;
             }
-            /* Iterate every file in one block */
-            for (; fi < LOLELFFS_FILES_PER_BLOCK; fi++) {
-                f = &dblock->files[fi];
-                if (f->inode && !dir_emit(ctx, f->filename,
-                               strnlen(f->filename, LOLELFFS_FILENAME_LEN),
-                               f->inode, DT_UNKNOWN))
-                    break;
-                ctx->pos++;
-            }
-            brelse(bh2);
-            bh2 = NULL;
         }
+        if (f->inode && !dir_emit(ctx, f->filename,
+                                  strnlen(f->filename, LOLELFFS_FILENAME_LEN),
+                                  f->inode, DT_UNKNOWN))
+            break;
+        ctx->pos++;
     }
-
-release_bh:
+    brelse(bh2);
     brelse(bh);
 
     return ret;
@@ -95,9 +837,10 @@ release_bh:
  * @arg: ioctl argument
  *
  * Handles filesystem-level ioctl commands, including unlocking encrypted
- * filesystems and querying encryption status.
+ * filesystems and querying encryption status, and the defragmentation of
+ * regular files. Shared by directories and regular files.
  */
-static long lolelffs_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+long lolelffs_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 {
     struct inode *inode = file_inode(file);
     struct super_block *sb = inode->i_sb;
@@ -115,6 +858,7 @@ static long lolelffs_ioctl(struct file *file, unsigned int cmd, unsigned long ar
     switch (cmd) {
     case LOLELFFS_IOC_UNLOCK: {
         struct lolelffs_ioctl_unlock req;
+        struct lolelffs_enc_key *key;
         u8 user_key[32];
         u8 master_key[32];
 
@@ -171,9 +915,23 @@ static long lolelffs_ioctl(struct file *file, unsigned int cmd, unsigned long ar
             goto out_zero;
         }
 
+        /* Key the transforms used by the data path */
+        ret = lolelffs_enc_key_setup(master_key, sb->s_bdev, &key);
+        if (ret < 0)
+            goto out_zero;
+
         /* Store decrypted master key and mark as unlocked */
         mutex_lock(&sbi->enc_lock);
+        if (sbi->enc_unlocked) {
+            /* Lost a race with a concurrent unlock */
+            mutex_unlock(&sbi->enc_lock);
+            lolelffs_enc_key_free(key);
+            ret = 0;
+            goto out_zero;
+        }
         memcpy(sbi->enc_master_key_decrypted, master_key, 32);
+        /* Readers check enc_key locklessly: publish it fully keyed */
+        smp_store_release(&sbi->enc_key, key);
         sbi->enc_unlocked = true;
         mutex_unlock(&sbi->enc_lock);
 
@@ -207,6 +965,33 @@ out_zero:
         break;
     }
 
+    case LOLELFFS_IOC_DEFRAG: {
+        struct lolelffs_ioctl_defrag stats;
+
+        if (!S_ISREG(inode->i_mode)) {
+            ret = -EINVAL;
+            goto out;
+        }
+        if (!(file->f_mode & FMODE_WRITE)) {
+            ret = -EBADF;
+            goto out;
+        }
+
+        ret = mnt_want_write_file(file);
+        if (ret)
+            goto out;
+        ret = lolelffs_defrag(inode, &stats);
+        mnt_drop_write_file(file);
+        if (ret)
+            goto out;
+
+        if (copy_to_user((void __user *)arg, &stats, sizeof(stats))) {
+            ret = -EFAULT;
+            goto out;
+        }
+        break;
+    }
+
     default:
         ret = -ENOTTY;
         break;
@@ -7,15 +7,19 @@
 
 #include <linux/kernel.h>
 #include <linux/slab.h>
+#include <linux/mempool.h>
 #include <linux/fs.h>
+#include <linux/ktime.h>
 #include <linux/string.h>
 #include <linux/random.h>
 #include <linux/scatterlist.h>
 #include <crypto/skcipher.h>
 #include <crypto/aead.h>
 #include <crypto/hash.h>
+#include <crypto/sha2.h>
 #include "lolelffs.h"
 #include "encrypt.h"
+#include "trace.h"
 
 /* Encryption algorithm names for kernel crypto API */
 static const char *enc_algo_names[] = {
@@ -42,7 +46,7 @@ static const char *enc_algo_display_names[] = {
 /* Authentication tag size for AEAD */
 #define CHACHA20_POLY1305_TAG_SIZE 16
 
-/* Encryption context */
+/* Algorithm availability, probed once at module load */
 struct lolelffs_enc_ctx {
 	struct crypto_skcipher *skcipher; /* For AES-XTS */
 	struct crypto_aead *aead;          /* For ChaCha20-Poly1305 */
@@ -50,7 +54,9 @@ struct lolelffs_enc_ctx {
 };
 
 static struct lolelffs_enc_ctx enc_ctx[LOLELFFS_ENC_MAX_ALGO + 1];
-static DEFINE_MUTEX(enc_mutex);
+
+/* Requests kept in reserve per keyed transform for forward progress */
+#define LOLELFFS_ENC_POOL_SIZE 4
 
 /**
  * lolelffs_enc_supported - Check if algorithm is supported
@@ -100,210 +106,289 @@ static void derive_iv_from_block(u64 block_num, u8 *iv, size_t iv_size)
 	memcpy(iv, &block_num, min(sizeof(block_num), iv_size));
 }
 
-/**
- * lolelffs_encrypt_aes_xts - Encrypt using AES-256-XTS
+#ifdef CONFIG_BLK_INLINE_ENCRYPTION
+/*
+ * Hand AES-256-XTS over to the inline encryption hardware of bdev, if it
+ * supports it natively. The data unit number is the logical block number,
+ * which is the IV derive_iv_from_block() gives the software path, so blocks
+ * written either way read back either way. blk-crypto-fallback is not used:
+ * it would do the same work as the software path, with an extra copy.
  */
-static int lolelffs_encrypt_aes_xts(const u8 *key, u64 block_num,
-				    const void *src, void *dst)
+static void lolelffs_enc_inline_setup(struct lolelffs_enc_key *key,
+				      const u8 *xts_key,
+				      struct block_device *bdev)
 {
-	struct skcipher_request *req;
-	struct scatterlist sg_src, sg_dst;
-	u8 iv[AES_IV_SIZE];
+	struct blk_crypto_config cfg = {
+		.crypto_mode = BLK_ENCRYPTION_MODE_AES_256_XTS,
+		.data_unit_size = LOLELFFS_BLOCK_SIZE,
+		.dun_bytes = sizeof(u64),
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 15, 0)
+		.key_type = BLK_CRYPTO_KEY_TYPE_RAW,
+#endif
+	};
 	int ret;
-	DECLARE_CRYPTO_WAIT(wait);
 
-	if (!enc_ctx[LOLELFFS_ENC_AES256_XTS].available)
-		return -EOPNOTSUPP;
-
-	/* Derive IV from block number */
-	derive_iv_from_block(block_num, iv, AES_IV_SIZE);
-
-	/* Allocate request */
-	req = skcipher_request_alloc(enc_ctx[LOLELFFS_ENC_AES256_XTS].skcipher,
-				     GFP_NOFS);
-	if (!req)
-		return -ENOMEM;
-
-	/* Set up scatter-gather lists */
-	sg_init_one(&sg_src, src, LOLELFFS_BLOCK_SIZE);
-	sg_init_one(&sg_dst, dst, LOLELFFS_BLOCK_SIZE);
-
-	/* Set up request */
-	skcipher_request_set_callback(req, CRYPTO_TFM_REQ_MAY_BACKLOG |
-					   CRYPTO_TFM_REQ_MAY_SLEEP,
-				      crypto_req_done, &wait);
-	skcipher_request_set_crypt(req, &sg_src, &sg_dst,
-				   LOLELFFS_BLOCK_SIZE, iv);
-
-	/* Perform encryption */
-	ret = crypto_wait_req(crypto_skcipher_encrypt(req), &wait);
+	if (!bdev || !blk_crypto_config_supported_natively(bdev, &cfg))
+		return;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 15, 0)
+	ret = blk_crypto_init_key(&key->blk_key, xts_key, AES_XTS_KEY_SIZE,
+				  BLK_CRYPTO_KEY_TYPE_RAW, cfg.crypto_mode,
+				  cfg.dun_bytes, cfg.data_unit_size);
+#else
+	ret = blk_crypto_init_key(&key->blk_key, xts_key, cfg.crypto_mode,
+				  cfg.dun_bytes, cfg.data_unit_size);
+#endif
+	if (ret == 0)
+		ret = blk_crypto_start_using_key(bdev, &key->blk_key);
+	if (ret < 0) {
+		pr_warn("lolelffs: inline encryption unavailable, using software: %d\n",
+			ret);
+		memzero_explicit(&key->blk_key, sizeof(key->blk_key));
+		return;
+	}
 
-	skcipher_request_free(req);
-	return ret;
+	key->blk_bdev = bdev;
+	pr_info("lolelffs: using inline encryption for aes-256-xts\n");
 }
+#endif
 
 /**
- * lolelffs_decrypt_aes_xts - Decrypt using AES-256-XTS
+ * lolelffs_enc_key_setup - Allocate the keyed transforms of a filesystem
+ *
+ * The XTS key is the master key followed by its SHA-256 digest, matching the
+ * userspace tools. Each transform gets a mempool of requests so that the data
+ * path never depends on a fresh allocation succeeding. The software XTS
+ * transform is kept when the hardware takes over, for the packed extents
+ * read through the buffer cache.
  */
-static int lolelffs_decrypt_aes_xts(const u8 *key, u64 block_num,
-				    const void *src, void *dst)
+int lolelffs_enc_key_setup(const u8 *master_key, struct block_device *bdev,
+			   struct lolelffs_enc_key **keyp)
 {
-	struct skcipher_request *req;
-	struct scatterlist sg_src, sg_dst;
-	u8 iv[AES_IV_SIZE];
+	struct lolelffs_enc_key *key;
+	u8 xts_key[AES_XTS_KEY_SIZE];
 	int ret;
-	DECLARE_CRYPTO_WAIT(wait);
 
-	if (!enc_ctx[LOLELFFS_ENC_AES256_XTS].available)
-		return -EOPNOTSUPP;
+	key = kzalloc(sizeof(*key), GFP_KERNEL);
+	if (!key)
+		return -ENOMEM;
 
-	/* Derive IV from block number */
-	derive_iv_from_block(block_num, iv, AES_IV_SIZE);
+	if (enc_ctx[LOLELFFS_ENC_AES256_XTS].available) {
+		key->xts = crypto_alloc_skcipher(enc_algo_names[LOLELFFS_ENC_AES256_XTS],
+						 0, 0);
+		if (IS_ERR(key->xts)) {
+			ret = PTR_ERR(key->xts);
+			key->xts = NULL;
+			goto fail;
+		}
 
-	/* Allocate request */
-	req = skcipher_request_alloc(enc_ctx[LOLELFFS_ENC_AES256_XTS].skcipher,
-				     GFP_NOFS);
-	if (!req)
-		return -ENOMEM;
+		memcpy(xts_key, master_key, 32);
+		sha256(master_key, 32, xts_key + 32);
+		ret = crypto_skcipher_setkey(key->xts, xts_key, AES_XTS_KEY_SIZE);
+#ifdef CONFIG_BLK_INLINE_ENCRYPTION
+		if (ret == 0)
+			lolelffs_enc_inline_setup(key, xts_key, bdev);
+#endif
+		memzero_explicit(xts_key, sizeof(xts_key));
+		if (ret < 0)
+			goto fail;
+
+		key->xts_pool = mempool_create_kmalloc_pool(LOLELFFS_ENC_POOL_SIZE,
+				sizeof(struct skcipher_request) +
+				crypto_skcipher_reqsize(key->xts));
+		if (!key->xts_pool) {
+			ret = -ENOMEM;
+			goto fail;
+		}
+	}
 
-	/* Set up scatter-gather lists */
-	sg_init_one(&sg_src, src, LOLELFFS_BLOCK_SIZE);
-	sg_init_one(&sg_dst, dst, LOLELFFS_BLOCK_SIZE);
+	if (enc_ctx[LOLELFFS_ENC_CHACHA20_POLY].available) {
+		key->aead = crypto_alloc_aead(enc_algo_names[LOLELFFS_ENC_CHACHA20_POLY],
+					      0, 0);
+		if (IS_ERR(key->aead)) {
+			ret = PTR_ERR(key->aead);
+			key->aead = NULL;
+			goto fail;
+		}
 
-	/* Set up request */
-	skcipher_request_set_callback(req, CRYPTO_TFM_REQ_MAY_BACKLOG |
-					   CRYPTO_TFM_REQ_MAY_SLEEP,
-				      crypto_req_done, &wait);
-	skcipher_request_set_crypt(req, &sg_src, &sg_dst,
-				   LOLELFFS_BLOCK_SIZE, iv);
+		ret = crypto_aead_setauthsize(key->aead, CHACHA20_POLY1305_TAG_SIZE);
+		if (ret < 0)
+			goto fail;
+		ret = crypto_aead_setkey(key->aead, master_key, CHACHA20_KEY_SIZE);
+		if (ret < 0)
+			goto fail;
+
+		key->aead_pool = mempool_create_kmalloc_pool(LOLELFFS_ENC_POOL_SIZE,
+				sizeof(struct aead_request) +
+				crypto_aead_reqsize(key->aead));
+		if (!key->aead_pool) {
+			ret = -ENOMEM;
+			goto fail;
+		}
+	}
 
-	/* Perform decryption */
-	ret = crypto_wait_req(crypto_skcipher_decrypt(req), &wait);
+	*keyp = key;
+	return 0;
 
-	skcipher_request_free(req);
+fail:
+	pr_err("lolelffs: failed to set up encryption key: %d\n", ret);
+	lolelffs_enc_key_free(key);
 	return ret;
 }
 
 /**
- * lolelffs_encrypt_chacha20_poly - Encrypt using ChaCha20-Poly1305
+ * lolelffs_enc_key_free - Free the keyed transforms of a filesystem
  */
-static int lolelffs_encrypt_chacha20_poly(const u8 *key, u64 block_num,
-					  const void *src, void *dst)
+void lolelffs_enc_key_free(struct lolelffs_enc_key *key)
 {
-	struct aead_request *req;
-	struct scatterlist sg_src, sg_dst;
-	u8 iv[CHACHA20_IV_SIZE];
-	int ret;
-	DECLARE_CRYPTO_WAIT(wait);
-
-	if (!enc_ctx[LOLELFFS_ENC_CHACHA20_POLY].available)
-		return -EOPNOTSUPP;
-
-	/* Derive IV from block number */
-	derive_iv_from_block(block_num, iv, CHACHA20_IV_SIZE);
-
-	/* Allocate request */
-	req = aead_request_alloc(enc_ctx[LOLELFFS_ENC_CHACHA20_POLY].aead,
-				 GFP_NOFS);
-	if (!req)
-		return -ENOMEM;
-
-	/* Set up scatter-gather lists - dst includes tag */
-	sg_init_one(&sg_src, src, LOLELFFS_BLOCK_SIZE);
-	sg_init_one(&sg_dst, dst, LOLELFFS_BLOCK_SIZE + CHACHA20_POLY1305_TAG_SIZE);
-
-	/* Set up request */
-	aead_request_set_callback(req, CRYPTO_TFM_REQ_MAY_BACKLOG |
-				       CRYPTO_TFM_REQ_MAY_SLEEP,
-				  crypto_req_done, &wait);
-	aead_request_set_crypt(req, &sg_src, &sg_dst,
-			       LOLELFFS_BLOCK_SIZE, iv);
-	aead_request_set_ad(req, 0); /* No associated data */
-
-	/* Perform encryption */
-	ret = crypto_wait_req(crypto_aead_encrypt(req), &wait);
-
-	aead_request_free(req);
-	return ret;
+	if (!key)
+		return;
+
+#ifdef CONFIG_BLK_INLINE_ENCRYPTION
+	if (key->blk_bdev)
+		blk_crypto_evict_key(key->blk_bdev, &key->blk_key);
+	memzero_explicit(&key->blk_key, sizeof(key->blk_key));
+#endif
+	mempool_destroy(key->xts_pool);
+	mempool_destroy(key->aead_pool);
+	if (key->xts)
+		crypto_free_skcipher(key->xts);
+	if (key->aead)
+		crypto_free_aead(key->aead);
+	kfree(key);
 }
 
 /**
- * lolelffs_decrypt_chacha20_poly - Decrypt using ChaCha20-Poly1305
+ * lolelffs_enc_bio_set_ctx - Attach the inline encryption context to a bio
  */
-static int lolelffs_decrypt_chacha20_poly(const u8 *key, u64 block_num,
-					  const void *src, void *dst)
+void lolelffs_enc_bio_set_ctx(struct bio *bio, const struct lolelffs_enc_key *key,
+			      u64 block_num)
 {
-	struct aead_request *req;
-	struct scatterlist sg_src, sg_dst;
-	u8 iv[CHACHA20_IV_SIZE];
-	int ret;
-	DECLARE_CRYPTO_WAIT(wait);
+#ifdef CONFIG_BLK_INLINE_ENCRYPTION
+	u64 dun[BLK_CRYPTO_DUN_ARRAY_SIZE] = { block_num };
 
-	if (!enc_ctx[LOLELFFS_ENC_CHACHA20_POLY].available)
-		return -EOPNOTSUPP;
-
-	/* Derive IV from block number */
-	derive_iv_from_block(block_num, iv, CHACHA20_IV_SIZE);
-
-	/* Allocate request */
-	req = aead_request_alloc(enc_ctx[LOLELFFS_ENC_CHACHA20_POLY].aead,
-				 GFP_NOFS);
-	if (!req)
-		return -ENOMEM;
-
-	/* Set up scatter-gather lists - src includes tag */
-	sg_init_one(&sg_src, src, LOLELFFS_BLOCK_SIZE + CHACHA20_POLY1305_TAG_SIZE);
-	sg_init_one(&sg_dst, dst, LOLELFFS_BLOCK_SIZE);
-
-	/* Set up request */
-	aead_request_set_callback(req, CRYPTO_TFM_REQ_MAY_BACKLOG |
-				       CRYPTO_TFM_REQ_MAY_SLEEP,
-				  crypto_req_done, &wait);
-	aead_request_set_crypt(req, &sg_src, &sg_dst,
-			       LOLELFFS_BLOCK_SIZE + CHACHA20_POLY1305_TAG_SIZE,
-			       iv);
-	aead_request_set_ad(req, 0); /* No associated data */
-
-	/* Perform decryption (includes authentication) */
-	ret = crypto_wait_req(crypto_aead_decrypt(req), &wait);
-
-	aead_request_free(req);
-	return ret; /* Returns -EBADMSG if authentication fails */
+	/* Cannot fail: GFP_NOFS may sleep on the bio_crypt_ctx mempool */
+	bio_crypt_set_ctx(bio, &key->blk_key, dun, GFP_NOFS);
+#endif
 }
 
 /**
- * lolelffs_encrypt_block - Encrypt a block of data
+ * lolelffs_enc_req_init - Get a request usable for any number of blocks
  */
-int lolelffs_encrypt_block(u8 algo, const u8 *key, u64 block_num,
-			    const void *src, void *dst)
+int lolelffs_enc_req_init(struct lolelffs_enc_req *req,
+			   struct lolelffs_enc_key *key, u8 algo)
 {
-	int ret;
+	req->algo = algo;
+	crypto_init_wait(&req->wait);
 
-	if (algo == LOLELFFS_ENC_NONE || algo > LOLELFFS_ENC_MAX_ALGO)
+	switch (algo) {
+	case LOLELFFS_ENC_AES256_XTS:
+		if (!key->xts)
+			return -EOPNOTSUPP;
+		req->skcipher = mempool_alloc(key->xts_pool, GFP_NOFS);
+		req->pool = key->xts_pool;
+		skcipher_request_set_tfm(req->skcipher, key->xts);
+		skcipher_request_set_callback(req->skcipher,
+					      CRYPTO_TFM_REQ_MAY_BACKLOG |
+					      CRYPTO_TFM_REQ_MAY_SLEEP,
+					      crypto_req_done, &req->wait);
+		return 0;
+	case LOLELFFS_ENC_CHACHA20_POLY:
+		if (!key->aead)
+			return -EOPNOTSUPP;
+		req->aead = mempool_alloc(key->aead_pool, GFP_NOFS);
+		req->pool = key->aead_pool;
+		aead_request_set_tfm(req->aead, key->aead);
+		aead_request_set_callback(req->aead, CRYPTO_TFM_REQ_MAY_BACKLOG |
+						     CRYPTO_TFM_REQ_MAY_SLEEP,
+					  crypto_req_done, &req->wait);
+		aead_request_set_ad(req->aead, 0); /* No associated data */
+		return 0;
+	default:
 		return -EINVAL;
+	}
+}
 
-	if (!enc_ctx[algo].available)
-		return -EOPNOTSUPP;
+/**
+ * lolelffs_enc_req_release - Give a request back to its pool
+ */
+void lolelffs_enc_req_release(struct lolelffs_enc_req *req)
+{
+	/* The request context may hold expanded key material */
+	if (req->algo == LOLELFFS_ENC_AES256_XTS) {
+		skcipher_request_zero(req->skcipher);
+		mempool_free(req->skcipher, req->pool);
+	} else {
+		memzero_explicit(req->aead, sizeof(*req->aead) +
+				 crypto_aead_reqsize(crypto_aead_reqtfm(req->aead)));
+		mempool_free(req->aead, req->pool);
+	}
+}
 
-	mutex_lock(&enc_mutex);
+/**
+ * lolelffs_crypt_block - Run one block through a request
+ *
+ * ChaCha20-Poly1305 ciphertext carries a tag after the data, so only
+ * AES-XTS can work in place.
+ */
+static int lolelffs_crypt_block(struct lolelffs_enc_req *req, bool encrypt,
+				u64 block_num, const void *src, void *dst)
+{
+	struct scatterlist sg_src, sg_dst;
+	u8 iv[AES_IV_SIZE];
+	int ret;
 
-	switch (algo) {
+	switch (req->algo) {
 	case LOLELFFS_ENC_AES256_XTS:
-		ret = lolelffs_encrypt_aes_xts(key, block_num, src, dst);
+		derive_iv_from_block(block_num, iv, AES_IV_SIZE);
+		sg_init_one(&sg_src, src, LOLELFFS_BLOCK_SIZE);
+		if (dst != src)
+			sg_init_one(&sg_dst, dst, LOLELFFS_BLOCK_SIZE);
+		skcipher_request_set_crypt(req->skcipher, &sg_src,
+					   dst != src ? &sg_dst : &sg_src,
+					   LOLELFFS_BLOCK_SIZE, iv);
+		ret = encrypt ? crypto_skcipher_encrypt(req->skcipher)
+			      : crypto_skcipher_decrypt(req->skcipher);
 		break;
 	case LOLELFFS_ENC_CHACHA20_POLY:
-		ret = lolelffs_encrypt_chacha20_poly(key, block_num, src, dst);
+		if (dst == src)
+			return -EINVAL;
+		derive_iv_from_block(block_num, iv, CHACHA20_IV_SIZE);
+		/* The tagged side is LOLELFFS_BLOCK_SIZE + tag bytes long */
+		sg_init_one(&sg_src, src, LOLELFFS_BLOCK_SIZE +
+			    (encrypt ? 0 : CHACHA20_POLY1305_TAG_SIZE));
+		sg_init_one(&sg_dst, dst, LOLELFFS_BLOCK_SIZE +
+			    (encrypt ? CHACHA20_POLY1305_TAG_SIZE : 0));
+		aead_request_set_crypt(req->aead, &sg_src, &sg_dst,
+				       LOLELFFS_BLOCK_SIZE +
+				       (encrypt ? 0 : CHACHA20_POLY1305_TAG_SIZE),
+				       iv);
+		ret = encrypt ? crypto_aead_encrypt(req->aead)
+			      : crypto_aead_decrypt(req->aead);
 		break;
 	default:
-		ret = -EINVAL;
-		break;
+		return -EINVAL;
 	}
 
-	mutex_unlock(&enc_mutex);
+	return crypto_wait_req(ret, &req->wait);
+}
 
+/**
+ * lolelffs_encrypt_block - Encrypt a block of data
+ */
+int lolelffs_encrypt_block(struct lolelffs_enc_req *req, u64 block_num,
+			    const void *src, void *dst)
+{
+	u64 start = lolelffs_trace_start(lolelffs_encrypt);
+	int ret;
+
+	ret = lolelffs_crypt_block(req, true, block_num, src, dst);
+	if (start)
+		trace_lolelffs_encrypt(req->algo, block_num, LOLELFFS_BLOCK_SIZE, ret,
+				       ktime_get_ns() - start);
 	if (ret < 0)
 		pr_debug("lolelffs: encryption failed (algo=%s): %d\n",
-			 enc_algo_display_names[algo], ret);
+			 enc_algo_display_names[req->algo], ret);
 
 	return ret;
 }
@@ -311,38 +396,21 @@ int lolelffs_encrypt_block(u8 algo, const u8 *key, u64 block_num,
 /**
  * lolelffs_decrypt_block - Decrypt a block of data
  */
-int lolelffs_decrypt_block(u8 algo, const u8 *key, u64 block_num,
+int lolelffs_decrypt_block(struct lolelffs_enc_req *req, u64 block_num,
 			    const void *src, void *dst)
 {
+	u64 start = lolelffs_trace_start(lolelffs_decrypt);
 	int ret;
 
-	if (algo == LOLELFFS_ENC_NONE || algo > LOLELFFS_ENC_MAX_ALGO)
-		return -EINVAL;
-
-	if (!enc_ctx[algo].available)
-		return -EOPNOTSUPP;
-
-	mutex_lock(&enc_mutex);
-
-	switch (algo) {
-	case LOLELFFS_ENC_AES256_XTS:
-		ret = lolelffs_decrypt_aes_xts(key, block_num, src, dst);
-		break;
-	case LOLELFFS_ENC_CHACHA20_POLY:
-		ret = lolelffs_decrypt_chacha20_poly(key, block_num, src, dst);
-		break;
-	default:
-		ret = -EINVAL;
-		break;
-	}
-
-	mutex_unlock(&enc_mutex);
-
+	ret = lolelffs_crypt_block(req, false, block_num, src, dst);
+	if (start)
+		trace_lolelffs_decrypt(req->algo, block_num, LOLELFFS_BLOCK_SIZE, ret,
+				       ktime_get_ns() - start);
 	if (ret < 0)
 		pr_err("lolelffs: decryption failed (algo=%s): %d\n",
-		       enc_algo_display_names[algo], ret);
+		       enc_algo_display_names[req->algo], ret);
 
-	return ret;
+	return ret; /* Returns -EBADMSG if authentication fails */
 }
 
 /**
@@ -9,33 +9,148 @@
 #define LOLELFFS_ENCRYPT_H
 
 #include <linux/types.h>
+#include <linux/mempool.h>
+#include <crypto/aead.h>
+#include <crypto/skcipher.h>
+#ifdef CONFIG_BLK_INLINE_ENCRYPTION
+#include <linux/blk-crypto.h>
+#endif
+
+struct bio;
+struct block_device;
 
 /**
- * lolelffs_encrypt_block - Encrypt a block of data
+ * struct lolelffs_enc_key - Keyed transforms of an unlocked filesystem
+ * @xts: AES-256-XTS transform, NULL if unavailable
+ * @aead: ChaCha20-Poly1305 transform, NULL if unavailable
+ * @xts_pool: Preallocated requests for @xts
+ * @aead_pool: Preallocated requests for @aead
+ * @blk_key: AES-256-XTS key programmed into the inline encryption hardware
+ * @blk_bdev: Device using @blk_key, NULL if AES-256-XTS is done in software
+ */
+struct lolelffs_enc_key {
+	struct crypto_skcipher *xts;
+	struct crypto_aead *aead;
+	mempool_t *xts_pool;
+	mempool_t *aead_pool;
+#ifdef CONFIG_BLK_INLINE_ENCRYPTION
+	struct blk_crypto_key blk_key;
+	struct block_device *blk_bdev;
+#endif
+};
+
+/**
+ * struct lolelffs_enc_req - Crypto request reused across a batch of blocks
+ * @algo: Encryption algorithm ID (LOLELFFS_ENC_*)
+ * @skcipher: Request for AES-256-XTS
+ * @aead: Request for ChaCha20-Poly1305
+ * @pool: Mempool the request was taken from
+ * @wait: Completion for asynchronous implementations
+ *
+ * Meant to live on the caller's stack for the duration of a batch.
+ */
+struct lolelffs_enc_req {
+	u8 algo;
+	union {
+		struct skcipher_request *skcipher;
+		struct aead_request *aead;
+	};
+	mempool_t *pool;
+	struct crypto_wait wait;
+};
+
+/**
+ * lolelffs_enc_key_setup - Set up the keyed transforms of a filesystem
+ * @master_key: Decrypted filesystem master key (32 bytes)
+ * @bdev: Block device of the filesystem, for inline encryption
+ * @keyp: Output for the new key, freed with lolelffs_enc_key_free()
+ *
+ * Returns 0 on success, negative error code on failure.
+ */
+int lolelffs_enc_key_setup(const u8 *master_key, struct block_device *bdev,
+			   struct lolelffs_enc_key **keyp);
+
+/**
+ * lolelffs_enc_key_free - Free a key set up by lolelffs_enc_key_setup()
+ * @key: Key to free, may be NULL
+ */
+void lolelffs_enc_key_free(struct lolelffs_enc_key *key);
+
+/**
+ * lolelffs_enc_inline - Whether blocks are encrypted by the storage hardware
+ * @key: Keyed transforms of the filesystem, may be NULL
+ * @algo: Encryption algorithm ID (LOLELFFS_ENC_*)
+ *
+ * Blocks encrypted inline are read and written with bios carrying a crypt
+ * context set by lolelffs_enc_bio_set_ctx(), and never go through
+ * lolelffs_encrypt_block() or lolelffs_decrypt_block().
+ */
+static inline bool lolelffs_enc_inline(const struct lolelffs_enc_key *key,
+				       u8 algo)
+{
+#ifdef CONFIG_BLK_INLINE_ENCRYPTION
+	return key && key->blk_bdev && algo == LOLELFFS_ENC_AES256_XTS;
+#else
+	return false;
+#endif
+}
+
+/**
+ * lolelffs_enc_bio_set_ctx - Have the hardware encrypt a bio
+ * @bio: Bio of blocks for which lolelffs_enc_inline() is true
+ * @key: Keyed transforms of the filesystem
+ * @block_num: Logical block number of the first block of @bio
+ *
+ * The blocks of @bio must have consecutive logical block numbers.
+ */
+void lolelffs_enc_bio_set_ctx(struct bio *bio, const struct lolelffs_enc_key *key,
+			      u64 block_num);
+
+/**
+ * lolelffs_enc_req_init - Prepare a request for a batch of blocks
+ * @req: Request to initialize
+ * @key: Keyed transforms of the filesystem
  * @algo: Encryption algorithm ID (LOLELFFS_ENC_*)
- * @key: Encryption key (32 bytes)
- * @iv: Initialization vector (16 bytes for AES, 12 for ChaCha20)
+ *
+ * The request comes from a mempool and is never NULL once this returns 0.
+ * It must be given back with lolelffs_enc_req_release().
+ *
+ * Returns 0 on success, negative error code on failure.
+ */
+int lolelffs_enc_req_init(struct lolelffs_enc_req *req,
+			   struct lolelffs_enc_key *key, u8 algo);
+
+/**
+ * lolelffs_enc_req_release - Release a request prepared by lolelffs_enc_req_init()
+ * @req: Request to release
+ */
+void lolelffs_enc_req_release(struct lolelffs_enc_req *req);
+
+/**
+ * lolelffs_encrypt_block - Encrypt a block of data
+ * @req: Request prepared by lolelffs_enc_req_init()
  * @block_num: Logical block number (used for IV derivation)
  * @src: Source data buffer (LOLELFFS_BLOCK_SIZE)
- * @dst: Destination buffer for encrypted data (LOLELFFS_BLOCK_SIZE + tag size)
+ * @dst: Destination buffer for encrypted data (LOLELFFS_BLOCK_SIZE + tag size),
+ *       may be @src for algorithms without a tag
  *
  * Returns 0 on success, negative error code on failure.
  */
-int lolelffs_encrypt_block(u8 algo, const u8 *key, u64 block_num,
+int lolelffs_encrypt_block(struct lolelffs_enc_req *req, u64 block_num,
 			    const void *src, void *dst);
 
 /**
  * lolelffs_decrypt_block - Decrypt a block of data
- * @algo: Encryption algorithm ID (LOLELFFS_ENC_*)
- * @key: Decryption key (32 bytes)
+ * @req: Request prepared by lolelffs_enc_req_init()
  * @block_num: Logical block number (used for IV derivation)
  * @src: Encrypted data buffer
- * @dst: Destination buffer for decrypted data (LOLELFFS_BLOCK_SIZE)
+ * @dst: Destination buffer for decrypted data (LOLELFFS_BLOCK_SIZE),
+ *       may be @src for algorithms without a tag
  *
  * Returns 0 on success, negative error code on failure.
  * Returns -EBADMSG if authentication fails (for AEAD modes).
  */
-int lolelffs_decrypt_block(u8 algo, const u8 *key, u64 block_num,
+int lolelffs_decrypt_block(struct lolelffs_enc_req *req, u64 block_num,
 			    const void *src, void *dst);
 
 /**
@@ -1,7 +1,10 @@
 #include <linux/fs.h>
 #include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
 
 #include "lolelffs.h"
+#include "trace.h"
 
 /*
  * Count the number of used extents in an index block.
@@ -84,36 +87,21 @@ static uint32_t __maybe_unused lolelffs_extents_total_blocks(struct lolelffs_fil
 }
 
 /*
- * Search the extent which contains the target block using binary search.
- * Return the extent index if found.
- * Return the first unused extent index if not found (for allocation).
- * Return -1 if all extents are used and none contain the block.
- *
- * Optimized version with locality hint support.
+ * Binary search for the extent containing iblock among the first nr_extents
+ * entries of a packed extent array. Return nr_extents if none contains it.
  */
-uint32_t lolelffs_ext_search(struct lolelffs_file_ei_block *index,
-                             uint32_t iblock)
+static uint32_t __lolelffs_ext_search(const struct lolelffs_extent *extents,
+                                      uint32_t nr_extents,
+                                      uint32_t iblock)
 {
-    uint32_t nr_extents = 0;
-    uint32_t left, right, mid;
-
-    /* Find the number of used extents */
-    nr_extents = lolelffs_count_extents(index);
-
-    /* If no extents are allocated, return 0 (first slot for allocation) */
-    if (nr_extents == 0)
-        return 0;
-
-    /* Binary search among used extents */
-    left = 0;
-    right = nr_extents;
+    uint32_t left = 0, right = nr_extents, mid;
 
     while (left < right) {
         uint32_t block, len;
 
         mid = left + (right - left) / 2;
-        block = index->extents[mid].ee_block;
-        len = index->extents[mid].ee_len;
+        block = extents[mid].ee_block;
+        len = extents[mid].ee_len;
 
         if (iblock < block) {
             /* Target is before this extent */
@@ -127,6 +115,32 @@ uint32_t lolelffs_ext_search(struct lolelffs_file_ei_block *index,
         }
     }
 
+    return nr_extents;
+}
+
+/*
+ * Search the extent which contains the target block using binary search.
+ * Return the extent index if found.
+ * Return the first unused extent index if not found (for allocation).
+ * Return -1 if all extents are used and none contain the block.
+ */
+uint32_t lolelffs_ext_search(struct lolelffs_file_ei_block *index,
+                             uint32_t iblock)
+{
+    uint32_t nr_extents = 0;
+    uint32_t extent;
+
+    /* Find the number of used extents */
+    nr_extents = lolelffs_count_extents(index);
+
+    /* If no extents are allocated, return 0 (first slot for allocation) */
+    if (nr_extents == 0)
+        return 0;
+
+    extent = __lolelffs_ext_search(index->extents, nr_extents, iblock);
+    if (extent < nr_extents)
+        return extent;
+
     /* Not found in any extent, return first unused slot for allocation */
     if (nr_extents < LOLELFFS_MAX_EXTENTS)
         return nr_extents;
@@ -139,22 +153,17 @@ uint32_t lolelffs_ext_search(struct lolelffs_file_ei_block *index,
  * Search with locality hint - check the hinted extent first before
  * falling back to binary search. This is useful for sequential access
  * patterns where the next block is likely in the same or adjacent extent.
+ * Return nr_extents if no extent contains the block.
  */
-static uint32_t __maybe_unused lolelffs_ext_search_with_hint(struct lolelffs_file_ei_block *index,
-                                                              uint32_t iblock,
-                                                              uint32_t hint)
+static uint32_t lolelffs_ext_search_with_hint(const struct lolelffs_extent *extents,
+                                              uint32_t nr_extents,
+                                              uint32_t iblock,
+                                              uint32_t hint)
 {
-    uint32_t nr_extents;
-
-    nr_extents = lolelffs_count_extents(index);
-
-    if (nr_extents == 0)
-        return 0;
-
     /* Check if hint is valid */
     if (hint < nr_extents) {
-        uint32_t block = index->extents[hint].ee_block;
-        uint32_t len = index->extents[hint].ee_len;
+        uint32_t block = extents[hint].ee_block;
+        uint32_t len = extents[hint].ee_len;
 
         /* Check if iblock is in the hinted extent */
         if (iblock >= block && iblock < block + len)
@@ -162,13 +171,875 @@ static uint32_t __maybe_unused lolelffs_ext_search_with_hint(struct lolelffs_fil
 
         /* Check next extent (common for sequential access) */
         if (hint + 1 < nr_extents) {
-            block = index->extents[hint + 1].ee_block;
-            len = index->extents[hint + 1].ee_len;
+            block = extents[hint + 1].ee_block;
+            len = extents[hint + 1].ee_len;
             if (iblock >= block && iblock < block + len)
                 return hint + 1;
         }
     }
 
     /* Fall back to binary search */
-    return lolelffs_ext_search(index, iblock);
+    return __lolelffs_ext_search(extents, nr_extents, iblock);
+}
+
+/*
+ * Walk the extent tree whose root is held in root down to the leaf covering
+ * iblock, which is the rightmost one for U32_MAX - 1. Return the leaf buffer in
+ * leaf and its block number in leaf_blk, and the range of logical blocks it
+ * covers, [start, end), with an end of U32_MAX for the rightmost leaf.
+ */
+static int lolelffs_ext_tree_find(struct super_block *sb,
+                                  struct buffer_head *root,
+                                  uint32_t iblock,
+                                  struct buffer_head **leaf,
+                                  uint32_t *leaf_blk,
+                                  uint32_t *start,
+                                  uint32_t *end)
+{
+    struct lolelffs_ext_tree_node *node = (struct lolelffs_ext_tree_node *) root->b_data;
+    struct buffer_head *bh = NULL;
+    uint32_t depth = node->eh.eh_depth;
+    uint32_t left, right, mid, child;
+
+    *start = 0;
+    *end = U32_MAX;
+    if (depth == 0 || depth > LOLELFFS_EXT_TREE_MAX_DEPTH)
+        goto corrupted;
+
+    for (;;) {
+        if (node->eh.eh_entries == 0 ||
+            node->eh.eh_entries > LOLELFFS_EXT_TREE_IDX_ENTRIES)
+            goto corrupted;
+
+        /* Last child starting at or before iblock */
+        left = 0;
+        right = node->eh.eh_entries;
+        while (right - left > 1) {
+            mid = left + (right - left) / 2;
+            if (node->idx[mid].ei_block <= iblock)
+                left = mid;
+            else
+                right = mid;
+        }
+        *start = node->idx[left].ei_block;
+        if (left + 1 < node->eh.eh_entries)
+            *end = node->idx[left + 1].ei_block;
+        child = node->idx[left].ei_child;
+
+        brelse(bh);
+        bh = LOLELFFS_SB_BREAD(sb, child);
+        if (!bh)
+            return -EIO;
+        node = (struct lolelffs_ext_tree_node *) bh->b_data;
+        if (!lolelffs_ext_is_tree(node) || node->eh.eh_depth != --depth)
+            goto corrupted;
+
+        if (depth == 0) {
+            if (node->eh.eh_entries > LOLELFFS_EXT_TREE_LEAF_ENTRIES)
+                goto corrupted;
+            *leaf = bh;
+            *leaf_blk = child;
+            return 0;
+        }
+    }
+
+corrupted:
+    brelse(bh);
+    pr_err("corrupted extent tree\n");
+    return -EIO;
+}
+
+/*
+ * Fill the per-inode extent cache with the extents covering iblock: all the
+ * extents of a plain extent index, or those of one leaf of an extent tree.
+ * A concurrent lolelffs_ext_map_invalidate() bumps ext_map_gen, in which case
+ * the copy we just made may be stale and is dropped instead of installed.
+ *
+ * The lookup is done on the copy, so that it succeeds even if another leaf
+ * is cached in the meantime: if ext is not NULL, copy there the extent
+ * containing iblock and its block in blk, and return its index in that
+ * block, or -ENOENT. If last_end is not NULL, store there the first logical
+ * block past the last extent copied.
+ */
+static int lolelffs_ext_map_load(struct inode *inode,
+                                 uint32_t iblock,
+                                 struct lolelffs_extent *ext,
+                                 uint32_t *blk,
+                                 uint32_t *last_end)
+{
+    struct lolelffs_inode_info *ci = LOLELFFS_INODE(inode);
+    struct lolelffs_file_ei_block *index;
+    struct lolelffs_extent *map = NULL, *extents;
+    struct buffer_head *bh, *leaf = NULL;
+    uint32_t nr_extents, gen, leaf_blk, start = 0, end = U32_MAX, extent;
+    int ret;
+
+    spin_lock(&ci->ext_lock);
+    gen = ci->ext_map_gen;
+    spin_unlock(&ci->ext_lock);
+
+    bh = LOLELFFS_SB_BREAD(inode->i_sb, ci->ei_block);
+    if (!bh)
+        return -EIO;
+    index = (struct lolelffs_file_ei_block *) bh->b_data;
+
+    if (lolelffs_ext_is_tree(index)) {
+        ret = lolelffs_ext_tree_find(inode->i_sb, bh, iblock, &leaf, &leaf_blk,
+                                     &start, &end);
+        if (ret) {
+            brelse(bh);
+            return ret;
+        }
+        extents = ((struct lolelffs_ext_tree_node *) leaf->b_data)->extents;
+        nr_extents = ((struct lolelffs_ext_tree_node *) leaf->b_data)->eh.eh_entries;
+    } else {
+        extents = index->extents;
+        nr_extents = lolelffs_count_extents(index);
+        leaf_blk = ci->ei_block;
+    }
+    if (nr_extents) {
+        map = kmemdup(extents, nr_extents * sizeof(*map), GFP_NOFS);
+        if (!map) {
+            brelse(leaf);
+            brelse(bh);
+            return -ENOMEM;
+        }
+    }
+    brelse(leaf);
+    brelse(bh);
+
+    ret = -ENOENT;
+    if (ext) {
+        extent = __lolelffs_ext_search(map, nr_extents, iblock);
+        if (extent < nr_extents) {
+            *ext = map[extent];
+            *blk = leaf_blk;
+            ret = extent;
+        }
+    }
+    if (last_end)
+        *last_end = nr_extents ? map[nr_extents - 1].ee_block +
+                                     map[nr_extents - 1].ee_len
+                               : start;
+
+    spin_lock(&ci->ext_lock);
+    if (ci->ext_map_gen == gen) {
+        swap(ci->ext_map, map);
+        ci->cached_extent_count = nr_extents;
+        ci->cached_extent_idx = ret >= 0 ? ret : 0;
+        ci->ext_leaf = leaf_blk;
+        ci->ext_leaf_start = start;
+        ci->ext_leaf_end = end;
+        ci->cache_valid = LOLELFFS_CACHE_EXTENT_COUNT | LOLELFFS_CACHE_EXTENT_IDX;
+    }
+    spin_unlock(&ci->ext_lock);
+
+    kfree(map);
+    return ret;
+}
+
+/* Whether the extent cache holds the extents covering iblock */
+static inline bool lolelffs_ext_map_covers(struct lolelffs_inode_info *ci,
+                                           uint32_t iblock)
+{
+    return (ci->cache_valid & LOLELFFS_CACHE_EXTENT_COUNT) &&
+           iblock >= ci->ext_leaf_start && iblock < ci->ext_leaf_end;
+}
+
+/*
+ * Look up the extent containing iblock through the per-inode extent cache,
+ * loading it from disk when it does not cover iblock. On success, copy the
+ * extent to ext, the block holding it (the extent index block, or a leaf of
+ * the extent tree) to blk if not NULL, and return its index in that block.
+ * Return -ENOENT if iblock is not mapped, or another negative error code if
+ * the index could not be read.
+ */
+int lolelffs_ext_map_lookup(struct inode *inode,
+                            uint32_t iblock,
+                            struct lolelffs_extent *ext,
+                            uint32_t *blk)
+{
+    struct lolelffs_sb_info *sbi = LOLELFFS_SB(inode->i_sb);
+    struct lolelffs_inode_info *ci = LOLELFFS_INODE(inode);
+    uint32_t extent, hint, leaf, nr_extents;
+    u64 start = lolelffs_trace_start(lolelffs_ext_search);
+    int ret;
+
+    spin_lock(&ci->ext_lock);
+    if (!lolelffs_ext_map_covers(ci, iblock)) {
+        spin_unlock(&ci->ext_lock);
+        lolelffs_stat_add(sbi, LOLELFFS_STAT_EXT_CACHE_MISSES, 1);
+        ret = lolelffs_ext_map_load(inode, iblock, ext, blk ? blk : &leaf, NULL);
+        if (start)
+            trace_lolelffs_ext_search(inode, iblock,
+                                      READ_ONCE(ci->cached_extent_count), false,
+                                      ret, ktime_get_ns() - start);
+        return ret;
+    }
+
+    hint = (ci->cache_valid & LOLELFFS_CACHE_EXTENT_IDX) ? ci->cached_extent_idx : 0;
+    extent = lolelffs_ext_search_with_hint(ci->ext_map, ci->cached_extent_count,
+                                           iblock, hint);
+    if (extent < ci->cached_extent_count) {
+        *ext = ci->ext_map[extent];
+        if (blk)
+            *blk = ci->ext_leaf;
+        ci->cached_extent_idx = extent;
+        ci->cache_valid |= LOLELFFS_CACHE_EXTENT_IDX;
+        ret = extent;
+    } else {
+        ret = -ENOENT;
+    }
+    nr_extents = ci->cached_extent_count;
+    spin_unlock(&ci->ext_lock);
+
+    lolelffs_stat_add(sbi, LOLELFFS_STAT_EXT_CACHE_HITS, 1);
+    if (start)
+        trace_lolelffs_ext_search(inode, iblock, nr_extents, true, ret,
+                                  ktime_get_ns() - start);
+    return ret;
+}
+
+/*
+ * Store in end the first logical block past the last extent of the inode,
+ * where the next extent must start. Return 0 or a negative error code.
+ */
+int lolelffs_ext_map_end(struct inode *inode, uint32_t *end)
+{
+    struct lolelffs_inode_info *ci = LOLELFFS_INODE(inode);
+    int ret;
+
+    spin_lock(&ci->ext_lock);
+    if (!lolelffs_ext_map_covers(ci, U32_MAX - 1)) {
+        spin_unlock(&ci->ext_lock);
+        ret = lolelffs_ext_map_load(inode, U32_MAX - 1, NULL, NULL, end);
+        return ret == -ENOENT ? 0 : ret;
+    }
+    if (ci->cached_extent_count) {
+        struct lolelffs_extent *last = &ci->ext_map[ci->cached_extent_count - 1];
+
+        *end = last->ee_block + last->ee_len;
+    } else {
+        *end = ci->ext_leaf_start;
+    }
+    spin_unlock(&ci->ext_lock);
+
+    return 0;
+}
+
+/*
+ * Drop the per-inode extent cache. Must be called after every change made to
+ * the extent block of the inode so that the next lookup reloads it.
+ */
+void lolelffs_ext_map_invalidate(struct inode *inode)
+{
+    struct lolelffs_inode_info *ci = LOLELFFS_INODE(inode);
+    struct lolelffs_extent *map;
+
+    spin_lock(&ci->ext_lock);
+    map = ci->ext_map;
+    ci->ext_map = NULL;
+    ci->cached_extent_count = 0;
+    ci->cached_extent_idx = 0;
+    ci->cache_valid = 0;
+    ci->ext_map_gen++;
+    spin_unlock(&ci->ext_lock);
+
+    kfree(map);
+}
+
+/*
+ * Return the number of physical data blocks used by ext from ee_start. This
+ * is ee_len, except for packed extents whose compressed clusters fit in the
+ * fewer blocks recorded in their metadata block. Return 0 if that metadata
+ * block cannot be read or is corrupted.
+ */
+uint32_t lolelffs_ext_phys_len(struct super_block *sb,
+                               const struct lolelffs_extent *ext)
+{
+    struct lolelffs_comp_metadata *meta;
+    struct buffer_head *bh;
+    uint32_t nr_phys = 0;
+
+    if (!(ext->ee_flags & LOLELFFS_EXT_HAS_META))
+        return ext->ee_len;
+
+    bh = LOLELFFS_SB_BREAD(sb, ext->ee_meta);
+    if (!bh)
+        return 0;
+    meta = (struct lolelffs_comp_metadata *) bh->b_data;
+    if (meta->magic == LOLELFFS_COMP_META_MAGIC && meta->nr_phys <= ext->ee_len)
+        nr_phys = meta->nr_phys;
+    brelse(bh);
+
+    return nr_phys;
+}
+
+/* Extents stored in a plain extent index block, or in an extent tree leaf */
+struct lolelffs_extent *lolelffs_ext_block_extents(void *block)
+{
+    if (lolelffs_ext_is_tree(block))
+        return ((struct lolelffs_ext_tree_node *) block)->extents;
+    return ((struct lolelffs_file_ei_block *) block)->extents;
+}
+
+/* Mark a tree node dirty, and write it out now if sync */
+static void lolelffs_ext_tree_dirty(struct buffer_head *bh, bool sync)
+{
+    mark_buffer_dirty(bh);
+    if (sync)
+        sync_dirty_buffer(bh);
+}
+
+/*
+ * Allocate an empty tree node of the given depth near goal. Return its
+ * buffer in bh and its block number in blk.
+ */
+static int lolelffs_ext_tree_new_node(struct super_block *sb,
+                                      uint32_t goal,
+                                      uint16_t depth,
+                                      struct buffer_head **bh,
+                                      uint32_t *blk)
+{
+    struct lolelffs_sb_info *sbi = LOLELFFS_SB(sb);
+    struct lolelffs_ext_tree_node *node;
+
+    *blk = lolelffs_new_blocks(sbi, goal, 1);
+    if (!*blk)
+        return -ENOSPC;
+    *bh = sb_getblk(sb, *blk + sbi->fs_offset);
+    if (!*bh) {
+        lolelffs_free_blocks(sbi, *blk, 1);
+        return -ENOMEM;
+    }
+
+    lock_buffer(*bh);
+    memset((*bh)->b_data, 0, LOLELFFS_BLOCK_SIZE);
+    node = (struct lolelffs_ext_tree_node *) (*bh)->b_data;
+    node->eh.eh_magic = LOLELFFS_EXT_TREE_MAGIC;
+    node->eh.eh_depth = depth;
+    set_buffer_uptodate(*bh);
+    unlock_buffer(*bh);
+
+    return 0;
+}
+
+/*
+ * Read the rightmost path of the extent tree whose root is held in root:
+ * path[0] is the root, path[depth] the rightmost leaf. Return the depth of
+ * the tree, or a negative error code. The caller releases path[1..depth].
+ */
+static int lolelffs_ext_tree_path(struct super_block *sb,
+                                  struct buffer_head *root,
+                                  struct buffer_head **path)
+{
+    struct lolelffs_ext_tree_node *node = (struct lolelffs_ext_tree_node *) root->b_data;
+    uint32_t depth = node->eh.eh_depth, d;
+
+    if (depth == 0 || depth > LOLELFFS_EXT_TREE_MAX_DEPTH)
+        goto corrupted;
+
+    path[0] = root;
+    for (d = 0; d < depth; d++) {
+        node = (struct lolelffs_ext_tree_node *) path[d]->b_data;
+        if (node->eh.eh_entries == 0 ||
+            node->eh.eh_entries > LOLELFFS_EXT_TREE_IDX_ENTRIES)
+            goto corrupted;
+        path[d + 1] = LOLELFFS_SB_BREAD(sb,
+                                        node->idx[node->eh.eh_entries - 1].ei_child);
+        if (!path[d + 1])
+            return -EIO;
+        node = (struct lolelffs_ext_tree_node *) path[d + 1]->b_data;
+        if (!lolelffs_ext_is_tree(node) || node->eh.eh_depth != depth - d - 1)
+            goto corrupted;
+    }
+    node = (struct lolelffs_ext_tree_node *) path[depth]->b_data;
+    if (node->eh.eh_entries > LOLELFFS_EXT_TREE_LEAF_ENTRIES)
+        goto corrupted;
+
+    return depth;
+
+corrupted:
+    pr_err("corrupted extent tree\n");
+    return -EIO;
+}
+
+static void lolelffs_ext_tree_release(struct buffer_head **path, int depth)
+{
+    int d;
+
+    for (d = 1; d <= depth; d++) {
+        brelse(path[d]);
+        path[d] = NULL;
+    }
+}
+
+/*
+ * Return the block where the data of an extent appended to the extent index
+ * held in bh_index should start: right after the last extent, or after the
+ * index block if there is none.
+ */
+uint32_t lolelffs_ext_goal(struct inode *inode, struct buffer_head *bh_index)
+{
+    struct super_block *sb = inode->i_sb;
+    struct lolelffs_file_ei_block *index =
+        (struct lolelffs_file_ei_block *) bh_index->b_data;
+    struct lolelffs_extent *extents = index->extents;
+    struct buffer_head *path[LOLELFFS_EXT_TREE_MAX_DEPTH + 1] = { NULL };
+    uint32_t nr_extents, goal = LOLELFFS_INODE(inode)->ei_block + 1;
+    int depth = 0;
+
+    if (lolelffs_ext_is_tree(index)) {
+        depth = lolelffs_ext_tree_path(sb, bh_index, path);
+        if (depth < 0) {
+            lolelffs_ext_tree_release(path, LOLELFFS_EXT_TREE_MAX_DEPTH);
+            return goal;
+        }
+        extents = ((struct lolelffs_ext_tree_node *) path[depth]->b_data)->extents;
+        nr_extents = ((struct lolelffs_ext_tree_node *) path[depth]->b_data)->eh.eh_entries;
+    } else {
+        nr_extents = lolelffs_count_extents(index);
+    }
+    if (nr_extents)
+        goal = extents[nr_extents - 1].ee_start +
+               lolelffs_ext_phys_len(sb, &extents[nr_extents - 1]);
+
+    lolelffs_ext_tree_release(path, depth);
+    return goal;
+}
+
+/*
+ * Turn the full plain extent index held in bh_index into the root of an
+ * extent tree of depth 1, whose only leaf takes its extents.
+ */
+static int lolelffs_ext_tree_convert(struct inode *inode,
+                                     struct buffer_head *bh_index,
+                                     bool sync)
+{
+    struct lolelffs_file_ei_block *index =
+        (struct lolelffs_file_ei_block *) bh_index->b_data;
+    struct lolelffs_ext_tree_node *root, *leaf;
+    struct buffer_head *bh;
+    uint32_t blk;
+    int ret;
+
+    ret = lolelffs_ext_tree_new_node(inode->i_sb, LOLELFFS_INODE(inode)->ei_block + 1,
+                                     0, &bh, &blk);
+    if (ret)
+        return ret;
+    leaf = (struct lolelffs_ext_tree_node *) bh->b_data;
+    memcpy(leaf->extents, index->extents,
+           LOLELFFS_MAX_EXTENTS * sizeof(struct lolelffs_extent));
+    leaf->eh.eh_entries = LOLELFFS_MAX_EXTENTS;
+    lolelffs_ext_tree_dirty(bh, sync);
+    brelse(bh);
+
+    memset(bh_index->b_data, 0, LOLELFFS_BLOCK_SIZE);
+    root = (struct lolelffs_ext_tree_node *) bh_index->b_data;
+    root->eh.eh_magic = LOLELFFS_EXT_TREE_MAGIC;
+    root->eh.eh_depth = 1;
+    root->eh.eh_entries = 1;
+    root->idx[0].ei_block = 0;
+    root->idx[0].ei_child = blk;
+
+    return 0;
+}
+
+/*
+ * Append ext to the rightmost leaf of the extent tree held in bh_index. A
+ * full leaf gets a new sibling, which may fill its parents in turn, up to
+ * the root, which then grows the tree by one level. All the new nodes are
+ * allocated first, so that a failure leaves the tree unchanged.
+ */
+static int lolelffs_ext_tree_append(struct inode *inode,
+                                    struct buffer_head *bh_index,
+                                    const struct lolelffs_extent *ext,
+                                    bool sync)
+{
+    struct super_block *sb = inode->i_sb;
+    struct lolelffs_sb_info *sbi = LOLELFFS_SB(sb);
+    struct buffer_head *path[LOLELFFS_EXT_TREE_MAX_DEPTH + 1] = { NULL };
+    struct buffer_head *nodes[LOLELFFS_EXT_TREE_MAX_DEPTH + 2] = { NULL };
+    uint32_t blks[LOLELFFS_EXT_TREE_MAX_DEPTH + 2];
+    struct lolelffs_ext_tree_node *node, *root;
+    struct lolelffs_ext_tree_idx pending;
+    int depth, d, nr_nodes = 0, n = 0, i, ret;
+    bool grow = false;
+
+    depth = lolelffs_ext_tree_path(sb, bh_index, path);
+    if (depth < 0) {
+        ret = depth;
+        depth = LOLELFFS_EXT_TREE_MAX_DEPTH;
+        goto out;
+    }
+
+    node = (struct lolelffs_ext_tree_node *) path[depth]->b_data;
+    if (node->eh.eh_entries < LOLELFFS_EXT_TREE_LEAF_ENTRIES) {
+        node->extents[node->eh.eh_entries++] = *ext;
+        lolelffs_ext_tree_dirty(path[depth], sync);
+        ret = 0;
+        goto out;
+    }
+
+    /* A new leaf, a sibling for each full parent, two more to grow */
+    nr_nodes = 1;
+    for (d = depth - 1; d >= 0; d--) {
+        node = (struct lolelffs_ext_tree_node *) path[d]->b_data;
+        if (node->eh.eh_entries < LOLELFFS_EXT_TREE_IDX_ENTRIES)
+            break;
+        if (d == 0) {
+            if (depth == LOLELFFS_EXT_TREE_MAX_DEPTH) {
+                ret = -EFBIG;
+                goto out;
+            }
+            grow = true;
+            nr_nodes++;
+        }
+        nr_nodes++;
+    }
+    for (i = 0; i < nr_nodes; i++) {
+        /* Nodes of the new path, leaf first; the grown root's child last */
+        uint16_t level = i < depth ? i : depth;
+
+        ret = lolelffs_ext_tree_new_node(sb, ext->ee_start + ext->ee_len, level,
+                                         &nodes[i], &blks[i]);
+        if (ret) {
+            while (i--) {
+                bforget(nodes[i]);
+                lolelffs_free_blocks(sbi, blks[i], 1);
+            }
+            goto out;
+        }
+    }
+
+    /* Children are written before the parents that point to them */
+    node = (struct lolelffs_ext_tree_node *) nodes[0]->b_data;
+    node->extents[0] = *ext;
+    node->eh.eh_entries = 1;
+    lolelffs_ext_tree_dirty(nodes[0], sync);
+    pending.ei_block = ext->ee_block;
+    pending.ei_child = blks[0];
+    n = 1;
+
+    for (d = depth - 1; d >= 0; d--) {
+        node = (struct lolelffs_ext_tree_node *) path[d]->b_data;
+        if (node->eh.eh_entries < LOLELFFS_EXT_TREE_IDX_ENTRIES) {
+            node->idx[node->eh.eh_entries++] = pending;
+            if (d)
+                lolelffs_ext_tree_dirty(path[d], sync);
+            break;
+        }
+        if (d == 0)
+            break;
+        node = (struct lolelffs_ext_tree_node *) nodes[n]->b_data;
+        node->idx[0] = pending;
+        node->eh.eh_entries = 1;
+        lolelffs_ext_tree_dirty(nodes[n], sync);
+        pending.ei_child = blks[n++];
+    }
+
+    if (grow) {
+        /* The new root level: the old root moves down, next to the new path */
+        root = (struct lolelffs_ext_tree_node *) bh_index->b_data;
+        node = (struct lolelffs_ext_tree_node *) nodes[n]->b_data;
+        node->idx[0] = pending;
+        node->eh.eh_entries = 1;
+        lolelffs_ext_tree_dirty(nodes[n], sync);
+        pending.ei_child = blks[n++];
+
+        node = (struct lolelffs_ext_tree_node *) nodes[n]->b_data;
+        memcpy(node->idx, root->idx, sizeof(root->idx));
+        node->eh.eh_entries = root->eh.eh_entries;
+        lolelffs_ext_tree_dirty(nodes[n], sync);
+
+        memset(root->idx, 0, sizeof(root->idx));
+        root->eh.eh_depth = depth + 1;
+        root->eh.eh_entries = 2;
+        root->idx[0].ei_block = 0;
+        root->idx[0].ei_child = blks[n];
+        root->idx[1] = pending;
+    }
+    ret = 0;
+
+    for (i = 0; i < nr_nodes; i++)
+        brelse(nodes[i]);
+out:
+    lolelffs_ext_tree_release(path, depth);
+    return ret;
+}
+
+/*
+ * Append ext, which must start where the last extent of the inode ends, to
+ * the extent index held in bh_index. A full plain index is turned into an
+ * extent tree if the filesystem allows it, or fails with -EFBIG otherwise.
+ * Changes to bh_index are left to the caller to write back. The other tree
+ * nodes are written back here, synchronously if sync.
+ */
+int lolelffs_ext_append(struct inode *inode,
+                        struct buffer_head *bh_index,
+                        const struct lolelffs_extent *ext,
+                        bool sync)
+{
+    struct lolelffs_sb_info *sbi = LOLELFFS_SB(inode->i_sb);
+    struct lolelffs_file_ei_block *index =
+        (struct lolelffs_file_ei_block *) bh_index->b_data;
+    uint32_t nr_extents;
+    int ret;
+
+    if (!lolelffs_ext_is_tree(index)) {
+        nr_extents = lolelffs_count_extents(index);
+        if (nr_extents < LOLELFFS_MAX_EXTENTS) {
+            index->extents[nr_extents] = *ext;
+            return 0;
+        }
+        if (!(sbi->comp_features & LOLELFFS_FEATURE_EXTENT_TREE))
+            return -EFBIG;
+        ret = lolelffs_ext_tree_convert(inode, bh_index, sync);
+        if (ret)
+            return ret;
+    }
+
+    return lolelffs_ext_tree_append(inode, bh_index, ext, sync);
+}
+
+/* Free the blocks of an extent, after zeroing its data blocks if scrub */
+void lolelffs_ext_free(struct super_block *sb,
+                       const struct lolelffs_extent *ext,
+                       bool scrub)
+{
+    struct lolelffs_sb_info *sbi = LOLELFFS_SB(sb);
+    struct buffer_head *bh;
+    uint32_t nr_phys, bi;
+
+    /* Packed extents use fewer blocks, plus their metadata block */
+    nr_phys = lolelffs_ext_phys_len(sb, ext);
+    lolelffs_free_blocks(sbi, ext->ee_start, nr_phys);
+    if (ext->ee_flags & LOLELFFS_EXT_HAS_META)
+        lolelffs_free_blocks(sbi, ext->ee_meta, 1);
+
+    if (!scrub)
+        return;
+    for (bi = 0; bi < nr_phys; bi++) {
+        bh = LOLELFFS_SB_BREAD(sb, ext->ee_start + bi);
+        if (!bh)
+            continue;
+        memset(bh->b_data, 0, LOLELFFS_BLOCK_SIZE);
+        mark_buffer_dirty(bh);
+        brelse(bh);
+    }
+}
+
+/*
+ * Turn an extent tree whose root has a single child back into a smaller
+ * tree, or into a plain extent index once its extents fit there.
+ */
+static void lolelffs_ext_tree_shrink(struct super_block *sb,
+                                     struct buffer_head *bh_index)
+{
+    struct lolelffs_ext_tree_node *root =
+        (struct lolelffs_ext_tree_node *) bh_index->b_data;
+    struct lolelffs_file_ei_block *index =
+        (struct lolelffs_file_ei_block *) bh_index->b_data;
+    struct lolelffs_ext_tree_node *child;
+    struct buffer_head *bh;
+    uint32_t blk;
+
+    while (lolelffs_ext_is_tree(root) && root->eh.eh_entries == 1) {
+        blk = root->idx[0].ei_child;
+        bh = LOLELFFS_SB_BREAD(sb, blk);
+        if (!bh)
+            return;
+        child = (struct lolelffs_ext_tree_node *) bh->b_data;
+        if (child->eh.eh_depth == 0) {
+            uint32_t nr_extents = child->eh.eh_entries;
+
+            memset(index, 0, LOLELFFS_BLOCK_SIZE);
+            memcpy(index->extents, child->extents,
+                   nr_extents * sizeof(struct lolelffs_extent));
+        } else {
+            memcpy(root, child, LOLELFFS_BLOCK_SIZE);
+        }
+        bforget(bh);
+        lolelffs_free_blocks(LOLELFFS_SB(sb), blk, 1);
+    }
+}
+
+/*
+ * Whether one of the extents below node (or of the plain extent index
+ * index) that start at or past logical block first has one of flags. Returns
+ * 1 if so, after copying the first such extent to found if not NULL, 0 if
+ * not, or a negative error.
+ */
+static int lolelffs_ext_flagged_from(struct super_block *sb,
+                                     const void *block,
+                                     uint32_t first,
+                                     uint16_t flags,
+                                     struct lolelffs_extent *found)
+{
+    const struct lolelffs_ext_tree_node *node = block;
+    const struct lolelffs_file_ei_block *index = block;
+    const struct lolelffs_extent *ext = NULL;
+    struct buffer_head *bh;
+    uint32_t entries, i;
+    int ret = 0;
+
+    if (!lolelffs_ext_is_tree(block)) {
+        for (i = 0; i < LOLELFFS_MAX_EXTENTS && index->extents[i].ee_start; i++) {
+            if (index->extents[i].ee_block >= first &&
+                (index->extents[i].ee_flags & flags)) {
+                ext = &index->extents[i];
+                break;
+            }
+        }
+        goto out;
+    }
+
+    entries = node->eh.eh_entries;
+    if (node->eh.eh_depth == 0) {
+        for (i = 0; i < entries && i < LOLELFFS_EXT_TREE_LEAF_ENTRIES; i++) {
+            if (node->extents[i].ee_block >= first &&
+                (node->extents[i].ee_flags & flags)) {
+                ext = &node->extents[i];
+                break;
+            }
+        }
+        goto out;
+    }
+
+    for (i = 0; i < entries && i < LOLELFFS_EXT_TREE_IDX_ENTRIES && !ret; i++) {
+        /* Children ending before first hold no extent to look at */
+        if (i + 1 < entries && node->idx[i + 1].ei_block <= first)
+            continue;
+        bh = LOLELFFS_SB_BREAD(sb, node->idx[i].ei_child);
+        if (!bh)
+            return -EIO;
+        if (!lolelffs_ext_is_tree(bh->b_data) ||
+            ((struct lolelffs_ext_tree_node *) bh->b_data)->eh.eh_depth + 1 !=
+                node->eh.eh_depth)
+            ret = -EIO;
+        else
+            ret = lolelffs_ext_flagged_from(sb, bh->b_data, first, flags, found);
+        brelse(bh);
+    }
+    return ret;
+
+out:
+    if (!ext)
+        return 0;
+    if (found)
+        *found = *ext;
+    return 1;
+}
+
+/*
+ * Copy to ext the first extent of the inode starting at or past logical
+ * block first that has one of flags. Return 1 if there is one, 0 if not, or
+ * a negative error code.
+ */
+int lolelffs_ext_find_flagged(struct inode *inode,
+                              uint32_t first,
+                              uint16_t flags,
+                              struct lolelffs_extent *ext)
+{
+    struct buffer_head *bh;
+    int ret;
+
+    bh = LOLELFFS_SB_BREAD(inode->i_sb, LOLELFFS_INODE(inode)->ei_block);
+    if (!bh)
+        return -EIO;
+    ret = lolelffs_ext_flagged_from(inode->i_sb, bh->b_data, first, flags, ext);
+    brelse(bh);
+
+    return ret;
+}
+
+/*
+ * Free the extents of the inode that start at or past logical block first,
+ * zeroing their data blocks if scrub, along with the extent tree nodes they
+ * leave empty. The extent index is held in bh_index, whose changes are left
+ * to the caller to write back.
+ *
+ * Other files may map the blocks of shared extents, and only the tools know
+ * which: if one of the extents is shared, nothing is freed and -EOPNOTSUPP
+ * is returned.
+ */
+int lolelffs_ext_truncate(struct inode *inode,
+                          struct buffer_head *bh_index,
+                          uint32_t first,
+                          bool scrub)
+{
+    struct super_block *sb = inode->i_sb;
+    struct lolelffs_sb_info *sbi = LOLELFFS_SB(sb);
+    struct lolelffs_file_ei_block *index =
+        (struct lolelffs_file_ei_block *) bh_index->b_data;
+    struct buffer_head *path[LOLELFFS_EXT_TREE_MAX_DEPTH + 1] = { NULL };
+    struct lolelffs_ext_tree_node *node;
+    uint32_t i, blk;
+    int depth, d;
+
+    if (sbi->comp_features & LOLELFFS_FEATURE_SHARED_EXTENTS) {
+        d = lolelffs_ext_flagged_from(sb, index, first, LOLELFFS_EXT_SHARED, NULL);
+        if (d)
+            return d < 0 ? d : -EOPNOTSUPP;
+    }
+
+    if (!lolelffs_ext_is_tree(index)) {
+        for (i = 0; i < LOLELFFS_MAX_EXTENTS; i++) {
+            if (!index->extents[i].ee_start)
+                break;
+            if (index->extents[i].ee_block < first)
+                continue;
+            lolelffs_ext_free(sb, &index->extents[i], scrub);
+            memset(&index->extents[i], 0, sizeof(struct lolelffs_extent));
+        }
+        return 0;
+    }
+
+    /* Empty the rightmost leaf, and drop it, until it keeps an extent */
+    for (;;) {
+        depth = lolelffs_ext_tree_path(sb, bh_index, path);
+        if (depth < 0) {
+            lolelffs_ext_tree_release(path, LOLELFFS_EXT_TREE_MAX_DEPTH);
+            return depth;
+        }
+
+        node = (struct lolelffs_ext_tree_node *) path[depth]->b_data;
+        while (node->eh.eh_entries &&
+               node->extents[node->eh.eh_entries - 1].ee_block >= first) {
+            struct lolelffs_extent *ext = &node->extents[--node->eh.eh_entries];
+
+            lolelffs_ext_free(sb, ext, scrub);
+            memset(ext, 0, sizeof(*ext));
+        }
+        if (node->eh.eh_entries) {
+            mark_buffer_dirty(path[depth]);
+            lolelffs_ext_tree_release(path, depth);
+            break;
+        }
+
+        for (d = depth; d > 0; d--) {
+            node = (struct lolelffs_ext_tree_node *) path[d - 1]->b_data;
+            blk = node->idx[--node->eh.eh_entries].ei_child;
+            memset(&node->idx[node->eh.eh_entries], 0,
+                   sizeof(struct lolelffs_ext_tree_idx));
+            bforget(path[d]);
+            path[d] = NULL;
+            lolelffs_free_blocks(sbi, blk, 1);
+            if (node->eh.eh_entries) {
+                if (d > 1)
+                    mark_buffer_dirty(path[d - 1]);
+                break;
+            }
+        }
+        lolelffs_ext_tree_release(path, depth);
+
+        /* The whole tree is gone */
+        if (d == 0) {
+            memset(index, 0, LOLELFFS_BLOCK_SIZE);
+            return 0;
+        }
+    }
+
+    lolelffs_ext_tree_shrink(sb, bh_index);
+    return 0;
 }
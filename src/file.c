@@ -3,10 +3,12 @@
 #include <linux/buffer_head.h>
 #include <linux/fs.h>
 #include <linux/kernel.h>
+#include <linux/mempool.h>
 #include <linux/module.h>
-#include <linux/mpage.h>
 #include <linux/vmalloc.h>
+#include <linux/workqueue.h>
 #include <linux/writeback.h>
+#include <linux/bio.h>
 #include <linux/blkdev.h>
 #include <linux/pagemap.h>
 #include <linux/pagevec.h>
@@ -15,11 +17,95 @@
 #include "lolelffs.h"
 #include "compress.h"
 #include "encrypt.h"
+#include "trace.h"
+
+/*
+ * Reserve free space for iblock, which lies past the last extent of the inode
+ * and will only get an extent at writeback time. The reservation also covers
+ * the unallocated blocks before iblock, which that extent will include too.
+ * Return -EAGAIN if writeback allocated iblock in the meantime.
+ */
+static int lolelffs_da_reserve(struct inode *inode, uint32_t iblock)
+{
+    struct lolelffs_sb_info *sbi = LOLELFFS_SB(inode->i_sb);
+    struct lolelffs_inode_info *ci = LOLELFFS_INODE(inode);
+    uint32_t start, nr;
+    int ret = 0;
+
+    lolelffs_alloc_lock(sbi, ci);
+    if (ci->da_reserved && iblock < ci->da_end)
+        goto unlock;
+
+    if (ci->da_reserved) {
+        start = ci->da_end;
+    } else {
+        ret = lolelffs_ext_map_end(inode, &start);
+        if (ret)
+            goto unlock;
+        if (iblock < start) {
+            ret = -EAGAIN;
+            goto unlock;
+        }
+    }
+    nr = iblock + 1 - start;
+
+    lolelffs_sb_lock(sbi);
+    if (lolelffs_nr_free_blocks(sbi) - sbi->nr_reserved_blocks < nr)
+        ret = -ENOSPC;
+    else
+        sbi->nr_reserved_blocks += nr;
+    mutex_unlock(&sbi->lock);
+
+    if (!ret) {
+        ci->da_reserved += nr;
+        ci->da_end = iblock + 1;
+    }
+
+unlock:
+    mutex_unlock(&ci->alloc_lock);
+    return ret;
+}
+
+/*
+ * Give back the reserved blocks at or past the end-th block of the inode,
+ * after a truncation or a failed write. An end of 0 releases all of them.
+ */
+void lolelffs_da_release(struct inode *inode, uint32_t end)
+{
+    struct lolelffs_sb_info *sbi = LOLELFFS_SB(inode->i_sb);
+    struct lolelffs_inode_info *ci = LOLELFFS_INODE(inode);
+    uint32_t nr;
+
+    lolelffs_alloc_lock(sbi, ci);
+    if (ci->da_reserved && end < ci->da_end) {
+        nr = min(ci->da_reserved, ci->da_end - end);
+        ci->da_reserved -= nr;
+        ci->da_end -= nr;
+
+        lolelffs_sb_lock(sbi);
+        sbi->nr_reserved_blocks -= nr;
+        mutex_unlock(&sbi->lock);
+    }
+    mutex_unlock(&ci->alloc_lock);
+}
+
+/*
+ * Logical blocks a file can have: as many as the extent index can map with
+ * extents of metadata-sized length, or up to the size limit with trees.
+ */
+static uint32_t lolelffs_max_file_blocks(struct lolelffs_sb_info *sbi)
+{
+    if (sbi->comp_features & LOLELFFS_FEATURE_EXTENT_TREE)
+        return LOLELFFS_MAX_FILE_BLOCKS;
+    return LOLELFFS_MAX_BLOCKS_PER_EXTENT * LOLELFFS_MAX_EXTENTS;
+}
 
 /*
  * Map the buffer_head passed in argument with the iblock-th block of the file
  * represented by inode. If the requested block is not allocated and create is
- * true,  allocate a new block on disk and map it.
+ * true, reserve space for it and map it as a delayed block: its extent is
+ * allocated at writeback time, when the whole dirty range of the file is
+ * known, by lolelffs_da_alloc().
  */
 static int lolelffs_file_get_block(struct inode *inode,
                                    sector_t iblock,
@@ -28,90 +114,421 @@ static int lolelffs_file_get_block(struct inode *inode,
 {
     struct super_block *sb = inode->i_sb;
     struct lolelffs_sb_info *sbi = LOLELFFS_SB(sb);
-    struct lolelffs_inode_info *ci = LOLELFFS_INODE(inode);
-    struct lolelffs_file_ei_block *index;
-    struct buffer_head *bh_index;
-    bool alloc = false;
-    int ret = 0, bno;
-    uint32_t extent;
+    struct lolelffs_extent ext;
+    int ret;
 
     /* If block number exceeds filesize, fail */
-    if (iblock >= LOLELFFS_MAX_BLOCKS_PER_EXTENT * LOLELFFS_MAX_EXTENTS)
+    if (iblock >= lolelffs_max_file_blocks(sbi))
         return -EFBIG;
 
-    /* Read directory block from disk */
-    bh_index = LOLELFFS_SB_BREAD(sb, ci->ei_block);
-    if (!bh_index)
-        return -EIO;
-    index = (struct lolelffs_file_ei_block *) bh_index->b_data;
+    do {
+        ret = lolelffs_ext_map_lookup(inode, iblock, &ext, NULL);
+        if (ret >= 0) {
+            /*
+             * Blocks of packed extents have no 1:1 physical mapping to write
+             * to, and other files may map shared blocks:
+             * lolelffs_file_prepare_write() rewrites both on open
+             */
+            if (ext.ee_flags & LOLELFFS_EXT_HAS_META)
+                return -EOPNOTSUPP;
+            if (create && (ext.ee_flags & LOLELFFS_EXT_SHARED))
+                return -EOPNOTSUPP;
+            map_bh(bh_result, sb,
+                   ext.ee_start + (iblock - ext.ee_block) + sbi->fs_offset);
+            return 0;
+        }
+        if (ret != -ENOENT)
+            return ret;
+        if (!create)
+            return 0;
+
+        ret = lolelffs_da_reserve(inode, iblock);
+    } while (ret == -EAGAIN);
+    if (ret)
+        return ret;
+
+    /* Like ext4, map delayed blocks to an invalid block number */
+    map_bh(bh_result, sb, ~(sector_t) 0);
+    set_buffer_new(bh_result);
+    set_buffer_delay(bh_result);
+
+    return 0;
+}
+
+/* Workqueue used to decrypt and decompress readahead bios off the IRQ path */
+static struct workqueue_struct *lolelffs_read_wq;
+
+/*
+ * Per-bio state for a readahead run that needs decoding once the I/O
+ * completes. All folios of the bio share the same extent-level algorithms.
+ */
+struct lolelffs_read_ctx {
+    struct work_struct work;
+    struct bio *bio;
+    struct lolelffs_sb_info *sbi;
+    unsigned long ino;
+    u8 comp_algo;
+    u8 enc_algo;
+};
 
-    extent = lolelffs_ext_search(index, iblock);
-    if (extent == -1) {
-        ret = -EFBIG;
-        goto brelse_index;
+/*
+ * Prepare req for decoding blocks encrypted with enc_algo. Fail with -EPERM
+ * while the filesystem is locked.
+ */
+static int lolelffs_read_enc_req(struct lolelffs_sb_info *sbi,
+                                 u8 enc_algo,
+                                 struct lolelffs_enc_req *req)
+{
+    struct lolelffs_enc_key *key = smp_load_acquire(&sbi->enc_key);
+
+    if (!key) {
+        pr_err("cannot read encrypted block: filesystem is locked\n");
+        return -EPERM;
     }
 
-    /*
-     * Check if iblock is already allocated. If not and create is true,
-     * allocate it. Else, get the physical block number.
-     */
-    if (index->extents[extent].ee_start == 0) {
-        uint32_t alloc_size;
-        if (!create)
+    return lolelffs_enc_req_init(req, key, enc_algo);
+}
+
+/*
+ * Run the decrypt-then-decompress pipeline on one on-disk block. src may alias
+ * dst. req must have been prepared for enc_algo if the block is encrypted;
+ * scratch must be a LOLELFFS_BLOCK_SIZE buffer when the block is compressed,
+ * or when it is decrypted in place with an algorithm that appends a tag.
+ */
+static int lolelffs_decode_block(struct lolelffs_enc_req *req,
+                                 u8 comp_algo,
+                                 u8 enc_algo,
+                                 u64 iblock,
+                                 const void *src,
+                                 void *dst,
+                                 void *scratch)
+{
+    bool encrypted = enc_algo != LOLELFFS_ENC_NONE && lolelffs_enc_supported(enc_algo);
+    bool compressed = comp_algo != LOLELFFS_COMP_NONE && lolelffs_comp_supported(comp_algo);
+    int ret;
+
+    /* Step 1: Decrypt if needed, in place when the cipher allows it */
+    if (encrypted) {
+        void *out = dst;
+
+        if (compressed || (src == dst && lolelffs_enc_tag_size(enc_algo)))
+            out = scratch;
+
+        ret = lolelffs_decrypt_block(req, iblock, src, out);
+        if (ret < 0)
+            return ret;
+
+        if (!compressed) {
+            if (out != dst)
+                memcpy(dst, out, LOLELFFS_BLOCK_SIZE);
             return 0;
-        /* Use adaptive allocation based on current file size */
-        /* Currently always false - no per-block metadata */
-        bool needs_metadata = false;
-        alloc_size = calc_optimal_extent_size(sbi, inode->i_blocks, needs_metadata);
-        bno = get_free_blocks(sbi, alloc_size);
-        if (!bno) {
-            ret = -ENOSPC;
-            goto brelse_index;
-        }
-        index->extents[extent].ee_start = bno;
-        index->extents[extent].ee_len = alloc_size;
-        index->extents[extent].ee_block =
-            extent ? index->extents[extent - 1].ee_block +
-                         index->extents[extent - 1].ee_len
-                   : 0;
-        alloc = true;
-    } else {
-        bno = index->extents[extent].ee_start + iblock -
-              index->extents[extent].ee_block;
+        }
+        src = out;
+    } else if (compressed && src == dst) {
+        /* The decompressors cannot work in place */
+        memcpy(scratch, src, LOLELFFS_BLOCK_SIZE);
+        src = scratch;
     }
 
-    /* Map the physical block to to the given buffer_head (adjust for ELF offset) */
-    map_bh(bh_result, sb, bno + ((struct lolelffs_sb_info *)sb->s_fs_info)->fs_offset);
+    /* Step 2: Decompress if needed */
+    if (compressed)
+        return lolelffs_decompress_block(comp_algo, src, LOLELFFS_BLOCK_SIZE,
+                                         dst, LOLELFFS_BLOCK_SIZE);
 
-    /* If we allocated a new extent, mark the index as dirty and sync it */
-    if (alloc) {
-        mark_buffer_dirty(bh_index);
-        sync_dirty_buffer(bh_index);
+    /* No compression - direct copy */
+    if (src != dst)
+        memcpy(dst, src, LOLELFFS_BLOCK_SIZE);
+    return 0;
+}
+
+/* The last cluster decoded from a packed extent, reused by its other folios */
+struct lolelffs_cluster_cache {
+    void *buf;            /* LOLELFFS_COMP_CLUSTER_SIZE bytes */
+    uint32_t ee_start;    /* Extent the cluster belongs to */
+    uint32_t first;       /* First logical block of the cluster */
+    uint32_t nr_blocks;   /* Number of valid blocks in buf, 0 if none */
+};
+
+/*
+ * Read and decompress the cluster of the packed extent ext which contains the
+ * rel-th block of the extent. On success, buf holds the cluster, *first is
+ * set to its first block relative to the extent and the number of blocks
+ * decoded is returned.
+ *
+ * The packed blocks of an encrypted extent are encrypted after compression
+ * like the logical blocks at the same offset in the extent: the b-th one
+ * with the tweak of block ee_block + b. Only ciphers without a tag can do
+ * that, see lolelffs-tools.
+ */
+static int lolelffs_read_cluster(struct super_block *sb,
+                                 const struct lolelffs_extent *ext,
+                                 uint32_t rel,
+                                 void *buf,
+                                 uint32_t *first)
+{
+    struct lolelffs_sb_info *sbi = LOLELFFS_SB(sb);
+    struct lolelffs_comp_metadata *meta;
+    struct lolelffs_enc_req req;
+    struct buffer_head *bh;
+    uint32_t shift, cluster, nr_blocks = 0, b, first_b, last_b, i;
+    size_t off = 0, size = 0, done;
+    bool compressed, encrypted = ext->ee_enc_algo != LOLELFFS_ENC_NONE;
+    void *src, *dst, *plain = NULL;
+    u8 algo;
+    int ret = 0;
+
+    if (encrypted && lolelffs_enc_tag_size(ext->ee_enc_algo))
+        return -EOPNOTSUPP;
+
+    bh = LOLELFFS_SB_BREAD(sb, ext->ee_meta);
+    if (!bh)
+        return -EIO;
+    meta = (struct lolelffs_comp_metadata *) bh->b_data;
+
+    shift = meta->cluster_shift;
+    if (meta->magic != LOLELFFS_COMP_META_MAGIC ||
+        shift > LOLELFFS_COMP_CLUSTER_SHIFT ||
+        meta->nr_blocks != ext->ee_len || meta->nr_phys > ext->ee_len ||
+        meta->nr_clusters > LOLELFFS_COMP_META_ENTRIES ||
+        meta->nr_clusters != DIV_ROUND_UP(meta->nr_blocks, 1U << shift)) {
+        pr_err("corrupted compression metadata in block %u\n", ext->ee_meta);
+        brelse(bh);
+        return -EIO;
     }
 
-brelse_index:
-    brelse(bh_index);
+    /* Clusters are packed back to back: sum the sizes of the previous ones */
+    cluster = rel >> shift;
+    for (i = 0; i <= cluster; i++) {
+        nr_blocks = min_t(uint32_t, 1U << shift, meta->nr_blocks - (i << shift));
+        size = meta->clusters[i].comp_size;
+        if (!size)
+            size = nr_blocks * LOLELFFS_BLOCK_SIZE;
+        if (i < cluster)
+            off += size;
+    }
+    compressed = meta->clusters[cluster].comp_size != 0;
+    algo = meta->clusters[cluster].comp_algo ? meta->clusters[cluster].comp_algo
+                                             : ext->ee_comp_algo;
+    first_b = off / LOLELFFS_BLOCK_SIZE;
+    last_b = (off + size - 1) / LOLELFFS_BLOCK_SIZE;
+    if (last_b >= meta->nr_phys)
+        ret = -EIO;
+    brelse(bh);
+    if (ret)
+        return ret;
+
+    src = NULL;
+    dst = buf;
+    if (compressed) {
+        src = kvmalloc(size, GFP_NOFS);
+        if (!src)
+            return -ENOMEM;
+        dst = src;
+    }
+    if (encrypted) {
+        plain = kmalloc(LOLELFFS_BLOCK_SIZE, GFP_NOFS);
+        if (!plain) {
+            kvfree(src);
+            return -ENOMEM;
+        }
+        ret = lolelffs_read_enc_req(sbi, ext->ee_enc_algo, &req);
+        if (ret) {
+            kfree(plain);
+            kvfree(src);
+            return ret;
+        }
+    }
+
+    /* Get every block of the cluster in flight before waiting on the first */
+    for (b = first_b + 1; b <= last_b; b++)
+        sb_breadahead(sb, ext->ee_start + b + sbi->fs_offset);
+
+    for (b = first_b, done = 0; b <= last_b; b++) {
+        size_t start = b == first_b ? off % LOLELFFS_BLOCK_SIZE : 0;
+        size_t len = min_t(size_t, LOLELFFS_BLOCK_SIZE - start, size - done);
+
+        void *data;
+
+        bh = LOLELFFS_SB_BREAD(sb, ext->ee_start + b);
+        if (!bh) {
+            ret = -EIO;
+            goto out;
+        }
+        data = bh->b_data;
+        if (encrypted) {
+            ret = lolelffs_decrypt_block(&req, ext->ee_block + b, data, plain);
+            if (ret < 0) {
+                brelse(bh);
+                goto out;
+            }
+            data = plain;
+        }
+        memcpy(dst + done, data + start, len);
+        brelse(bh);
+        done += len;
+    }
+    lolelffs_stat_add(sbi, LOLELFFS_STAT_BLOCKS_READ, last_b - first_b + 1);
+
+    if (compressed)
+        ret = lolelffs_decompress_block(algo, src, size, buf,
+                                        nr_blocks * LOLELFFS_BLOCK_SIZE);
+
+out:
+    if (encrypted) {
+        lolelffs_enc_req_release(&req);
+        kfree(plain);
+    }
+    kvfree(src);
+    if (ret < 0)
+        return ret;
+    *first = cluster << shift;
+    return nr_blocks;
+}
+
+/*
+ * Fill folio, the iblock-th block of the file, from the packed extent ext,
+ * decoding its cluster unless it is the one already held by cc.
+ */
+static int lolelffs_read_packed_folio(struct super_block *sb,
+                                      const struct lolelffs_extent *ext,
+                                      sector_t iblock,
+                                      struct folio *folio,
+                                      struct lolelffs_cluster_cache *cc)
+{
+    void *data;
+    uint32_t first;
+    int ret;
+
+    if (!cc->buf) {
+        cc->buf = kvmalloc(LOLELFFS_COMP_CLUSTER_SIZE, GFP_NOFS);
+        if (!cc->buf)
+            return -ENOMEM;
+        cc->nr_blocks = 0;
+    }
+
+    if (!cc->nr_blocks || cc->ee_start != ext->ee_start ||
+        iblock < cc->first || iblock >= cc->first + cc->nr_blocks) {
+        ret = lolelffs_read_cluster(sb, ext, iblock - ext->ee_block, cc->buf,
+                                    &first);
+        if (ret < 0) {
+            cc->nr_blocks = 0;
+            return ret;
+        }
+        cc->ee_start = ext->ee_start;
+        cc->first = ext->ee_block + first;
+        cc->nr_blocks = ret;
+    }
+
+    data = kmap_local_folio(folio, 0);
+    memcpy(data, cc->buf + (iblock - cc->first) * LOLELFFS_BLOCK_SIZE,
+           LOLELFFS_BLOCK_SIZE);
+    kunmap_local(data);
+    return 0;
+}
 
+/*
+ * Fill the first folio of an inline file, from its inode or its tail block
+ */
+static int lolelffs_read_inline_data(struct inode *inode, struct folio *folio)
+{
+    struct lolelffs_inode_info *ci = LOLELFFS_INODE(inode);
+    const struct lolelffs_tail_ref *ref = (const void *) ci->i_data;
+    const struct lolelffs_tail_header *th;
+    struct buffer_head *bh;
+    size_t size = i_size_read(inode);
+    uint32_t offset;
+    void *data;
+    int ret = 0;
+
+    if (size > LOLELFFS_TAIL_MAX_SIZE)
+        return -EUCLEAN;
+
+    data = kmap_local_folio(folio, 0);
+    if (size <= LOLELFFS_INLINE_DATA_SIZE) {
+        memcpy(data, ci->i_data, size);
+        goto zero;
+    }
+
+    bh = LOLELFFS_SB_BREAD(inode->i_sb, le32_to_cpu(ref->tr_block));
+    if (!bh) {
+        ret = -EIO;
+        goto zero;
+    }
+    th = (const struct lolelffs_tail_header *) bh->b_data;
+    offset = le32_to_cpu(ref->tr_offset);
+    if (le32_to_cpu(th->th_magic) != LOLELFFS_TAIL_MAGIC ||
+        offset < sizeof(*th) || offset > le32_to_cpu(th->th_used) ||
+        size > le32_to_cpu(th->th_used) - offset) {
+        pr_err("inode %lu: invalid tail reference\n", inode->i_ino);
+        ret = -EUCLEAN;
+    } else {
+        memcpy(data, bh->b_data + offset, size);
+    }
+    brelse(bh);
+
+zero:
+    memset(data + size, 0, folio_size(folio) - size);
+    kunmap_local(data);
     return ret;
 }
 
 /*
- * Called by the page cache to read a folio from the physical disk and map it in
- * memory. Handles transparent decompression if the block is compressed.
+ * Read the block phys_block of an extent encrypted inline into folio, with a
+ * bio the storage hardware decrypts, then decompress it in place.
  */
-static int lolelffs_read_folio(struct file *file, struct folio *folio)
+static int lolelffs_read_inline_folio(struct super_block *sb,
+                                      struct lolelffs_enc_key *key,
+                                      struct folio *folio,
+                                      uint32_t phys_block,
+                                      u8 comp_algo)
+{
+    struct lolelffs_sb_info *sbi = LOLELFFS_SB(sb);
+    struct bio *bio;
+    void *data, *scratch;
+    int ret;
+
+    bio = bio_alloc(sb->s_bdev, 1, REQ_OP_READ, GFP_NOFS);
+    bio->bi_iter.bi_sector = (sector_t)(phys_block + sbi->fs_offset)
+                             << (sb->s_blocksize_bits - SECTOR_SHIFT);
+    bio_add_folio_nofail(bio, folio, folio_size(folio), 0);
+    lolelffs_enc_bio_set_ctx(bio, key, folio->index);
+    ret = submit_bio_wait(bio);
+    bio_put(bio);
+    lolelffs_stat_add(sbi, LOLELFFS_STAT_BLOCKS_READ, 1);
+    if (ret < 0 || comp_algo == LOLELFFS_COMP_NONE ||
+        !lolelffs_comp_supported(comp_algo))
+        return ret;
+
+    scratch = kmalloc(LOLELFFS_BLOCK_SIZE, GFP_NOFS);
+    if (!scratch)
+        return -ENOMEM;
+    data = kmap_local_folio(folio, 0);
+    ret = lolelffs_decode_block(NULL, comp_algo, LOLELFFS_ENC_NONE,
+                                folio->index, data, data, scratch);
+    kunmap_local(data);
+    kfree(scratch);
+
+    return ret;
+}
+
+/*
+ * Read a folio from the physical disk and map it in memory. Handles
+ * transparent decompression if the block is compressed.
+ */
+static int __lolelffs_read_folio(struct folio *folio)
 {
     struct inode *inode = folio->mapping->host;
     struct super_block *sb = inode->i_sb;
     struct lolelffs_sb_info *sbi = LOLELFFS_SB(sb);
-    struct lolelffs_inode_info *ci = LOLELFFS_INODE(inode);
-    struct lolelffs_file_ei_block *index;
-    struct buffer_head *bh_index, *bh_block;
-    struct page *page = &folio->page;
+    struct lolelffs_extent ext;
+    struct buffer_head *bh_block;
     void *page_data;
     sector_t iblock;
-    uint32_t extent_idx, phys_block;
+    uint32_t phys_block;
     u8 comp_algo, enc_algo;
+    struct lolelffs_enc_key *key;
+    struct lolelffs_enc_req req;
+    bool have_req = false;
     void *decrypt_buf = NULL;
     int ret = 0;
 
@@ -126,105 +543,106 @@ static int lolelffs_read_folio(struct file *file, struct folio *folio)
         return 0;
     }
 
-    /* Read extent index block */
-    bh_index = LOLELFFS_SB_BREAD(sb, ci->ei_block);
-    if (!bh_index) {
-        ret = -EIO;
-        goto error;
+    if (lolelffs_inode_is_inline(inode)) {
+        ret = lolelffs_read_inline_data(inode, folio);
+        if (ret < 0)
+            goto error;
+        folio_mark_uptodate(folio);
+        folio_unlock(folio);
+        return 0;
     }
-    index = (struct lolelffs_file_ei_block *) bh_index->b_data;
 
     /* Find the extent containing this block */
-    extent_idx = lolelffs_ext_search(index, iblock);
-    if (extent_idx == (uint32_t)-1 || index->extents[extent_idx].ee_start == 0) {
+    ret = lolelffs_ext_map_lookup(inode, iblock, &ext, NULL);
+    if (ret == -ENOENT) {
         /* Block not allocated - zero-fill */
-        brelse(bh_index);
         folio_zero_range(folio, 0, folio_size(folio));
         folio_mark_uptodate(folio);
         folio_unlock(folio);
         return 0;
     }
-
-    /* Calculate physical block number */
-    phys_block = index->extents[extent_idx].ee_start +
-                 (iblock - index->extents[extent_idx].ee_block);
-    comp_algo = index->extents[extent_idx].ee_comp_algo;
-    enc_algo = index->extents[extent_idx].ee_enc_algo;
-
-    brelse(bh_index);
-
-    /* Read the physical block (adjust for ELF offset) */
-    bh_block = LOLELFFS_SB_BREAD(sb, phys_block + sbi->fs_offset);
-    if (!bh_block) {
-        ret = -EIO;
+    if (ret < 0)
         goto error;
-    }
-
-    page_data = kmap_local_page(page);
 
-    /* Handle decrypt-then-decompress pipeline */
-    void *source_buf = bh_block->b_data;
+    /* Compressed clusters are not mapped block by block */
+    if (ext.ee_flags & LOLELFFS_EXT_HAS_META) {
+        struct lolelffs_cluster_cache cc = { 0 };
 
-    /* Step 1: Decrypt if needed */
-    if (enc_algo != LOLELFFS_ENC_NONE && lolelffs_enc_supported(enc_algo)) {
-        /* Check if filesystem is unlocked */
-        if (!sbi->enc_unlocked) {
-            pr_err("cannot read encrypted block: filesystem is locked\n");
-            ret = -EPERM;
-            kunmap_local(page_data);
-            brelse(bh_block);
-            goto error;
-        }
-
-        /* Allocate temporary buffer for decrypted data */
-        decrypt_buf = kmalloc(LOLELFFS_BLOCK_SIZE, GFP_NOFS);
-        if (!decrypt_buf) {
-            ret = -ENOMEM;
-            kunmap_local(page_data);
-            brelse(bh_block);
+        ret = lolelffs_read_packed_folio(sb, &ext, iblock, folio, &cc);
+        kvfree(cc.buf);
+        if (ret < 0) {
+            pr_err("decoding failed for inode %lu block %llu: %d\n",
+                   inode->i_ino, (u64)iblock, ret);
             goto error;
         }
+        folio_mark_uptodate(folio);
+        folio_unlock(folio);
+        return 0;
+    }
 
-        /* Decrypt the block */
-        ret = lolelffs_decrypt_block(enc_algo, sbi->enc_master_key_decrypted,
-                                     iblock, source_buf, decrypt_buf);
+    /* Calculate physical block number */
+    phys_block = ext.ee_start + (iblock - ext.ee_block);
+    comp_algo = ext.ee_comp_algo;
+    enc_algo = ext.ee_enc_algo;
+
+    /* The storage hardware decrypts straight into the folio */
+    key = smp_load_acquire(&sbi->enc_key);
+    if (enc_algo != LOLELFFS_ENC_NONE && lolelffs_enc_inline(key, enc_algo)) {
+        ret = lolelffs_read_inline_folio(sb, key, folio, phys_block, comp_algo);
         if (ret < 0) {
-            pr_err("decryption failed for inode %lu block %llu: %d\n",
+            pr_err("decoding failed for inode %lu block %llu: %d\n",
                    inode->i_ino, (u64)iblock, ret);
-            kfree(decrypt_buf);
-            kunmap_local(page_data);
-            brelse(bh_block);
             goto error;
         }
+        folio_mark_uptodate(folio);
+        folio_unlock(folio);
+        return 0;
+    }
 
-        /* Use decrypted data as source for next step */
-        source_buf = decrypt_buf;
+    /* Read the physical block (LOLELFFS_SB_BREAD adjusts for the ELF offset) */
+    bh_block = LOLELFFS_SB_BREAD(sb, phys_block);
+    if (!bh_block) {
+        ret = -EIO;
+        goto error;
     }
+    lolelffs_stat_add(sbi, LOLELFFS_STAT_BLOCKS_READ, 1);
 
-    /* Step 2: Decompress if needed */
-    if (comp_algo != LOLELFFS_COMP_NONE && lolelffs_comp_supported(comp_algo)) {
-        ret = lolelffs_decompress_block(comp_algo, source_buf, LOLELFFS_BLOCK_SIZE,
-                                        page_data, LOLELFFS_BLOCK_SIZE);
+    /* Encrypted blocks are decrypted straight into the folio */
+    if (enc_algo != LOLELFFS_ENC_NONE && lolelffs_enc_supported(enc_algo)) {
+        ret = lolelffs_read_enc_req(sbi, enc_algo, &req);
         if (ret < 0) {
-            pr_err("decompression failed for inode %lu block %llu: %d\n",
-                   inode->i_ino, (u64)iblock, ret);
-            if (decrypt_buf)
-                kfree(decrypt_buf);
-            kunmap_local(page_data);
             brelse(bh_block);
             goto error;
         }
-    } else {
-        /* No compression - direct copy */
-        memcpy(page_data, source_buf, LOLELFFS_BLOCK_SIZE);
+        have_req = true;
+
+        /* Decrypt-then-decompress needs an intermediate buffer */
+        if (comp_algo != LOLELFFS_COMP_NONE) {
+            decrypt_buf = kmalloc(LOLELFFS_BLOCK_SIZE, GFP_NOFS);
+            if (!decrypt_buf) {
+                ret = -ENOMEM;
+                lolelffs_enc_req_release(&req);
+                brelse(bh_block);
+                goto error;
+            }
+        }
     }
 
-    /* Clean up */
-    if (decrypt_buf)
-        kfree(decrypt_buf);
+    page_data = kmap_local_folio(folio, 0);
+    ret = lolelffs_decode_block(&req, comp_algo, enc_algo, iblock,
+                                bh_block->b_data, page_data, decrypt_buf);
     kunmap_local(page_data);
+    if (have_req)
+        lolelffs_enc_req_release(&req);
+    kfree(decrypt_buf);
     brelse(bh_block);
 
+    if (ret < 0) {
+        pr_err("decoding failed for inode %lu block %llu: %d\n",
+               inode->i_ino, (u64)iblock, ret);
+        goto error;
+    }
+
     /* Mark page as uptodate and unlock */
     folio_mark_uptodate(folio);
     folio_unlock(folio);
@@ -235,180 +653,706 @@ error:
     return ret;
 }
 
+/* Called by the page cache to read a folio, see __lolelffs_read_folio() */
+static int lolelffs_read_folio(struct file *file, struct folio *folio)
+{
+    /* The folio may be truncated once unlocked */
+    struct inode *inode = folio->mapping->host;
+    u64 iblock = folio->index;
+    size_t size = folio_size(folio);
+    u64 start = lolelffs_trace_start(lolelffs_read_folio);
+    int ret;
+
+    ret = __lolelffs_read_folio(folio);
+    if (start)
+        trace_lolelffs_read_folio(inode, iblock, size, ret,
+                                  ktime_get_ns() - start);
+    return ret;
+}
+
+/* Decode every folio of a completed readahead bio in process context */
+static void lolelffs_read_work(struct work_struct *work)
+{
+    struct lolelffs_read_ctx *ctx =
+        container_of(work, struct lolelffs_read_ctx, work);
+    struct bio *bio = ctx->bio;
+    struct lolelffs_enc_req req;
+    struct folio_iter fi;
+    bool have_req = false;
+    void *scratch = NULL;
+    int err = 0;
+
+    /* One crypto request serves every block of the bio */
+    if (ctx->enc_algo != LOLELFFS_ENC_NONE) {
+        err = lolelffs_read_enc_req(ctx->sbi, ctx->enc_algo, &req);
+        have_req = !err;
+    }
+
+    /* AES-XTS decrypts in place, everything else needs a bounce buffer */
+    if (!err && (ctx->comp_algo != LOLELFFS_COMP_NONE ||
+                 lolelffs_enc_tag_size(ctx->enc_algo))) {
+        scratch = kmalloc(LOLELFFS_BLOCK_SIZE, GFP_NOFS);
+        if (!scratch)
+            err = -ENOMEM;
+    }
+
+    bio_for_each_folio_all(fi, bio) {
+        struct folio *folio = fi.folio;
+        void *data;
+        int ret = err;
+
+        if (!ret) {
+            data = kmap_local_folio(folio, 0);
+            ret = lolelffs_decode_block(&req, ctx->comp_algo, ctx->enc_algo,
+                                        folio->index, data, data, scratch);
+            kunmap_local(data);
+        }
+        if (ret < 0)
+            pr_err("decoding failed for inode %lu block %llu: %d\n", ctx->ino,
+                   (u64)folio->index, ret);
+
+        /* A folio left !uptodate is retried through ->read_folio */
+        folio_end_read(folio, ret == 0);
+    }
+
+    if (have_req)
+        lolelffs_enc_req_release(&req);
+    kfree(scratch);
+    bio_put(bio);
+    kfree(ctx);
+}
+
 /*
- * Called by the page cache to write a dirty folio to the physical disk (when
- * sync is called or when memory is needed).
- *
- * TODO: Implement encryption and compression during write. For now, data is
- * written uncompressed and unencrypted. Compressed/encrypted blocks can be
- * created using the Rust tools and read transparently via the read path.
- *
- * Write-side encryption requires:
- * 1. Kernel 6.2+ folio/writeback APIs
- * 2. Custom writepage implementation with compress-then-encrypt pipeline
- * 3. Proper extent metadata updates
+ * Completion handler for readahead bios. Plain runs are finished here; runs
+ * that need decryption or decompression are punted to lolelffs_read_wq since
+ * the crypto and compression paths may sleep.
  */
-/* Helper function to write a single page/folio with compression and encryption */
-static int lolelffs_writepage_locked(struct folio *folio, struct writeback_control *wbc)
+static void lolelffs_read_end_io(struct bio *bio)
 {
-    struct inode *inode = folio->mapping->host;
+    struct lolelffs_read_ctx *ctx = bio->bi_private;
+    struct folio_iter fi;
+
+    if (ctx && !bio->bi_status) {
+        INIT_WORK(&ctx->work, lolelffs_read_work);
+        queue_work(lolelffs_read_wq, &ctx->work);
+        return;
+    }
+
+    bio_for_each_folio_all(fi, bio)
+        folio_end_read(fi.folio, !bio->bi_status);
+
+    kfree(ctx);
+    bio_put(bio);
+}
+
+/*
+ * Called by the page cache to read ahead a window of folios. Blocks are mapped
+ * through the per-inode extent cache and each run of physically contiguous
+ * blocks sharing the same compression and encryption settings is sent to the
+ * block layer as a single bio. Blocks the storage hardware decrypts inline
+ * are decrypted by the time the bio completes. Anything left unread here is
+ * picked up again by lolelffs_read_folio().
+ */
+static void lolelffs_readahead(struct readahead_control *rac)
+{
+    struct inode *inode = rac->mapping->host;
     struct super_block *sb = inode->i_sb;
     struct lolelffs_sb_info *sbi = LOLELFFS_SB(sb);
-    struct lolelffs_inode_info *ci = LOLELFFS_INODE(inode);
-    struct lolelffs_file_ei_block *index;
-    struct buffer_head *bh_index = NULL, *bh_block = NULL;
-    struct page *page = &folio->page;
-    void *page_data = NULL;
-    void *work_buf = NULL;
-    void *final_buf = NULL;
-    sector_t iblock;
-    uint32_t extent_idx, phys_block;
-    u8 comp_algo, enc_algo;
-    u8 used_comp_algo = LOLELFFS_COMP_NONE;
-    u8 used_enc_algo = LOLELFFS_ENC_NONE;
-    u16 flags = 0;
+    struct lolelffs_extent ext;
+    struct lolelffs_cluster_cache cc = { 0 };
+    struct bio *bio = NULL;
+    struct folio *folio;
+    loff_t size = i_size_read(inode);
+    sector_t next_phys = 0, next_iblock = 0;
+    bool have_ext = false;
+    u8 run_comp = LOLELFFS_COMP_NONE, run_enc = LOLELFFS_ENC_NONE;
+
+    /* Inline files fit in one folio, left to ->read_folio */
+    if (lolelffs_inode_is_inline(inode))
+        return;
+
+    while ((folio = readahead_folio(rac))) {
+        sector_t iblock = folio->index;
+        sector_t phys;
+        struct lolelffs_enc_key *key;
+        u8 comp_algo, enc_algo;
+        bool inline_enc;
+
+        if (folio_pos(folio) >= size)
+            goto zero;
+
+        /* Sequential windows almost always stay within the previous extent */
+        if (!have_ext || iblock < ext.ee_block ||
+            iblock >= ext.ee_block + ext.ee_len) {
+            int ret = lolelffs_ext_map_lookup(inode, iblock, &ext, NULL);
+
+            have_ext = ret >= 0;
+            if (ret == -ENOENT)
+                goto zero;
+            if (ret < 0) {
+                /* Let ->read_folio report the error */
+                folio_unlock(folio);
+                continue;
+            }
+        }
+
+        /*
+         * Packed clusters are decoded synchronously, once for all the folios
+         * they cover. Queue what we have so far first so it overlaps.
+         */
+        if (ext.ee_flags & LOLELFFS_EXT_HAS_META) {
+            if (bio) {
+                submit_bio(bio);
+                bio = NULL;
+            }
+            if (lolelffs_read_packed_folio(sb, &ext, iblock, folio, &cc) < 0) {
+                folio_unlock(folio);
+                continue;
+            }
+            folio_mark_uptodate(folio);
+            folio_unlock(folio);
+            continue;
+        }
+
+        phys = ext.ee_start + (iblock - ext.ee_block) + sbi->fs_offset;
+        comp_algo = lolelffs_comp_supported(ext.ee_comp_algo)
+                        ? ext.ee_comp_algo
+                        : LOLELFFS_COMP_NONE;
+        enc_algo = lolelffs_enc_supported(ext.ee_enc_algo)
+                       ? ext.ee_enc_algo
+                       : LOLELFFS_ENC_NONE;
+
+        /* Leave locked blocks to ->read_folio so the caller sees -EPERM */
+        key = smp_load_acquire(&sbi->enc_key);
+        if (enc_algo != LOLELFFS_ENC_NONE && !key) {
+            folio_unlock(folio);
+            continue;
+        }
+        inline_enc = enc_algo != LOLELFFS_ENC_NONE &&
+                     lolelffs_enc_inline(key, enc_algo);
+
+        /* Inline encryption also needs consecutive logical blocks */
+        if (bio && (phys != next_phys || iblock != next_iblock ||
+                    comp_algo != run_comp ||
+                    enc_algo != run_enc ||
+                    !bio_add_folio(bio, folio, folio_size(folio), 0))) {
+            submit_bio(bio);
+            bio = NULL;
+        }
+
+        if (!bio) {
+            struct lolelffs_read_ctx *ctx = NULL;
+
+            if (comp_algo != LOLELFFS_COMP_NONE ||
+                (enc_algo != LOLELFFS_ENC_NONE && !inline_enc)) {
+                ctx = kmalloc(sizeof(*ctx), GFP_NOFS);
+                if (!ctx) {
+                    lolelffs_read_folio(NULL, folio);
+                    continue;
+                }
+                ctx->sbi = sbi;
+                ctx->ino = inode->i_ino;
+                ctx->comp_algo = comp_algo;
+                ctx->enc_algo = inline_enc ? LOLELFFS_ENC_NONE : enc_algo;
+            }
+
+            bio = bio_alloc(sb->s_bdev,
+                            bio_max_segs(readahead_count(rac) + 1),
+                            REQ_OP_READ, GFP_NOFS);
+            bio->bi_iter.bi_sector = phys << (sb->s_blocksize_bits - SECTOR_SHIFT);
+            bio->bi_end_io = lolelffs_read_end_io;
+            bio->bi_private = ctx;
+            if (ctx)
+                ctx->bio = bio;
+            if (inline_enc)
+                lolelffs_enc_bio_set_ctx(bio, key, iblock);
+            bio_add_folio_nofail(bio, folio, folio_size(folio), 0);
+            run_comp = comp_algo;
+            run_enc = enc_algo;
+        }
+
+        lolelffs_stat_add(sbi, LOLELFFS_STAT_BLOCKS_READ, 1);
+        next_phys = phys + 1;
+        next_iblock = iblock + 1;
+        continue;
+
+zero:
+        folio_zero_range(folio, 0, folio_size(folio));
+        folio_mark_uptodate(folio);
+        folio_unlock(folio);
+    }
+
+    if (bio)
+        submit_bio(bio);
+    kvfree(cc.buf);
+}
+
+int lolelffs_init_read_wq(void)
+{
+    lolelffs_read_wq = alloc_workqueue("lolelffs_read",
+                                       WQ_UNBOUND | WQ_MEM_RECLAIM, 0);
+    if (!lolelffs_read_wq)
+        return -ENOMEM;
+    return 0;
+}
+
+void lolelffs_destroy_read_wq(void)
+{
+    destroy_workqueue(lolelffs_read_wq);
+}
+
+/*
+ * Bounce pages holding the transformed copy of folios under writeback. The
+ * reserve guarantees that writeback keeps making progress under memory
+ * pressure, when it is most needed.
+ */
+#define LOLELFFS_WB_POOL_PAGES 32
+static mempool_t *lolelffs_wb_page_pool;
+
+/*
+ * State of one ->writepages call. Delayed blocks get their extents first.
+ * On encrypted mounts, folios are then encrypted into bounce pages, unless
+ * the storage hardware encrypts them inline. Blocks are merged into one bio
+ * for each physically contiguous run, also logically contiguous when
+ * encrypted inline.
+ * The extent index is updated in memory and written back once, when the
+ * batch is finished.
+ */
+struct lolelffs_wb_ctx {
+    struct inode *inode;
+    bool bounce;                     /* Data must be transformed */
+    struct lolelffs_enc_key *inline_key; /* Key of inline encryption, if used */
+    struct bio *bio;                 /* Run being built */
+    sector_t next_phys;              /* Block that would extend the run */
+    sector_t next_iblock;            /* Logical block that would extend it */
+    struct lolelffs_extent ext;      /* Extent of the last folio */
+    int ext_idx;                     /* Its index, -1 if none yet */
+    uint32_t ext_blk;                /* Block holding it */
+    struct buffer_head *bh_index;    /* Block holding the extents changed */
+    uint32_t index_blk;
+    bool index_dirty;
+    bool sync;                       /* Data integrity writeback */
+    struct lolelffs_enc_req req;
+    bool have_req;
+    void *scratch;                   /* Compressor/AEAD output */
+};
+
+/*
+ * Bio completion: release the bounce pages, if any, and end writeback of
+ * the page cache folios.
+ */
+static void lolelffs_write_end_io(struct bio *bio)
+{
+    struct bio_vec *bv;
+    struct bvec_iter_all iter;
+    int err = blk_status_to_errno(bio->bi_status);
+
+    bio_for_each_segment_all(bv, bio, iter) {
+        struct page *page = bv->bv_page;
+        struct folio *folio;
+
+        if (bio->bi_private) {
+            folio = (struct folio *) page_private(page);
+            set_page_private(page, 0);
+            mempool_free(page, lolelffs_wb_page_pool);
+        } else {
+            folio = page_folio(page);
+        }
+
+        if (err)
+            mapping_set_error(folio->mapping, err);
+        folio_end_writeback(folio);
+    }
+
+    bio_put(bio);
+}
+
+/*
+ * Write back the changes made to the extents held in wb->bh_index, and
+ * synchronously for data integrity writeback, then release it.
+ */
+static int lolelffs_wb_put_index(struct lolelffs_wb_ctx *wb)
+{
     int ret = 0;
-    size_t comp_size = 0;
 
-    /* Calculate which block to write */
-    iblock = folio->index;
+    if (!wb->bh_index)
+        return 0;
+    if (wb->index_dirty) {
+        mark_buffer_dirty(wb->bh_index);
+        if (wb->sync) {
+            sync_dirty_buffer(wb->bh_index);
+            if (buffer_write_io_error(wb->bh_index))
+                ret = -EIO;
+        }
+        lolelffs_ext_map_invalidate(wb->inode);
+        wb->index_dirty = false;
+    }
+    brelse(wb->bh_index);
+    wb->bh_index = NULL;
 
-    /* Get extent index */
-    bh_index = LOLELFFS_SB_BREAD(sb, ci->ei_block);
-    if (!bh_index) {
-        ret = -EIO;
-        goto error;
+    return ret;
+}
+
+/*
+ * Hold in wb->bh_index the block blk of extents: the extent index block, or
+ * a leaf of the extent tree. Files with a plain extent index keep their one
+ * block for the whole batch.
+ */
+static int lolelffs_wb_get_index(struct lolelffs_wb_ctx *wb, uint32_t blk)
+{
+    int ret;
+
+    if (wb->bh_index && wb->index_blk == blk)
+        return 0;
+    ret = lolelffs_wb_put_index(wb);
+    if (ret)
+        return ret;
+
+    wb->bh_index = LOLELFFS_SB_BREAD(wb->inode->i_sb, blk);
+    if (!wb->bh_index)
+        return -EIO;
+    wb->index_blk = blk;
+    return 0;
+}
+
+/*
+ * Allocate the extents of the delayed blocks of the inode up to iblock, and
+ * at least up to the end of its reservation. The size of the first extent
+ * follows calc_optimal_extent_size(), grown to cover the whole delayed
+ * range, so a file written at once gets a single extent. Extents shrink to
+ * what contiguous free space allows, with as many extents as needed, in an
+ * extent tree past the capacity of the extent index block.
+ */
+static int lolelffs_da_alloc(struct lolelffs_wb_ctx *wb, uint32_t iblock)
+{
+    struct inode *inode = wb->inode;
+    struct lolelffs_sb_info *sbi = LOLELFFS_SB(inode->i_sb);
+    struct lolelffs_inode_info *ci = LOLELFFS_INODE(inode);
+    struct lolelffs_extent ext;
+    uint32_t end, need, len, extra, goal, bno, used, nr_blocks = 0;
+    u64 start = lolelffs_trace_start(lolelffs_get_block_alloc);
+    int ret;
+
+    ret = lolelffs_wb_get_index(wb, ci->ei_block);
+    if (ret)
+        return ret;
+
+    lolelffs_alloc_lock(sbi, ci);
+    for (;;) {
+        ret = lolelffs_ext_map_end(inode, &end);
+        if (ret || iblock < end)
+            break;
+
+        need = max(iblock + 1, ci->da_reserved ? ci->da_end : 0) - end;
+        len = calc_optimal_extent_size(sbi, end, false);
+        if (len > need) {
+            /* Preallocate for appends only from unreserved free space */
+            extra = lolelffs_nr_free_blocks(sbi) > sbi->nr_reserved_blocks
+                        ? lolelffs_nr_free_blocks(sbi) - sbi->nr_reserved_blocks
+                        : 0;
+            len = need + min(len - need, extra);
+        } else {
+            len = need;
+        }
+        len = min_t(uint32_t, len, LOLELFFS_MAX_BLOCKS_PER_EXTENT_LARGE);
+
+        /* Continue the last extent on disk, or start after the index */
+        goal = lolelffs_ext_goal(inode, wb->bh_index);
+        while (!(bno = lolelffs_new_blocks(sbi, goal, len)) && len > 1)
+            len /= 2;
+        if (!bno) {
+            ret = -ENOSPC;
+            break;
+        }
+
+        memset(&ext, 0, sizeof(ext));
+        ext.ee_block = end;
+        ext.ee_len = len;
+        ext.ee_start = bno;
+        ret = lolelffs_ext_append(inode, wb->bh_index, &ext, wb->sync);
+        if (ret) {
+            put_blocks(sbi, bno, len);
+            break;
+        }
+        mark_buffer_dirty(wb->bh_index);
+        wb->index_dirty = true;
+        lolelffs_ext_map_invalidate(inode);
+        nr_blocks += len;
+
+        /* The extent starts where the reservation does */
+        used = min(len, ci->da_reserved);
+        if (used) {
+            ci->da_reserved -= used;
+            lolelffs_sb_lock(sbi);
+            sbi->nr_reserved_blocks -= used;
+            mutex_unlock(&sbi->lock);
+        }
     }
-    index = (struct lolelffs_file_ei_block *) bh_index->b_data;
+    mutex_unlock(&ci->alloc_lock);
 
-    /* Find extent for this block */
-    extent_idx = lolelffs_ext_search(index, iblock);
-    if (extent_idx == (uint32_t)-1 || index->extents[extent_idx].ee_start == 0) {
-        /* Block not allocated - this shouldn't happen for dirty pages */
-        pr_err("lolelffs: trying to write unallocated block %lu\n", (unsigned long)iblock);
-        ret = -EIO;
-        goto error;
+    if (start)
+        trace_lolelffs_get_block_alloc(inode, iblock, nr_blocks, ret,
+                                       ktime_get_ns() - start);
+    return ret;
+}
+
+/*
+ * Encrypt one block in place, with the policy of the mount, and report the
+ * algorithm actually applied in enc_algo. Blocks encrypted inline are left
+ * for the storage hardware to encrypt. Data is never compressed here: the
+ * per-block zero-padded output cannot be decoded by LZ4 or zstd, so
+ * compressed extents are only written by the tools, see lolelffs.h.
+ */
+static int lolelffs_wb_transform(struct lolelffs_wb_ctx *wb,
+                                 sector_t iblock,
+                                 void *data,
+                                 u8 *enc_algo)
+{
+    struct lolelffs_sb_info *sbi = LOLELFFS_SB(wb->inode->i_sb);
+    u8 enc = sbi->enc_enabled ? sbi->enc_default_algo : LOLELFFS_ENC_NONE;
+    int ret;
+
+    *enc_algo = LOLELFFS_ENC_NONE;
+
+    if (!wb->scratch) {
+        wb->scratch = kmalloc(LOLELFFS_BLOCK_SIZE +
+                                  lolelffs_enc_tag_size(LOLELFFS_ENC_CHACHA20_POLY),
+                              GFP_NOFS);
+        if (!wb->scratch)
+            return -ENOMEM;
     }
 
-    /* Calculate physical block number */
-    phys_block = index->extents[extent_idx].ee_start +
-                 (iblock - index->extents[extent_idx].ee_block);
+    if (enc != LOLELFFS_ENC_NONE && lolelffs_enc_inline(wb->inline_key, enc)) {
+        *enc_algo = enc;
+    } else if (enc != LOLELFFS_ENC_NONE && lolelffs_enc_supported(enc)) {
+        if (!wb->have_req) {
+            struct lolelffs_enc_key *key = smp_load_acquire(&sbi->enc_key);
 
-    /* Get compression and encryption settings */
-    comp_algo = sbi->comp_enabled ? sbi->comp_default_algo : LOLELFFS_COMP_NONE;
-    enc_algo = sbi->enc_enabled ? sbi->enc_default_algo : LOLELFFS_ENC_NONE;
+            if (!key) {
+                pr_err("cannot write encrypted block: filesystem is locked\n");
+                return -EPERM;
+            }
+            ret = lolelffs_enc_req_init(&wb->req, key, enc);
+            if (ret)
+                return ret;
+            wb->have_req = true;
+        }
 
-    /* Map the page to get data */
-    page_data = kmap(page);
-    if (!page_data) {
-        ret = -ENOMEM;
-        goto error;
+        /* AES-XTS encrypts in place, AEAD output needs room for the tag */
+        if (lolelffs_enc_tag_size(enc)) {
+            ret = lolelffs_encrypt_block(&wb->req, iblock, data, wb->scratch);
+            if (ret == 0)
+                memcpy(data, wb->scratch, LOLELFFS_BLOCK_SIZE);
+        } else {
+            ret = lolelffs_encrypt_block(&wb->req, iblock, data, data);
+        }
+        if (ret) {
+            pr_err("encryption failed: %d\n", ret);
+            return ret;
+        }
+        *enc_algo = enc;
     }
 
-    /* Allocate working buffer */
-    work_buf = kmalloc(LOLELFFS_BLOCK_SIZE, GFP_NOFS);
-    if (!work_buf) {
-        ret = -ENOMEM;
-        goto error;
+    return 0;
+}
+
+/*
+ * Record the encoding of the extent of the current folio in the block that
+ * holds it. The buffer is only written back by lolelffs_wb_put_index().
+ */
+static int lolelffs_wb_set_encoding(struct lolelffs_wb_ctx *wb,
+                                    u8 enc_algo,
+                                    u16 flags)
+{
+    struct lolelffs_extent *extents;
+    int ret;
+
+    ret = lolelffs_wb_get_index(wb, wb->ext_blk);
+    if (ret)
+        return ret;
+    extents = lolelffs_ext_block_extents(wb->bh_index->b_data);
+
+    extents[wb->ext_idx].ee_enc_algo = enc_algo;
+    extents[wb->ext_idx].ee_flags = flags;
+    wb->ext.ee_enc_algo = enc_algo;
+    wb->ext.ee_flags = flags;
+    wb->index_dirty = true;
+
+    return 0;
+}
+
+/*
+ * Queue a locked folio, cleared for I/O by writeback_iter(), into the current
+ * run, allocating its block first if it was delayed. On encrypted mounts
+ * the run gets an encrypted bounce copy of the folio, unless it is
+ * encrypted inline. The folio is unlocked on return, and under writeback
+ * unless an error is returned.
+ */
+static int lolelffs_wb_folio(struct lolelffs_wb_ctx *wb,
+                             struct folio *folio,
+                             struct writeback_control *wbc)
+{
+    struct inode *inode = wb->inode;
+    struct super_block *sb = inode->i_sb;
+    struct lolelffs_sb_info *sbi = LOLELFFS_SB(sb);
+    sector_t iblock = folio->index;
+    loff_t size = i_size_read(inode);
+    size_t valid = LOLELFFS_BLOCK_SIZE;
+    struct buffer_head *head, *bh;
+    struct page *page;
+    sector_t phys;
+    u8 enc_algo = LOLELFFS_ENC_NONE;
+    u16 flags = 0;
+    u64 start = lolelffs_trace_start(lolelffs_writepage);
+    int ret;
+
+    /* Truncated under us */
+    if (folio_pos(folio) >= size) {
+        folio_unlock(folio);
+        return 0;
     }
-
-    /* Copy page data to working buffer */
-    memcpy(work_buf, page_data, LOLELFFS_BLOCK_SIZE);
-    final_buf = work_buf;
-
-    /* Step 1: Compress if enabled */
-    if (comp_algo != LOLELFFS_COMP_NONE && lolelffs_comp_supported(comp_algo)) {
-        void *comp_buf = kmalloc(LOLELFFS_BLOCK_SIZE, GFP_NOFS);
-        if (comp_buf) {
-            ret = lolelffs_compress_block(comp_algo, work_buf, LOLELFFS_BLOCK_SIZE,
-                                         comp_buf, &comp_size);
-            if (ret == 0 && comp_size < LOLELFFS_BLOCK_SIZE * 95 / 100) {
-                /* Compression saved at least 5% - use it */
-                memcpy(work_buf, comp_buf, comp_size);
-                memset(work_buf + comp_size, 0, LOLELFFS_BLOCK_SIZE - comp_size);
-                used_comp_algo = comp_algo;
-                flags |= LOLELFFS_EXT_COMPRESSED;
-            }
-            kfree(comp_buf);
+    if (size - folio_pos(folio) < LOLELFFS_BLOCK_SIZE)
+        valid = size - folio_pos(folio);
+
+    if (wb->ext_idx < 0 || iblock < wb->ext.ee_block ||
+        iblock >= wb->ext.ee_block + wb->ext.ee_len) {
+        ret = lolelffs_ext_map_lookup(inode, iblock, &wb->ext, &wb->ext_blk);
+        if (ret == -ENOENT) {
+            /* Delayed block, or dirtied through mmap */
+            ret = lolelffs_da_alloc(wb, iblock);
+            if (!ret)
+                ret = lolelffs_ext_map_lookup(inode, iblock, &wb->ext, &wb->ext_blk);
         }
+        wb->ext_idx = ret;
+        if (ret < 0)
+            goto error;
     }
 
-    /* Step 2: Encrypt if enabled (compress-then-encrypt) */
-    if (enc_algo != LOLELFFS_ENC_NONE && lolelffs_enc_supported(enc_algo)) {
-        void *enc_buf = kmalloc(LOLELFFS_BLOCK_SIZE, GFP_NOFS);
-        if (!enc_buf) {
-            ret = -ENOMEM;
-            goto error;
+    /* Packed and shared extents were rewritten on open */
+    if (wb->ext.ee_flags & (LOLELFFS_EXT_HAS_META | LOLELFFS_EXT_SHARED)) {
+        ret = -EOPNOTSUPP;
+        goto error;
+    }
+    phys = wb->ext.ee_start + (iblock - wb->ext.ee_block) + sbi->fs_offset;
+
+    if (wb->bounce) {
+        void *src, *dst;
+
+        /*
+         * Waiting on the pool could wait for the pages of the bio not
+         * submitted yet: with one pending, submit it before waiting, as
+         * fscrypt does. Without one, the wait never fails.
+         */
+        page = mempool_alloc(lolelffs_wb_page_pool, wb->bio ? GFP_NOWAIT : GFP_NOFS);
+        if (!page) {
+            submit_bio(wb->bio);
+            wb->bio = NULL;
+            page = mempool_alloc(lolelffs_wb_page_pool, GFP_NOFS);
         }
-
-        /* Check if filesystem is unlocked */
-        if (!sbi->enc_unlocked) {
-            pr_err("lolelffs: cannot write encrypted block: filesystem is locked\n");
-            kfree(enc_buf);
-            ret = -EPERM;
+        dst = page_address(page);
+        src = kmap_local_folio(folio, 0);
+        memcpy(dst, src, valid);
+        kunmap_local(src);
+        /* Do not leak stale page cache contents beyond EOF to disk */
+        memset(dst + valid, 0, LOLELFFS_BLOCK_SIZE - valid);
+
+        ret = lolelffs_wb_transform(wb, iblock, dst, &enc_algo);
+        if (ret) {
+            mempool_free(page, lolelffs_wb_page_pool);
             goto error;
         }
-
-        ret = lolelffs_encrypt_block(enc_algo, sbi->enc_master_key_decrypted,
-                                     iblock, work_buf, enc_buf);
-        if (ret == 0) {
-            memcpy(work_buf, enc_buf, LOLELFFS_BLOCK_SIZE);
-            used_enc_algo = enc_algo;
-            flags |= LOLELFFS_EXT_ENCRYPTED;
-        }
-        kfree(enc_buf);
-
-        if (ret != 0) {
-            pr_err("lolelffs: encryption failed: %d\n", ret);
+        set_page_private(page, (unsigned long) folio);
+    } else {
+        if (valid < LOLELFFS_BLOCK_SIZE)
+            folio_zero_segment(folio, valid, folio_size(folio));
+        page = &folio->page;
+        if (wb->inline_key)
+            enc_algo = sbi->enc_default_algo;
+    }
+    if (enc_algo != LOLELFFS_ENC_NONE)
+        flags |= LOLELFFS_EXT_ENCRYPTED;
+
+    if (enc_algo != wb->ext.ee_enc_algo || flags != wb->ext.ee_flags) {
+        ret = lolelffs_wb_set_encoding(wb, enc_algo, flags);
+        if (ret) {
+            if (wb->bounce) {
+                set_page_private(page, 0);
+                mempool_free(page, lolelffs_wb_page_pool);
+            }
             goto error;
         }
     }
 
-    /* Read the physical block buffer */
-    bh_block = LOLELFFS_SB_BREAD(sb, phys_block);
-    if (!bh_block) {
-        ret = -EIO;
-        goto error;
+    if (wb->bio && (phys != wb->next_phys ||
+                    (wb->inline_key && iblock != wb->next_iblock) ||
+                    bio_add_page(wb->bio, page, LOLELFFS_BLOCK_SIZE, 0) !=
+                        LOLELFFS_BLOCK_SIZE)) {
+        submit_bio(wb->bio);
+        wb->bio = NULL;
     }
+    if (!wb->bio) {
+        wb->bio = bio_alloc(sb->s_bdev, BIO_MAX_VECS,
+                            REQ_OP_WRITE | wbc_to_write_flags(wbc), GFP_NOFS);
+        wb->bio->bi_iter.bi_sector = phys << (sb->s_blocksize_bits - SECTOR_SHIFT);
+        wb->bio->bi_end_io = lolelffs_write_end_io;
+        wb->bio->bi_private = wb->bounce ? lolelffs_wb_page_pool : NULL;
+        if (wb->inline_key)
+            lolelffs_enc_bio_set_ctx(wb->bio, wb->inline_key, iblock);
+        __bio_add_page(wb->bio, page, LOLELFFS_BLOCK_SIZE, 0);
+    }
+    wb->next_phys = phys + 1;
+    wb->next_iblock = iblock + 1;
 
-    /* Copy encrypted/compressed data to block buffer */
-    memcpy(bh_block->b_data, work_buf, LOLELFFS_BLOCK_SIZE);
-    mark_buffer_dirty(bh_block);
-    sync_dirty_buffer(bh_block);
-
-    /* Update extent metadata if compression or encryption was used */
-    if (used_comp_algo != index->extents[extent_idx].ee_comp_algo ||
-        used_enc_algo != index->extents[extent_idx].ee_enc_algo ||
-        flags != index->extents[extent_idx].ee_flags) {
-
-        index->extents[extent_idx].ee_comp_algo = used_comp_algo;
-        index->extents[extent_idx].ee_enc_algo = used_enc_algo;
-        index->extents[extent_idx].ee_flags = flags;
-        mark_buffer_dirty(bh_index);
-        sync_dirty_buffer(bh_index);
+    /*
+     * The bio writes the folio, its buffers from ->write_begin are clean.
+     * Delayed ones are left unmapped so that the next write maps them to
+     * the extent they just got.
+     */
+    head = folio_buffers(folio);
+    if (head) {
+        bh = head;
+        do {
+            clear_buffer_dirty(bh);
+            if (buffer_delay(bh)) {
+                clear_buffer_delay(bh);
+                clear_buffer_mapped(bh);
+            }
+            bh = bh->b_this_page;
+        } while (bh != head);
     }
 
-    /* Mark page clean */
     folio_start_writeback(folio);
     folio_unlock(folio);
-    folio_end_writeback(folio);
-    ret = 0;
+    lolelffs_stat_add(sbi, LOLELFFS_STAT_BLOCKS_WRITTEN, 1);
+    if (start)
+        trace_lolelffs_writepage(inode, iblock, valid, enc_algo, 0,
+                                 ktime_get_ns() - start);
+    return 0;
 
 error:
-    if (page_data)
-        kunmap(page);
-    if (work_buf)
-        kfree(work_buf);
-    if (bh_block)
-        brelse(bh_block);
-    if (bh_index)
-        brelse(bh_index);
+    /* Keep the data dirty for the next writeback to try again */
+    folio_redirty_for_writepage(wbc, folio);
+    mapping_set_error(folio->mapping, ret);
+    folio_unlock(folio);
+    if (start)
+        trace_lolelffs_writepage(inode, iblock, valid, enc_algo, ret,
+                                 ktime_get_ns() - start);
+    return ret;
+}
 
-    if (ret != 0) {
-        /* Mark page as having an error */
-        mapping_set_error(folio->mapping, ret);
-        folio_unlock(folio);
-    }
+/*
+ * Write the extent index changes of the batch back once, synchronously for
+ * data integrity writeback, and release the per-batch resources.
+ */
+static int lolelffs_wb_finish(struct lolelffs_wb_ctx *wb,
+                              struct writeback_control *wbc)
+{
+    int ret;
+
+    ret = lolelffs_wb_put_index(wb);
+    if (wb->have_req)
+        lolelffs_enc_req_release(&wb->req);
+    kfree(wb->scratch);
 
     return ret;
 }
@@ -417,79 +1361,284 @@ static int lolelffs_writepages(struct address_space *mapping,
                                struct writeback_control *wbc)
 {
     struct inode *inode = mapping->host;
+    struct lolelffs_sb_info *sbi = LOLELFFS_SB(inode->i_sb);
+    struct lolelffs_enc_key *key = smp_load_acquire(&sbi->enc_key);
+    struct lolelffs_wb_ctx wb = {
+        .inode = inode,
+        .ext_idx = -1,
+        .sync = wbc->sync_mode == WB_SYNC_ALL,
+    };
+    struct folio *folio = NULL;
     struct blk_plug plug;
-    pgoff_t index = 0;
-    pgoff_t end;
-    int ret = 0;
-    int done = 0;
-
-    /* For now, fall back to mpage_writepages if encryption is not enabled */
-    struct super_block *sb = inode->i_sb;
-    struct lolelffs_sb_info *sbi = LOLELFFS_SB(sb);
+    int error = 0, ret;
 
-    if (!sbi->enc_enabled && !sbi->comp_enabled) {
-        return mpage_writepages(mapping, wbc, lolelffs_file_get_block);
-    }
+    /* A locked filesystem fails in lolelffs_wb_transform() */
+    if (sbi->enc_enabled && lolelffs_enc_inline(key, sbi->enc_default_algo))
+        wb.inline_key = key;
+    wb.bounce = sbi->enc_enabled && !wb.inline_key;
 
-    /* Custom writepages for compression and encryption */
+    /*
+     * mpage_writepages() cannot be used: it would write delayed buffers to
+     * their placeholder block number.
+     */
     blk_start_plug(&plug);
+    while ((folio = writeback_iter(mapping, wbc, folio, &error)))
+        error = lolelffs_wb_folio(&wb, folio, wbc);
+    if (wb.bio)
+        submit_bio(wb.bio);
+    blk_finish_plug(&plug);
 
-    if (wbc->range_cyclic) {
-        index = mapping->writeback_index;
-        end = -1;
-    } else {
-        index = wbc->range_start >> PAGE_SHIFT;
-        end = wbc->range_end >> PAGE_SHIFT;
+    ret = lolelffs_wb_finish(&wb, wbc);
+    return error ? error : ret;
+}
+
+int lolelffs_init_wb_pool(void)
+{
+    lolelffs_wb_page_pool = mempool_create_page_pool(LOLELFFS_WB_POOL_PAGES, 0);
+    if (!lolelffs_wb_page_pool)
+        return -ENOMEM;
+    return 0;
+}
+
+void lolelffs_destroy_wb_pool(void)
+{
+    mempool_destroy(lolelffs_wb_page_pool);
+}
+
+/*
+ * Drop the reference of an inline file to the tail block block, and free the
+ * block once it holds no file anymore
+ */
+void lolelffs_tail_put(struct super_block *sb, uint32_t block)
+{
+    struct lolelffs_sb_info *sbi = LOLELFFS_SB(sb);
+    struct lolelffs_tail_header *th;
+    struct buffer_head *bh;
+    uint32_t nr_tails;
+
+    bh = LOLELFFS_SB_BREAD(sb, block);
+    if (!bh) {
+        pr_err("failed reading tail block %u, its space is lost\n", block);
+        return;
     }
+    th = (struct lolelffs_tail_header *) bh->b_data;
+
+    /* Files sharing the block may be converted concurrently */
+    lock_buffer(bh);
+    nr_tails = le32_to_cpu(th->th_nr_tails);
+    if (le32_to_cpu(th->th_magic) != LOLELFFS_TAIL_MAGIC || !nr_tails) {
+        unlock_buffer(bh);
+        pr_err("invalid tail block %u\n", block);
+        brelse(bh);
+        return;
+    }
+    th->th_nr_tails = cpu_to_le32(--nr_tails);
+    /* A freed block must not be taken for a tail block again */
+    if (!nr_tails)
+        memset(th, 0, sizeof(*th));
+    unlock_buffer(bh);
+    mark_buffer_dirty(bh);
+    if (!nr_tails)
+        sync_dirty_buffer(bh);
+    brelse(bh);
+
+    if (!nr_tails) {
+        lolelffs_sb_lock(sbi);
+        if (sbi->tail_block == block)
+            WRITE_ONCE(sbi->tail_block, 0);
+        mutex_unlock(&sbi->lock);
+        put_blocks(sbi, block, 1);
+    }
+}
 
-    while (!done && (index <= end)) {
-        struct folio_batch fbatch;
-        unsigned int i, nr;
+/*
+ * Move an inline file to an extent index before it is written to. Its
+ * contents are written again through the page cache, so that writeback
+ * allocates and encodes their block like any other. Called with the inode
+ * lock held.
+ */
+int lolelffs_inline_convert(struct inode *inode)
+{
+    struct lolelffs_inode_info *ci = LOLELFFS_INODE(inode);
+    struct address_space *mapping = inode->i_mapping;
+    struct super_block *sb = inode->i_sb;
+    struct lolelffs_sb_info *sbi = LOLELFFS_SB(sb);
+    loff_t size = i_size_read(inode);
+    char old_data[sizeof(ci->i_data)];
+    struct folio *folio = NULL, *wfolio;
+    struct buffer_head *bh;
+    uint32_t bno;
+    int ret;
+
+    if (!lolelffs_inode_is_inline(inode))
+        return 0;
 
-        folio_batch_init(&fbatch);
-        nr = filemap_get_folios_tag(mapping, &index, end,
-                                     PAGECACHE_TAG_DIRTY, &fbatch);
-        if (nr == 0)
-            break;
+    /* Bring the contents in while they can still be read inline */
+    if (size) {
+        folio = read_mapping_folio(mapping, 0, NULL);
+        if (IS_ERR(folio))
+            return PTR_ERR(folio);
+    }
 
-        for (i = 0; i < nr; i++) {
-            struct folio *folio = fbatch.folios[i];
+    bno = get_free_blocks(sbi, 1);
+    if (!bno) {
+        ret = -ENOSPC;
+        goto out;
+    }
+    bh = LOLELFFS_SB_BREAD(sb, bno);
+    if (!bh) {
+        put_blocks(sbi, bno, 1);
+        ret = -EIO;
+        goto out;
+    }
+    memset(bh->b_data, 0, LOLELFFS_BLOCK_SIZE);
+    mark_buffer_dirty(bh);
+    sync_dirty_buffer(bh);
+    brelse(bh);
+
+    memcpy(old_data, ci->i_data, sizeof(old_data));
+    memset(ci->i_data, 0, sizeof(ci->i_data));
+    ci->ei_block = bno;
+    lolelffs_ext_map_invalidate(inode);
+
+    if (folio) {
+        /* The folio is uptodate: its buffers are only mapped and dirtied */
+        ret = block_write_begin(mapping, 0, size, &wfolio,
+                                lolelffs_file_get_block);
+        if (ret) {
+            lolelffs_da_release(inode, 0);
+            ci->ei_block = 0;
+            memcpy(ci->i_data, old_data, sizeof(old_data));
+            lolelffs_ext_map_invalidate(inode);
+            put_blocks(sbi, bno, 1);
+            goto out;
+        }
+        generic_write_end(NULL, mapping, 0, size, size, wfolio, NULL);
+    }
 
-            folio_lock(folio);
+    if (size > LOLELFFS_INLINE_DATA_SIZE)
+        lolelffs_tail_put(sb, le32_to_cpu(((struct lolelffs_tail_ref *) old_data)->tr_block));
 
-            if (!folio_clear_dirty_for_io(folio)) {
-                folio_unlock(folio);
-                continue;
-            }
+    inode->i_blocks = size ? size / LOLELFFS_BLOCK_SIZE + 2 : 1;
+    mark_inode_dirty(inode);
+    ret = 0;
 
-            ret = lolelffs_writepage_locked(folio, wbc);
-            if (ret) {
-                done = 1;
-                break;
-            }
+out:
+    if (folio)
+        folio_put(folio);
+    return ret;
+}
 
-            if (wbc->nr_to_write <= 0) {
-                done = 1;
-                break;
-            }
-        }
+/*
+ * Get an inline file ready to be truncated to size. The size of an inline
+ * file tells where its contents are: in i_data up to
+ * LOLELFFS_INLINE_DATA_SIZE bytes, in its tail block above. Truncating it to
+ * 0 drops its tail block, and a tail that only shrinks stays where it is.
+ * Any other change that crosses the limit, or grows a tail past the bytes
+ * it owns, moves the file to an extent index first. Called with the inode
+ * lock and the invalidate lock of its mapping held.
+ */
+int lolelffs_inline_truncate(struct inode *inode, loff_t size)
+{
+    struct lolelffs_inode_info *ci = LOLELFFS_INODE(inode);
+    loff_t old = i_size_read(inode);
+    uint32_t block;
 
-        folio_batch_release(&fbatch);
-        cond_resched();
+    if (!lolelffs_inode_is_inline(inode))
+        return 0;
+
+    if (old <= LOLELFFS_INLINE_DATA_SIZE && size <= LOLELFFS_INLINE_DATA_SIZE) {
+        /* The bytes past the end must read back as zeroes once it grows */
+        old = min(old, size);
+        memset(ci->i_data + old, 0, sizeof(ci->i_data) - old);
+        return 0;
+    }
+    if (old > LOLELFFS_INLINE_DATA_SIZE && !size) {
+        block = le32_to_cpu(((struct lolelffs_tail_ref *) ci->i_data)->tr_block);
+        memset(ci->i_data, 0, sizeof(ci->i_data));
+        lolelffs_tail_put(inode->i_sb, block);
+        return 0;
     }
+    if (old > LOLELFFS_INLINE_DATA_SIZE && size > LOLELFFS_INLINE_DATA_SIZE &&
+        size <= old)
+        return 0;
 
-    blk_finish_plug(&plug);
+    return lolelffs_inline_convert(inode);
+}
+
+/*
+ * Free the blocks of a file shrunk to its new size, once its page cache is
+ * truncated: the blocks reserved past the end, the extents starting past it
+ * and the tail of the extent crossing it. Packed and shared extents crossing
+ * the end are kept whole, and shared extents past it stay mapped for the
+ * tools to free, as on write_end(). Called with the inode lock and the
+ * invalidate lock of its mapping held.
+ */
+int lolelffs_file_trim(struct inode *inode)
+{
+    struct super_block *sb = inode->i_sb;
+    struct lolelffs_sb_info *sbi = LOLELFFS_SB(sb);
+    struct lolelffs_inode_info *ci = LOLELFFS_INODE(inode);
+    uint32_t end = DIV_ROUND_UP(i_size_read(inode), LOLELFFS_BLOCK_SIZE);
+    struct lolelffs_extent ext, *extents;
+    struct buffer_head *bh;
+    uint32_t blk, keep;
+    int idx, ret;
+
+    lolelffs_da_release(inode, end);
+    if (lolelffs_inode_is_inline(inode))
+        return 0;
 
-    if (wbc->range_cyclic)
-        mapping->writeback_index = index;
+    bh = LOLELFFS_SB_BREAD(sb, ci->ei_block);
+    if (!bh)
+        return -EIO;
+    lolelffs_alloc_lock(sbi, ci);
+    ret = lolelffs_ext_truncate(inode, bh, end, false);
+    if (ret == -EOPNOTSUPP)
+        ret = 0;
+    mark_buffer_dirty(bh);
+    if (!ret)
+        ret = sync_dirty_buffer(bh);
+    brelse(bh);
+    lolelffs_ext_map_invalidate(inode);
+    if (ret || !end)
+        goto unlock;
+
+    idx = lolelffs_ext_map_lookup(inode, end, &ext, &blk);
+    if (idx == -ENOENT)
+        goto unlock;
+    if (idx < 0) {
+        ret = idx;
+        goto unlock;
+    }
+    if (ext.ee_flags & (LOLELFFS_EXT_HAS_META | LOLELFFS_EXT_SHARED))
+        goto unlock;
 
+    keep = end - ext.ee_block;
+    bh = LOLELFFS_SB_BREAD(sb, blk);
+    if (!bh) {
+        ret = -EIO;
+        goto unlock;
+    }
+    extents = lolelffs_ext_block_extents(bh->b_data);
+    extents[idx].ee_len = keep;
+    mark_buffer_dirty(bh);
+    ret = sync_dirty_buffer(bh);
+    brelse(bh);
+    lolelffs_ext_map_invalidate(inode);
+    if (!ret)
+        lolelffs_free_blocks(sbi, ext.ee_start + keep, ext.ee_len - keep);
+
+unlock:
+    mutex_unlock(&ci->alloc_lock);
+    inode->i_blocks = i_size_read(inode) / LOLELFFS_BLOCK_SIZE + 2;
     return ret;
 }
 
 /*
  * Called by the VFS when a write() syscall occurs on file before writing the
  * data in the page cache. This functions checks if the write will be able to
- * complete and allocates the necessary blocks through block_write_begin().
+ * complete and reserves the necessary blocks through block_write_begin().
  */
 static int lolelffs_write_begin(const struct kiocb *iocb,
                                 struct address_space *mapping,
@@ -501,13 +1650,8 @@ static int lolelffs_write_begin(const struct kiocb *iocb,
     struct inode *inode = mapping->host;
     struct super_block *sb = inode->i_sb;
     struct lolelffs_sb_info *sbi = LOLELFFS_SB(sb);
-    struct lolelffs_inode_info *ci = LOLELFFS_INODE(inode);
-    struct lolelffs_file_ei_block *index;
-    struct buffer_head *bh_index;
     int err;
     uint32_t nr_allocs = 0;
-    uint32_t nr_extents_before = 0;
-    uint32_t i;
 
     /* Check if the write can be completed (enough space?) */
     if (pos + len > LOLELFFS_MAX_FILESIZE)
@@ -517,42 +1661,24 @@ static int lolelffs_write_begin(const struct kiocb *iocb,
         nr_allocs -= inode->i_blocks - 1;
     else
         nr_allocs = 0;
-    if (nr_allocs > sbi->nr_free_blocks)
+    if (nr_allocs > lolelffs_nr_free_blocks(sbi) - sbi->nr_reserved_blocks)
         return -ENOSPC;
 
-    /* Count extents before write to track new allocations */
-    bh_index = LOLELFFS_SB_BREAD(sb, ci->ei_block);
-    if (!bh_index)
-        return -EIO;
-    index = (struct lolelffs_file_ei_block *) bh_index->b_data;
-    for (i = 0; i < LOLELFFS_MAX_EXTENTS; i++) {
-        if (index->extents[i].ee_start == 0)
-            break;
-        nr_extents_before++;
-    }
-    brelse(bh_index);
+    /* Writeback could not encrypt the data, refuse it upfront */
+    if (sbi->enc_enabled && !READ_ONCE(sbi->enc_key))
+        return -EPERM;
+
+    err = lolelffs_inline_convert(inode);
+    if (err)
+        return err;
 
     /* prepare the write */
     err = block_write_begin(mapping, pos, len, foliop,
                             lolelffs_file_get_block);
 
-    /* if this failed, reclaim newly allocated blocks */
-    if (err < 0) {
-        bh_index = LOLELFFS_SB_BREAD(sb, ci->ei_block);
-        if (bh_index) {
-            index = (struct lolelffs_file_ei_block *) bh_index->b_data;
-            /* Free any extents allocated during the failed write */
-            for (i = nr_extents_before; i < LOLELFFS_MAX_EXTENTS; i++) {
-                if (index->extents[i].ee_start == 0)
-                    break;
-                put_blocks(sbi, index->extents[i].ee_start,
-                           index->extents[i].ee_len);
-                memset(&index->extents[i], 0, sizeof(struct lolelffs_extent));
-            }
-            mark_buffer_dirty(bh_index);
-            brelse(bh_index);
-        }
-    }
+    /* if this failed, give back what was reserved past EOF */
+    if (err < 0)
+        lolelffs_da_release(inode, DIV_ROUND_UP(inode->i_size, LOLELFFS_BLOCK_SIZE));
     return err;
 }
 
@@ -590,18 +1716,16 @@ static int lolelffs_write_end(const struct kiocb *iocb,
         inode_set_mtime_to_ts(inode, now);
         inode_set_ctime_to_ts(inode, now);
     }
+    /* Written back with the data, keep write() free of synchronous I/O */
     mark_inode_dirty(inode);
-    lolelffs_write_inode(inode, NULL);
 
     /* If file is smaller than before, free unused blocks */
     if (nr_blocks_old > inode->i_blocks) {
-        int i;
         struct buffer_head *bh_index;
-        struct lolelffs_file_ei_block *index;
-        uint32_t first_ext;
 
         /* Free unused blocks from page cache */
         truncate_pagecache(inode, inode->i_size);
+        lolelffs_da_release(inode, DIV_ROUND_UP(inode->i_size, LOLELFFS_BLOCK_SIZE));
 
         /* Read ei_block to remove unused blocks */
         bh_index = LOLELFFS_SB_BREAD(sb, ci->ei_block);
@@ -610,30 +1734,495 @@ static int lolelffs_write_end(const struct kiocb *iocb,
                    nr_blocks_old - inode->i_blocks);
             goto end;
         }
-        index = (struct lolelffs_file_ei_block *) bh_index->b_data;
-
-        first_ext = lolelffs_ext_search(index, inode->i_blocks - 1);
-        /* Reserve unused block in last extent */
-        if (inode->i_blocks - 1 != index->extents[first_ext].ee_block)
-            first_ext++;
 
-        for (i = first_ext; i < LOLELFFS_MAX_EXTENTS; i++) {
-            if (!index->extents[i].ee_start)
-                break;
-            put_blocks(LOLELFFS_SB(sb), index->extents[i].ee_start,
-                       index->extents[i].ee_len);
-            memset(&index->extents[i], 0, sizeof(struct lolelffs_extent));
-        }
+        /*
+         * Keep the unused blocks of the last extent reserved. Shared
+         * extents stay mapped past the end, for the tools to free.
+         */
+        lolelffs_alloc_lock(LOLELFFS_SB(sb), ci);
+        lolelffs_ext_truncate(inode, bh_index, inode->i_blocks - 1, false);
         mark_buffer_dirty(bh_index);
         sync_dirty_buffer(bh_index);
+        lolelffs_ext_map_invalidate(inode);
+        mutex_unlock(&ci->alloc_lock);
         brelse(bh_index);
     }
 end:
     return ret;
 }
 
+/* Old and new extents of a file being defragmented */
+struct lolelffs_defrag_plan {
+    struct lolelffs_extent old[LOLELFFS_MAX_EXTENTS];
+    struct lolelffs_extent new[LOLELFFS_MAX_EXTENTS];
+    bool fresh[LOLELFFS_MAX_EXTENTS]; /* new[i] was allocated by the plan */
+};
+
+/*
+ * Whether b can be appended to a: it must map the logical blocks right after
+ * those of a, so that no hole of a sparse file is closed up. Packed and
+ * shared extents are never merged.
+ */
+static bool lolelffs_defrag_mergeable(const struct lolelffs_extent *a,
+                                      const struct lolelffs_extent *b)
+{
+    return !(a->ee_flags & (LOLELFFS_EXT_HAS_META | LOLELFFS_EXT_SHARED)) &&
+           a->ee_flags == b->ee_flags && a->ee_comp_algo == b->ee_comp_algo &&
+           a->ee_enc_algo == b->ee_enc_algo &&
+           b->ee_block == a->ee_block + a->ee_len;
+}
+
+/*
+ * Copy nr blocks from src to dest through the buffer cache. Blocks are copied
+ * as stored: their encoding only depends on their logical block number.
+ */
+static int lolelffs_defrag_copy(struct super_block *sb,
+                                uint32_t src,
+                                uint32_t dest,
+                                uint32_t nr)
+{
+    struct lolelffs_sb_info *sbi = LOLELFFS_SB(sb);
+    struct buffer_head *from, *to;
+    uint32_t i;
+
+    for (i = 0; i < nr; i++) {
+        from = LOLELFFS_SB_BREAD(sb, src + i);
+        if (!from)
+            return -EIO;
+        to = sb_getblk(sb, dest + i + sbi->fs_offset);
+        if (!to) {
+            brelse(from);
+            return -ENOMEM;
+        }
+        lock_buffer(to);
+        memcpy(to->b_data, from->b_data, LOLELFFS_BLOCK_SIZE);
+        set_buffer_uptodate(to);
+        unlock_buffer(to);
+        mark_buffer_dirty(to);
+        brelse(to);
+        brelse(from);
+    }
+
+    return 0;
+}
+
+/*
+ * Fill plan->new with the extents of the file once runs of mergeable extents
+ * are merged, up to the large extent limit. Physically contiguous runs are
+ * merged in place; the others are copied to a new run of free blocks, which
+ * shrinks by whole extents while free space does not allow it. Clear ee_len
+ * in plan->old for the extents whose blocks stay in use. Return the number
+ * of new extents, or a negative error code after freeing the new runs.
+ */
+static int lolelffs_defrag_plan(struct inode *inode,
+                                struct lolelffs_defrag_plan *plan,
+                                uint32_t nr_extents,
+                                uint32_t *moved)
+{
+    struct super_block *sb = inode->i_sb;
+    struct lolelffs_sb_info *sbi = LOLELFFS_SB(sb);
+    struct lolelffs_extent *old = plan->old;
+    uint32_t max_len, i = 0, j, k, len, goal, bno, off;
+    int n = 0, ret;
+    bool contig;
+
+    max_len = sbi->max_extent_blocks_large;
+    if (max_len == 0 || max_len > LOLELFFS_MAX_BLOCKS_PER_EXTENT_LARGE)
+        max_len = LOLELFFS_MAX_BLOCKS_PER_EXTENT_LARGE;
+
+    while (i < nr_extents) {
+        len = old[i].ee_len;
+        contig = true;
+        for (j = i + 1; j < nr_extents &&
+                        lolelffs_defrag_mergeable(&old[j - 1], &old[j]) &&
+                        len + old[j].ee_len <= max_len;
+             j++) {
+            if (old[j].ee_start != old[j - 1].ee_start + old[j - 1].ee_len)
+                contig = false;
+            len += old[j].ee_len;
+        }
+
+        bno = 0;
+        if (j - i > 1 && !contig) {
+            goal = n ? plan->new[n - 1].ee_start +
+                           lolelffs_ext_phys_len(sb, &plan->new[n - 1])
+                     : LOLELFFS_INODE(inode)->ei_block + 1;
+            while (!(bno = lolelffs_new_blocks(sbi, goal, len)) && j - i > 2)
+                len -= old[--j].ee_len;
+            if (!bno) {
+                j = i + 1;
+                len = old[i].ee_len;
+            }
+        }
+
+        plan->new[n] = old[i];
+        if (bno) {
+            for (k = i, off = 0; k < j; off += old[k].ee_len, k++) {
+                ret = lolelffs_defrag_copy(sb, old[k].ee_start, bno + off,
+                                           old[k].ee_len);
+                if (ret) {
+                    put_blocks(sbi, bno, len);
+                    goto fail;
+                }
+            }
+            plan->new[n].ee_start = bno;
+            plan->fresh[n] = true;
+            *moved += len;
+        } else {
+            for (k = i; k < j; k++)
+                old[k].ee_len = 0;
+        }
+        plan->new[n].ee_len = len;
+        n++;
+        i = j;
+    }
+
+    return n;
+
+fail:
+    while (n--) {
+        if (plan->fresh[n])
+            put_blocks(sbi, plan->new[n].ee_start, plan->new[n].ee_len);
+    }
+    return ret;
+}
+
+/*
+ * Merge the extents of a regular file into as few as its contiguous free
+ * space allows, while it stays mounted and in use. Readers and writers are
+ * kept out while the blocks move: the file is written back and dropped from
+ * the page cache first, so that no folio keeps a mapping to a moved block.
+ * New blocks reach the disk before the extent index points to them, and old
+ * blocks are only freed after that. Packed and shared extents are left where
+ * they are.
+ */
+int lolelffs_defrag(struct inode *inode, struct lolelffs_ioctl_defrag *stats)
+{
+    struct super_block *sb = inode->i_sb;
+    struct lolelffs_sb_info *sbi = LOLELFFS_SB(sb);
+    struct lolelffs_inode_info *ci = LOLELFFS_INODE(inode);
+    struct address_space *mapping = inode->i_mapping;
+    struct lolelffs_file_ei_block *index;
+    struct lolelffs_defrag_plan *plan = NULL;
+    struct buffer_head *bh = NULL;
+    uint32_t i, nr_extents, moved = 0;
+    int n, ret;
+
+    memset(stats, 0, sizeof(*stats));
+
+    inode_lock(inode);
+    /* Inline files have no extent to merge */
+    if (lolelffs_inode_is_inline(inode)) {
+        inode_unlock(inode);
+        return 0;
+    }
+    filemap_invalidate_lock(mapping);
+
+    ret = filemap_write_and_wait(mapping);
+    if (ret)
+        goto unlock;
+    ret = invalidate_inode_pages2(mapping);
+    if (ret)
+        goto unlock;
+
+    lolelffs_alloc_lock(sbi, ci);
+    bh = LOLELFFS_SB_BREAD(sb, ci->ei_block);
+    if (!bh) {
+        ret = -EIO;
+        goto unlock_alloc;
+    }
+    index = (struct lolelffs_file_ei_block *) bh->b_data;
+
+    /* Extent trees are only merged offline, by lolelffs defrag */
+    if (lolelffs_ext_is_tree(index)) {
+        ret = -EOPNOTSUPP;
+        goto unlock_alloc;
+    }
+
+    for (nr_extents = 0; nr_extents < LOLELFFS_MAX_EXTENTS; nr_extents++) {
+        if (!index->extents[nr_extents].ee_start)
+            break;
+    }
+    stats->extents_before = stats->extents_after = nr_extents;
+    if (nr_extents < 2)
+        goto unlock_alloc;
+
+    plan = kzalloc(sizeof(*plan), GFP_NOFS);
+    if (!plan) {
+        ret = -ENOMEM;
+        goto unlock_alloc;
+    }
+    memcpy(plan->old, index->extents, nr_extents * sizeof(struct lolelffs_extent));
+
+    n = lolelffs_defrag_plan(inode, plan, nr_extents, &moved);
+    if (n < 0) {
+        ret = n;
+        goto unlock_alloc;
+    }
+    if (n == nr_extents)
+        goto unlock_alloc;
+
+    /* The copies must be stable before the index points to them */
+    ret = sync_blockdev(sb->s_bdev);
+    if (ret)
+        goto undo;
+
+    memset(index->extents, 0, sizeof(index->extents));
+    memcpy(index->extents, plan->new, n * sizeof(struct lolelffs_extent));
+    mark_buffer_dirty(bh);
+    ret = sync_dirty_buffer(bh);
+    lolelffs_ext_map_invalidate(inode);
+    if (ret)
+        goto unlock_alloc;
+
+    for (i = 0; i < nr_extents; i++) {
+        if (plan->old[i].ee_len)
+            put_blocks(sbi, plan->old[i].ee_start, plan->old[i].ee_len);
+    }
+    stats->extents_after = n;
+    stats->blocks_moved = moved;
+    goto unlock_alloc;
+
+undo:
+    while (n--) {
+        if (plan->fresh[n])
+            put_blocks(sbi, plan->new[n].ee_start, plan->new[n].ee_len);
+    }
+unlock_alloc:
+    mutex_unlock(&ci->alloc_lock);
+    brelse(bh);
+    kfree(plan);
+unlock:
+    filemap_invalidate_unlock(mapping);
+    inode_unlock(inode);
+    return ret;
+}
+
+/*
+ * Hand the shared extent ext, which the inode stops mapping, to *orphan, and
+ * create one when there is none yet or it is full. See lolelffs_new_orphan().
+ */
+static int lolelffs_orphan_extent(struct super_block *sb,
+                                  struct inode **orphan,
+                                  const struct lolelffs_extent *ext)
+{
+    int ret;
+
+    if (*orphan) {
+        ret = lolelffs_orphan_add(*orphan, ext);
+        if (ret != -ENOSPC)
+            return ret;
+        iput(*orphan);
+    }
+
+    *orphan = lolelffs_new_orphan(sb);
+    if (IS_ERR(*orphan)) {
+        ret = PTR_ERR(*orphan);
+        *orphan = NULL;
+        return ret;
+    }
+    return lolelffs_orphan_add(*orphan, ext);
+}
+
+/*
+ * Rewrite the extent ext of the inode, found by lolelffs_ext_map_lookup() at
+ * index idx of the extent block blk, to new blocks of its own. A packed
+ * extent becomes a plain extent of as many raw blocks, which are encrypted
+ * again with their logical block numbers if it is encrypted. The blocks of
+ * other extents are copied as stored. buf must hold
+ * LOLELFFS_COMP_CLUSTER_SIZE bytes.
+ *
+ * The old blocks are then freed, unless the extent is shared: other files
+ * may map them, so the extent is handed to *orphan instead before the inode
+ * stops mapping it.
+ */
+static int lolelffs_rewrite_extent(struct inode *inode,
+                                   const struct lolelffs_extent *ext,
+                                   uint32_t blk,
+                                   int idx,
+                                   void *buf,
+                                   struct inode **orphan)
+{
+    struct super_block *sb = inode->i_sb;
+    struct lolelffs_sb_info *sbi = LOLELFFS_SB(sb);
+    struct lolelffs_extent *extents;
+    struct lolelffs_enc_req req;
+    struct buffer_head *bh;
+    bool packed = ext->ee_flags & LOLELFFS_EXT_HAS_META;
+    bool shared = ext->ee_flags & LOLELFFS_EXT_SHARED;
+    bool encrypted = packed && ext->ee_enc_algo != LOLELFFS_ENC_NONE;
+    uint32_t bno, rel, first, i;
+    int nr, ret;
+
+    if (ext->ee_len > lolelffs_nr_free_blocks(sbi) - sbi->nr_reserved_blocks)
+        return -ENOSPC;
+    if (encrypted) {
+        ret = lolelffs_read_enc_req(sbi, ext->ee_enc_algo, &req);
+        if (ret)
+            return ret;
+    }
+    bno = lolelffs_new_blocks(sbi, ext->ee_start, ext->ee_len);
+    if (!bno) {
+        ret = -ENOSPC;
+        goto out;
+    }
+
+    for (rel = 0; packed && rel < ext->ee_len; rel = first + nr) {
+        nr = lolelffs_read_cluster(sb, ext, rel, buf, &first);
+        if (nr <= 0) {
+            ret = nr ? nr : -EIO;
+            goto fail;
+        }
+        for (i = 0; i < nr; i++) {
+            bh = sb_getblk(sb, bno + first + i + sbi->fs_offset);
+            if (!bh) {
+                ret = -ENOMEM;
+                goto fail;
+            }
+            lock_buffer(bh);
+            memcpy(bh->b_data, buf + i * LOLELFFS_BLOCK_SIZE, LOLELFFS_BLOCK_SIZE);
+            if (encrypted) {
+                ret = lolelffs_encrypt_block(&req, ext->ee_block + first + i,
+                                             bh->b_data, bh->b_data);
+                if (ret < 0) {
+                    unlock_buffer(bh);
+                    brelse(bh);
+                    goto fail;
+                }
+            }
+            set_buffer_uptodate(bh);
+            unlock_buffer(bh);
+            mark_buffer_dirty(bh);
+            brelse(bh);
+        }
+    }
+    if (!packed) {
+        ret = lolelffs_defrag_copy(sb, ext->ee_start, bno, ext->ee_len);
+        if (ret)
+            goto fail;
+    }
+
+    /* The new blocks must be stable before the extent points to them */
+    ret = sync_blockdev(sb->s_bdev);
+    if (ret)
+        goto fail;
+    if (shared) {
+        ret = lolelffs_orphan_extent(sb, orphan, ext);
+        if (ret)
+            goto fail;
+    }
+
+    bh = LOLELFFS_SB_BREAD(sb, blk);
+    if (!bh) {
+        ret = -EIO;
+        goto fail;
+    }
+    extents = lolelffs_ext_block_extents(bh->b_data);
+    extents[idx].ee_start = bno;
+    extents[idx].ee_flags &= ~LOLELFFS_EXT_SHARED;
+    if (packed) {
+        extents[idx].ee_comp_algo = LOLELFFS_COMP_NONE;
+        extents[idx].ee_flags &= ~(LOLELFFS_EXT_COMPRESSED | LOLELFFS_EXT_HAS_META);
+        extents[idx].ee_meta = 0;
+    }
+    mark_buffer_dirty(bh);
+    ret = sync_dirty_buffer(bh);
+    brelse(bh);
+    lolelffs_ext_map_invalidate(inode);
+    if (!ret && !shared)
+        lolelffs_ext_free(sb, ext, false);
+    goto out;
+
+fail:
+    lolelffs_free_blocks(sbi, bno, ext->ee_len);
+out:
+    if (encrypted)
+        lolelffs_enc_req_release(&req);
+    return ret;
+}
+
+/*
+ * Get a regular file ready to be written to, when it is opened for writing.
+ * The blocks of packed extents are not mapped 1:1 to logical blocks, so
+ * these extents are rewritten as plain extents of raw blocks first, which
+ * needs room for their uncompressed size. Writeback then compresses their
+ * blocks again one at a time, if the filesystem asks for it. Other files may
+ * map the blocks of shared extents, so these are copied to blocks of the
+ * file's own first: the file is copied on write, once, when it is opened.
+ */
+int lolelffs_file_prepare_write(struct inode *inode)
+{
+    struct lolelffs_sb_info *sbi = LOLELFFS_SB(inode->i_sb);
+    struct lolelffs_inode_info *ci = LOLELFFS_INODE(inode);
+    struct address_space *mapping = inode->i_mapping;
+    const uint16_t flags = LOLELFFS_EXT_HAS_META | LOLELFFS_EXT_SHARED;
+    struct inode *orphan = NULL;
+    struct lolelffs_extent ext;
+    uint32_t blk, first = 0;
+    void *buf;
+    int idx, ret;
+
+    if (!S_ISREG(inode->i_mode) || lolelffs_inode_is_inline(inode))
+        return 0;
+
+    /* Most files have nothing to rewrite: look before locking them */
+    ret = lolelffs_ext_find_flagged(inode, 0, flags, &ext);
+    if (ret <= 0)
+        return ret;
+
+    buf = kvmalloc(LOLELFFS_COMP_CLUSTER_SIZE, GFP_KERNEL);
+    if (!buf)
+        return -ENOMEM;
+
+    /* Keep the file out of the page cache meanwhile, as lolelffs_defrag() */
+    inode_lock(inode);
+    filemap_invalidate_lock(mapping);
+    ret = filemap_write_and_wait(mapping);
+    if (ret)
+        goto unlock;
+    ret = invalidate_inode_pages2(mapping);
+    if (ret)
+        goto unlock;
+
+    lolelffs_alloc_lock(sbi, ci);
+    while ((ret = lolelffs_ext_find_flagged(inode, first, flags, &ext)) > 0) {
+        idx = lolelffs_ext_map_lookup(inode, ext.ee_block, &ext, &blk);
+        if (idx < 0) {
+            ret = idx;
+            break;
+        }
+        ret = lolelffs_rewrite_extent(inode, &ext, blk, idx, buf, &orphan);
+        if (ret)
+            break;
+        first = ext.ee_block + ext.ee_len;
+    }
+    mutex_unlock(&ci->alloc_lock);
+
+unlock:
+    filemap_invalidate_unlock(mapping);
+    inode_unlock(inode);
+    if (orphan)
+        iput(orphan);
+    kvfree(buf);
+    return ret;
+}
+
+static int lolelffs_file_open(struct inode *inode, struct file *file)
+{
+    int ret;
+
+    if (file->f_mode & FMODE_WRITE) {
+        ret = lolelffs_file_prepare_write(inode);
+        if (ret)
+            return ret;
+    }
+
+    return generic_file_open(inode, file);
+}
+
 const struct address_space_operations lolelffs_aops = {
     .read_folio = lolelffs_read_folio,
+    .readahead = lolelffs_readahead,
     .writepages = lolelffs_writepages,
     .write_begin = lolelffs_write_begin,
     .write_end = lolelffs_write_end,
@@ -642,7 +2231,9 @@ const struct address_space_operations lolelffs_aops = {
 const struct file_operations lolelffs_file_ops = {
     .llseek = generic_file_llseek,
     .owner = THIS_MODULE,
+    .open = lolelffs_file_open,
     .read_iter = generic_file_read_iter,
     .write_iter = generic_file_write_iter,
     .fsync = generic_file_fsync,
+    .unlocked_ioctl = lolelffs_ioctl,
 };
@@ -9,6 +9,9 @@
 #include "compress.h"
 #include "encrypt.h"
 
+#define CREATE_TRACE_POINTS
+#include "trace.h"
+
 /* Wrapper for fill_super to match new kernel API */
 static int lolelffs_fill_super_fc(struct super_block *sb, struct fs_context *fc)
 {
@@ -76,15 +79,39 @@ static int __init lolelffs_init(void)
         goto cleanup_enc;
     }
 
+    ret = lolelffs_init_read_wq();
+    if (ret) {
+        pr_err("read workqueue creation failed\n");
+        goto cleanup_cache;
+    }
+
+    ret = lolelffs_init_wb_pool();
+    if (ret) {
+        pr_err("writeback page pool creation failed\n");
+        goto cleanup_wq;
+    }
+
+    ret = lolelffs_sysfs_init();
+    if (ret) {
+        pr_err("sysfs registration failed\n");
+        goto cleanup_pool;
+    }
+
     ret = register_filesystem(&lolelffs_file_system_type);
     if (ret) {
         pr_err("register_filesystem() failed\n");
-        goto cleanup_cache;
+        goto cleanup_sysfs;
     }
 
     pr_info("module loaded\n");
     return 0;
 
+cleanup_sysfs:
+    lolelffs_sysfs_exit();
+cleanup_pool:
+    lolelffs_destroy_wb_pool();
+cleanup_wq:
+    lolelffs_destroy_read_wq();
 cleanup_cache:
     lolelffs_destroy_inode_cache();
 cleanup_enc:
@@ -100,6 +127,9 @@ static void __exit lolelffs_exit(void)
     if (ret)
         pr_err("unregister_filesystem() failed\n");
 
+    lolelffs_sysfs_exit();
+    lolelffs_destroy_wb_pool();
+    lolelffs_destroy_read_wq();
     lolelffs_destroy_inode_cache();
     lolelffs_enc_exit();
     lolelffs_comp_exit();
@@ -6,6 +6,16 @@
  * - Verifying inode and block bitmap consistency
  * - Checking root inode structure
  * - Validating extent structures
+ * - Validating the hashed index of the root directory
+ * - Validating the extent trees of regular files
+ * - Validating the tail blocks of small files and their file counts
+ *
+ * With -f, every allocated inode is also walked, by one thread per CPU by
+ * default, to build a map of the blocks they own: blocks claimed by two
+ * inodes, referenced but free, or used but referenced by none are reported,
+ * as are link counts that do not match the directory entries. With -r, the
+ * free inode and block counters of the superblock are rewritten from the
+ * bitmaps when they disagree.
  */
 
 #include <stdio.h>
@@ -15,15 +25,19 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <errno.h>
 #include <endian.h>
+#include <pthread.h>
+#include <time.h>
 
 #include "lolelffs.h"
 
 /* File entry index block for userspace */
 struct lolelffs_file_ei_block {
     uint32_t nr_files;
-    struct lolelffs_extent extents[(LOLELFFS_BLOCK_SIZE - sizeof(uint32_t)) / sizeof(struct lolelffs_extent)];
+    struct lolelffs_extent extents[LOLELFFS_MAX_EXTENTS];
+    uint32_t dx_block;
 };
 
 /* Global state */
@@ -32,15 +46,18 @@ static struct lolelffs_sb_info sb;
 static int errors = 0;
 static int warnings = 0;
 static int verbose = 0;
+static const uint8_t *image_map = NULL; /* Whole image, when it can be mapped */
+static uint64_t image_size = 0;
 
+/* Counted atomically, the full check reporting from several threads */
 #define ERROR(fmt, ...) do { \
     fprintf(stderr, "ERROR: " fmt "\n", ##__VA_ARGS__); \
-    errors++; \
+    __atomic_add_fetch(&errors, 1, __ATOMIC_RELAXED); \
 } while(0)
 
 #define WARN(fmt, ...) do { \
     fprintf(stderr, "WARNING: " fmt "\n", ##__VA_ARGS__); \
-    warnings++; \
+    __atomic_add_fetch(&warnings, 1, __ATOMIC_RELAXED); \
 } while(0)
 
 #define INFO(fmt, ...) do { \
@@ -48,17 +65,42 @@ static int verbose = 0;
         printf("INFO: " fmt "\n", ##__VA_ARGS__); \
 } while(0)
 
-/* Read a block from the filesystem */
+/* Read a block from the filesystem, from any thread */
 static int read_block(uint32_t block_num, void *buf)
 {
-    off_t offset = (off_t)block_num * LOLELFFS_BLOCK_SIZE;
-    if (lseek(fd, offset, SEEK_SET) != offset)
-        return -1;
-    if (read(fd, buf, LOLELFFS_BLOCK_SIZE) != LOLELFFS_BLOCK_SIZE)
+    uint64_t offset = (uint64_t)block_num * LOLELFFS_BLOCK_SIZE;
+
+    if (image_map) {
+        /* Past the end of the mapping, an access would fault */
+        if (offset + LOLELFFS_BLOCK_SIZE > image_size)
+            return -1;
+        memcpy(buf, image_map + offset, LOLELFFS_BLOCK_SIZE);
+        return 0;
+    }
+    if (pread(fd, buf, LOLELFFS_BLOCK_SIZE, offset) != LOLELFFS_BLOCK_SIZE)
         return -1;
     return 0;
 }
 
+/* Map the image, reads going through pread when it cannot be */
+static void map_image(void)
+{
+    struct stat st;
+    off_t size;
+    void *map;
+
+    if (fstat(fd, &st) < 0)
+        return;
+    size = S_ISREG(st.st_mode) ? st.st_size : lseek(fd, 0, SEEK_END);
+    if (size < LOLELFFS_BLOCK_SIZE)
+        return;
+    map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+        return;
+    image_map = map;
+    image_size = size;
+}
+
 /* Check superblock validity */
 static int check_superblock(void)
 {
@@ -302,6 +344,132 @@ static int check_root_inode(void)
     return 0;
 }
 
+/* Read the directory entry at slot through the extents of eblock */
+static int read_dir_entry(const struct lolelffs_file_ei_block *eblock,
+                          uint32_t slot, struct lolelffs_file *entry)
+{
+    char block[LOLELFFS_BLOCK_SIZE];
+    uint32_t iblock = slot / LOLELFFS_FILES_PER_BLOCK;
+
+    for (uint32_t i = 0; i < LOLELFFS_MAX_EXTENTS; i++) {
+        uint32_t ee_start = le32toh(eblock->extents[i].ee_start);
+        uint32_t ee_block = le32toh(eblock->extents[i].ee_block);
+        uint32_t ee_len = le32toh(eblock->extents[i].ee_len);
+
+        if (ee_start == 0)
+            break;
+        if (iblock < ee_block || iblock >= ee_block + ee_len)
+            continue;
+        if (read_block(ee_start + iblock - ee_block, block) < 0)
+            return -1;
+        memcpy(entry, block + (slot % LOLELFFS_FILES_PER_BLOCK) * sizeof(*entry),
+               sizeof(*entry));
+        return 0;
+    }
+
+    return -1;
+}
+
+/* Check the hashed index of a directory against its entries */
+static void check_dir_index(const struct lolelffs_file_ei_block *eblock)
+{
+    struct lolelffs_dx_root root;
+    struct lolelffs_dx_leaf leaf;
+    uint32_t nr_files = le32toh(eblock->nr_files);
+    uint32_t dx_block = le32toh(eblock->dx_block);
+    uint32_t nr_blocks = le32toh(sb.nr_blocks);
+    uint32_t nr_leaves, nr_records = 0;
+    uint8_t *seen;
+
+    if (dx_block == 0) {
+        if (nr_files > LOLELFFS_DX_MIN_FILES &&
+            (le32toh(sb.comp_features) & LOLELFFS_FEATURE_DIR_INDEX))
+            INFO("Directory with %u files has no index", nr_files);
+        return;
+    }
+    if (!(le32toh(sb.comp_features) & LOLELFFS_FEATURE_DIR_INDEX))
+        WARN("Directory index without the DIR_INDEX feature");
+
+    if (dx_block >= nr_blocks || read_block(dx_block, &root) < 0) {
+        ERROR("Failed to read directory index root %u", dx_block);
+        return;
+    }
+    if (le32toh(root.magic) != LOLELFFS_DX_MAGIC) {
+        ERROR("Directory index root %u has bad magic 0x%08x",
+              dx_block, le32toh(root.magic));
+        return;
+    }
+    nr_leaves = le32toh(root.nr_entries);
+    if (nr_leaves == 0 || nr_leaves > LOLELFFS_DX_ROOT_ENTRIES) {
+        ERROR("Directory index root has invalid leaf count %u", nr_leaves);
+        return;
+    }
+    if (le32toh(root.entries[0].hash) != 0)
+        ERROR("Directory index does not cover hash 0");
+    if (le32toh(root.nr_records) != nr_files)
+        ERROR("Directory index holds %u records, directory has %u files",
+              le32toh(root.nr_records), nr_files);
+
+    seen = calloc(nr_files ? nr_files : 1, 1);
+    if (!seen) {
+        ERROR("Out of memory");
+        return;
+    }
+
+    for (uint32_t l = 0; l < nr_leaves; l++) {
+        uint32_t lo = le32toh(root.entries[l].hash);
+        uint32_t bno = le32toh(root.entries[l].value);
+        uint64_t hi = l + 1 < nr_leaves ? le32toh(root.entries[l + 1].hash)
+                                        : (uint64_t)UINT32_MAX + 1;
+
+        if (lo >= hi)
+            ERROR("Directory index leaf %u out of hash order", l);
+        if (bno == 0 || bno >= nr_blocks || read_block(bno, &leaf) < 0) {
+            ERROR("Failed to read directory index leaf %u at block %u", l, bno);
+            continue;
+        }
+        if (le32toh(leaf.nr_entries) > LOLELFFS_DX_LEAF_ENTRIES) {
+            ERROR("Directory index leaf %u has invalid record count %u",
+                  l, le32toh(leaf.nr_entries));
+            continue;
+        }
+
+        for (uint32_t i = 0; i < le32toh(leaf.nr_entries); i++) {
+            uint32_t hash = le32toh(leaf.entries[i].hash);
+            uint32_t slot = le32toh(leaf.entries[i].value);
+            struct lolelffs_file entry;
+
+            nr_records++;
+            if (hash < lo || hash >= hi)
+                ERROR("Directory index record %u/%u hash 0x%08x outside leaf range",
+                      l, i, hash);
+            if (slot >= nr_files) {
+                ERROR("Directory index record %u/%u points to slot %u past %u files",
+                      l, i, slot, nr_files);
+                continue;
+            }
+            if (seen[slot]++)
+                ERROR("Directory slot %u indexed more than once", slot);
+            if (read_dir_entry(eblock, slot, &entry) < 0) {
+                ERROR("Failed to read directory slot %u", slot);
+                continue;
+            }
+            if (le32toh(entry.inode) == 0)
+                ERROR("Directory index record %u/%u points to empty slot %u",
+                      l, i, slot);
+            else if (lolelffs_dx_hash(entry.filename, LOLELFFS_FILENAME_LEN) != hash)
+                ERROR("Directory index record %u/%u hash 0x%08x does not match '%.*s'",
+                      l, i, hash, LOLELFFS_FILENAME_LEN, entry.filename);
+        }
+    }
+
+    if (nr_records != nr_files)
+        ERROR("Directory index has %u records for %u files", nr_records, nr_files);
+    else
+        INFO("Directory index: %u leaves, %u records verified", nr_leaves, nr_records);
+    free(seen);
+}
+
 /* Check root directory extent block */
 static int check_root_extent_block(void)
 {
@@ -373,6 +541,28 @@ static int check_root_extent_block(void)
                       i, ee_start, ee_start + ee_len);
             }
 
+            /* Validate the metadata block of packed compressed extents */
+            if (ee_flags & LOLELFFS_EXT_HAS_META) {
+                uint32_t ee_meta = le32toh(eblock->extents[i].ee_meta);
+                struct lolelffs_comp_metadata meta;
+
+                if (ee_meta == 0 || ee_meta >= le32toh(sb.nr_blocks)) {
+                    ERROR("Extent %u metadata block %u outside filesystem", i, ee_meta);
+                } else if (read_block(ee_meta, &meta) < 0) {
+                    ERROR("Failed to read extent %u metadata block %u", i, ee_meta);
+                } else if (le32toh(meta.magic) != LOLELFFS_COMP_META_MAGIC) {
+                    ERROR("Extent %u metadata block %u has bad magic 0x%08x",
+                          i, ee_meta, le32toh(meta.magic));
+                } else if (le32toh(meta.nr_blocks) != ee_len ||
+                           le32toh(meta.nr_phys) > ee_len ||
+                           le16toh(meta.cluster_shift) > LOLELFFS_COMP_CLUSTER_SHIFT) {
+                    ERROR("Extent %u metadata block %u inconsistent with extent "
+                          "(blocks=%u, phys=%u, shift=%u)", i, ee_meta,
+                          le32toh(meta.nr_blocks), le32toh(meta.nr_phys),
+                          le16toh(meta.cluster_shift));
+                }
+            }
+
             /* Validate compression algorithm */
             if (ee_comp_algo > LOLELFFS_COMP_ZSTD) {
                 ERROR("Extent %u has invalid compression algorithm: %u", i, ee_comp_algo);
@@ -393,10 +583,982 @@ static int check_root_extent_block(void)
         }
     }
 
+    check_dir_index(eblock);
+
     printf("  Root extent block OK\n");
     return 0;
 }
 
+/*
+ * Check the extent tree node at blk of inode ino, expected at the given
+ * depth and to cover logical blocks [start, end). Extents must be sorted
+ * and not overlap, *next being the first block past the previous one.
+ */
+static void check_ext_tree_node(uint32_t ino, uint32_t blk, uint32_t depth,
+                                uint64_t start, uint64_t end, uint64_t *next,
+                                uint32_t *nr_extents, uint32_t *nr_nodes)
+{
+    struct lolelffs_ext_tree_node node;
+    uint32_t entries, i;
+
+    if (blk == 0 || blk >= le32toh(sb.nr_blocks)) {
+        ERROR("Inode %u extent tree node %u outside filesystem", ino, blk);
+        return;
+    }
+    if (read_block(blk, &node) < 0) {
+        ERROR("Failed to read inode %u extent tree node %u", ino, blk);
+        return;
+    }
+    if (le16toh(node.eh.eh_magic) != LOLELFFS_EXT_TREE_MAGIC ||
+        le16toh(node.eh.eh_depth) != depth) {
+        ERROR("Inode %u extent tree node %u has bad header "
+              "(magic=0x%04x, depth=%u, expected %u)", ino, blk,
+              le16toh(node.eh.eh_magic), le16toh(node.eh.eh_depth), depth);
+        return;
+    }
+    entries = le32toh(node.eh.eh_entries);
+    (*nr_nodes)++;
+
+    if (depth == 0) {
+        if (entries > LOLELFFS_EXT_TREE_LEAF_ENTRIES) {
+            ERROR("Inode %u extent tree leaf %u has %u extents (max %lu)", ino,
+                  blk, entries, (unsigned long)LOLELFFS_EXT_TREE_LEAF_ENTRIES);
+            return;
+        }
+        for (i = 0; i < entries; i++) {
+            uint64_t ee_block = le32toh(node.extents[i].ee_block);
+            uint32_t ee_len = le32toh(node.extents[i].ee_len);
+            uint32_t ee_start = le32toh(node.extents[i].ee_start);
+
+            if (ee_len == 0 || ee_block < *next || ee_block < start ||
+                ee_block + ee_len > end) {
+                ERROR("Inode %u extent tree leaf %u: extent %u [%lu, %lu) "
+                      "out of order or outside its node", ino, blk, i,
+                      (unsigned long)ee_block, (unsigned long)(ee_block + ee_len));
+            }
+            if ((uint64_t)ee_start + ee_len > le32toh(sb.nr_blocks)) {
+                ERROR("Inode %u extent tree leaf %u: extent %u outside filesystem",
+                      ino, blk, i);
+            }
+            *next = ee_block + ee_len;
+        }
+        *nr_extents += entries;
+        return;
+    }
+
+    if (entries == 0 || entries > LOLELFFS_EXT_TREE_IDX_ENTRIES) {
+        ERROR("Inode %u extent tree node %u has %u children (max %lu)", ino,
+              blk, entries, (unsigned long)LOLELFFS_EXT_TREE_IDX_ENTRIES);
+        return;
+    }
+    for (i = 0; i < entries; i++) {
+        uint64_t child_start = le32toh(node.idx[i].ei_block);
+        uint64_t child_end = i + 1 < entries ? le32toh(node.idx[i + 1].ei_block) : end;
+
+        if (child_start < start || child_end > end || child_start > child_end) {
+            ERROR("Inode %u extent tree node %u: child %u out of order", ino, blk, i);
+            continue;
+        }
+        check_ext_tree_node(ino, le32toh(node.idx[i].ei_child), depth - 1,
+                            child_start, child_end, next, nr_extents, nr_nodes);
+    }
+}
+
+/* Check the extent trees of all regular files */
+static int check_extent_trees(void)
+{
+    uint32_t nr_istore_blocks = le32toh(sb.nr_istore_blocks);
+    int has_trees = le32toh(sb.comp_features) & LOLELFFS_FEATURE_EXTENT_TREE;
+    uint32_t nr_files = 0;
+
+    printf("Checking extent trees...\n");
+
+    for (uint32_t b = 0; b < nr_istore_blocks; b++) {
+        char block[LOLELFFS_BLOCK_SIZE];
+        struct lolelffs_inode *inodes = (struct lolelffs_inode *)block;
+
+        if (read_block(1 + b, block) < 0) {
+            ERROR("Failed to read inode store block %u", b);
+            return -1;
+        }
+
+        for (uint32_t i = 0; i < LOLELFFS_INODES_PER_BLOCK; i++) {
+            uint32_t ino = b * LOLELFFS_INODES_PER_BLOCK + i;
+            uint32_t ei_block = le32toh(inodes[i].ei_block);
+            struct lolelffs_ext_tree_node root;
+            uint32_t depth, nr_extents = 0, nr_nodes = 0;
+            uint64_t next = 0;
+
+            if (!S_ISREG(le32toh(inodes[i].i_mode)) ||
+                le32toh(inodes[i].i_nlink) == 0 || ei_block == 0 ||
+                ei_block >= le32toh(sb.nr_blocks))
+                continue;
+            if (read_block(ei_block, &root) < 0) {
+                ERROR("Failed to read inode %u extent index block %u", ino, ei_block);
+                continue;
+            }
+            if (!lolelffs_ext_is_tree(&root))
+                continue;
+
+            if (!has_trees)
+                ERROR("Inode %u has an extent tree, but the filesystem has no "
+                      "extent tree feature", ino);
+
+            depth = le16toh(root.eh.eh_depth);
+            if (depth == 0 || depth > LOLELFFS_EXT_TREE_MAX_DEPTH) {
+                ERROR("Inode %u extent tree root has invalid depth %u", ino, depth);
+                continue;
+            }
+
+            /* Walk from the root, which counts as one of the nodes */
+            check_ext_tree_node(ino, ei_block, depth, 0, LOLELFFS_MAX_FILE_BLOCKS,
+                                &next, &nr_extents, &nr_nodes);
+            if (next < le32toh(inodes[i].i_blocks))
+                WARN("Inode %u extent tree maps %lu blocks, inode has %u", ino,
+                     (unsigned long)next, le32toh(inodes[i].i_blocks));
+            INFO("Inode %u: extent tree of depth %u, %u nodes, %u extents", ino,
+                 depth, nr_nodes, nr_extents);
+            nr_files++;
+        }
+    }
+
+    printf("  Extent trees OK (%u files)\n", nr_files);
+    return 0;
+}
+
+/* Read the inode bitmap, to be freed by the caller, or NULL on error */
+static uint8_t *read_inode_bitmap(void)
+{
+    uint32_t nr_istore_blocks = le32toh(sb.nr_istore_blocks);
+    uint32_t nr_ifree_blocks = le32toh(sb.nr_ifree_blocks);
+    uint8_t *ifree = malloc((size_t)nr_ifree_blocks * LOLELFFS_BLOCK_SIZE);
+
+    if (!ifree) {
+        ERROR("Out of memory");
+        return NULL;
+    }
+    for (uint32_t b = 0; b < nr_ifree_blocks; b++) {
+        if (read_block(1 + nr_istore_blocks + b, ifree + (size_t)b * LOLELFFS_BLOCK_SIZE) < 0) {
+            ERROR("Failed to read inode bitmap block %u", b);
+            free(ifree);
+            return NULL;
+        }
+    }
+    return ifree;
+}
+
+/* Tail block of an inline file, for counting the files of each block */
+struct tail_use {
+    uint32_t block;
+    uint32_t ino;
+};
+
+static int cmp_tail_use(const void *a, const void *b)
+{
+    uint32_t x = ((const struct tail_use *)a)->block;
+    uint32_t y = ((const struct tail_use *)b)->block;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Check the small files packed into tail blocks: each reference must fall in
+ * a tail block, within its used bytes, and each tail block must count the
+ * files that reference it.
+ */
+static int check_tail_blocks(void)
+{
+    uint32_t nr_istore_blocks = le32toh(sb.nr_istore_blocks);
+    uint32_t metadata_end = 1 + nr_istore_blocks + le32toh(sb.nr_ifree_blocks) +
+                            le32toh(sb.nr_bfree_blocks);
+    struct tail_use *uses = NULL;
+    uint32_t nr_uses = 0, max_uses = 0, nr_inline = 0, nr_blocks = 0;
+    uint8_t *ifree;
+
+    printf("Checking inline data...\n");
+
+    /* Inodes freed by the tools keep their contents: go by the bitmap */
+    ifree = read_inode_bitmap();
+    if (!ifree)
+        return -1;
+
+    for (uint32_t b = 0; b < nr_istore_blocks; b++) {
+        char block[LOLELFFS_BLOCK_SIZE];
+        struct lolelffs_inode *inodes = (struct lolelffs_inode *)block;
+
+        if (read_block(1 + b, block) < 0) {
+            ERROR("Failed to read inode store block %u", b);
+            free(ifree);
+            free(uses);
+            return -1;
+        }
+
+        for (uint32_t i = 0; i < LOLELFFS_INODES_PER_BLOCK; i++) {
+            uint32_t ino = b * LOLELFFS_INODES_PER_BLOCK + i;
+            uint32_t size = le32toh(inodes[i].i_size);
+            struct lolelffs_tail_ref ref;
+            struct lolelffs_tail_header th;
+            char tail[LOLELFFS_BLOCK_SIZE];
+
+            if (!S_ISREG(le32toh(inodes[i].i_mode)) ||
+                le32toh(inodes[i].i_nlink) == 0 || inodes[i].ei_block != 0 ||
+                ino >= le32toh(sb.nr_inodes) || (ifree[ino / 8] & (1 << (ino % 8))))
+                continue;
+            nr_inline++;
+            if (!(le32toh(sb.comp_features) & LOLELFFS_FEATURE_INLINE_DATA) && size)
+                ERROR("Inode %u has inline data, but the filesystem has no "
+                      "inline data feature", ino);
+            if (size > LOLELFFS_TAIL_MAX_SIZE) {
+                ERROR("Inode %u has no extent index block but %u bytes", ino, size);
+                continue;
+            }
+            if (size <= LOLELFFS_INLINE_DATA_SIZE)
+                continue;
+
+            memcpy(&ref, inodes[i].i_data, sizeof(ref));
+            uint32_t blk = le32toh(ref.tr_block);
+            uint32_t off = le32toh(ref.tr_offset);
+            if (blk < metadata_end || blk >= le32toh(sb.nr_blocks)) {
+                ERROR("Inode %u tail block %u outside data area [%u, %u)", ino,
+                      blk, metadata_end, le32toh(sb.nr_blocks));
+                continue;
+            }
+            if (read_block(blk, tail) < 0) {
+                ERROR("Failed to read inode %u tail block %u", ino, blk);
+                continue;
+            }
+            memcpy(&th, tail, sizeof(th));
+            if (le32toh(th.th_magic) != LOLELFFS_TAIL_MAGIC) {
+                ERROR("Inode %u tail block %u has bad magic 0x%08x", ino, blk,
+                      le32toh(th.th_magic));
+                continue;
+            }
+            if (off < sizeof(th) || (uint64_t)off + size > le32toh(th.th_used) ||
+                le32toh(th.th_used) > LOLELFFS_BLOCK_SIZE) {
+                ERROR("Inode %u tail [%u, %lu) outside the %u bytes used of "
+                      "block %u", ino, off, (unsigned long)off + size,
+                      le32toh(th.th_used), blk);
+                continue;
+            }
+
+            if (nr_uses == max_uses) {
+                uint32_t new_max = max_uses ? max_uses * 2 : 64;
+                struct tail_use *new_uses = realloc(uses, new_max * sizeof(*uses));
+                if (!new_uses) {
+                    ERROR("Out of memory");
+                    free(ifree);
+                    free(uses);
+                    return -1;
+                }
+                uses = new_uses;
+                max_uses = new_max;
+            }
+            uses[nr_uses].block = blk;
+            uses[nr_uses].ino = ino;
+            nr_uses++;
+        }
+    }
+
+    /* Each tail block must count the files found in it */
+    qsort(uses, nr_uses, sizeof(*uses), cmp_tail_use);
+    for (uint32_t i = 0; i < nr_uses;) {
+        struct lolelffs_tail_header th;
+        char tail[LOLELFFS_BLOCK_SIZE];
+        uint32_t j = i;
+
+        while (j < nr_uses && uses[j].block == uses[i].block)
+            j++;
+        if (read_block(uses[i].block, tail) == 0) {
+            memcpy(&th, tail, sizeof(th));
+            if (le32toh(th.th_nr_tails) != j - i)
+                ERROR("Tail block %u counts %u files, %u found", uses[i].block,
+                      le32toh(th.th_nr_tails), j - i);
+            INFO("Tail block %u: %u files, %u bytes used", uses[i].block, j - i,
+                 le32toh(th.th_used));
+        }
+        nr_blocks++;
+        i = j;
+    }
+    free(ifree);
+    free(uses);
+
+    printf("  Inline data OK (%u files, %u tail blocks)\n", nr_inline, nr_blocks);
+    return 0;
+}
+
+/* Physical run of a file extent, for finding blocks mapped more than once */
+struct ext_run {
+    uint32_t start;
+    uint32_t len;
+    uint32_t ino;
+    int shared;
+};
+
+struct ext_runs {
+    struct ext_run *runs;
+    uint32_t nr;
+    uint32_t max;
+};
+
+static int cmp_ext_run(const void *a, const void *b)
+{
+    uint32_t x = ((const struct ext_run *)a)->start;
+    uint32_t y = ((const struct ext_run *)b)->start;
+    return (x > y) - (x < y);
+}
+
+static int add_ext_run(struct ext_runs *r, uint32_t start, uint32_t len,
+                       uint32_t ino, int shared)
+{
+    if (len == 0 || (uint64_t)start + len > le32toh(sb.nr_blocks))
+        return 0; /* Reported by the extent checks */
+
+    if (r->nr == r->max) {
+        uint32_t new_max = r->max ? r->max * 2 : 256;
+        struct ext_run *new_runs = realloc(r->runs, new_max * sizeof(*r->runs));
+        if (!new_runs) {
+            ERROR("Out of memory");
+            return -1;
+        }
+        r->runs = new_runs;
+        r->max = new_max;
+    }
+    r->runs[r->nr].start = start;
+    r->runs[r->nr].len = len;
+    r->runs[r->nr].ino = ino;
+    r->runs[r->nr].shared = shared;
+    r->nr++;
+    return 0;
+}
+
+/*
+ * Add the blocks of an extent of inode ino: its data blocks, and for packed
+ * extents the nr_phys blocks of their streams and the metadata block
+ */
+static int add_extent_runs(struct ext_runs *r, uint32_t ino,
+                           const struct lolelffs_extent *e)
+{
+    uint16_t flags = le16toh(e->ee_flags);
+    int shared = !!(flags & LOLELFFS_EXT_SHARED);
+    uint32_t len = le32toh(e->ee_len);
+
+    if (flags & LOLELFFS_EXT_HAS_META) {
+        struct lolelffs_comp_metadata meta;
+        uint32_t meta_blk = le32toh(e->ee_meta);
+
+        if (meta_blk == 0 || meta_blk >= le32toh(sb.nr_blocks) ||
+            read_block(meta_blk, &meta) < 0 ||
+            le32toh(meta.magic) != LOLELFFS_COMP_META_MAGIC) {
+            ERROR("Inode %u extent at block %u has bad compression metadata "
+                  "block %u", ino, le32toh(e->ee_block), meta_blk);
+            return 0;
+        }
+        if (add_ext_run(r, meta_blk, 1, ino, shared) < 0)
+            return -1;
+        len = le32toh(meta.nr_phys);
+    }
+    return add_ext_run(r, le32toh(e->ee_start), len, ino, shared);
+}
+
+/* Add the extents below extent tree node blk, malformed nodes being skipped */
+static int add_ext_tree_runs(struct ext_runs *r, uint32_t ino, uint32_t blk,
+                             uint32_t depth)
+{
+    struct lolelffs_ext_tree_node node;
+    uint32_t entries;
+
+    if (blk == 0 || blk >= le32toh(sb.nr_blocks) || read_block(blk, &node) < 0 ||
+        le16toh(node.eh.eh_magic) != LOLELFFS_EXT_TREE_MAGIC ||
+        le16toh(node.eh.eh_depth) != depth)
+        return 0;
+    entries = le32toh(node.eh.eh_entries);
+
+    if (depth == 0) {
+        for (uint32_t i = 0; i < entries && i < LOLELFFS_EXT_TREE_LEAF_ENTRIES; i++) {
+            if (add_extent_runs(r, ino, &node.extents[i]) < 0)
+                return -1;
+        }
+        return 0;
+    }
+    for (uint32_t i = 0; i < entries && i < LOLELFFS_EXT_TREE_IDX_ENTRIES; i++) {
+        if (add_ext_tree_runs(r, ino, le32toh(node.idx[i].ei_child), depth - 1) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/*
+ * Check that the blocks of regular files are mapped once, except by extents
+ * flagged shared by deduplication, which may map the same blocks. Files the
+ * kernel unlinked while they had shared extents stay allocated with no link
+ * until the tools free them, and are counted in.
+ */
+static int check_shared_extents(void)
+{
+    uint32_t nr_istore_blocks = le32toh(sb.nr_istore_blocks);
+    struct ext_runs r = { 0 };
+    uint32_t nr_shared = 0, nr_dup_blocks = 0, nr_orphans = 0;
+    uint64_t end = 0;
+    uint32_t last = 0;
+    uint8_t *ifree;
+
+    printf("Checking shared extents...\n");
+
+    ifree = read_inode_bitmap();
+    if (!ifree)
+        return -1;
+
+    for (uint32_t b = 0; b < nr_istore_blocks; b++) {
+        char block[LOLELFFS_BLOCK_SIZE];
+        struct lolelffs_inode *inodes = (struct lolelffs_inode *)block;
+
+        if (read_block(1 + b, block) < 0) {
+            ERROR("Failed to read inode store block %u", b);
+            free(ifree);
+            free(r.runs);
+            return -1;
+        }
+
+        for (uint32_t i = 0; i < LOLELFFS_INODES_PER_BLOCK; i++) {
+            uint32_t ino = b * LOLELFFS_INODES_PER_BLOCK + i;
+            uint32_t ei_block = le32toh(inodes[i].ei_block);
+            union {
+                struct lolelffs_file_ei_block ei;
+                struct lolelffs_ext_tree_node node;
+            } index;
+            int ret = 0;
+
+            if (!S_ISREG(le32toh(inodes[i].i_mode)) || ei_block == 0 ||
+                ei_block >= le32toh(sb.nr_blocks) || ino >= le32toh(sb.nr_inodes) ||
+                (ifree[ino / 8] & (1 << (ino % 8))) || read_block(ei_block, &index) < 0)
+                continue;
+            if (le32toh(inodes[i].i_nlink) == 0) {
+                INFO("Inode %u: unlinked with shared extents, left for "
+                     "lolelffs dedup to free", ino);
+                nr_orphans++;
+            }
+
+            if (lolelffs_ext_is_tree(&index)) {
+                if (le16toh(index.node.eh.eh_depth) <= LOLELFFS_EXT_TREE_MAX_DEPTH)
+                    ret = add_ext_tree_runs(&r, ino, ei_block,
+                                            le16toh(index.node.eh.eh_depth));
+            } else {
+                for (uint32_t e = 0; e < LOLELFFS_MAX_EXTENTS && ret == 0; e++) {
+                    if (index.ei.extents[e].ee_start == 0)
+                        break;
+                    ret = add_extent_runs(&r, ino, &index.ei.extents[e]);
+                }
+            }
+            if (ret < 0) {
+                free(ifree);
+                free(r.runs);
+                return -1;
+            }
+        }
+    }
+    free(ifree);
+
+    /* Sweep the runs by start block, against the one reaching furthest */
+    qsort(r.runs, r.nr, sizeof(*r.runs), cmp_ext_run);
+    for (uint32_t i = 0; i < r.nr; i++) {
+        const struct ext_run *run = &r.runs[i];
+        uint64_t run_end = (uint64_t)run->start + run->len;
+
+        if (run->shared)
+            nr_shared++;
+        if (run->start < end) {
+            const struct ext_run *prev = &r.runs[last];
+            uint64_t overlap = (run_end < end ? run_end : end) - run->start;
+
+            if (run->shared && prev->shared)
+                nr_dup_blocks += overlap;
+            else
+                ERROR("Inode %u blocks [%u, %lu) are also mapped by inode %u, "
+                      "not both by shared extents", run->ino, run->start,
+                      (unsigned long)run_end, prev->ino);
+        }
+        if (run_end > end) {
+            end = run_end;
+            last = i;
+        }
+    }
+    free(r.runs);
+
+    if (nr_shared && !(le32toh(sb.comp_features) & LOLELFFS_FEATURE_SHARED_EXTENTS))
+        WARN("%u shared extents, but the filesystem has no shared extent feature",
+             nr_shared);
+
+    printf("  Shared extents OK (%u extent runs shared, %u blocks mapped more "
+           "than once, %u orphans)\n", nr_shared, nr_dup_blocks, nr_orphans);
+    return 0;
+}
+
+/* Free counts found in the bitmaps, for repairing the superblock counters */
+static int have_free_inodes = 0, have_free_blocks = 0;
+static uint32_t counted_free_inodes, counted_free_blocks;
+
+/*
+ * Full check: the inode store is scanned by several threads, each inode
+ * claiming the blocks it references in an ownership map and counting the
+ * directory entries naming other inodes. The map is then compared against
+ * the block bitmap, and the entry counts against the link counts.
+ */
+
+/* Kinds of block claims: only shared and tail blocks may be claimed twice */
+enum { CLAIM_EXCL = 0, CLAIM_SHARED = 1, CLAIM_TAIL = 2 };
+#define CLAIM_KIND_SHIFT 30
+#define CLAIM_INO_MASK ((1u << CLAIM_KIND_SHIFT) - 1)
+
+#define FULL_CHUNK_BLOCKS 16  /* Inode store blocks taken by a thread at once */
+#define FULL_MAX_REPORTS 64   /* Block errors listed before only being counted */
+
+static uint32_t *full_owners;    /* Per block: kind << 30 | (ino + 1), or 0 */
+static uint32_t *full_names;     /* Per inode: directory entries naming it */
+static uint8_t *full_ifree;      /* Inode bitmap */
+static uint32_t full_data_start; /* First block past the metadata */
+static uint32_t full_next_chunk; /* Next inode store block to scan */
+static uint32_t full_nr_reports;
+static uint32_t full_nr_inodes;
+static uint32_t full_nr_orphans;
+
+/* Report a block error, the first FULL_MAX_REPORTS of them only */
+#define BLOCK_ERROR(fmt, ...) do { \
+    if (__atomic_fetch_add(&full_nr_reports, 1, __ATOMIC_RELAXED) < FULL_MAX_REPORTS) \
+        ERROR(fmt, ##__VA_ARGS__); \
+    else \
+        __atomic_add_fetch(&errors, 1, __ATOMIC_RELAXED); \
+} while(0)
+
+static int inode_is_free(uint32_t ino)
+{
+    return ino >= le32toh(sb.nr_inodes) || (full_ifree[ino / 8] & (1 << (ino % 8)));
+}
+
+static int read_inode(uint32_t ino, struct lolelffs_inode *inode)
+{
+    char block[LOLELFFS_BLOCK_SIZE];
+
+    if (read_block(1 + ino / LOLELFFS_INODES_PER_BLOCK, block) < 0)
+        return -1;
+    memcpy(inode, block + (ino % LOLELFFS_INODES_PER_BLOCK) * sizeof(*inode),
+           sizeof(*inode));
+    return 0;
+}
+
+/* Claim blocks [start, start + count) for inode ino */
+static void claim_blocks(uint32_t ino, uint32_t start, uint32_t count, int kind,
+                         const char *what)
+{
+    uint32_t claim = ((uint32_t)kind << CLAIM_KIND_SHIFT) | (ino + 1);
+
+    if (start < full_data_start ||
+        (uint64_t)start + count > le32toh(sb.nr_blocks)) {
+        BLOCK_ERROR("Inode %u %s [%u, %lu) outside data area [%u, %u)", ino,
+                    what, start, (unsigned long)start + count, full_data_start,
+                    le32toh(sb.nr_blocks));
+        return;
+    }
+    for (uint32_t b = start; b < start + count; b++) {
+        uint32_t old = 0;
+
+        if (__atomic_compare_exchange_n(&full_owners[b], &old, claim, 0,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            continue;
+        if (kind != CLAIM_EXCL && old >> CLAIM_KIND_SHIFT == (uint32_t)kind)
+            continue;
+        BLOCK_ERROR("Block %u (%s of inode %u) is also used by inode %u", b,
+                    what, ino, (old & CLAIM_INO_MASK) - 1);
+    }
+}
+
+/* Claim the blocks of an extent, and the metadata of packed ones */
+static void claim_extent(uint32_t ino, const struct lolelffs_extent *e,
+                         const char *what)
+{
+    uint16_t flags = le16toh(e->ee_flags);
+    int kind = (flags & LOLELFFS_EXT_SHARED) ? CLAIM_SHARED : CLAIM_EXCL;
+    uint32_t len = le32toh(e->ee_len);
+
+    if (flags & LOLELFFS_EXT_HAS_META) {
+        struct lolelffs_comp_metadata meta;
+        uint32_t meta_blk = le32toh(e->ee_meta);
+
+        if (meta_blk == 0 || meta_blk >= le32toh(sb.nr_blocks) ||
+            read_block(meta_blk, &meta) < 0 ||
+            le32toh(meta.magic) != LOLELFFS_COMP_META_MAGIC) {
+            ERROR("Inode %u extent at block %u has bad compression metadata "
+                  "block %u", ino, le32toh(e->ee_block), meta_blk);
+            return;
+        }
+        claim_blocks(ino, meta_blk, 1, kind, "compression metadata");
+        len = le32toh(meta.nr_phys);
+    }
+    if (len)
+        claim_blocks(ino, le32toh(e->ee_start), len, kind, what);
+}
+
+/* Claim the nodes below extent tree node blk and their extents */
+static void claim_ext_tree(uint32_t ino, uint32_t blk, uint32_t depth)
+{
+    struct lolelffs_ext_tree_node node;
+    uint32_t entries;
+
+    /* Malformed nodes are reported by check_extent_trees() */
+    if (blk == 0 || blk >= le32toh(sb.nr_blocks) || read_block(blk, &node) < 0 ||
+        le16toh(node.eh.eh_magic) != LOLELFFS_EXT_TREE_MAGIC ||
+        le16toh(node.eh.eh_depth) != depth)
+        return;
+    entries = le32toh(node.eh.eh_entries);
+
+    if (depth == 0) {
+        for (uint32_t i = 0; i < entries && i < LOLELFFS_EXT_TREE_LEAF_ENTRIES; i++)
+            claim_extent(ino, &node.extents[i], "data");
+        return;
+    }
+    for (uint32_t i = 0; i < entries && i < LOLELFFS_EXT_TREE_IDX_ENTRIES; i++) {
+        uint32_t child = le32toh(node.idx[i].ei_child);
+
+        claim_blocks(ino, child, 1, CLAIM_EXCL, "extent tree node");
+        claim_ext_tree(ino, child, depth - 1);
+    }
+}
+
+/* Claim the blocks of a regular file */
+static void full_check_file(uint32_t ino, const struct lolelffs_inode *inode)
+{
+    uint32_t ei_block = le32toh(inode->ei_block);
+    union {
+        struct lolelffs_file_ei_block ei;
+        struct lolelffs_ext_tree_node node;
+    } index;
+
+    if (le32toh(inode->i_nlink) == 0)
+        __atomic_add_fetch(&full_nr_orphans, 1, __ATOMIC_RELAXED);
+
+    if (ei_block == 0) {
+        struct lolelffs_tail_ref ref;
+
+        /* Inline data, in the inode or packed in a tail block */
+        if (le32toh(inode->i_size) <= LOLELFFS_INLINE_DATA_SIZE ||
+            le32toh(inode->i_size) > LOLELFFS_TAIL_MAX_SIZE)
+            return;
+        memcpy(&ref, inode->i_data, sizeof(ref));
+        claim_blocks(ino, le32toh(ref.tr_block), 1, CLAIM_TAIL, "tail block");
+        return;
+    }
+
+    claim_blocks(ino, ei_block, 1, CLAIM_EXCL, "extent index block");
+    if (ei_block >= le32toh(sb.nr_blocks) || read_block(ei_block, &index) < 0)
+        return;
+    if (lolelffs_ext_is_tree(&index)) {
+        if (le16toh(index.node.eh.eh_depth) <= LOLELFFS_EXT_TREE_MAX_DEPTH)
+            claim_ext_tree(ino, ei_block, le16toh(index.node.eh.eh_depth));
+        return;
+    }
+    for (uint32_t e = 0; e < LOLELFFS_MAX_EXTENTS; e++) {
+        if (index.ei.extents[e].ee_start == 0)
+            break;
+        claim_extent(ino, &index.ei.extents[e], "data");
+    }
+}
+
+/* Claim the blocks of a directory and count the inodes its entries name */
+static void full_check_dir(uint32_t ino, const struct lolelffs_inode *inode)
+{
+    struct lolelffs_file_ei_block eblock;
+    uint32_t ei_block = le32toh(inode->ei_block);
+    uint32_t nr_files, nr_subdirs = 0, slot = 0;
+
+    claim_blocks(ino, ei_block, 1, CLAIM_EXCL, "extent index block");
+    if (ei_block >= le32toh(sb.nr_blocks) || read_block(ei_block, &eblock) < 0) {
+        ERROR("Failed to read directory inode %u extent index block %u", ino,
+              ei_block);
+        return;
+    }
+    nr_files = le32toh(eblock.nr_files);
+
+    /* Entries are packed: slot s is in logical block s / files per block */
+    for (uint32_t e = 0; e < LOLELFFS_MAX_EXTENTS; e++) {
+        const struct lolelffs_extent *ext = &eblock.extents[e];
+        uint32_t ee_start = le32toh(ext->ee_start);
+        uint32_t ee_len = le32toh(ext->ee_len);
+
+        if (ee_start == 0)
+            break;
+        claim_blocks(ino, ee_start, ee_len, CLAIM_EXCL, "directory block");
+        if ((uint64_t)ee_start + ee_len > le32toh(sb.nr_blocks))
+            continue;
+
+        for (uint32_t k = 0; k < ee_len; k++) {
+            struct lolelffs_file files[LOLELFFS_FILES_PER_BLOCK];
+            char dblock[LOLELFFS_BLOCK_SIZE];
+            uint32_t first = (le32toh(ext->ee_block) + k) * LOLELFFS_FILES_PER_BLOCK;
+
+            if (first >= nr_files)
+                break;
+            if (read_block(ee_start + k, dblock) < 0) {
+                ERROR("Failed to read directory inode %u block %u", ino,
+                      ee_start + k);
+                continue;
+            }
+            memcpy(files, dblock, sizeof(files));
+            for (uint32_t j = 0; j < LOLELFFS_FILES_PER_BLOCK &&
+                 first + j < nr_files; j++) {
+                const struct lolelffs_file *f = &files[j];
+                uint32_t child = le32toh(f->inode);
+                struct lolelffs_inode cinode;
+
+                slot++;
+                if (inode_is_free(child)) {
+                    ERROR("Directory inode %u entry '%.*s' names free or "
+                          "invalid inode %u", ino, LOLELFFS_FILENAME_LEN,
+                          f->filename, child);
+                    continue;
+                }
+                __atomic_add_fetch(&full_names[child], 1, __ATOMIC_RELAXED);
+                if (read_inode(child, &cinode) == 0 &&
+                    S_ISDIR(le32toh(cinode.i_mode)))
+                    nr_subdirs++;
+            }
+        }
+    }
+    if (slot != nr_files)
+        ERROR("Directory inode %u counts %u entries, its blocks hold %u", ino,
+              nr_files, slot);
+
+    if (eblock.dx_block) {
+        struct lolelffs_dx_root root;
+        uint32_t dx_block = le32toh(eblock.dx_block);
+
+        claim_blocks(ino, dx_block, 1, CLAIM_EXCL, "directory index root");
+        if (dx_block < le32toh(sb.nr_blocks) && read_block(dx_block, &root) == 0 &&
+            le32toh(root.magic) == LOLELFFS_DX_MAGIC) {
+            for (uint32_t i = 0; i < le32toh(root.nr_entries) &&
+                 i < LOLELFFS_DX_ROOT_ENTRIES; i++)
+                claim_blocks(ino, le32toh(root.entries[i].value), 1, CLAIM_EXCL,
+                             "directory index leaf");
+        }
+    }
+
+    if (le32toh(inode->i_nlink) != 2 + nr_subdirs)
+        ERROR("Directory inode %u has %u links, expected %u for %u "
+              "subdirectories", ino, le32toh(inode->i_nlink), 2 + nr_subdirs,
+              nr_subdirs);
+}
+
+/* Claim the blocks holding the extended attributes of an inode */
+static void full_check_xattrs(uint32_t ino, const struct lolelffs_inode *inode)
+{
+    struct lolelffs_xattr_ei_block xblock;
+    uint32_t xattr_block = le32toh(inode->xattr_block);
+
+    if (xattr_block == 0)
+        return;
+    claim_blocks(ino, xattr_block, 1, CLAIM_EXCL, "xattr index block");
+    if (xattr_block >= le32toh(sb.nr_blocks) || read_block(xattr_block, &xblock) < 0)
+        return;
+    /* Small sets are stored in the index block, leaving no extent */
+    for (uint32_t e = 0; e < LOLELFFS_MAX_EXTENTS; e++) {
+        if (xblock.extents[e].ee_start == 0)
+            break;
+        claim_extent(ino, &xblock.extents[e], "xattr data");
+    }
+}
+
+static void *full_check_worker(void *arg)
+{
+    uint32_t nr_istore_blocks = le32toh(sb.nr_istore_blocks);
+    char block[LOLELFFS_BLOCK_SIZE];
+    struct lolelffs_inode *inodes = (struct lolelffs_inode *)block;
+
+    (void)arg;
+    for (;;) {
+        uint32_t first = __atomic_fetch_add(&full_next_chunk, FULL_CHUNK_BLOCKS,
+                                            __ATOMIC_RELAXED);
+
+        if (first >= nr_istore_blocks)
+            break;
+        for (uint32_t b = first; b < first + FULL_CHUNK_BLOCKS && b < nr_istore_blocks; b++) {
+            if (read_block(1 + b, block) < 0) {
+                ERROR("Failed to read inode store block %u", b);
+                continue;
+            }
+            for (uint32_t i = 0; i < LOLELFFS_INODES_PER_BLOCK; i++) {
+                uint32_t ino = b * LOLELFFS_INODES_PER_BLOCK + i;
+                uint32_t mode = le32toh(inodes[i].i_mode);
+
+                /* Inodes freed by the tools keep their contents */
+                if (inode_is_free(ino))
+                    continue;
+                __atomic_add_fetch(&full_nr_inodes, 1, __ATOMIC_RELAXED);
+                if (S_ISDIR(mode))
+                    full_check_dir(ino, &inodes[i]);
+                else if (S_ISREG(mode))
+                    full_check_file(ino, &inodes[i]);
+                else if (S_ISLNK(mode) && inodes[i].ei_block)
+                    claim_blocks(ino, le32toh(inodes[i].ei_block), 1, CLAIM_EXCL,
+                                 "extent index block");
+                else if (!S_ISLNK(mode))
+                    ERROR("Inode %u is allocated with mode 0%o", ino, mode);
+                full_check_xattrs(ino, &inodes[i]);
+            }
+        }
+    }
+    return NULL;
+}
+
+/* Check that each allocated inode is named as many times as it has links */
+static void full_check_links(void)
+{
+    uint32_t nr_istore_blocks = le32toh(sb.nr_istore_blocks);
+
+    for (uint32_t b = 0; b < nr_istore_blocks; b++) {
+        char block[LOLELFFS_BLOCK_SIZE];
+        struct lolelffs_inode *inodes = (struct lolelffs_inode *)block;
+
+        if (read_block(1 + b, block) < 0)
+            continue; /* Reported by the scan */
+        for (uint32_t i = 0; i < LOLELFFS_INODES_PER_BLOCK; i++) {
+            uint32_t ino = b * LOLELFFS_INODES_PER_BLOCK + i;
+            uint32_t nlink = le32toh(inodes[i].i_nlink);
+
+            if (inode_is_free(ino))
+                continue;
+            if (S_ISDIR(le32toh(inodes[i].i_mode))) {
+                /* The root is named by no entry, other directories by one */
+                if (full_names[ino] != (ino == 0 ? 0u : 1u))
+                    ERROR("Directory inode %u is named by %u entries", ino,
+                          full_names[ino]);
+            } else if (full_names[ino] != nlink) {
+                ERROR("Inode %u has %u links, but %u entries name it", ino,
+                      nlink, full_names[ino]);
+            } else if (nlink == 0) {
+                INFO("Inode %u: orphan, left for lolelffs dedup to free", ino);
+            }
+        }
+    }
+}
+
+/* Compare block ownership with the block bitmap */
+static void full_check_ownership(const uint8_t *bfree)
+{
+    uint32_t nr_blocks = le32toh(sb.nr_blocks);
+    uint32_t nr_leaked = 0, nr_owned = 0;
+
+    for (uint32_t b = 0; b < nr_blocks; b++) {
+        int is_free = bfree[b / 8] & (1 << (b % 8));
+
+        if (b < full_data_start) {
+            if (is_free)
+                BLOCK_ERROR("Metadata block %u marked as free in bitmap", b);
+        } else if (full_owners[b]) {
+            nr_owned++;
+            if (is_free)
+                BLOCK_ERROR("Block %u used by inode %u marked as free in bitmap",
+                            b, (full_owners[b] & CLAIM_INO_MASK) - 1);
+        } else if (!is_free) {
+            if (nr_leaked < FULL_MAX_REPORTS)
+                INFO("Block %u marked as used, but no inode references it", b);
+            nr_leaked++;
+        }
+    }
+    if (nr_leaked)
+        WARN("%u blocks marked as used, but no inode references them (leaked)",
+             nr_leaked);
+    INFO("Blocks referenced by inodes: %u", nr_owned);
+}
+
+/*
+ * Walk every allocated inode with nr_threads threads, then cross-check
+ * block ownership and link counts
+ */
+static int check_full(int nr_threads)
+{
+    uint32_t nr_blocks = le32toh(sb.nr_blocks);
+    uint32_t nr_inodes = le32toh(sb.nr_inodes);
+    uint32_t bitmap_start = 1 + le32toh(sb.nr_istore_blocks) + le32toh(sb.nr_ifree_blocks);
+    uint32_t nr_bfree_blocks = le32toh(sb.nr_bfree_blocks);
+    pthread_t *threads;
+    uint8_t *bfree;
+    struct timespec t0, t1;
+    int started = 0;
+
+    printf("Checking all inodes (%d threads)...\n", nr_threads);
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    full_data_start = bitmap_start + nr_bfree_blocks;
+    full_ifree = read_inode_bitmap();
+    if (!full_ifree)
+        return -1;
+    bfree = malloc((size_t)nr_bfree_blocks * LOLELFFS_BLOCK_SIZE);
+    full_owners = calloc(nr_blocks, sizeof(*full_owners));
+    full_names = calloc(nr_inodes, sizeof(*full_names));
+    threads = calloc(nr_threads, sizeof(*threads));
+    if (!bfree || !full_owners || !full_names || !threads) {
+        ERROR("Out of memory");
+        goto out;
+    }
+    for (uint32_t b = 0; b < nr_bfree_blocks; b++) {
+        if (read_block(bitmap_start + b, bfree + (size_t)b * LOLELFFS_BLOCK_SIZE) < 0) {
+            ERROR("Failed to read block bitmap block %u", b);
+            goto out;
+        }
+    }
+
+    /* The root must be an allocated directory for the walk to reach anything */
+    if (inode_is_free(0)) {
+        ERROR("Root inode (inode 0) marked as free in bitmap");
+        goto out;
+    }
+
+    for (started = 0; started < nr_threads; started++) {
+        if (pthread_create(&threads[started], NULL, full_check_worker, NULL) != 0)
+            break;
+    }
+    /* Whatever could not be started is scanned here */
+    if (started < nr_threads)
+        full_check_worker(NULL);
+    for (int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+
+    full_check_links();
+    full_check_ownership(bfree);
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    printf("  All inodes OK (%u inodes, %u orphans, %.2fs)\n",
+           full_nr_inodes, full_nr_orphans,
+           (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9);
+
+out:
+    free(threads);
+    free(full_names);
+    free(full_owners);
+    free(bfree);
+    free(full_ifree);
+    return 0;
+}
+
+/* Rewrite the free counters of the superblock from the bitmaps */
+static int repair_counters(void)
+{
+    if (!have_free_inodes || !have_free_blocks) {
+        ERROR("Free counters not repaired: bitmaps could not be counted");
+        return -1;
+    }
+    if (counted_free_inodes == le32toh(sb.nr_free_inodes) &&
+        counted_free_blocks == le32toh(sb.nr_free_blocks))
+        return 0;
+
+    sb.nr_free_inodes = htole32(counted_free_inodes);
+    sb.nr_free_blocks = htole32(counted_free_blocks);
+    if (pwrite(fd, &sb, sizeof(sb), 0) != sizeof(sb) || fsync(fd) < 0) {
+        ERROR("Failed to write superblock: %s", strerror(errno));
+        return -1;
+    }
+    printf("Repaired superblock: %u free inodes, %u free blocks\n",
+           counted_free_inodes, counted_free_blocks);
+    return 0;
+}
+
 /* Check inode bitmap */
 static int check_inode_bitmap(void)
 {
@@ -428,6 +1590,8 @@ static int check_inode_bitmap(void)
         }
     }
 
+    counted_free_inodes = free_count;
+    have_free_inodes = 1;
     if (free_count != nr_free_inodes) {
         ERROR("Inode bitmap free count mismatch: counted %u, superblock says %u",
               free_count, nr_free_inodes);
@@ -480,6 +1644,8 @@ static int check_block_bitmap(void)
         }
     }
 
+    counted_free_blocks = free_count;
+    have_free_blocks = 1;
     if (free_count != nr_free_blocks) {
         ERROR("Block bitmap free count mismatch: counted %u, superblock says %u",
               free_count, nr_free_blocks);
@@ -503,22 +1669,41 @@ static int check_block_bitmap(void)
 
 static void usage(const char *prog)
 {
-    fprintf(stderr, "Usage: %s [-v] <image>\n", prog);
+    fprintf(stderr, "Usage: %s [-v] [-f [-j threads]] [-r] <image>\n", prog);
     fprintf(stderr, "\nOptions:\n");
     fprintf(stderr, "  -v    Verbose output\n");
+    fprintf(stderr, "  -f    Full check: walk all inodes, directories and extents,\n"
+                    "        checking block ownership and link counts\n");
+    fprintf(stderr, "  -j N  Threads for the full check (default: one per CPU)\n");
+    fprintf(stderr, "  -r    Repair the free inode and block counters of the\n"
+                    "        superblock (the image must not be mounted)\n");
     fprintf(stderr, "\nCheck the consistency of a lolelffs filesystem image.\n");
 }
 
 int main(int argc, char *argv[])
 {
-    int opt;
+    int opt, full = 0, repair = 0;
+    long nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
     const char *image = NULL;
 
-    while ((opt = getopt(argc, argv, "vh")) != -1) {
+    while ((opt = getopt(argc, argv, "vfj:rh")) != -1) {
         switch (opt) {
         case 'v':
             verbose = 1;
             break;
+        case 'f':
+            full = 1;
+            break;
+        case 'j':
+            nr_threads = strtol(optarg, NULL, 10);
+            if (nr_threads < 1 || nr_threads > 1024) {
+                fprintf(stderr, "Error: Invalid thread count: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'r':
+            repair = 1;
+            break;
         case 'h':
         default:
             usage(argv[0]);
@@ -535,11 +1720,14 @@ int main(int argc, char *argv[])
 
     printf("Checking lolelffs filesystem: %s\n\n", image);
 
-    fd = open(image, O_RDONLY);
+    fd = open(image, repair ? O_RDWR : O_RDONLY);
     if (fd < 0) {
         fprintf(stderr, "Error: Cannot open %s: %s\n", image, strerror(errno));
         return 1;
     }
+    map_image();
+    if (nr_threads < 1)
+        nr_threads = 1;
 
     /* Run all checks */
     if (check_superblock() < 0)
@@ -547,10 +1735,19 @@ int main(int argc, char *argv[])
 
     check_root_inode();
     check_root_extent_block();
+    check_extent_trees();
+    check_tail_blocks();
+    check_shared_extents();
     check_inode_bitmap();
     check_block_bitmap();
+    if (full)
+        check_full(nr_threads);
+    if (repair)
+        repair_counters();
 
 done:
+    if (image_map)
+        munmap((void *)image_map, image_size);
     close(fd);
 
     printf("\n========================================\n");
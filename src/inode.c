@@ -79,6 +79,8 @@ struct inode *lolelffs_iget(struct super_block *sb, unsigned long ino)
         inode->i_fop = &lolelffs_dir_ops;
     } else if (S_ISREG(inode->i_mode)) {
         ci->ei_block = le32_to_cpu(cinode->ei_block);
+        if (!ci->ei_block)
+            memcpy(ci->i_data, cinode->i_data, sizeof(ci->i_data));
         inode->i_fop = &lolelffs_file_ops;
         inode->i_mapping->a_ops = &lolelffs_aops;
     } else if (S_ISLNK(inode->i_mode)) {
@@ -109,56 +111,21 @@ static struct dentry *lolelffs_lookup(struct inode *dir,
                                       struct dentry *dentry,
                                       unsigned int flags)
 {
-    struct super_block *sb = dir->i_sb;
-    struct lolelffs_inode_info *ci_dir = LOLELFFS_INODE(dir);
     struct inode *inode = NULL;
-    struct buffer_head *bh = NULL, *bh2 = NULL;
-    struct lolelffs_file_ei_block *eblock = NULL;
-    struct lolelffs_dir_block *dblock = NULL;
-    struct lolelffs_file *f = NULL;
-    int ei, bi, fi;
+    uint32_t ino, slot;
+    int ret;
 
     /* Check filename length */
     if (dentry->d_name.len > LOLELFFS_FILENAME_LEN)
         return ERR_PTR(-ENAMETOOLONG);
 
-    /* Read the directory block on disk */
-    bh = LOLELFFS_SB_BREAD(sb, ci_dir->ei_block);
-    if (!bh)
-        return ERR_PTR(-EIO);
-    eblock = (struct lolelffs_file_ei_block *) bh->b_data;
-
     /* Search for the file in directory */
-    for (ei = 0; ei < LOLELFFS_MAX_EXTENTS; ei++) {
-        if (!eblock->extents[ei].ee_start)
-            break;
-
-        /* Iterate blocks in extent */
-        for (bi = 0; bi < eblock->extents[ei].ee_len; bi++) {
-            bh2 = LOLELFFS_SB_BREAD(sb, eblock->extents[ei].ee_start + bi);
-            if (!bh2)
-                return ERR_PTR(-EIO);
-            dblock = (struct lolelffs_dir_block *) bh2->b_data;
-            /* Search file in ei_block */
-            for (fi = 0; fi < LOLELFFS_FILES_PER_BLOCK; fi++) {
-                f = &dblock->files[fi];
-                if (!f->inode) {
-                    brelse(bh2);
-                    goto search_end;
-                }
-                if (!strncmp(f->filename, dentry->d_name.name, LOLELFFS_FILENAME_LEN)) {
-                    inode = lolelffs_iget(sb, f->inode);
-                    brelse(bh2);
-                    goto search_end;
-                }
-            }
-            brelse(bh2);
-            bh2 = NULL;
-        }
-    }
-
-search_end:
-    brelse(bh);
+    ret = lolelffs_dir_find(dir, dentry->d_name.name, dentry->d_name.len,
+                            &ino, &slot);
+    if (!ret)
+        inode = lolelffs_iget(dir->i_sb, ino);
+    else if (ret != -ENOENT)
+        return ERR_PTR(ret);
 
     /* Check if inode lookup failed */
     if (IS_ERR(inode))
@@ -198,7 +165,7 @@ static struct inode *lolelffs_new_inode(struct inode *dir, mode_t mode)
     /* Check if inodes are available */
     sb = dir->i_sb;
     sbi = LOLELFFS_SB(sb);
-    if (sbi->nr_free_inodes == 0 || sbi->nr_free_blocks == 0)
+    if (sbi->nr_free_inodes == 0 || lolelffs_nr_free_blocks(sbi) == 0)
         return ERR_PTR(-ENOSPC);
 
     /* Get a new free inode */
@@ -309,95 +276,42 @@ static int lolelffs_create(struct inode *dir,
                            bool excl)
 #endif
 {
-    struct super_block *sb;
+    struct super_block *sb = dir->i_sb;
     struct inode *inode;
-    struct lolelffs_inode_info *ci_dir;
-    struct lolelffs_file_ei_block *eblock;
-    struct lolelffs_dir_block *dblock;
     char *fblock;
-    struct buffer_head *bh, *bh2;
-    int ret = 0, alloc = false, bno = 0;
-    int ei = 0, bi = 0, fi = 0;
+    struct buffer_head *bh;
+    int ret = 0;
 
     /* Check filename length */
     if (strlen(dentry->d_name.name) > LOLELFFS_FILENAME_LEN)
         return -ENAMETOOLONG;
 
-    /* Read parent directory index */
-    ci_dir = LOLELFFS_INODE(dir);
-    sb = dir->i_sb;
-    bh = LOLELFFS_SB_BREAD(sb, ci_dir->ei_block);
-    if (!bh)
-        return -EIO;
-
-    eblock = (struct lolelffs_file_ei_block *) bh->b_data;
-    /* Check if parent directory is full */
-    if (eblock->nr_files == LOLELFFS_MAX_SUBFILES) {
-        ret = -EMLINK;
-        goto end;
-    }
-
     /* Get a new free inode */
     inode = lolelffs_new_inode(dir, mode);
-    if (IS_ERR(inode)) {
-        ret = PTR_ERR(inode);
-        goto end;
-    }
+    if (IS_ERR(inode))
+        return PTR_ERR(inode);
 
     /*
      * Scrub ei_block for new file/directory to avoid previous data
      * messing with new file/directory.
      */
-    bh2 = LOLELFFS_SB_BREAD(sb, LOLELFFS_INODE(inode)->ei_block);
-    if (!bh2) {
+    bh = LOLELFFS_SB_BREAD(sb, LOLELFFS_INODE(inode)->ei_block);
+    if (!bh) {
         ret = -EIO;
         goto iput;
     }
-    fblock = (char *) bh2->b_data;
+    fblock = (char *) bh->b_data;
     memset(fblock, 0, LOLELFFS_BLOCK_SIZE);
-    mark_buffer_dirty(bh2);
-    sync_dirty_buffer(bh2);
-    brelse(bh2);
-
-    /* Find first free slot in parent index and register new inode */
-    ei = eblock->nr_files / LOLELFFS_FILES_PER_EXT;
-    bi = eblock->nr_files % LOLELFFS_FILES_PER_EXT
-         / LOLELFFS_FILES_PER_BLOCK;
-    fi = eblock->nr_files % LOLELFFS_FILES_PER_BLOCK;
-
-    if (!eblock->extents[ei].ee_start) {
-        bno = get_free_blocks(LOLELFFS_SB(sb), 8);
-        if (!bno) {
-            ret = -ENOSPC;
-            goto iput;
-        }
-        eblock->extents[ei].ee_start = bno;
-        eblock->extents[ei].ee_len = 8;
-        eblock->extents[ei].ee_block =
-            ei ? eblock->extents[ei - 1].ee_block +
-                     eblock->extents[ei - 1].ee_len
-               : 0;
-        alloc = true;
-    }
-    bh2 = LOLELFFS_SB_BREAD(sb, eblock->extents[ei].ee_start + bi);
-    if (!bh2) {
-        ret = -EIO;
-        goto put_block;
-    }
-    dblock = (struct lolelffs_dir_block *) bh2->b_data;
-
-    dblock->files[fi].inode = inode->i_ino;
-    strncpy(dblock->files[fi].filename, dentry->d_name.name,
-            LOLELFFS_FILENAME_LEN);
-
-    eblock->nr_files++;
-    mark_buffer_dirty(bh2);
-    sync_dirty_buffer(bh2);
     mark_buffer_dirty(bh);
     sync_dirty_buffer(bh);
-    brelse(bh2);
     brelse(bh);
 
+    /* Register the new inode in the parent directory */
+    ret = lolelffs_dir_add(dir, dentry->d_name.name, dentry->d_name.len,
+                           inode->i_ino);
+    if (ret)
+        goto iput;
+
     /* Update stats and mark dir and new inode dirty */
     mark_inode_dirty(inode);
     lolelffs_write_inode(inode, NULL);
@@ -420,96 +334,26 @@ static int lolelffs_create(struct inode *dir,
 
     return 0;
 
-put_block:
-    if (alloc && eblock->extents[ei].ee_start) {
-        put_blocks(LOLELFFS_SB(sb), eblock->extents[ei].ee_start,
-                   eblock->extents[ei].ee_len);
-        memset(&eblock->extents[ei], 0, sizeof(struct lolelffs_extent));
-    }
 iput:
     put_blocks(LOLELFFS_SB(sb), LOLELFFS_INODE(inode)->ei_block, 1);
     put_inode(LOLELFFS_SB(sb), inode->i_ino);
     iput(inode);
-end:
-    brelse(bh);
     return ret;
 }
 
 static int lolelffs_remove_from_dir(struct inode *dir, struct dentry *dentry)
 {
-    struct super_block *sb = dir->i_sb;
-    struct inode *inode = d_inode(dentry);
-    struct buffer_head *bh = NULL, *bh2 = NULL, *bh_prev = NULL;
-    struct lolelffs_file_ei_block *eblock = NULL;
-    struct lolelffs_dir_block *dblock = NULL, *dblock_prev = NULL;
-    int ei = 0, bi = 0, fi = 0;
-    int ret = 0, found = false;
-
-    /* Read parent directory index */
-    bh = LOLELFFS_SB_BREAD(sb, LOLELFFS_INODE(dir)->ei_block);
-    if (!bh)
-        return -EIO;
-    eblock = (struct lolelffs_file_ei_block *) bh->b_data;
-    for (ei = 0; ei < LOLELFFS_MAX_EXTENTS; ei++) {
-        if (!eblock->extents[ei].ee_start)
-            break;
-
-        for (bi = 0; bi < eblock->extents[ei].ee_len; bi++) {
-            bh2 = LOLELFFS_SB_BREAD(sb, eblock->extents[ei].ee_start + bi);
-            if (!bh2) {
-                ret = -EIO;
-                goto release_bh;
-            }
-            dblock = (struct lolelffs_dir_block *) bh2->b_data;
-            if (!dblock->files[0].inode)
-                break;
-
-            if (found) {
-                memmove(dblock_prev->files + LOLELFFS_FILES_PER_BLOCK - 1,
-                        dblock->files, sizeof(struct lolelffs_file));
-                brelse(bh_prev);
-
-                memmove(dblock->files, dblock->files + 1,
-                        (LOLELFFS_FILES_PER_BLOCK - 1) * sizeof(struct lolelffs_file));
-                memset(dblock->files + LOLELFFS_FILES_PER_BLOCK - 1,
-                       0, sizeof(struct lolelffs_file));
-                mark_buffer_dirty(bh2);
-
-                bh_prev = bh2;
-                dblock_prev = dblock;
-                continue;
-            }
-            /* Remove file from parent directory */
-            for (fi = 0; fi < LOLELFFS_FILES_PER_BLOCK; fi++) {
-                if (dblock->files[fi].inode == inode->i_ino) {
-                    found = true;
-                    if (fi != LOLELFFS_FILES_PER_BLOCK - 1) {
-                        memmove(dblock->files + fi, dblock->files + fi + 1,
-                                (LOLELFFS_FILES_PER_BLOCK - fi - 1) * sizeof(struct lolelffs_file));
-                    }
-                    memset(dblock->files + LOLELFFS_FILES_PER_BLOCK - 1,
-                           0, sizeof(struct lolelffs_file));
-                    mark_buffer_dirty(bh2);
-                    bh_prev = bh2;
-                    dblock_prev = dblock;
-                    break;
-                }
-            }
-            if (!found)
-                brelse(bh2);
-        }
-    }
-    if (found) {
-        if (bh_prev) {
-            brelse(bh_prev);
-        }
-        eblock->nr_files--;
-        mark_buffer_dirty(bh);
-    }
-release_bh:
-    brelse(bh);
-    return ret;
+    uint32_t ino, slot;
+    int ret;
+
+    ret = lolelffs_dir_find(dir, dentry->d_name.name, dentry->d_name.len,
+                            &ino, &slot);
+    if (ret)
+        return ret;
+
+    return lolelffs_dir_remove(dir, slot);
 }
+
 /*
  * Remove a link for a file including the reference in the parent directory.
  * If link count is 0, destroy file in this way:
@@ -523,9 +367,8 @@ static int lolelffs_unlink(struct inode *dir, struct dentry *dentry)
     struct super_block *sb = dir->i_sb;
     struct lolelffs_sb_info *sbi = LOLELFFS_SB(sb);
     struct inode *inode = d_inode(dentry);
-    struct buffer_head *bh = NULL, *bh2 = NULL;
+    struct buffer_head *bh = NULL;
     struct lolelffs_file_ei_block *file_block = NULL;
-    int ei = 0, bi = 0;
     int ret = 0;
 
     uint32_t ino = inode->i_ino;
@@ -556,6 +399,17 @@ static int lolelffs_unlink(struct inode *dir, struct dentry *dentry)
         return ret;
     }
 
+    /* Inline files have no block of their own, only a share of a tail block */
+    if (lolelffs_inode_is_inline(inode)) {
+        struct lolelffs_inode_info *ci = LOLELFFS_INODE(inode);
+        struct lolelffs_tail_ref *ref = (struct lolelffs_tail_ref *) ci->i_data;
+
+        if (inode->i_size > LOLELFFS_INLINE_DATA_SIZE)
+            lolelffs_tail_put(sb, le32_to_cpu(ref->tr_block));
+        memset(ci->i_data, 0, sizeof(ci->i_data));
+        goto clean_inode;
+    }
+
     /*
      * Cleanup pointed blocks if unlinking a file. If we fail to read the
      * index block, cleanup inode anyway and lose this file's blocks
@@ -567,27 +421,25 @@ static int lolelffs_unlink(struct inode *dir, struct dentry *dentry)
     if (!bh)
         goto clean_inode;
     file_block = (struct lolelffs_file_ei_block *) bh->b_data;
-    if (S_ISDIR(inode->i_mode))
+    if (S_ISDIR(inode->i_mode)) {
+        lolelffs_dir_free_index(sb, file_block);
         goto scrub;
-    for (ei = 0; ei < LOLELFFS_MAX_EXTENTS; ei++) {
-        char *block;
-
-        if (!file_block->extents[ei].ee_start)
-            break;
-
-        put_blocks(sbi, file_block->extents[ei].ee_start,
-                   file_block->extents[ei].ee_len);
-
-        /* Scrub the extent */
-        for (bi = 0; bi < file_block->extents[ei].ee_len; bi++) {
-            bh2 = LOLELFFS_SB_BREAD(sb, file_block->extents[ei].ee_start + bi);
-            if (!bh2)
-                continue;
-            block = (char *) bh2->b_data;
-            memset(block, 0, LOLELFFS_BLOCK_SIZE);
-            mark_buffer_dirty(bh2);
-            brelse(bh2);
-        }
+    }
+    if (lolelffs_ext_truncate(inode, bh, 0, true) == -EOPNOTSUPP) {
+        /*
+         * Other files may map the blocks of its shared extents: keep the
+         * file allocated with no link, as an orphan for `lolelffs dedup`
+         * to free with the other references at hand
+         */
+        brelse(bh);
+        lolelffs_da_release(inode, 0);
+        lolelffs_xattr_free_blocks(sbi, inode);
+        LOLELFFS_INODE(inode)->xattr_block = 0;
+        drop_nlink(inode);
+        mark_inode_dirty(inode);
+        /* Evicting an unlinked inode does not write it back */
+        sync_inode_metadata(inode, 1);
+        return ret;
     }
 
 scrub:
@@ -595,8 +447,12 @@ scrub:
     memset(file_block, 0, LOLELFFS_BLOCK_SIZE);
     mark_buffer_dirty(bh);
     brelse(bh);
+    lolelffs_ext_map_invalidate(inode);
 
 clean_inode:
+    /* Nothing left to write back */
+    lolelffs_da_release(inode, 0);
+
     /* Free xattr blocks if any */
     lolelffs_xattr_free_blocks(sbi, inode);
 
@@ -619,7 +475,8 @@ clean_inode:
     }
 
     /* Free inode and index block from bitmap */
-    put_blocks(sbi, bno, 1);
+    if (bno)
+        put_blocks(sbi, bno, 1);
     put_inode(sbi, ino);
 
     return ret;
@@ -647,14 +504,9 @@ static int lolelffs_rename(struct inode *old_dir,
                            unsigned int flags)
 #endif
 {
-    struct super_block *sb = old_dir->i_sb;
-    struct lolelffs_inode_info *ci_new = LOLELFFS_INODE(new_dir);
     struct inode *src = d_inode(old_dentry);
-    struct buffer_head *bh_new = NULL, *bh2 = NULL;
-    struct lolelffs_file_ei_block *eblock_new = NULL;
-    struct lolelffs_dir_block *dblock = NULL;
-    int new_pos = -1, ret = 0;
-    int ei = 0 , bi = 0, fi = 0, bno = 0;
+    uint32_t ino, slot;
+    int ret = 0;
 
     /* fail with these unsupported flags */
     if (flags & (RENAME_EXCHANGE | RENAME_WHITEOUT))
@@ -664,85 +516,40 @@ static int lolelffs_rename(struct inode *old_dir,
     if (strlen(new_dentry->d_name.name) > LOLELFFS_FILENAME_LEN)
         return -ENAMETOOLONG;
 
-    /* Fail if new_dentry exists or if new_dir is full */
-    bh_new = LOLELFFS_SB_BREAD(sb, ci_new->ei_block);
-    if (!bh_new)
-        return -EIO;
+    /* Fail if new_dentry exists */
+    ret = lolelffs_dir_find(new_dir, new_dentry->d_name.name,
+                            new_dentry->d_name.len, &ino, &slot);
+    if (!ret)
+        return -EEXIST;
+    if (ret != -ENOENT)
+        return ret;
 
-    eblock_new = (struct lolelffs_file_ei_block *) bh_new->b_data;
-    for (ei = 0; new_pos < 0 && ei < LOLELFFS_MAX_EXTENTS; ei++) {
-        if (!eblock_new->extents[ei].ee_start)
-            break;
-
-        for (bi = 0; new_pos < 0 && bi < eblock_new->extents[ei].ee_len; bi++) {
-            bh2 = LOLELFFS_SB_BREAD(sb, eblock_new->extents[ei].ee_start + bi);
-            if (!bh2) {
-                ret = -EIO;
-                goto release_new;
-            }
-
-            dblock = (struct lolelffs_dir_block *) bh2->b_data;
-            for (fi = 0; fi < LOLELFFS_FILES_PER_BLOCK; fi++) {
-                if (new_dir == old_dir) {
-                    if (!strncmp(dblock->files[fi].filename, old_dentry->d_name.name,
-                                LOLELFFS_FILENAME_LEN)) {
-                        strncpy(dblock->files[fi].filename, new_dentry->d_name.name,
-                                LOLELFFS_FILENAME_LEN);
-                        mark_buffer_dirty(bh2);
-                        brelse(bh2);
-                        goto release_new;
-                    }
-                }
-                if (!strncmp(dblock->files[fi].filename, new_dentry->d_name.name,
-                            LOLELFFS_FILENAME_LEN)) {
-                    brelse(bh2);
-                    ret = -EEXIST;
-                    goto release_new;
-                }
-                if (new_pos < 0 && !dblock->files[fi].inode) {
-                    new_pos = fi;
-                    break;
-                }
-            }
-            if (new_pos < 0)
-                brelse(bh2);
-        }
-    }
+    /* Find the entry to move in old parent directory */
+    ret = lolelffs_dir_find(old_dir, old_dentry->d_name.name,
+                            old_dentry->d_name.len, &ino, &slot);
+    if (ret)
+        return ret;
 
-    /* If new directory is full, fail */
-    if (new_pos < 0 && eblock_new->nr_files == LOLELFFS_FILES_PER_EXT) {
-        ret = -EMLINK;
-        goto release_new;
+    /* Rename in place within the same directory */
+    if (new_dir == old_dir) {
+        ret = lolelffs_dir_rename(old_dir, slot, new_dentry->d_name.name,
+                                  new_dentry->d_name.len);
+        if (ret)
+            return ret;
+        {
+            struct timespec64 now = current_time(old_dir);
+            inode_set_ctime_to_ts(old_dir, now);
+            inode_set_mtime_to_ts(old_dir, now);
+        }
+        mark_inode_dirty(old_dir);
+        return 0;
     }
 
     /* insert in new parent directory */
-    /* Get new freeblocks for extent if needed*/
-    if (new_pos < 0) {
-        bno = get_free_blocks(LOLELFFS_SB(sb), 8);
-        if (!bno) {
-            ret = -ENOSPC;
-            goto release_new;
-        }
-        eblock_new->extents[ei].ee_start = bno;
-        eblock_new->extents[ei].ee_len = 8;
-        eblock_new->extents[ei].ee_block =
-            ei ? eblock_new->extents[ei - 1].ee_block +
-                     eblock_new->extents[ei - 1].ee_len
-               : 0;
-        bh2 = LOLELFFS_SB_BREAD(sb, eblock_new->extents[ei].ee_start + 0);
-        if (!bh2) {
-            ret = -EIO;
-            goto put_block;
-        }
-        dblock = (struct lolelffs_dir_block *) bh2->b_data;
-        mark_buffer_dirty(bh_new);
-        new_pos = 0;
-    }
-    dblock->files[new_pos].inode = src->i_ino;
-    strncpy(dblock->files[new_pos].filename, new_dentry->d_name.name,
-            LOLELFFS_FILENAME_LEN);
-    mark_buffer_dirty(bh2);
-    brelse(bh2);
+    ret = lolelffs_dir_add(new_dir, new_dentry->d_name.name,
+                           new_dentry->d_name.len, src->i_ino);
+    if (ret)
+        return ret;
 
     /* Update new parent inode metadata */
     {
@@ -756,9 +563,9 @@ static int lolelffs_rename(struct inode *old_dir,
     mark_inode_dirty(new_dir);
 
     /* remove target from old parent directory */
-    ret = lolelffs_remove_from_dir(old_dir, old_dentry);
+    ret = lolelffs_dir_remove(old_dir, slot);
     if (ret != 0)
-        goto release_new;
+        return ret;
 
     /* Update old parent inode metadata */
     {
@@ -772,16 +579,6 @@ static int lolelffs_rename(struct inode *old_dir,
     mark_inode_dirty(old_dir);
 
     return ret;
-
-put_block:
-    if (eblock_new->extents[ei].ee_start) {
-        put_blocks(LOLELFFS_SB(sb), eblock_new->extents[ei].ee_start,
-                   eblock_new->extents[ei].ee_len);
-        memset(&eblock_new->extents[ei], 0, sizeof(struct lolelffs_extent));
-    }
-release_new:
-    brelse(bh_new);
-    return ret;
 }
 
 #if MNT_IDMAP_REQUIRED()
@@ -839,74 +636,19 @@ static int lolelffs_link(struct dentry *old_dentry,
                          struct dentry *dentry)
 {
     struct inode *inode = d_inode(old_dentry);
-    struct super_block *sb = inode->i_sb;
-    struct lolelffs_inode_info *ci_dir = LOLELFFS_INODE(dir);
-    struct lolelffs_file_ei_block *eblock = NULL;
-    struct lolelffs_dir_block *dblock;
-    struct buffer_head *bh = NULL, *bh2 = NULL;
-    int ret = 0, alloc = false, bno = 0;
-    int ei = 0, bi = 0, fi = 0;
-
-    bh = LOLELFFS_SB_BREAD(sb, ci_dir->ei_block);
-    if (!bh)
-        return -EIO;
-    eblock = (struct lolelffs_file_ei_block *) bh->b_data;
-
-    if (eblock->nr_files == LOLELFFS_MAX_SUBFILES) {
-        ret = -EMLINK;
-        pr_err("directory is full\n");
-        goto end;
-    }
-
-    ei = eblock->nr_files / LOLELFFS_FILES_PER_EXT;
-    bi = eblock->nr_files % LOLELFFS_FILES_PER_EXT
-         / LOLELFFS_FILES_PER_BLOCK;
-    fi = eblock->nr_files % LOLELFFS_FILES_PER_BLOCK;
+    int ret;
 
-    if (eblock->extents[ei].ee_start == 0) {
-        bno = get_free_blocks(LOLELFFS_SB(sb), 8);
-        if (!bno) {
-            ret = -ENOSPC;
-            goto end;
-        }
-        eblock->extents[ei].ee_start = bno;
-        eblock->extents[ei].ee_len = 8;
-        eblock->extents[ei].ee_block =
-            ei ? eblock->extents[ei - 1].ee_block +
-                     eblock->extents[ei - 1].ee_len
-               : 0;
-        alloc = true;
-    }
-    bh2 = LOLELFFS_SB_BREAD(sb, eblock->extents[ei].ee_start + bi);
-    if (!bh2) {
-        ret = -EIO;
-        goto put_block;
+    ret = lolelffs_dir_add(dir, dentry->d_name.name, dentry->d_name.len,
+                           inode->i_ino);
+    if (ret) {
+        if (ret == -EMLINK)
+            pr_err("directory is full\n");
+        return ret;
     }
-    dblock = (struct lolelffs_dir_block *) bh2->b_data;
-
-    dblock->files[fi].inode = inode->i_ino;
-    strncpy(dblock->files[fi].filename, dentry->d_name.name,
-            LOLELFFS_FILENAME_LEN);
-
-    eblock->nr_files++;
-    mark_buffer_dirty(bh2);
-    mark_buffer_dirty(bh);
-    brelse(bh2);
-    brelse(bh);
 
     inode_inc_link_count(inode);
     d_instantiate(dentry, inode);
     return ret;
-
-put_block:
-    if (alloc && eblock->extents[ei].ee_start) {
-        put_blocks(LOLELFFS_SB(sb), eblock->extents[ei].ee_start,
-                   eblock->extents[ei].ee_len);
-        memset(&eblock->extents[ei], 0, sizeof(struct lolelffs_extent));
-    }
-end:
-    brelse(bh);
-    return ret;
 }
 
 #if MNT_IDMAP_REQUIRED()
@@ -925,86 +667,192 @@ static int lolelffs_symlink(struct inode *dir,
                             const char *symname)
 #endif
 {
-    struct super_block *sb = dir->i_sb;
     unsigned int l = strlen(symname) + 1;
     struct inode *inode = lolelffs_new_inode(dir, S_IFLNK | S_IRWXUGO);
     struct lolelffs_inode_info *ci = LOLELFFS_INODE(inode);
-    struct lolelffs_inode_info *ci_dir = LOLELFFS_INODE(dir);
-    struct lolelffs_file_ei_block *eblock = NULL;
-    struct lolelffs_dir_block *dblock = NULL;
-    struct buffer_head *bh = NULL, *bh2 = NULL;
-    int ret= 0, alloc = false, bno = 0;
-    int ei = 0, bi = 0, fi = 0;
+    int ret = 0;
 
     /* Check if symlink content is not too long (max 27 chars + NUL) */
     if (l > sizeof(ci->i_data))
         return -ENAMETOOLONG;
 
     /* fill directory data block */
-    bh = LOLELFFS_SB_BREAD(sb, ci_dir->ei_block);
-    if (!bh)
-        return -EIO;
-    eblock = (struct lolelffs_file_ei_block *) bh->b_data;
-
-    if (eblock->nr_files == LOLELFFS_MAX_SUBFILES) {
-        ret = -EMLINK;
-        pr_err("directory is full\n");
-        goto end;
+    ret = lolelffs_dir_add(dir, dentry->d_name.name, dentry->d_name.len,
+                           inode->i_ino);
+    if (ret) {
+        if (ret == -EMLINK)
+            pr_err("directory is full\n");
+        return ret;
     }
 
-    ei = eblock->nr_files / LOLELFFS_FILES_PER_EXT;
-    bi = eblock->nr_files % LOLELFFS_FILES_PER_EXT
-         / LOLELFFS_FILES_PER_BLOCK;
-    fi = eblock->nr_files % LOLELFFS_FILES_PER_BLOCK;
+    inode->i_link = (char *) ci->i_data;
+    memcpy(inode->i_link, symname, l);
+    inode->i_size = l - 1;
+    mark_inode_dirty(inode);
+    d_instantiate(dentry, inode);
+    return 0;
+}
 
-    if (eblock->extents[ei].ee_start == 0) {
-        bno = get_free_blocks(LOLELFFS_SB(sb), 8);
-        if (!bno) {
-            ret = -ENOSPC;
-            goto end;
-        }
-        eblock->extents[ei].ee_start = bno;
-        eblock->extents[ei].ee_len = 8;
-        eblock->extents[ei].ee_block =
-            ei ? eblock->extents[ei - 1].ee_block +
-                     eblock->extents[ei - 1].ee_len
-               : 0;
-        alloc = true;
+/*
+ * Create a regular file with no link and an empty extent index, to keep the
+ * shared extents that a file stops mapping: other files may still map their
+ * blocks, and like the files lolelffs_unlink() cannot free, `lolelffs dedup`
+ * frees it with the other references at hand. It is on disk once created.
+ */
+struct inode *lolelffs_new_orphan(struct super_block *sb)
+{
+    struct lolelffs_sb_info *sbi = LOLELFFS_SB(sb);
+    struct lolelffs_inode_info *ci;
+    struct buffer_head *bh;
+    struct inode *inode;
+    uint32_t ino, bno;
+    int ret;
+
+    ino = get_free_inode(sbi);
+    if (!ino)
+        return ERR_PTR(-ENOSPC);
+    bno = get_free_blocks(sbi, 1);
+    if (!bno) {
+        ret = -ENOSPC;
+        goto put_ino;
     }
-    bh2 = LOLELFFS_SB_BREAD(sb, eblock->extents[ei].ee_start + bi);
-    if (!bh2) {
+
+    bh = LOLELFFS_SB_BREAD(sb, bno);
+    if (!bh) {
         ret = -EIO;
         goto put_block;
     }
-    dblock = (struct lolelffs_dir_block *) bh2->b_data;
+    memset(bh->b_data, 0, LOLELFFS_BLOCK_SIZE);
+    mark_buffer_dirty(bh);
+    sync_dirty_buffer(bh);
+    brelse(bh);
 
-    dblock->files[fi].inode = inode->i_ino;
-    strncpy(dblock->files[fi].filename, dentry->d_name.name,
-            LOLELFFS_FILENAME_LEN);
+    inode = lolelffs_iget(sb, ino);
+    if (IS_ERR(inode)) {
+        ret = PTR_ERR(inode);
+        goto put_block;
+    }
+    ci = LOLELFFS_INODE(inode);
+    inode->i_mode = S_IFREG;
+    i_uid_write(inode, 0);
+    i_gid_write(inode, 0);
+    clear_nlink(inode);
+    inode->i_size = 0;
+    inode->i_blocks = 1;
+    ci->ei_block = bno;
+    ci->xattr_block = 0;
+    memset(ci->i_data, 0, sizeof(ci->i_data));
+    {
+        struct timespec64 now = current_time(inode);
+        inode_set_ctime_to_ts(inode, now);
+        inode_set_atime_to_ts(inode, now);
+        inode_set_mtime_to_ts(inode, now);
+    }
+    ret = lolelffs_write_inode(inode, NULL);
+    if (ret) {
+        iput(inode);
+        goto put_block;
+    }
+
+    /* The allocation bitmaps must know of the orphan too */
+    lolelffs_sync_fs(sb, 1);
+    return inode;
 
-    eblock->nr_files++;
-    mark_buffer_dirty(bh2);
+put_block:
+    put_blocks(sbi, bno, 1);
+put_ino:
+    put_inode(sbi, ino);
+    return ERR_PTR(ret);
+}
+
+/*
+ * Append ext to the extents of orphan, and write them back. Extents must be
+ * given in logical order. Return -ENOSPC if the extent index of the orphan
+ * is full.
+ */
+int lolelffs_orphan_add(struct inode *orphan, const struct lolelffs_extent *ext)
+{
+    struct lolelffs_file_ei_block *index;
+    struct buffer_head *bh;
+    uint32_t i;
+    int ret;
+
+    bh = LOLELFFS_SB_BREAD(orphan->i_sb, LOLELFFS_INODE(orphan)->ei_block);
+    if (!bh)
+        return -EIO;
+    index = (struct lolelffs_file_ei_block *) bh->b_data;
+    for (i = 0; i < LOLELFFS_MAX_EXTENTS && index->extents[i].ee_start; i++)
+        ;
+    if (i == LOLELFFS_MAX_EXTENTS) {
+        brelse(bh);
+        return -ENOSPC;
+    }
+    index->extents[i] = *ext;
     mark_buffer_dirty(bh);
-    brelse(bh2);
+    ret = sync_dirty_buffer(bh);
     brelse(bh);
+    if (ret)
+        return ret;
 
-    inode->i_link = (char *) ci->i_data;
-    memcpy(inode->i_link, symname, l);
-    inode->i_size = l - 1;
-    mark_inode_dirty(inode);
-    d_instantiate(dentry, inode);
-    return 0;
+    orphan->i_size = (loff_t) (ext->ee_block + ext->ee_len) * LOLELFFS_BLOCK_SIZE;
+    orphan->i_blocks = orphan->i_size / LOLELFFS_BLOCK_SIZE + 2;
+    return lolelffs_write_inode(orphan, NULL);
+}
 
-put_block:
-    if (alloc && eblock->extents[ei].ee_start) {
-        put_blocks(LOLELFFS_SB(sb), eblock->extents[ei].ee_start,
-                   eblock->extents[ei].ee_len);
-        memset(&eblock->extents[ei], 0, sizeof(struct lolelffs_extent));
+/*
+ * Change the attributes of an inode. A new size must be given to an inline
+ * file before its page cache is truncated, see lolelffs_inline_truncate().
+ */
+#if MNT_IDMAP_REQUIRED()
+static int lolelffs_setattr(struct mnt_idmap *idmap,
+                            struct dentry *dentry,
+                            struct iattr *attr)
+#elif USER_NS_REQUIRED()
+static int lolelffs_setattr(struct user_namespace *ns,
+                            struct dentry *dentry,
+                            struct iattr *attr)
+#else
+static int lolelffs_setattr(struct dentry *dentry, struct iattr *attr)
+#endif
+{
+    struct inode *inode = d_inode(dentry);
+    int ret;
+
+#if MNT_IDMAP_REQUIRED()
+    ret = setattr_prepare(idmap, dentry, attr);
+#elif USER_NS_REQUIRED()
+    ret = setattr_prepare(ns, dentry, attr);
+#else
+    ret = setattr_prepare(dentry, attr);
+#endif
+    if (ret)
+        return ret;
+
+    if ((attr->ia_valid & ATTR_SIZE) && attr->ia_size != i_size_read(inode)) {
+        loff_t old = i_size_read(inode);
+
+        filemap_invalidate_lock(inode->i_mapping);
+        ret = lolelffs_inline_truncate(inode, attr->ia_size);
+        if (!ret) {
+            /* No page past the end is left to write back to freed blocks */
+            truncate_setsize(inode, attr->ia_size);
+            if (attr->ia_size < old)
+                ret = lolelffs_file_trim(inode);
+        }
+        filemap_invalidate_unlock(inode->i_mapping);
+        if (ret)
+            return ret;
     }
 
-end:
-    brelse(bh);
-    return ret;
+#if MNT_IDMAP_REQUIRED()
+    setattr_copy(idmap, inode, attr);
+#elif USER_NS_REQUIRED()
+    setattr_copy(ns, inode, attr);
+#else
+    setattr_copy(inode, attr);
+#endif
+    mark_inode_dirty(inode);
+    return 0;
 }
 
 static const char *lolelffs_get_link(struct dentry *dentry,
@@ -1023,6 +871,7 @@ static const struct inode_operations lolelffs_inode_ops = {
     .rename = lolelffs_rename,
     .link = lolelffs_link,
     .symlink = lolelffs_symlink,
+    .setattr = lolelffs_setattr,
     .listxattr = lolelffs_listxattr,
 };
 
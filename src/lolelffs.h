@@ -19,6 +19,11 @@
 
 /* Feature flags for comp_features field */
 #define LOLELFFS_FEATURE_LARGE_EXTENTS 0x0001
+#define LOLELFFS_FEATURE_DIR_INDEX     0x0002  /* Hashed directory index */
+#define LOLELFFS_FEATURE_EXTENT_TREE   0x0004  /* Multi-level file extent trees */
+#define LOLELFFS_FEATURE_INLINE_DATA   0x0008  /* Small files in the inode store */
+#define LOLELFFS_FEATURE_XATTR_INLINE  0x0010  /* Small xattr sets in their index block */
+#define LOLELFFS_FEATURE_SHARED_EXTENTS 0x0020 /* Extents sharing blocks, from dedup */
 
 /* Compression algorithm IDs */
 #define LOLELFFS_COMP_NONE      0  /* No compression */
@@ -26,6 +31,29 @@
 #define LOLELFFS_COMP_ZLIB      2  /* zlib/deflate (moderate speed, better ratio) */
 #define LOLELFFS_COMP_ZSTD      3  /* zstd (configurable, best ratio) */
 
+/*
+ * Adaptive compression policy of the tools, the only writers of compressed
+ * extents: the kernel module writes new data uncompressed. The byte entropy
+ * of a sample of the data is estimated first, and data close to 8 bits per
+ * byte (already compressed or encrypted) is stored without running the
+ * compressor. After LOLELFFS_COMP_MAX_FAILS blocks in a row that the
+ * compressor could not shrink, a file only tries one block in
+ * LOLELFFS_COMP_RETRY_INTERVAL until one compresses again.
+ */
+#define LOLELFFS_COMP_SAMPLE_SIZE    1024 /* Bytes sampled per estimate */
+#define LOLELFFS_COMP_SAMPLE_RUN     16   /* Contiguous bytes per sampled run */
+#define LOLELFFS_COMP_ENTROPY_MAX    30   /* Quarter bits per byte: 7.5 bits */
+#define LOLELFFS_COMP_MAX_FAILS      8
+#define LOLELFFS_COMP_RETRY_INTERVAL 64
+
+/*
+ * Per-file compression hint, a user xattr overriding comp_default_algo for
+ * data the tools write to the file: an algorithm name ("none", "lz4",
+ * "zlib", "zstd"), "hot" for the fastest algorithm, or "cold" for the best
+ * ratio available
+ */
+#define LOLELFFS_COMP_HINT_XATTR "lolelffs.compress"
+
 /* Encryption algorithm IDs */
 #define LOLELFFS_ENC_NONE           0  /* No encryption */
 #define LOLELFFS_ENC_AES256_XTS     1  /* AES-256-XTS (block device encryption) */
@@ -44,6 +72,13 @@
 #define LOLELFFS_EXT_ENCRYPTED    0x0002  /* Extent contains encrypted blocks */
 #define LOLELFFS_EXT_HAS_META     0x0004  /* Has per-block metadata */
 #define LOLELFFS_EXT_MIXED        0x0008  /* Mixed compressed/uncompressed/encrypted */
+/*
+ * The physical blocks of the extent may be mapped by other extents too, as
+ * left by `lolelffs dedup`. They are never written in place nor freed by the
+ * kernel module: the tools copy an extent before changing it, and reclaim
+ * the shared blocks no extent maps anymore.
+ */
+#define LOLELFFS_EXT_SHARED       0x0010
 
 /* Extent structure with compression and encryption support (24 bytes) */
 struct lolelffs_extent {
@@ -58,20 +93,36 @@ struct lolelffs_extent {
     uint32_t ee_meta;       /* Block number of metadata (compression/encryption) */
 };
 
-/* Compression metadata for a single block */
+/*
+ * Packed extents (LOLELFFS_EXT_HAS_META) compress their logical blocks in
+ * clusters of 1 << cluster_shift blocks, each as a single stream
+ */
+#define LOLELFFS_COMP_CLUSTER_SHIFT  4  /* 16 blocks = 64 KiB per cluster */
+#define LOLELFFS_COMP_CLUSTER_BLOCKS (1 << LOLELFFS_COMP_CLUSTER_SHIFT)
+#define LOLELFFS_COMP_CLUSTER_SIZE   (LOLELFFS_COMP_CLUSTER_BLOCKS * LOLELFFS_BLOCK_SIZE)
+
+/* Compression metadata for a single cluster */
 struct lolelffs_comp_block_meta {
-    uint16_t comp_size;     /* Compressed size (0 = uncompressed) */
+    uint16_t comp_size;     /* Compressed size in bytes (0 = stored uncompressed) */
     uint8_t  comp_algo;     /* Algorithm override (0 = use extent default) */
     uint8_t  flags;         /* Reserved */
 };
 
-/* Compression metadata block (one 4KB block, supports up to 2040 blocks) */
+#define LOLELFFS_COMP_META_ENTRIES 1020
+
+/*
+ * Compression metadata block of a packed extent, found at ee_meta. The
+ * streams of the clusters are stored back to back in the nr_phys blocks
+ * starting at ee_start; a cluster begins where the previous one ends.
+ */
 struct lolelffs_comp_metadata {
     uint32_t magic;         /* Magic: LOLELFFS_COMP_META_MAGIC */
-    uint32_t nr_blocks;     /* Number of blocks with metadata */
-    struct lolelffs_comp_block_meta blocks[2040];  /* 2040 entries = 8160 bytes */
-    char padding[1928];     /* Pad to 4096 bytes (8 + 8160 + 1928 = 4096) */
-};
+    uint32_t nr_blocks;     /* Number of logical blocks covered (ee_len) */
+    uint32_t nr_phys;       /* Number of physical data blocks at ee_start */
+    uint16_t cluster_shift; /* log2 of logical blocks per cluster */
+    uint16_t nr_clusters;   /* Number of used entries in clusters[] */
+    struct lolelffs_comp_block_meta clusters[LOLELFFS_COMP_META_ENTRIES];
+};                          /* 16 + 1020 * 4 = 4096 bytes */
 
 /* File entry structure - needed for userspace calculations */
 struct lolelffs_file {
@@ -85,6 +136,56 @@ struct lolelffs_file {
     ((uint64_t) LOLELFFS_MAX_BLOCKS_PER_EXTENT_LARGE * LOLELFFS_BLOCK_SIZE \
         * LOLELFFS_MAX_EXTENTS)
 
+/*
+ * Extent tree of a regular file, used on filesystems with
+ * LOLELFFS_FEATURE_EXTENT_TREE once its extents outgrow the extent index
+ * block, which then becomes the root node. Every node fills a block and
+ * starts with a header. Leaves (depth 0) hold extents sorted by logical
+ * block. Interior nodes hold, for each child, the first logical block it
+ * covers; a child covers the blocks up to the first one of the next child.
+ * The root is never a leaf, and a regular file never has nr_files set in a
+ * plain extent index block, which tells both formats apart.
+ */
+#define LOLELFFS_EXT_TREE_MAGIC 0xE7EE
+#define LOLELFFS_EXT_TREE_MAX_DEPTH 4
+
+struct lolelffs_ext_tree_header {
+    uint16_t eh_magic;   /* Magic: LOLELFFS_EXT_TREE_MAGIC */
+    uint16_t eh_depth;   /* Depth of the node above the leaves (0 = leaf) */
+    uint32_t eh_entries; /* Number of used entries */
+};
+
+struct lolelffs_ext_tree_idx {
+    uint32_t ei_block; /* First logical block covered by the child */
+    uint32_t ei_child; /* Block of the child node */
+};
+
+#define LOLELFFS_EXT_TREE_LEAF_ENTRIES                                  \
+    ((LOLELFFS_BLOCK_SIZE - sizeof(struct lolelffs_ext_tree_header)) / \
+     sizeof(struct lolelffs_extent))
+#define LOLELFFS_EXT_TREE_IDX_ENTRIES                                   \
+    ((LOLELFFS_BLOCK_SIZE - sizeof(struct lolelffs_ext_tree_header)) / \
+     sizeof(struct lolelffs_ext_tree_idx))
+
+struct lolelffs_ext_tree_node {
+    struct lolelffs_ext_tree_header eh;
+    union {
+        struct lolelffs_extent extents[LOLELFFS_EXT_TREE_LEAF_ENTRIES];
+        struct lolelffs_ext_tree_idx idx[LOLELFFS_EXT_TREE_IDX_ENTRIES];
+    };
+};                       /* 8 + 170 * 24 or 8 + 511 * 8 = 4088 bytes */
+
+/* Whether an extent index block is the root of an extent tree */
+static inline int lolelffs_ext_is_tree(const void *block)
+{
+    const struct lolelffs_ext_tree_header *eh = block;
+
+    return eh->eh_magic == LOLELFFS_EXT_TREE_MAGIC;
+}
+
+/* Logical blocks of the largest file, whose size must fit in i_size */
+#define LOLELFFS_MAX_FILE_BLOCKS ((uint32_t) ((1ULL << 32) / LOLELFFS_BLOCK_SIZE))
+
 #define LOLELFFS_FILES_PER_BLOCK \
     (LOLELFFS_BLOCK_SIZE / sizeof(struct lolelffs_file))
 #define LOLELFFS_FILES_PER_EXT \
@@ -93,6 +194,83 @@ struct lolelffs_file {
 #define LOLELFFS_MAX_SUBFILES \
     (LOLELFFS_FILES_PER_EXT *LOLELFFS_MAX_EXTENTS)
 
+/*
+ * Hashed directory index, found at dx_block in the extent index block of a
+ * directory once it outgrows one block of entries. Entries are kept packed,
+ * so the entry of slot s lives in logical block s / LOLELFFS_FILES_PER_BLOCK
+ * of the directory. The root splits the hash space in ranges, sorted by
+ * their lowest hash, each listed by a leaf as (hash, slot) records.
+ */
+#define LOLELFFS_DX_MAGIC 0xD12EC7ED
+#define LOLELFFS_DX_MIN_FILES LOLELFFS_FILES_PER_BLOCK /* Index past this */
+#define LOLELFFS_DX_ROOT_ENTRIES 510
+#define LOLELFFS_DX_LEAF_ENTRIES 511
+
+struct lolelffs_dx_entry {
+    uint32_t hash;  /* Lowest hash of a leaf range, or hash of a name */
+    uint32_t value; /* Leaf block (in root), or slot of the entry (in leaf) */
+};
+
+struct lolelffs_dx_root {
+    uint32_t magic;      /* Magic: LOLELFFS_DX_MAGIC */
+    uint32_t nr_entries; /* Number of leaves, entries[0].hash is always 0 */
+    uint32_t nr_records; /* Records in all leaves, equal to nr_files */
+    uint32_t reserved;
+    struct lolelffs_dx_entry entries[LOLELFFS_DX_ROOT_ENTRIES];
+};                       /* 16 + 510 * 8 = 4096 bytes */
+
+struct lolelffs_dx_leaf {
+    uint32_t nr_entries; /* Number of records, in no particular order */
+    uint32_t reserved;
+    struct lolelffs_dx_entry entries[LOLELFFS_DX_LEAF_ENTRIES];
+};                       /* 8 + 511 * 8 = 4096 bytes */
+
+/* 32-bit FNV-1a hash of a file name, stopping at its NUL or at len */
+static inline uint32_t lolelffs_dx_hash(const char *name, size_t len)
+{
+    uint32_t hash = 2166136261u;
+    size_t i;
+
+    for (i = 0; i < len && name[i]; i++) {
+        hash ^= (unsigned char) name[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+/*
+ * Inline data, on filesystems with LOLELFFS_FEATURE_INLINE_DATA: a regular
+ * file without an extent index block (ei_block = 0) keeps its contents out
+ * of the data blocks. Up to LOLELFFS_INLINE_DATA_SIZE bytes are stored in
+ * i_data itself. Larger files, up to LOLELFFS_TAIL_MAX_SIZE bytes, are
+ * packed with others into a shared tail block, found through the
+ * struct lolelffs_tail_ref at the start of i_data. A tail block counts the
+ * files it holds and is freed with the last one; the space of the others is
+ * only reclaimed then. Encrypted filesystems never store inline data, which
+ * would be left in clear. Only the userspace tools create inline files: the
+ * kernel module reads them, and moves one to an extent index on its first
+ * write or on a truncation its data cannot follow, see
+ * lolelffs_inline_truncate().
+ */
+#define LOLELFFS_INLINE_DATA_SIZE 28
+#define LOLELFFS_TAIL_MAGIC 0x7A11B10C
+
+struct lolelffs_tail_ref {
+    uint32_t tr_block;  /* Tail block holding the file */
+    uint32_t tr_offset; /* Byte offset of the file in the block */
+};
+
+struct lolelffs_tail_header {
+    uint32_t th_magic;    /* Magic: LOLELFFS_TAIL_MAGIC */
+    uint32_t th_nr_tails; /* Number of files stored in the block */
+    uint32_t th_used;     /* Bytes used from the start, header included */
+    uint32_t th_reserved;
+};
+
+#define LOLELFFS_TAIL_MAX_SIZE \
+    (LOLELFFS_BLOCK_SIZE - sizeof(struct lolelffs_tail_header))
+
 /* Extended attribute (xattr) support */
 #define LOLELFFS_XATTR_INDEX_USER       0
 #define LOLELFFS_XATTR_INDEX_TRUSTED    1
@@ -115,6 +293,20 @@ struct lolelffs_xattr_ei_block {
     struct lolelffs_extent extents[LOLELFFS_MAX_EXTENTS];
 };
 
+/*
+ * On filesystems with LOLELFFS_FEATURE_XATTR_INLINE, a set of xattrs small
+ * enough is stored in its index block rather than in data blocks: the first
+ * extent is left empty, and the entries follow it. Readers without inline
+ * support see no xattrs there.
+ */
+#define LOLELFFS_XATTR_INLINE_OFFSET \
+    (2 * sizeof(uint32_t) + sizeof(struct lolelffs_extent))
+#define LOLELFFS_XATTR_INLINE_SIZE \
+    (LOLELFFS_BLOCK_SIZE - LOLELFFS_XATTR_INLINE_OFFSET)
+
+/* Largest xattr set of an inode */
+#define LOLELFFS_XATTR_MAX_SIZE (LOLELFFS_BLOCK_SIZE * 8)
+
 /*
  * lolelffs partition layout (within a .lolfs elf section)
  * +---------------+
@@ -149,6 +341,36 @@ struct lolelffs_inode {
 #define LOLELFFS_INODES_PER_BLOCK \
     (LOLELFFS_BLOCK_SIZE / sizeof(struct lolelffs_inode))
 
+#ifdef __KERNEL__
+#include <linux/completion.h>
+#include <linux/kobject.h>
+#include <linux/ktime.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+
+/*
+ * Per-mount counters, exported under /sys/fs/lolelffs/<dev>/ by sysfs.c.
+ * Every *_WAITS counter is followed by the total time of those waits.
+ */
+enum lolelffs_stat {
+    LOLELFFS_STAT_BLOCKS_READ,      /* Data blocks read by the read paths */
+    LOLELFFS_STAT_BLOCKS_WRITTEN,   /* Data blocks written by writeback */
+    LOLELFFS_STAT_EXT_CACHE_HITS,   /* Extent lookups served by the extent cache */
+    LOLELFFS_STAT_EXT_CACHE_MISSES, /* Extent lookups that read the extent blocks */
+    LOLELFFS_STAT_ALLOC_SEARCHES,   /* Free space searches of the block allocator */
+    LOLELFFS_STAT_ALLOC_GROUPS,     /* Bitmap groups those searches scanned */
+    LOLELFFS_STAT_LOCK_WAITS,       /* Contended acquisitions of sbi->lock */
+    LOLELFFS_STAT_LOCK_WAIT_NS,
+    LOLELFFS_STAT_ALLOC_LOCK_WAITS, /* Contended acquisitions of an alloc_lock */
+    LOLELFFS_STAT_ALLOC_LOCK_WAIT_NS,
+    LOLELFFS_NR_STATS,
+};
+
+struct lolelffs_stats {
+    u64 count[LOLELFFS_NR_STATS];
+};
+#endif
+
 struct lolelffs_sb_info {
     uint32_t magic; /* Magic number */
 
@@ -181,18 +403,34 @@ struct lolelffs_sb_info {
     uint8_t  enc_salt[32];         /* Salt for key derivation (32 bytes) */
     uint8_t  enc_master_key[32];   /* Encrypted master key (32 bytes) */
     uint32_t enc_features;         /* Feature flags for future extensions */
-    uint32_t reserved[3];          /* Reserved for future use */
+    uint32_t hot_start;            /* First block of the startup read range */
+    uint32_t hot_len;              /* Blocks in the startup read range (0 = none) */
+    uint32_t tail_block;           /* Last tail block, with room for small files (0 = none) */
 
 #ifdef __KERNEL__
+    struct super_block *sb; /* Reads bitmap blocks on first use */
     unsigned long *ifree_bitmap; /* In-memory free inodes bitmap */
-    unsigned long *bfree_bitmap; /* In-memory free blocks bitmap */
+    unsigned long *bfree_bitmap; /* In-memory free blocks bitmap, by group */
+    bool ifree_loaded; /* ifree_bitmap was read from disk */
     struct mutex lock; /* Protects bitmap and free counters */
+    uint32_t nr_reserved_blocks; /* Free blocks promised to delayed allocations */
+    unsigned long *bitmap_dirty; /* ifree then bfree bitmap blocks to write on sync */
+    struct lolelffs_group_info *groups; /* Free space summary of each bitmap block */
+    uint32_t nr_groups;
+    struct lolelffs_alloc_window __percpu *windows; /* Per-CPU blocks for small allocations */
+    uint32_t window_blocks; /* Blocks taken by a window refill (0 = no windows) */
+    atomic_t nr_window_blocks; /* Free blocks held by the windows */
     loff_t fs_offset; /* Offset to filesystem data (0 for raw, or ELF section offset) */
 
     /* Encryption runtime state */
     u8 enc_master_key_decrypted[32]; /* Decrypted master key (in memory only) */
     bool enc_unlocked; /* True if filesystem is unlocked */
+    struct lolelffs_enc_key *enc_key; /* Keyed transforms, set on unlock */
     struct mutex enc_lock; /* Protects encryption state */
+
+    struct lolelffs_stats __percpu *stats; /* See lolelffs_stat_add() */
+    struct kobject s_kobj; /* /sys/fs/lolelffs/<dev> */
+    struct completion s_kobj_unregister; /* Released s_kobj */
 #endif
 };
 
@@ -214,6 +452,21 @@ struct lolelffs_inode_info {
     uint32_t cached_extent_idx;   /* Last accessed extent index */
     uint32_t cached_extent_count; /* Cached number of used extents */
     uint32_t cache_valid;         /* Cache validity flags */
+    struct lolelffs_extent *ext_map; /* In-memory copy of the used extents */
+    uint32_t ext_map_gen;         /* Bumped on every cache invalidation */
+    uint32_t ext_leaf;            /* Block holding the cached extents */
+    uint32_t ext_leaf_start;      /* Logical blocks covered by the cached */
+    uint32_t ext_leaf_end;        /* extents: [start, end) */
+    spinlock_t ext_lock;          /* Protects the extent cache */
+    /* Delayed allocation: blocks [da_end - da_reserved, da_end) are reserved */
+    struct mutex alloc_lock;      /* Serializes reservations and allocations */
+    uint32_t da_end;
+    uint32_t da_reserved;
+    /* Xattr entries as read from disk, loaded on first use */
+    struct rw_semaphore xattr_sem; /* Protects the xattr cache */
+    char *xattr_data;
+    size_t xattr_size;
+    bool xattr_cached;
     struct inode vfs_inode;
 };
 
@@ -224,6 +477,7 @@ struct lolelffs_inode_info {
 struct lolelffs_file_ei_block {
     uint32_t nr_files; /* Number of files in directory */
     struct lolelffs_extent extents[LOLELFFS_MAX_EXTENTS];
+    uint32_t dx_block; /* Root of the hashed directory index (0 = none) */
 };
 
 struct lolelffs_dir_block {
@@ -239,15 +493,146 @@ int lolelffs_sync_fs(struct super_block *sb, int wait);
 int lolelffs_init_inode_cache(void);
 void lolelffs_destroy_inode_cache(void);
 struct inode *lolelffs_iget(struct super_block *sb, unsigned long ino);
+struct inode *lolelffs_new_orphan(struct super_block *sb);
+int lolelffs_orphan_add(struct inode *orphan, const struct lolelffs_extent *ext);
+
+/* directory functions */
+int lolelffs_dir_find(struct inode *dir, const char *name, size_t len,
+                      uint32_t *ino, uint32_t *slot);
+int lolelffs_dir_add(struct inode *dir, const char *name, size_t len,
+                     uint32_t ino);
+int lolelffs_dir_remove(struct inode *dir, uint32_t slot);
+int lolelffs_dir_rename(struct inode *dir, uint32_t slot, const char *name,
+                        size_t len);
+void lolelffs_dir_free_index(struct super_block *sb,
+                             struct lolelffs_file_ei_block *eblock);
+long lolelffs_ioctl(struct file *file, unsigned int cmd, unsigned long arg);
 
 /* file functions */
 extern const struct file_operations lolelffs_file_ops;
 extern const struct file_operations lolelffs_dir_ops;
 extern const struct address_space_operations lolelffs_aops;
+int lolelffs_init_read_wq(void);
+void lolelffs_destroy_read_wq(void);
+void lolelffs_da_release(struct inode *inode, uint32_t end);
+int lolelffs_init_wb_pool(void);
+void lolelffs_destroy_wb_pool(void);
+int lolelffs_inline_convert(struct inode *inode);
+int lolelffs_inline_truncate(struct inode *inode, loff_t size);
+int lolelffs_file_trim(struct inode *inode);
+void lolelffs_tail_put(struct super_block *sb, uint32_t block);
+struct lolelffs_ioctl_defrag;
+int lolelffs_defrag(struct inode *inode, struct lolelffs_ioctl_defrag *stats);
+int lolelffs_file_prepare_write(struct inode *inode);
 
 /* extent functions */
 extern uint32_t lolelffs_ext_search(struct lolelffs_file_ei_block *index,
                                     uint32_t iblock);
+int lolelffs_ext_map_lookup(struct inode *inode,
+                            uint32_t iblock,
+                            struct lolelffs_extent *ext,
+                            uint32_t *blk);
+int lolelffs_ext_map_end(struct inode *inode, uint32_t *end);
+void lolelffs_ext_map_invalidate(struct inode *inode);
+struct lolelffs_extent *lolelffs_ext_block_extents(void *block);
+uint32_t lolelffs_ext_goal(struct inode *inode, struct buffer_head *bh_index);
+int lolelffs_ext_append(struct inode *inode,
+                        struct buffer_head *bh_index,
+                        const struct lolelffs_extent *ext,
+                        bool sync);
+int lolelffs_ext_truncate(struct inode *inode,
+                          struct buffer_head *bh_index,
+                          uint32_t first,
+                          bool scrub);
+uint32_t lolelffs_ext_phys_len(struct super_block *sb,
+                               const struct lolelffs_extent *ext);
+void lolelffs_ext_free(struct super_block *sb,
+                       const struct lolelffs_extent *ext,
+                       bool scrub);
+int lolelffs_ext_find_flagged(struct inode *inode,
+                              uint32_t first,
+                              uint16_t flags,
+                              struct lolelffs_extent *ext);
+
+/* block allocator functions */
+uint32_t lolelffs_new_blocks(struct lolelffs_sb_info *sbi, uint32_t goal,
+                             uint32_t len);
+void lolelffs_free_blocks(struct lolelffs_sb_info *sbi, uint32_t bno,
+                          uint32_t len);
+void lolelffs_alloc_fill_bitmap(struct lolelffs_sb_info *sbi, void *buf,
+                                uint32_t first, uint32_t nbits);
+int lolelffs_alloc_init(struct lolelffs_sb_info *sbi);
+void lolelffs_alloc_destroy(struct lolelffs_sb_info *sbi);
+int lolelffs_load_inode_bitmap(struct lolelffs_sb_info *sbi);
+
+/* sysfs functions */
+int lolelffs_sysfs_init(void);
+void lolelffs_sysfs_exit(void);
+int lolelffs_register_sysfs(struct super_block *sb);
+void lolelffs_unregister_sysfs(struct super_block *sb);
+
+/* Add n to counter stat of the mount, on the local CPU */
+static inline void lolelffs_stat_add(struct lolelffs_sb_info *sbi,
+                                     enum lolelffs_stat stat,
+                                     u64 n)
+{
+    this_cpu_add(sbi->stats->count[stat], n);
+}
+
+/*
+ * Take lock, and when it was contended add the wait to counter waits of the
+ * mount and its time to the counter after it. Uncontended acquisitions are
+ * not timed.
+ */
+static inline void lolelffs_lock(struct lolelffs_sb_info *sbi,
+                                 struct mutex *lock,
+                                 enum lolelffs_stat waits)
+{
+    u64 start;
+
+    if (mutex_trylock(lock))
+        return;
+    start = ktime_get_ns();
+    mutex_lock(lock);
+    lolelffs_stat_add(sbi, waits, 1);
+    lolelffs_stat_add(sbi, waits + 1, ktime_get_ns() - start);
+}
+
+#define lolelffs_sb_lock(sbi) \
+    lolelffs_lock((sbi), &(sbi)->lock, LOLELFFS_STAT_LOCK_WAITS)
+#define lolelffs_alloc_lock(sbi, ci) \
+    lolelffs_lock((sbi), &(ci)->alloc_lock, LOLELFFS_STAT_ALLOC_LOCK_WAITS)
+
+/*
+ * Start time of a call traced by event, or 0 while the event is off, so
+ * that untraced calls are not timed. See trace.h.
+ */
+#define lolelffs_trace_start(event) \
+    (trace_##event##_enabled() ? ktime_get_ns() : 0)
+
+/* Free blocks, including those held by the allocation windows */
+static inline uint32_t lolelffs_nr_free_blocks(struct lolelffs_sb_info *sbi)
+{
+    return sbi->nr_free_blocks + atomic_read(&sbi->nr_window_blocks);
+}
+
+/*
+ * Mark for the next sync the bitmap blocks covering bits [first, first + nr)
+ * of the free blocks bitmap, or of the free inodes bitmap if !blocks. Call
+ * it after changing the bits.
+ */
+static inline void lolelffs_mark_bitmap_dirty(struct lolelffs_sb_info *sbi,
+                                              bool blocks,
+                                              uint32_t first,
+                                              uint32_t nr)
+{
+    uint32_t base = blocks ? sbi->nr_ifree_blocks : 0;
+    uint32_t i;
+
+    for (i = first / (LOLELFFS_BLOCK_SIZE * 8);
+         i <= (first + nr - 1) / (LOLELFFS_BLOCK_SIZE * 8); i++)
+        set_bit(base + i, sbi->bitmap_dirty);
+}
 
 /* xattr functions */
 extern const struct xattr_handler *lolelffs_xattr_handlers[];
@@ -259,6 +644,12 @@ void lolelffs_xattr_free_blocks(struct lolelffs_sb_info *sbi, struct inode *inod
 #define LOLELFFS_INODE(inode) \
     (container_of(inode, struct lolelffs_inode_info, vfs_inode))
 
+/* Whether a regular file keeps its contents in the inode store */
+static inline bool lolelffs_inode_is_inline(struct inode *inode)
+{
+    return S_ISREG(inode->i_mode) && LOLELFFS_INODE(inode)->ei_block == 0;
+}
+
 /* Compression helper */
 #define LOLELFFS_IS_COMPRESSED_ENABLED(sbi) ((sbi)->comp_enabled)
 
@@ -282,6 +673,15 @@ struct lolelffs_ioctl_enc_status {
 
 #define LOLELFFS_IOC_ENC_STATUS _IOR(LOLELFFS_IOC_MAGIC, 2, struct lolelffs_ioctl_enc_status)
 
+/* Merge the extents of a regular file opened for writing */
+struct lolelffs_ioctl_defrag {
+    uint32_t extents_before; /* Extents of the file before the call */
+    uint32_t extents_after;  /* Extents of the file after the call */
+    uint32_t blocks_moved;   /* Data blocks copied to a new location */
+};
+
+#define LOLELFFS_IOC_DEFRAG _IOR(LOLELFFS_IOC_MAGIC, 3, struct lolelffs_ioctl_defrag)
+
 #endif /* __KERNEL__ */
 
 #endif /* LOLELFFS_H */
@@ -1,7 +1,12 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <endian.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
 #include <libelf.h>
 #include <gelf.h>
+#include <search.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -13,11 +18,20 @@
 
 #include "lolelffs.h"
 
+#define MKFS_MIN_BLOCKS 100
+
 struct superblock {
     struct lolelffs_sb_info info;
     char padding[LOLELFFS_BLOCK_SIZE - sizeof(struct lolelffs_sb_info)];
 };
 
+/* File entry index block for userspace */
+struct lolelffs_file_ei_block {
+    uint32_t nr_files;
+    struct lolelffs_extent extents[LOLELFFS_MAX_EXTENTS];
+    uint32_t dx_block;
+};
+
 /* Returns ceil(a/b) */
 static inline uint32_t idiv_ceil(uint32_t a, uint32_t b)
 {
@@ -27,17 +41,33 @@ static inline uint32_t idiv_ceil(uint32_t a, uint32_t b)
     return ret;
 }
 
-static struct superblock *write_superblock(int fd, struct stat *fstats)
+/* Returns n rounded up to a whole block of inodes */
+static inline uint32_t round_inodes(uint32_t n)
 {
-    struct superblock *sb = malloc(sizeof(struct superblock));
-    if (!sb)
-        return NULL;
-
-    uint32_t nr_blocks = fstats->st_size / LOLELFFS_BLOCK_SIZE;
-    uint32_t nr_inodes = nr_blocks;
-    uint32_t mod = nr_inodes % LOLELFFS_INODES_PER_BLOCK;
+    uint32_t mod = n % LOLELFFS_INODES_PER_BLOCK;
     if (mod)
-        nr_inodes += LOLELFFS_INODES_PER_BLOCK - mod;
+        n += LOLELFFS_INODES_PER_BLOCK - mod;
+    return n;
+}
+
+/* Number of blocks before the data area: superblock, inode store, bitmaps */
+static inline uint32_t nr_meta_blocks(uint32_t nr_blocks, uint32_t nr_inodes)
+{
+    return 1 + idiv_ceil(nr_inodes, LOLELFFS_INODES_PER_BLOCK) +
+           idiv_ceil(nr_inodes, LOLELFFS_BLOCK_SIZE * 8) +
+           idiv_ceil(nr_blocks, LOLELFFS_BLOCK_SIZE * 8);
+}
+
+/*
+ * Fill sb for a filesystem of nr_blocks blocks and nr_inodes inodes, of which
+ * nr_used_inodes inodes and nr_used_data data blocks are taken.
+ */
+static void init_superblock(struct superblock *sb,
+                            uint32_t nr_blocks,
+                            uint32_t nr_inodes,
+                            uint32_t nr_used_inodes,
+                            uint32_t nr_used_data)
+{
     uint32_t nr_istore_blocks = idiv_ceil(nr_inodes, LOLELFFS_INODES_PER_BLOCK);
     uint32_t nr_ifree_blocks = idiv_ceil(nr_inodes, LOLELFFS_BLOCK_SIZE * 8);
     uint32_t nr_bfree_blocks = idiv_ceil(nr_blocks, LOLELFFS_BLOCK_SIZE * 8);
@@ -52,14 +82,18 @@ static struct superblock *write_superblock(int fd, struct stat *fstats)
         .nr_istore_blocks = htole32(nr_istore_blocks),
         .nr_ifree_blocks = htole32(nr_ifree_blocks),
         .nr_bfree_blocks = htole32(nr_bfree_blocks),
-        .nr_free_inodes = htole32(nr_inodes - 1),
-        .nr_free_blocks = htole32(nr_data_blocks - 1),
+        .nr_free_inodes = htole32(nr_inodes - nr_used_inodes),
+        .nr_free_blocks = htole32(nr_data_blocks - nr_used_data),
         /* Compression support */
         .version = htole32(LOLELFFS_VERSION),
         .comp_default_algo = htole32(LOLELFFS_COMP_LZ4),
         .comp_enabled = htole32(1),  /* Compression enabled by default */
         .comp_min_block_size = htole32(128),  /* Don't compress blocks < 128 bytes */
-        .comp_features = htole32(LOLELFFS_FEATURE_LARGE_EXTENTS),
+        .comp_features = htole32(LOLELFFS_FEATURE_LARGE_EXTENTS |
+                                 LOLELFFS_FEATURE_DIR_INDEX |
+                                 LOLELFFS_FEATURE_EXTENT_TREE |
+                                 LOLELFFS_FEATURE_INLINE_DATA |
+                                 LOLELFFS_FEATURE_XATTR_INLINE),
         .max_extent_blocks = htole32(LOLELFFS_MAX_BLOCKS_PER_EXTENT),
         .max_extent_blocks_large = htole32(LOLELFFS_MAX_BLOCKS_PER_EXTENT_LARGE),
         /* Encryption support */
@@ -72,15 +106,12 @@ static struct superblock *write_superblock(int fd, struct stat *fstats)
         .enc_salt = {0},
         .enc_master_key = {0},
         .enc_features = htole32(0),
-        .reserved = {0},
+        .tail_block = htole32(0),
     };
+}
 
-    ssize_t ret = write(fd, sb, sizeof(struct superblock));
-    if (ret != sizeof(struct superblock)) {
-        free(sb);
-        return NULL;
-    }
-
+static void print_superblock(struct superblock *sb)
+{
     const char *comp_algo_str = "none";
     switch (le32toh(sb->info.comp_default_algo)) {
         case LOLELFFS_COMP_LZ4: comp_algo_str = "lz4"; break;
@@ -107,6 +138,24 @@ static struct superblock *write_superblock(int fd, struct stat *fstats)
         le32toh(sb->info.nr_free_inodes), le32toh(sb->info.nr_free_blocks),
         le32toh(sb->info.comp_enabled) ? "yes" : "no", comp_algo_str,
         le32toh(sb->info.comp_enabled), le32toh(sb->info.max_extent_blocks));
+}
+
+static struct superblock *write_superblock(int fd, struct stat *fstats)
+{
+    struct superblock *sb = malloc(sizeof(struct superblock));
+    if (!sb)
+        return NULL;
+
+    uint32_t nr_blocks = fstats->st_size / LOLELFFS_BLOCK_SIZE;
+    init_superblock(sb, nr_blocks, round_inodes(nr_blocks), 1, 1);
+
+    ssize_t ret = write(fd, sb, sizeof(struct superblock));
+    if (ret != sizeof(struct superblock)) {
+        free(sb);
+        return NULL;
+    }
+
+    print_superblock(sb);
 
     return sb;
 }
@@ -287,6 +336,881 @@ static int write_data_blocks(int fd)
     return 0;
 }
 
+/*
+ * --from-dir: build the filesystem from a host directory tree in one pass.
+ *
+ * The tree is walked first to lay it out: inodes are numbered and data blocks
+ * handed out in the same depth-first order, by name, so that a recursive
+ * read of the image goes forward through the inode store and the data area.
+ * A directory takes its extent index block, its entry blocks and its hashed
+ * index in a row, and a regular file its extent index block followed by all
+ * its data, in as few extents as possible. Small files take no block of
+ * their own: they are stored in their inode, or packed into a tail block
+ * placed where the first of them comes. The data area is then written as one
+ * sequential stream, and the metadata blocks last.
+ */
+#define MKFS_WRITE_BUF_SIZE (8 << 20)
+#define MKFS_DX_LEAF_FILL (LOLELFFS_DX_LEAF_ENTRIES * 3 / 4) /* Room to grow */
+#define MKFS_TARGET_SIZE sizeof(((struct lolelffs_inode *) 0)->i_data) /* Symlinks */
+
+struct tree_inode {
+    char *path;            /* Host path of regular files */
+    struct stat st;
+    char target[MKFS_TARGET_SIZE]; /* Symlink target */
+    uint32_t nlink;
+    uint32_t ei_block;     /* Relative to the first data block, or tail block */
+    uint32_t nr_blocks;    /* Directory entry blocks, or file data blocks */
+    uint32_t tail_offset;  /* Offset of a tail packed file in its block */
+    uint32_t tail_last;    /* Last file of the tail block it opens (0 = none) */
+    uint32_t nr_dx_leaves; /* Index leaves after the root (0 = no index) */
+    uint32_t first_entry;  /* Entries of a directory, in slot order */
+    uint32_t nr_entries;
+};
+
+struct tree_entry {
+    char name[LOLELFFS_FILENAME_LEN];
+    uint32_t ino;
+};
+
+struct tree {
+    struct tree_inode *inodes;
+    uint32_t nr_inodes, max_inodes;
+    struct tree_entry *entries;
+    uint32_t nr_entries, max_entries;
+    uint64_t nr_blocks;    /* Data blocks laid out so far */
+    uint32_t tail_block;   /* Tail block being filled */
+    uint32_t tail_used;    /* Bytes used in it (0 = none) */
+    uint32_t tail_opener;  /* File it was opened for */
+    void *links;           /* Hard linked files seen, by device and inode */
+};
+
+struct tree_link {
+    dev_t dev;
+    ino_t ino;
+    uint32_t idx;
+};
+
+struct tree_child {
+    char *name;
+    struct stat st;
+    char target[MKFS_TARGET_SIZE];
+};
+
+static int cmp_links(const void *a, const void *b)
+{
+    const struct tree_link *la = a, *lb = b;
+
+    if (la->dev != lb->dev)
+        return la->dev < lb->dev ? -1 : 1;
+    if (la->ino != lb->ino)
+        return la->ino < lb->ino ? -1 : 1;
+    return 0;
+}
+
+static int cmp_children(const void *a, const void *b)
+{
+    return strcmp(((const struct tree_child *) a)->name,
+                  ((const struct tree_child *) b)->name);
+}
+
+static int cmp_dx(const void *a, const void *b)
+{
+    const struct lolelffs_dx_entry *ea = a, *eb = b;
+
+    if (ea->hash != eb->hash)
+        return ea->hash < eb->hash ? -1 : 1;
+    return ea->value < eb->value ? -1 : ea->value > eb->value;
+}
+
+/*
+ * Sort the n records of a directory index and split them in leaves filled to
+ * MKFS_DX_LEAF_FILL, never separating equal hashes. Store the first record of
+ * each leaf in starts, if not NULL, and return the number of leaves, or 0 if
+ * the records do not fit in an index.
+ */
+static uint32_t dx_plan(struct lolelffs_dx_entry *recs, uint32_t n,
+                        uint32_t *starts)
+{
+    uint32_t nr_leaves = 0, start = 0, end;
+
+    qsort(recs, n, sizeof(*recs), cmp_dx);
+    while (start < n) {
+        end = start + MKFS_DX_LEAF_FILL < n ? start + MKFS_DX_LEAF_FILL : n;
+        while (end < n && recs[end].hash == recs[end - 1].hash)
+            end++;
+        if (end - start > LOLELFFS_DX_LEAF_ENTRIES ||
+            nr_leaves == LOLELFFS_DX_ROOT_ENTRIES)
+            return 0;
+        if (starts)
+            starts[nr_leaves] = start;
+        nr_leaves++;
+        start = end;
+    }
+
+    return nr_leaves;
+}
+
+static void *grow_array(void *array, uint32_t *max, uint32_t needed, size_t size)
+{
+    uint32_t new_max = *max ? *max : 64;
+    void *new_array;
+
+    if (needed <= *max)
+        return array;
+    while (new_max < needed)
+        new_max *= 2;
+    new_array = realloc(array, (size_t) new_max * size);
+    if (!new_array)
+        return NULL;
+    *max = new_max;
+    return new_array;
+}
+
+static int tree_add_inode(struct tree *t, const struct stat *st)
+{
+    struct tree_inode *inodes =
+        grow_array(t->inodes, &t->max_inodes, t->nr_inodes + 1, sizeof(*inodes));
+    if (!inodes)
+        return -1;
+    t->inodes = inodes;
+
+    struct tree_inode *ti = &t->inodes[t->nr_inodes];
+    memset(ti, 0, sizeof(*ti));
+    ti->st = *st;
+    ti->nlink = S_ISDIR(st->st_mode) ? 2 : 1;
+
+    return t->nr_inodes++;
+}
+
+/* Whether a regular file is packed into a tail block rather than inline */
+static inline int tree_is_tail(const struct tree_inode *ti)
+{
+    return S_ISREG(ti->st.st_mode) && ti->st.st_size > LOLELFFS_INLINE_DATA_SIZE &&
+           ti->st.st_size <= (off_t) LOLELFFS_TAIL_MAX_SIZE;
+}
+
+/* Pack the small file idx into the tail block, opening a new one if full */
+static void tree_add_tail(struct tree *t, uint32_t idx)
+{
+    uint32_t size = t->inodes[idx].st.st_size;
+
+    if (!t->tail_used || t->tail_used + size > LOLELFFS_BLOCK_SIZE) {
+        t->tail_block = t->nr_blocks++;
+        t->tail_used = sizeof(struct lolelffs_tail_header);
+        t->tail_opener = idx;
+    }
+    t->inodes[idx].ei_block = t->tail_block;
+    t->inodes[idx].tail_offset = t->tail_used;
+    t->inodes[t->tail_opener].tail_last = idx;
+    t->tail_used += size;
+}
+
+static char *join_path(const char *dir, const char *name)
+{
+    size_t len = strlen(dir) + strlen(name) + 2;
+    char *path = malloc(len);
+
+    if (path)
+        snprintf(path, len, "%s/%s", dir, name);
+    return path;
+}
+
+/*
+ * List the directory at path, sorted by name, keeping what lolelffs can hold:
+ * directories, regular files and short symlinks. Return the number of
+ * children stored in *children, or -1.
+ */
+static int list_children(const char *path, struct tree_child **children)
+{
+    struct tree_child *list = NULL;
+    uint32_t n = 0, max = 0;
+    struct dirent *de;
+    int ret = -1;
+
+    DIR *dir = opendir(path);
+    if (!dir) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    while ((de = readdir(dir))) {
+        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+            continue;
+
+        char *child = join_path(path, de->d_name);
+        if (!child)
+            goto end;
+
+        struct tree_child c = {0};
+        if (lstat(child, &c.st)) {
+            fprintf(stderr, "%s: %s\n", child, strerror(errno));
+            free(child);
+            goto end;
+        }
+        if (strlen(de->d_name) > LOLELFFS_FILENAME_LEN) {
+            fprintf(stderr, "%s: name too long\n", child);
+            free(child);
+            goto end;
+        }
+        if (S_ISLNK(c.st.st_mode)) {
+            ssize_t len = readlink(child, c.target, sizeof(c.target));
+            if (len < 0 || len >= (ssize_t) sizeof(c.target)) {
+                fprintf(stderr, "Skipping %s: symlink target too long\n", child);
+                free(child);
+                continue;
+            }
+            c.target[len] = '\0';
+        } else if (S_ISREG(c.st.st_mode)) {
+            if ((uint64_t) c.st.st_size > UINT32_MAX) {
+                fprintf(stderr, "%s: file too large\n", child);
+                free(child);
+                goto end;
+            }
+        } else if (!S_ISDIR(c.st.st_mode)) {
+            fprintf(stderr, "Skipping %s: file type not supported\n", child);
+            free(child);
+            continue;
+        }
+        free(child);
+
+        struct tree_child *grown = grow_array(list, &max, n + 1, sizeof(*list));
+        if (!grown)
+            goto end;
+        list = grown;
+        c.name = strdup(de->d_name);
+        if (!c.name)
+            goto end;
+        list[n++] = c;
+    }
+
+    qsort(list, n, sizeof(*list), cmp_children);
+    *children = list;
+    list = NULL;
+    ret = n;
+
+end:
+    if (list) {
+        for (uint32_t i = 0; i < n; i++)
+            free(list[i].name);
+        free(list);
+    }
+    closedir(dir);
+    return ret;
+}
+
+/*
+ * Lay out the directory dir found at path, then its children in name order,
+ * descending into subdirectories as they come.
+ */
+static int walk_dir(struct tree *t, uint32_t dir, const char *path)
+{
+    struct tree_child *children = NULL;
+    struct lolelffs_dx_entry *recs = NULL;
+    int n, ret = -1;
+
+    n = list_children(path, &children);
+    if (n < 0)
+        return -1;
+    if ((uint32_t) n > LOLELFFS_MAX_SUBFILES) {
+        fprintf(stderr, "%s: too many files\n", path);
+        goto end;
+    }
+
+    /* The directory comes first, right before what it lists */
+    struct tree_entry *entries = grow_array(t->entries, &t->max_entries,
+                                            t->nr_entries + n, sizeof(*entries));
+    if (!entries)
+        goto end;
+    t->entries = entries;
+    t->inodes[dir].first_entry = t->nr_entries;
+    t->inodes[dir].nr_entries = n;
+    t->inodes[dir].nr_blocks = idiv_ceil(n, LOLELFFS_FILES_PER_BLOCK);
+    t->nr_entries += n;
+
+    if ((uint32_t) n > LOLELFFS_DX_MIN_FILES) {
+        recs = malloc(n * sizeof(*recs));
+        if (!recs)
+            goto end;
+        for (int i = 0; i < n; i++) {
+            recs[i].hash = lolelffs_dx_hash(children[i].name, LOLELFFS_FILENAME_LEN);
+            recs[i].value = i;
+        }
+        t->inodes[dir].nr_dx_leaves = dx_plan(recs, n, NULL);
+    }
+
+    t->inodes[dir].ei_block = t->nr_blocks;
+    t->nr_blocks += 1 + t->inodes[dir].nr_blocks;
+    if (t->inodes[dir].nr_dx_leaves)
+        t->nr_blocks += 1 + t->inodes[dir].nr_dx_leaves;
+
+    for (int i = 0; i < n; i++) {
+        struct tree_child *c = &children[i];
+        struct tree_entry *e = &t->entries[t->inodes[dir].first_entry + i];
+        struct tree_link *link = NULL, key = {c->st.st_dev, c->st.st_ino, 0};
+
+        memset(e->name, 0, sizeof(e->name));
+        memcpy(e->name, c->name, strlen(c->name));
+
+        /* Further names of a hard linked file share its inode */
+        if (S_ISREG(c->st.st_mode) && c->st.st_nlink > 1) {
+            void *found = tfind(&key, &t->links, cmp_links);
+            if (found) {
+                link = *(struct tree_link **) found;
+                e->ino = link->idx;
+                t->inodes[link->idx].nlink++;
+                continue;
+            }
+        }
+
+        int idx = tree_add_inode(t, &c->st);
+        if (idx < 0)
+            goto end;
+        e->ino = idx;
+
+        if (S_ISREG(c->st.st_mode) && c->st.st_nlink > 1) {
+            link = malloc(sizeof(*link));
+            if (!link)
+                goto end;
+            *link = key;
+            link->idx = idx;
+            if (!tsearch(link, &t->links, cmp_links)) {
+                free(link);
+                goto end;
+            }
+        }
+
+        if (S_ISLNK(c->st.st_mode)) {
+            memcpy(t->inodes[idx].target, c->target, sizeof(c->target));
+        } else if (S_ISREG(c->st.st_mode)) {
+            t->inodes[idx].path = join_path(path, c->name);
+            if (!t->inodes[idx].path)
+                goto end;
+            if (c->st.st_size <= (off_t) LOLELFFS_TAIL_MAX_SIZE) {
+                if (tree_is_tail(&t->inodes[idx]))
+                    tree_add_tail(t, idx);
+                continue;
+            }
+            t->inodes[idx].nr_blocks =
+                (c->st.st_size + LOLELFFS_BLOCK_SIZE - 1) / LOLELFFS_BLOCK_SIZE;
+            t->inodes[idx].ei_block = t->nr_blocks;
+            t->nr_blocks += 1 + t->inodes[idx].nr_blocks;
+        } else {
+            char *child = join_path(path, c->name);
+            if (!child)
+                goto end;
+            t->inodes[dir].nlink++;
+            ret = walk_dir(t, idx, child);
+            free(child);
+            if (ret)
+                goto end;
+            ret = -1;
+        }
+    }
+    ret = 0;
+
+end:
+    for (int i = 0; i < n; i++)
+        free(children[i].name);
+    free(children);
+    free(recs);
+    return ret;
+}
+
+/* Buffered writer for a run of consecutive blocks */
+struct seq_writer {
+    int fd;
+    char *buf;
+    size_t len;
+    uint64_t off; /* Image offset of buf[0] */
+};
+
+static int pwrite_all(int fd, const char *buf, size_t len, uint64_t off)
+{
+    while (len) {
+        ssize_t ret = pwrite(fd, buf, len, off);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += ret;
+        len -= ret;
+        off += ret;
+    }
+    return 0;
+}
+
+static int seq_flush(struct seq_writer *w)
+{
+    if (pwrite_all(w->fd, w->buf, w->len, w->off))
+        return -1;
+    w->off += w->len;
+    w->len = 0;
+    return 0;
+}
+
+/* Append len bytes of data, or of zeroes if data is NULL */
+static int seq_write(struct seq_writer *w, const void *data, uint64_t len)
+{
+    while (len) {
+        if (w->len == MKFS_WRITE_BUF_SIZE && seq_flush(w))
+            return -1;
+        size_t n = MKFS_WRITE_BUF_SIZE - w->len;
+        if (n > len)
+            n = len;
+        if (data) {
+            memcpy(w->buf + w->len, data, n);
+            data = (const char *) data + n;
+        } else {
+            memset(w->buf + w->len, 0, n);
+        }
+        w->len += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Append the first size bytes of the file at path, padded to whole blocks */
+static int seq_copy_file(struct seq_writer *w, const char *path, uint64_t size)
+{
+    uint64_t left = size;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    /* Read straight into the write buffer */
+    while (left) {
+        if (w->len == MKFS_WRITE_BUF_SIZE && seq_flush(w))
+            goto err;
+        size_t n = MKFS_WRITE_BUF_SIZE - w->len;
+        if (n > left)
+            n = left;
+        ssize_t ret = read(fd, w->buf + w->len, n);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "%s: %s\n", path, strerror(errno));
+            goto err;
+        }
+        if (!ret) {
+            fprintf(stderr, "Warning: %s shrank while copying, zero filled\n",
+                    path);
+            break;
+        }
+        w->len += ret;
+        left -= ret;
+    }
+    close(fd);
+
+    uint64_t padded = (uint64_t) idiv_ceil(size, LOLELFFS_BLOCK_SIZE) *
+                      LOLELFFS_BLOCK_SIZE;
+    return seq_write(w, NULL, padded - (size - left));
+
+err:
+    close(fd);
+    return -1;
+}
+
+/* Read the size bytes of the small file at path into buf */
+static int read_small_file(const char *path, char *buf, uint32_t size)
+{
+    uint32_t done = 0;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    while (done < size) {
+        ssize_t ret = read(fd, buf + done, size - done);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "%s: %s\n", path, strerror(errno));
+            close(fd);
+            return -1;
+        }
+        if (!ret) {
+            fprintf(stderr, "Warning: %s shrank while copying, zero filled\n",
+                    path);
+            memset(buf + done, 0, size - done);
+            break;
+        }
+        done += ret;
+    }
+    close(fd);
+    return 0;
+}
+
+/* Write the tail block opened by file first, with the files packed into it */
+static int write_tail_block(struct seq_writer *w, struct tree *t, uint32_t first)
+{
+    char block[LOLELFFS_BLOCK_SIZE] = {0};
+    struct lolelffs_tail_header *th = (struct lolelffs_tail_header *) block;
+    uint32_t nr_tails = 0, used = sizeof(*th);
+
+    for (uint32_t i = first; i <= t->inodes[first].tail_last; i++) {
+        struct tree_inode *ti = &t->inodes[i];
+        if (!tree_is_tail(ti) || ti->ei_block != t->inodes[first].ei_block)
+            continue;
+        if (read_small_file(ti->path, block + ti->tail_offset, ti->st.st_size))
+            return -1;
+        nr_tails++;
+        used = ti->tail_offset + ti->st.st_size;
+    }
+    th->th_magic = htole32(LOLELFFS_TAIL_MAGIC);
+    th->th_nr_tails = htole32(nr_tails);
+    th->th_used = htole32(used);
+
+    return seq_write(w, block, LOLELFFS_BLOCK_SIZE);
+}
+
+/*
+ * Map nr_blocks logical blocks to the physical blocks from start, in extents
+ * of up to max_len blocks.
+ */
+static int fill_extents(struct lolelffs_file_ei_block *ei,
+                        uint32_t start,
+                        uint32_t nr_blocks,
+                        uint32_t max_len)
+{
+    uint32_t i, done = 0;
+
+    for (i = 0; done < nr_blocks; i++) {
+        if (i == LOLELFFS_MAX_EXTENTS)
+            return -1;
+        uint32_t len = nr_blocks - done < max_len ? nr_blocks - done : max_len;
+        ei->extents[i].ee_block = htole32(done);
+        ei->extents[i].ee_len = htole32(len);
+        ei->extents[i].ee_start = htole32(start + done);
+        done += len;
+    }
+    return 0;
+}
+
+static int write_dir_blocks(struct seq_writer *w,
+                            struct tree *t,
+                            struct tree_inode *ti)
+{
+    char block[LOLELFFS_BLOCK_SIZE];
+    struct lolelffs_file *files = (struct lolelffs_file *) block;
+
+    for (uint32_t b = 0; b < ti->nr_blocks; b++) {
+        memset(block, 0, sizeof(block));
+        for (uint32_t s = 0; s < LOLELFFS_FILES_PER_BLOCK; s++) {
+            uint32_t slot = b * LOLELFFS_FILES_PER_BLOCK + s;
+            if (slot == ti->nr_entries)
+                break;
+            struct tree_entry *e = &t->entries[ti->first_entry + slot];
+            files[s].inode = htole32(e->ino);
+            memcpy(files[s].filename, e->name, LOLELFFS_FILENAME_LEN);
+        }
+        if (seq_write(w, block, LOLELFFS_BLOCK_SIZE))
+            return -1;
+    }
+    return 0;
+}
+
+/* Write the index root at dx_block with its leaves right after it */
+static int write_dx_blocks(struct seq_writer *w,
+                           struct tree *t,
+                           struct tree_inode *ti,
+                           uint32_t dx_block)
+{
+    uint32_t starts[LOLELFFS_DX_ROOT_ENTRIES];
+    struct lolelffs_dx_entry *recs;
+    struct lolelffs_dx_root *root;
+    struct lolelffs_dx_leaf *leaf;
+    uint32_t n = ti->nr_entries, l;
+    int ret = -1;
+
+    recs = malloc(n * sizeof(*recs));
+    root = calloc(1, sizeof(*root));
+    leaf = malloc(sizeof(*leaf));
+    if (!recs || !root || !leaf)
+        goto end;
+
+    for (uint32_t s = 0; s < n; s++) {
+        recs[s].hash = lolelffs_dx_hash(t->entries[ti->first_entry + s].name,
+                                        LOLELFFS_FILENAME_LEN);
+        recs[s].value = s;
+    }
+    if (dx_plan(recs, n, starts) != ti->nr_dx_leaves)
+        goto end;
+
+    root->magic = htole32(LOLELFFS_DX_MAGIC);
+    root->nr_entries = htole32(ti->nr_dx_leaves);
+    root->nr_records = htole32(n);
+    for (l = 0; l < ti->nr_dx_leaves; l++) {
+        root->entries[l].hash = htole32(l ? recs[starts[l]].hash : 0);
+        root->entries[l].value = htole32(dx_block + 1 + l);
+    }
+    if (seq_write(w, root, sizeof(*root)))
+        goto end;
+
+    for (l = 0; l < ti->nr_dx_leaves; l++) {
+        uint32_t end = l + 1 < ti->nr_dx_leaves ? starts[l + 1] : n;
+        memset(leaf, 0, sizeof(*leaf));
+        leaf->nr_entries = htole32(end - starts[l]);
+        for (uint32_t r = starts[l]; r < end; r++) {
+            leaf->entries[r - starts[l]].hash = htole32(recs[r].hash);
+            leaf->entries[r - starts[l]].value = htole32(recs[r].value);
+        }
+        if (seq_write(w, leaf, sizeof(*leaf)))
+            goto end;
+    }
+    ret = 0;
+
+end:
+    free(leaf);
+    free(root);
+    free(recs);
+    return ret;
+}
+
+/*
+ * Write the data area laid out by walk_dir(), starting at block data_start,
+ * and fill the inode store istore to match.
+ */
+static int write_tree(int fd, struct tree *t, uint32_t data_start, char *istore)
+{
+    struct seq_writer w = {.fd = fd, .off = (uint64_t) data_start * LOLELFFS_BLOCK_SIZE};
+    struct lolelffs_file_ei_block *ei = malloc(LOLELFFS_BLOCK_SIZE);
+    int ret = -1;
+
+    w.buf = malloc(MKFS_WRITE_BUF_SIZE);
+    if (!w.buf || !ei)
+        goto end;
+
+    for (uint32_t i = 0; i < t->nr_inodes; i++) {
+        struct tree_inode *ti = &t->inodes[i];
+        struct lolelffs_inode *inode =
+            (struct lolelffs_inode *) (istore + (size_t) (i / LOLELFFS_INODES_PER_BLOCK) *
+                                                    LOLELFFS_BLOCK_SIZE) +
+            i % LOLELFFS_INODES_PER_BLOCK;
+        uint32_t ei_block = data_start + ti->ei_block;
+
+        inode->i_mode = htole32(ti->st.st_mode);
+        inode->i_uid = htole32(ti->st.st_uid);
+        inode->i_gid = htole32(ti->st.st_gid);
+        inode->i_ctime = htole32(ti->st.st_ctime);
+        inode->i_atime = htole32(ti->st.st_atime);
+        inode->i_mtime = htole32(ti->st.st_mtime);
+        inode->i_nlink = htole32(ti->nlink);
+
+        if (S_ISLNK(ti->st.st_mode)) {
+            inode->i_size = htole32(strlen(ti->target));
+            memcpy(inode->i_data, ti->target, sizeof(inode->i_data));
+            continue;
+        }
+
+        /* Inline files: ei_block and i_blocks stay 0 */
+        if (S_ISREG(ti->st.st_mode) &&
+            ti->st.st_size <= (off_t) LOLELFFS_TAIL_MAX_SIZE) {
+            inode->i_size = htole32(ti->st.st_size);
+            if (!tree_is_tail(ti)) {
+                if (read_small_file(ti->path, inode->i_data, ti->st.st_size))
+                    goto end;
+                continue;
+            }
+
+            struct lolelffs_tail_ref ref = {
+                .tr_block = htole32(ei_block),
+                .tr_offset = htole32(ti->tail_offset),
+            };
+            memcpy(inode->i_data, &ref, sizeof(ref));
+            if (!ti->tail_last)
+                continue;
+            if (w.off + w.len != (uint64_t) ei_block * LOLELFFS_BLOCK_SIZE) {
+                fprintf(stderr, "Layout mismatch at inode %u\n", i);
+                goto end;
+            }
+            if (write_tail_block(&w, t, i))
+                goto end;
+            continue;
+        }
+
+        inode->i_blocks = htole32(1 + ti->nr_blocks);
+        inode->ei_block = htole32(ei_block);
+        if (w.off + w.len != (uint64_t) ei_block * LOLELFFS_BLOCK_SIZE) {
+            fprintf(stderr, "Layout mismatch at inode %u\n", i);
+            goto end;
+        }
+
+        memset(ei, 0, LOLELFFS_BLOCK_SIZE);
+        if (S_ISDIR(ti->st.st_mode)) {
+            uint32_t dx_block = ei_block + 1 + ti->nr_blocks;
+
+            inode->i_size = htole32(LOLELFFS_BLOCK_SIZE);
+            ei->nr_files = htole32(ti->nr_entries);
+            if (ti->nr_dx_leaves)
+                ei->dx_block = htole32(dx_block);
+            if (fill_extents(ei, ei_block + 1, ti->nr_blocks,
+                             LOLELFFS_MAX_BLOCKS_PER_EXTENT) ||
+                seq_write(&w, ei, LOLELFFS_BLOCK_SIZE) ||
+                write_dir_blocks(&w, t, ti) ||
+                (ti->nr_dx_leaves && write_dx_blocks(&w, t, ti, dx_block)))
+                goto end;
+        } else {
+            inode->i_size = htole32(ti->st.st_size);
+            if (fill_extents(ei, ei_block + 1, ti->nr_blocks,
+                             LOLELFFS_MAX_BLOCKS_PER_EXTENT_LARGE) ||
+                seq_write(&w, ei, LOLELFFS_BLOCK_SIZE) ||
+                seq_copy_file(&w, ti->path, ti->st.st_size))
+                goto end;
+        }
+    }
+    ret = seq_flush(&w);
+
+end:
+    free(w.buf);
+    free(ei);
+    return ret;
+}
+
+/* Returns nr_bitmap_blocks bitmap blocks with the first nr_used bits cleared */
+static uint8_t *make_bitmap(uint32_t nr_bitmap_blocks, uint32_t nr_used)
+{
+    uint8_t *bitmap = malloc((size_t) nr_bitmap_blocks * LOLELFFS_BLOCK_SIZE);
+    if (!bitmap)
+        return NULL;
+
+    memset(bitmap, 0xff, (size_t) nr_bitmap_blocks * LOLELFFS_BLOCK_SIZE);
+    memset(bitmap, 0, nr_used / 8);
+    if (nr_used % 8)
+        bitmap[nr_used / 8] = (uint8_t) (0xff << (nr_used % 8));
+    return bitmap;
+}
+
+static void free_tree(struct tree *t)
+{
+    for (uint32_t i = 0; i < t->nr_inodes; i++)
+        free(t->inodes[i].path);
+    free(t->inodes);
+    free(t->entries);
+    tdestroy(t->links, free);
+}
+
+/*
+ * Create a filesystem holding the tree at src. The image is used whole if
+ * the tree fits in it, otherwise a regular file image is resized to fit the
+ * tree exactly, with an inode store just large enough.
+ */
+static int mkfs_from_dir(int fd, struct stat *fstats, const char *src)
+{
+    struct seq_writer w = {.fd = fd, .off = LOLELFFS_BLOCK_SIZE};
+    uint8_t *ifree = NULL, *bfree = NULL;
+    struct superblock *sb = NULL;
+    struct tree t = {0};
+    char *istore = NULL;
+    struct stat st;
+    int ret = -1;
+
+    if (stat(src, &st)) {
+        fprintf(stderr, "%s: %s\n", src, strerror(errno));
+        return -1;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        fprintf(stderr, "%s: not a directory\n", src);
+        return -1;
+    }
+    if (tree_add_inode(&t, &st) < 0 || walk_dir(&t, 0, src))
+        goto end;
+    if (t.nr_blocks > UINT32_MAX) {
+        fprintf(stderr, "%s: too large for lolelffs\n", src);
+        goto end;
+    }
+    printf("Source: %s (%u inodes, %lu data blocks)\n", src, t.nr_inodes,
+           (unsigned long) t.nr_blocks);
+
+    uint32_t nr_data = t.nr_blocks;
+    uint32_t nr_blocks = fstats->st_size / LOLELFFS_BLOCK_SIZE;
+    uint32_t nr_inodes = round_inodes(nr_blocks);
+    if (nr_blocks <= MKFS_MIN_BLOCKS || t.nr_inodes > nr_inodes ||
+        (uint64_t) nr_meta_blocks(nr_blocks, nr_inodes) + nr_data > nr_blocks) {
+        uint64_t needed = nr_data;
+
+        nr_inodes = round_inodes(t.nr_inodes);
+        while (needed <= UINT32_MAX &&
+               nr_meta_blocks(needed, nr_inodes) + nr_data > needed)
+            needed = (uint64_t) nr_meta_blocks(needed, nr_inodes) + nr_data;
+        if (needed <= MKFS_MIN_BLOCKS)
+            needed = MKFS_MIN_BLOCKS + 1;
+        if (needed > UINT32_MAX || !S_ISREG(fstats->st_mode)) {
+            fprintf(stderr, "Image too small for %s (%lu blocks needed)\n",
+                    src, (unsigned long) needed);
+            goto end;
+        }
+        nr_blocks = needed;
+        if (ftruncate(fd, (off_t) nr_blocks * LOLELFFS_BLOCK_SIZE)) {
+            perror("ftruncate():");
+            goto end;
+        }
+        fstats->st_size = (off_t) nr_blocks * LOLELFFS_BLOCK_SIZE;
+        printf("Image resized to %u blocks to fit the source tree\n", nr_blocks);
+    }
+
+    sb = malloc(sizeof(struct superblock));
+    if (!sb)
+        goto end;
+    init_superblock(sb, nr_blocks, nr_inodes, t.nr_inodes, nr_data);
+    if (t.tail_used)
+        sb->info.tail_block = htole32(nr_meta_blocks(nr_blocks, nr_inodes) +
+                                      t.tail_block);
+    uint32_t nr_istore_blocks = le32toh(sb->info.nr_istore_blocks);
+    uint32_t nr_ifree_blocks = le32toh(sb->info.nr_ifree_blocks);
+    uint32_t nr_bfree_blocks = le32toh(sb->info.nr_bfree_blocks);
+    uint32_t data_start = nr_meta_blocks(nr_blocks, nr_inodes);
+    uint32_t nr_used_istore = idiv_ceil(t.nr_inodes, LOLELFFS_INODES_PER_BLOCK);
+
+    istore = calloc(nr_used_istore, LOLELFFS_BLOCK_SIZE);
+    ifree = make_bitmap(nr_ifree_blocks, t.nr_inodes);
+    bfree = make_bitmap(nr_bfree_blocks, data_start + nr_data);
+    w.buf = malloc(MKFS_WRITE_BUF_SIZE);
+    if (!istore || !ifree || !bfree || !w.buf)
+        goto end;
+
+    if (write_tree(fd, &t, data_start, istore)) {
+        perror("write_tree():");
+        goto end;
+    }
+    printf("Data blocks: wrote %u blocks from block %u\n", nr_data, data_start);
+
+    /* Inode store and bitmaps follow each other, the superblock goes last */
+    if (seq_write(&w, istore, (uint64_t) nr_used_istore * LOLELFFS_BLOCK_SIZE) ||
+        seq_write(&w, NULL, (uint64_t) (nr_istore_blocks - nr_used_istore) *
+                                LOLELFFS_BLOCK_SIZE) ||
+        seq_write(&w, ifree, (uint64_t) nr_ifree_blocks * LOLELFFS_BLOCK_SIZE) ||
+        seq_write(&w, bfree, (uint64_t) nr_bfree_blocks * LOLELFFS_BLOCK_SIZE) ||
+        seq_flush(&w)) {
+        perror("write metadata:");
+        goto end;
+    }
+    printf("Inode store: wrote %u blocks\n", nr_istore_blocks);
+    printf("Ifree blocks: wrote %u blocks\n", nr_ifree_blocks);
+    printf("Bfree blocks: wrote %u blocks\n", nr_bfree_blocks);
+
+    if (pwrite_all(fd, (const char *) sb, sizeof(struct superblock), 0)) {
+        perror("write_superblock():");
+        goto end;
+    }
+    print_superblock(sb);
+    ret = 0;
+
+end:
+    free(w.buf);
+    free(bfree);
+    free(ifree);
+    free(istore);
+    free(sb);
+    free_tree(&t);
+    return ret;
+}
+
 /* Check if file is an ELF binary and print info */
 static int check_elf_file(int fd)
 {
@@ -357,15 +1281,41 @@ static int check_elf_file(int fd)
     return 0;
 }
 
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-d|--from-dir DIR] disk\n", prog);
+    fprintf(stderr, "  -d, --from-dir DIR  Populate the filesystem with the tree at DIR,\n"
+                    "                      creating or growing a disk image to fit it\n");
+}
+
 int main(int argc, char **argv)
 {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s disk\n", argv[0]);
+    static const struct option options[] = {
+        {"from-dir", required_argument, NULL, 'd'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0},
+    };
+    const char *from_dir = NULL;
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "d:h", options, NULL)) != -1) {
+        switch (opt) {
+        case 'd':
+            from_dir = optarg;
+            break;
+        case 'h':
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    if (optind != argc - 1) {
+        usage(argv[0]);
         return EXIT_FAILURE;
     }
 
-    /* Open disk image */
-    int fd = open(argv[1], O_RDWR);
+    /* Open disk image, a new one can only be sized from a source tree */
+    int fd = open(argv[optind], from_dir ? O_RDWR | O_CREAT : O_RDWR, 0644);
     if (fd == -1) {
         perror("open():");
         return EXIT_FAILURE;
@@ -399,8 +1349,16 @@ int main(int argc, char **argv)
         stat_buf.st_size = blk_size;
     }
 
+    if (from_dir) {
+        ret = mkfs_from_dir(fd, &stat_buf, from_dir) ? EXIT_FAILURE : 0;
+        if (!ret)
+            printf("\nFilesystem created successfully!\n"
+                   "Total size: %ld bytes\n", stat_buf.st_size);
+        goto close_fd;
+    }
+
     /* Check if image is large enough */
-    long int min_size = 100 * LOLELFFS_BLOCK_SIZE;
+    long int min_size = MKFS_MIN_BLOCKS * LOLELFFS_BLOCK_SIZE;
     if (stat_buf.st_size <= min_size) {
         fprintf(stderr, "File is not large enough (size=%ld, min size=%ld)\n",
                 stat_buf.st_size, min_size);
@@ -11,6 +11,7 @@
 
 #include "elf.h"
 #include "lolelffs.h"
+#include "encrypt.h"
 
 static struct kmem_cache *lolelffs_inode_cache;
 
@@ -35,6 +36,21 @@ static struct inode *lolelffs_alloc_inode(struct super_block *sb)
     if (!ci)
         return NULL;
 
+    memset(ci->i_data, 0, sizeof(ci->i_data));
+    ci->ext_map = NULL;
+    ci->ext_map_gen = 0;
+    ci->cached_extent_idx = 0;
+    ci->cached_extent_count = 0;
+    ci->cache_valid = 0;
+    spin_lock_init(&ci->ext_lock);
+    mutex_init(&ci->alloc_lock);
+    ci->da_end = 0;
+    ci->da_reserved = 0;
+    init_rwsem(&ci->xattr_sem);
+    ci->xattr_data = NULL;
+    ci->xattr_size = 0;
+    ci->xattr_cached = false;
+
     inode_init_once(&ci->vfs_inode);
     return &ci->vfs_inode;
 }
@@ -42,6 +58,10 @@ static struct inode *lolelffs_alloc_inode(struct super_block *sb)
 static void lolelffs_destroy_inode(struct inode *inode)
 {
     struct lolelffs_inode_info *ci = LOLELFFS_INODE(inode);
+
+    lolelffs_da_release(inode, 0);
+    kfree(ci->ext_map);
+    kfree(ci->xattr_data);
     kmem_cache_free(lolelffs_inode_cache, ci);
 }
 
@@ -79,7 +99,8 @@ int lolelffs_write_inode(struct inode *inode,
     disk_inode->i_nlink = inode->i_nlink;
     disk_inode->ei_block = ci->ei_block;
     disk_inode->xattr_block = ci->xattr_block;
-    strncpy(disk_inode->i_data, ci->i_data, sizeof(ci->i_data));
+    /* Inline data is binary: copy all of it */
+    memcpy(disk_inode->i_data, ci->i_data, sizeof(ci->i_data));
 
     mark_buffer_dirty(bh);
     sync_dirty_buffer(bh);
@@ -92,22 +113,60 @@ static void lolelffs_put_super(struct super_block *sb)
 {
     struct lolelffs_sb_info *sbi = LOLELFFS_SB(sb);
     if (sbi) {
+        lolelffs_unregister_sysfs(sb);
+        lolelffs_enc_key_free(sbi->enc_key);
+        lolelffs_alloc_destroy(sbi);
         kfree(sbi->ifree_bitmap);
         kfree(sbi->bfree_bitmap);
+        bitmap_free(sbi->bitmap_dirty);
+        free_percpu(sbi->stats);
         kfree(sbi);
     }
 }
 
+/*
+ * Write the superblock and the bitmap blocks changed since the last sync,
+ * submitted as one plugged batch. Blocks changed again meanwhile are marked
+ * dirty again and go with the next sync.
+ */
 int lolelffs_sync_fs(struct super_block *sb, int wait)
 {
     struct lolelffs_sb_info *sbi = LOLELFFS_SB(sb);
     struct lolelffs_sb_info *disk_sb;
-    int i;
+    uint32_t nr_bitmaps = sbi->nr_ifree_blocks + sbi->nr_bfree_blocks;
+    struct buffer_head **bhs = NULL;
+    struct buffer_head *bh;
+    unsigned long *flush;
+    struct blk_plug plug;
+    uint32_t i, j, nr_bhs = 0;
+    int ret = 0;
+
+    flush = bitmap_zalloc(nr_bitmaps, GFP_NOFS);
+    if (!flush)
+        return -ENOMEM;
+    for_each_set_bit (i, sbi->bitmap_dirty, nr_bitmaps) {
+        if (test_and_clear_bit(i, sbi->bitmap_dirty))
+            __set_bit(i, flush);
+    }
+
+    /* Keep the buffers until their write completes */
+    if (wait) {
+        bhs = kmalloc_array(bitmap_weight(flush, nr_bitmaps) + 1, sizeof(*bhs),
+                            GFP_NOFS);
+        if (!bhs) {
+            ret = -ENOMEM;
+            goto redirty;
+        }
+    }
+
+    blk_start_plug(&plug);
 
     /* Flush superblock */
-    struct buffer_head *bh = LOLELFFS_SB_BREAD(sb, 0);
-    if (!bh)
-        return -EIO;
+    bh = LOLELFFS_SB_BREAD(sb, 0);
+    if (!bh) {
+        ret = -EIO;
+        goto unplug;
+    }
 
     disk_sb = (struct lolelffs_sb_info *) bh->b_data;
 
@@ -117,48 +176,79 @@ int lolelffs_sync_fs(struct super_block *sb, int wait)
     disk_sb->nr_ifree_blocks = sbi->nr_ifree_blocks;
     disk_sb->nr_bfree_blocks = sbi->nr_bfree_blocks;
     disk_sb->nr_free_inodes = sbi->nr_free_inodes;
-    disk_sb->nr_free_blocks = sbi->nr_free_blocks;
+    disk_sb->nr_free_blocks = lolelffs_nr_free_blocks(sbi);
+    disk_sb->tail_block = READ_ONCE(sbi->tail_block);
 
     mark_buffer_dirty(bh);
-    if (wait)
-        sync_dirty_buffer(bh);
-    brelse(bh);
-
-    /* Flush free inodes bitmask */
-    for (i = 0; i < sbi->nr_ifree_blocks; i++) {
-        int idx = sbi->nr_istore_blocks + i + 1;
+    if (wait) {
+        write_dirty_buffer(bh, 0);
+        bhs[nr_bhs++] = bh;
+    } else {
+        brelse(bh);
+    }
 
-        bh = LOLELFFS_SB_BREAD(sb, idx);
-        if (!bh)
-            return -EIO;
+    /*
+     * Flush the dirty blocks of the free inodes and free blocks bitmasks,
+     * which follow each other on disk after the inode store.
+     */
+    for_each_set_bit (i, flush, nr_bitmaps) {
+        bh = LOLELFFS_SB_BREAD(sb, sbi->nr_istore_blocks + 1 + i);
+        if (!bh) {
+            ret = -EIO;
+            break;
+        }
 
-        memcpy(bh->b_data, (void *) sbi->ifree_bitmap + i * LOLELFFS_BLOCK_SIZE,
-               LOLELFFS_BLOCK_SIZE);
+        lolelffs_sb_lock(sbi);
+        if (i < sbi->nr_ifree_blocks) {
+            memcpy(bh->b_data,
+                   (void *) sbi->ifree_bitmap + i * LOLELFFS_BLOCK_SIZE,
+                   LOLELFFS_BLOCK_SIZE);
+        } else {
+            j = i - sbi->nr_ifree_blocks;
+            memcpy(bh->b_data,
+                   (void *) sbi->bfree_bitmap + j * LOLELFFS_BLOCK_SIZE,
+                   LOLELFFS_BLOCK_SIZE);
+            /* Blocks held by the allocation windows are free on disk */
+            lolelffs_alloc_fill_bitmap(sbi, bh->b_data,
+                                       j * LOLELFFS_BLOCK_SIZE * 8,
+                                       LOLELFFS_BLOCK_SIZE * 8);
+        }
+        mutex_unlock(&sbi->lock);
 
         mark_buffer_dirty(bh);
-        if (wait)
-            sync_dirty_buffer(bh);
-        brelse(bh);
+        __clear_bit(i, flush);
+        if (wait) {
+            write_dirty_buffer(bh, 0);
+            bhs[nr_bhs++] = bh;
+        } else {
+            brelse(bh);
+        }
     }
 
-    /* Flush free blocks bitmask */
-    for (i = 0; i < sbi->nr_bfree_blocks; i++) {
-        int idx = sbi->nr_istore_blocks + sbi->nr_ifree_blocks + i + 1;
-
-        bh = LOLELFFS_SB_BREAD(sb, idx);
-        if (!bh)
-            return -EIO;
+unplug:
+    blk_finish_plug(&plug);
 
-        memcpy(bh->b_data, (void *) sbi->bfree_bitmap + i * LOLELFFS_BLOCK_SIZE,
-               LOLELFFS_BLOCK_SIZE);
-
-        mark_buffer_dirty(bh);
-        if (wait)
-            sync_dirty_buffer(bh);
-        brelse(bh);
+    for (j = 0; j < nr_bhs; j++) {
+        wait_on_buffer(bhs[j]);
+        if (!buffer_uptodate(bhs[j])) {
+            ret = -EIO;
+            /* Retry the bitmap block with the next sync */
+            if (j)
+                set_bit(bhs[j]->b_blocknr - sbi->fs_offset -
+                            sbi->nr_istore_blocks - 1,
+                        sbi->bitmap_dirty);
+        }
+        brelse(bhs[j]);
     }
+    kfree(bhs);
 
-    return 0;
+redirty:
+    /* Blocks left unwritten go with the next sync */
+    for_each_set_bit (i, flush, nr_bitmaps)
+        set_bit(i, sbi->bitmap_dirty);
+    bitmap_free(flush);
+
+    return ret;
 }
 
 static int lolelffs_statfs(struct dentry *dentry, struct kstatfs *stat)
@@ -169,8 +259,8 @@ static int lolelffs_statfs(struct dentry *dentry, struct kstatfs *stat)
     stat->f_type = LOLELFFS_MAGIC;
     stat->f_bsize = LOLELFFS_BLOCK_SIZE;
     stat->f_blocks = sbi->nr_blocks;
-    stat->f_bfree = sbi->nr_free_blocks;
-    stat->f_bavail = sbi->nr_free_blocks;
+    stat->f_bfree = lolelffs_nr_free_blocks(sbi) - sbi->nr_reserved_blocks;
+    stat->f_bavail = lolelffs_nr_free_blocks(sbi) - sbi->nr_reserved_blocks;
     stat->f_files = sbi->nr_inodes - sbi->nr_free_inodes;
     stat->f_ffree = sbi->nr_free_inodes;
     stat->f_namelen = LOLELFFS_FILENAME_LEN;
@@ -187,15 +277,198 @@ static struct super_operations lolelffs_super_ops = {
     .statfs = lolelffs_statfs,
 };
 
+/* Most blocks of the startup range read ahead at mount (64 MiB) */
+#define LOLELFFS_HOT_MAX_BLOCKS 16384
+
+/*
+ * Start reading the blocks that `lolelffs relayout` packed in the order the
+ * image is read at startup, so that they are cached by the time files are
+ * opened. This is only a hint: the reads are not waited for, and a range out
+ * of the data area is ignored.
+ */
+static void lolelffs_prefetch_hot(struct super_block *sb,
+                                  uint32_t start,
+                                  uint32_t len)
+{
+    struct lolelffs_sb_info *sbi = LOLELFFS_SB(sb);
+    uint32_t data_start = 1 + sbi->nr_istore_blocks + sbi->nr_ifree_blocks +
+                          sbi->nr_bfree_blocks;
+    struct blk_plug plug;
+    uint32_t i;
+
+    if (!len || start < data_start || start >= sbi->nr_blocks)
+        return;
+    len = min3(len, sbi->nr_blocks - start, (uint32_t) LOLELFFS_HOT_MAX_BLOCKS);
+
+    blk_start_plug(&plug);
+    for (i = 0; i < len; i++)
+        sb_breadahead(sb, sbi->fs_offset + start + i);
+    blk_finish_plug(&plug);
+
+    pr_debug("prefetching blocks %u-%u\n", start, start + len - 1);
+}
+
+/* Images whose ELF section offset is remembered, most recent first */
+#define LOLELFFS_OFFSET_CACHE_SIZE 8
+
+/*
+ * ELF section offsets of the devices mounted last, so that mounting the
+ * same image again does not parse its ELF headers. An offset is only used
+ * if the block it points to still holds a superblock.
+ */
+static struct {
+    dev_t dev;
+    loff_t offset;
+} lolelffs_offset_cache[LOLELFFS_OFFSET_CACHE_SIZE];
+static DEFINE_SPINLOCK(lolelffs_offset_lock);
+
+static loff_t lolelffs_offset_lookup(dev_t dev)
+{
+    loff_t offset = 0;
+    int i;
+
+    spin_lock(&lolelffs_offset_lock);
+    for (i = 0; i < LOLELFFS_OFFSET_CACHE_SIZE; i++) {
+        if (lolelffs_offset_cache[i].offset && lolelffs_offset_cache[i].dev == dev) {
+            offset = lolelffs_offset_cache[i].offset;
+            break;
+        }
+    }
+    spin_unlock(&lolelffs_offset_lock);
+
+    return offset;
+}
+
+static void lolelffs_offset_remember(dev_t dev, loff_t offset)
+{
+    int i;
+
+    spin_lock(&lolelffs_offset_lock);
+    for (i = 0; i < LOLELFFS_OFFSET_CACHE_SIZE - 1; i++) {
+        if (lolelffs_offset_cache[i].dev == dev)
+            break;
+    }
+    memmove(&lolelffs_offset_cache[1], &lolelffs_offset_cache[0],
+            i * sizeof(lolelffs_offset_cache[0]));
+    lolelffs_offset_cache[0].dev = dev;
+    lolelffs_offset_cache[0].offset = offset;
+    spin_unlock(&lolelffs_offset_lock);
+}
+
+/* Whether the block at byte offset holds a lolelffs superblock */
+static bool lolelffs_sb_at(struct super_block *sb, loff_t offset)
+{
+    struct buffer_head *bh;
+    bool found;
+
+    bh = sb_bread(sb, LOLELFFS_SB_BLOCK_NR + offset / LOLELFFS_BLOCK_SIZE);
+    if (!bh)
+        return false;
+    found = ((struct lolelffs_sb_info *) bh->b_data)->magic == LOLELFFS_MAGIC;
+    brelse(bh);
+
+    return found;
+}
+
+/*
+ * Return the byte offset of the filesystem in the device: 0 for a raw
+ * image, or that of the .lolfs.super section of an ELF binary. Raw images
+ * and images mounted before are recognized without opening the backing
+ * file to parse ELF headers.
+ */
+static loff_t lolelffs_find_offset(struct super_block *sb)
+{
+    struct file *bdev_file;
+    loff_t fs_offset;
+    dev_t dev;
+
+    if (!sb->s_bdev || lolelffs_sb_at(sb, 0)) {
+        pr_info("Using raw filesystem (offset 0)\n");
+        return 0;
+    }
+
+    dev = sb->s_bdev->bd_dev;
+    fs_offset = lolelffs_offset_lookup(dev);
+    if (fs_offset > 0 && lolelffs_sb_at(sb, fs_offset)) {
+        pr_info("Detected ELF binary, filesystem at offset 0x%llx (cached)\n",
+                fs_offset);
+        return fs_offset;
+    }
+
+    /* Use bdev_file_open_by_dev to access the underlying file for loop devices */
+    bdev_file = bdev_file_open_by_dev(dev, BLK_OPEN_READ, NULL, NULL);
+    if (IS_ERR(bdev_file)) {
+        pr_info("Using raw filesystem (offset 0)\n");
+        return 0;
+    }
+    fs_offset = find_lolelffs_section(bdev_file);
+    fput(bdev_file);
+
+    if (fs_offset <= 0) {
+        pr_info("Using raw filesystem (offset 0)\n");
+        return 0;
+    }
+    pr_info("Detected ELF binary, filesystem at offset 0x%llx\n", fs_offset);
+    lolelffs_offset_remember(dev, fs_offset);
+
+    return fs_offset;
+}
+
+/*
+ * Read the free inodes bitmap the first time an inode is allocated or
+ * freed. The caller holds sbi->lock.
+ */
+int lolelffs_load_inode_bitmap(struct lolelffs_sb_info *sbi)
+{
+    struct buffer_head *bh;
+    uint32_t i;
+
+    if (sbi->ifree_loaded)
+        return 0;
+
+    for (i = 0; i < sbi->nr_ifree_blocks; i++) {
+        bh = LOLELFFS_SB_BREAD(sbi->sb, sbi->nr_istore_blocks + i + 1);
+        if (!bh) {
+            pr_err("failed to read the free inodes bitmap\n");
+            return -EIO;
+        }
+        memcpy((void *) sbi->ifree_bitmap + i * LOLELFFS_BLOCK_SIZE, bh->b_data,
+               LOLELFFS_BLOCK_SIZE);
+        brelse(bh);
+    }
+    sbi->ifree_loaded = true;
+
+    return 0;
+}
+
+/*
+ * Start reading the bitmap blocks in one batch, without waiting, so that
+ * the allocator finds them cached when it first needs them.
+ */
+static void lolelffs_readahead_bitmaps(struct super_block *sb)
+{
+    struct lolelffs_sb_info *sbi = LOLELFFS_SB(sb);
+    uint32_t first = 1 + sbi->nr_istore_blocks;
+    uint32_t nr = sbi->nr_ifree_blocks + sbi->nr_bfree_blocks;
+    struct blk_plug plug;
+    uint32_t i;
+
+    blk_start_plug(&plug);
+    for (i = 0; i < nr; i++)
+        sb_breadahead(sb, sbi->fs_offset + first + i);
+    blk_finish_plug(&plug);
+}
+
 /* Fill the struct superblock from partition superblock */
 int lolelffs_fill_super(struct super_block *sb, void *data, int silent)
 {
     struct buffer_head *bh = NULL;
     struct lolelffs_sb_info *csb = NULL;
     struct lolelffs_sb_info *sbi = NULL;
+    uint32_t hot_start, hot_len;
     struct inode *root_inode = NULL;
-    loff_t fs_offset = 0;
-    int ret = 0, i;
+    loff_t fs_offset;
+    int ret = 0;
 
     /* Init sb */
     sb->s_magic = LOLELFFS_MAGIC;
@@ -204,31 +477,8 @@ int lolelffs_fill_super(struct super_block *sb, void *data, int silent)
     sb->s_op = &lolelffs_super_ops;
     sb->s_xattr = lolelffs_xattr_handlers;
 
-    /* Try to detect ELF file and find .lolfs.super section */
-    /* Use bdev_file_open_by_dev to access the underlying file for loop devices */
-    if (sb->s_bdev) {
-        struct file *bdev_file;
-        dev_t dev = sb->s_bdev->bd_dev;
-
-        bdev_file = bdev_file_open_by_dev(dev, BLK_OPEN_READ, NULL, NULL);
-        if (!IS_ERR(bdev_file)) {
-            /* Try to read ELF headers from the file */
-            fs_offset = find_lolelffs_section(bdev_file);
-            fput(bdev_file);
-
-            if (fs_offset > 0) {
-                pr_info("Detected ELF binary, filesystem at offset 0x%llx\n", fs_offset);
-            } else {
-                pr_info("Using raw filesystem (offset 0)\n");
-            }
-        } else {
-            pr_info("Using raw filesystem (offset 0)\n");
-        }
-    } else {
-        pr_info("Using raw filesystem (offset 0)\n");
-    }
+    fs_offset = lolelffs_find_offset(sb);
 
-    /* Temporarily store offset before sbi is created */
     /* Read sb from disk - use direct sb_bread here since sbi doesn't exist yet */
     bh = sb_bread(sb, LOLELFFS_SB_BLOCK_NR + (fs_offset / LOLELFFS_BLOCK_SIZE));
     if (!bh)
@@ -249,6 +499,11 @@ int lolelffs_fill_super(struct super_block *sb, void *data, int silent)
         ret = -ENOMEM;
         goto release;
     }
+    sbi->stats = alloc_percpu(struct lolelffs_stats);
+    if (!sbi->stats) {
+        ret = -ENOMEM;
+        goto free_sbi;
+    }
 
     sbi->nr_blocks = csb->nr_blocks;
     sbi->nr_inodes = csb->nr_inodes;
@@ -258,7 +513,18 @@ int lolelffs_fill_super(struct super_block *sb, void *data, int silent)
     sbi->nr_free_inodes = csb->nr_free_inodes;
     sbi->nr_free_blocks = csb->nr_free_blocks;
     sbi->fs_offset = fs_offset / LOLELFFS_BLOCK_SIZE; /* Store as block offset */
+    /*
+     * New blocks of an encrypted filesystem are encrypted on writeback.
+     * Compression stays a userspace-only write feature.
+     */
+    sbi->enc_enabled = csb->enc_enabled;
+    sbi->enc_default_algo = csb->enc_default_algo;
+    sbi->comp_features = csb->comp_features;
+    sbi->tail_block = csb->tail_block;
+    sbi->sb = sb;
     sb->s_fs_info = sbi;
+    hot_start = csb->hot_start;
+    hot_len = csb->hot_len;
 
     /* Initialize mutex for bitmap operations */
     mutex_init(&sbi->lock);
@@ -266,61 +532,52 @@ int lolelffs_fill_super(struct super_block *sb, void *data, int silent)
     /* Initialize encryption state */
     mutex_init(&sbi->enc_lock);
     sbi->enc_unlocked = false;
+    sbi->enc_key = NULL;
     memset(sbi->enc_master_key_decrypted, 0, 32);
 
     brelse(bh);
 
-    /* Alloc and copy ifree_bitmap */
+    /*
+     * The bitmaps are read on first use, see lolelffs_load_inode_bitmap()
+     * and the block allocator. A read-only mount never reads them.
+     */
     sbi->ifree_bitmap =
         kzalloc(sbi->nr_ifree_blocks * LOLELFFS_BLOCK_SIZE, GFP_KERNEL);
     if (!sbi->ifree_bitmap) {
         ret = -ENOMEM;
         goto free_sbi;
     }
-
-    for (i = 0; i < sbi->nr_ifree_blocks; i++) {
-        int idx = sbi->nr_istore_blocks + i + 1;
-
-        bh = LOLELFFS_SB_BREAD(sb, idx);
-        if (!bh) {
-            ret = -EIO;
-            goto free_ifree;
-        }
-
-        memcpy((void *) sbi->ifree_bitmap + i * LOLELFFS_BLOCK_SIZE, bh->b_data,
-               LOLELFFS_BLOCK_SIZE);
-
-        brelse(bh);
-    }
-
-    /* Alloc and copy bfree_bitmap */
     sbi->bfree_bitmap =
         kzalloc(sbi->nr_bfree_blocks * LOLELFFS_BLOCK_SIZE, GFP_KERNEL);
     if (!sbi->bfree_bitmap) {
         ret = -ENOMEM;
         goto free_ifree;
     }
+    if (!sb_rdonly(sb))
+        lolelffs_readahead_bitmaps(sb);
 
-    for (i = 0; i < sbi->nr_bfree_blocks; i++) {
-        int idx = sbi->nr_istore_blocks + sbi->nr_ifree_blocks + i + 1;
+    sbi->bitmap_dirty =
+        bitmap_zalloc(sbi->nr_ifree_blocks + sbi->nr_bfree_blocks, GFP_KERNEL);
+    if (!sbi->bitmap_dirty) {
+        ret = -ENOMEM;
+        goto free_bfree;
+    }
 
-        bh = LOLELFFS_SB_BREAD(sb, idx);
-        if (!bh) {
-            ret = -EIO;
-            goto free_bfree;
-        }
+    ret = lolelffs_alloc_init(sbi);
+    if (ret)
+        goto free_dirty;
 
-        memcpy((void *) sbi->bfree_bitmap + i * LOLELFFS_BLOCK_SIZE, bh->b_data,
-               LOLELFFS_BLOCK_SIZE);
+    ret = lolelffs_register_sysfs(sb);
+    if (ret)
+        goto free_alloc;
 
-        brelse(bh);
-    }
+    lolelffs_prefetch_hot(sb, hot_start, hot_len);
 
     /* Create root inode */
     root_inode = lolelffs_iget(sb, 0);
     if (IS_ERR(root_inode)) {
         ret = PTR_ERR(root_inode);
-        goto free_bfree;
+        goto unregister;
     }
 #if MNT_IDMAP_REQUIRED()
     inode_init_owner(&nop_mnt_idmap, root_inode, NULL, root_inode->i_mode);
@@ -340,11 +597,18 @@ int lolelffs_fill_super(struct super_block *sb, void *data, int silent)
 
 iput:
     iput(root_inode);
+unregister:
+    lolelffs_unregister_sysfs(sb);
+free_alloc:
+    lolelffs_alloc_destroy(sbi);
+free_dirty:
+    bitmap_free(sbi->bitmap_dirty);
 free_bfree:
     kfree(sbi->bfree_bitmap);
 free_ifree:
     kfree(sbi->ifree_bitmap);
 free_sbi:
+    free_percpu(sbi->stats);
     kfree(sbi);
 release:
     brelse(bh);
@@ -0,0 +1,191 @@
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/fs.h>
+#include <linux/kernel.h>
+#include <linux/kobject.h>
+#include <linux/math64.h>
+#include <linux/percpu.h>
+#include <linux/slab.h>
+#include <linux/sysfs.h>
+
+#include "lolelffs.h"
+
+/*
+ * Per-mount statistics, one read-only file per counter in
+ * /sys/fs/lolelffs/<dev>/, plus the ratios derived from them:
+ * - ext_cache_hit_rate: percentage of the extent lookups served by the cache
+ * - alloc_groups_per_search: average groups scanned by an allocator search
+ *
+ * The counters are per-CPU, see lolelffs_stat_add(), and summed on read.
+ * They start from zero at every mount.
+ */
+
+static struct kset *lolelffs_kset;
+
+struct lolelffs_attr {
+    struct attribute attr;
+    ssize_t (*show)(struct lolelffs_sb_info *sbi,
+                    const struct lolelffs_attr *a,
+                    char *buf);
+    enum lolelffs_stat stat;
+};
+
+static u64 lolelffs_stat_sum(struct lolelffs_sb_info *sbi,
+                             enum lolelffs_stat stat)
+{
+    u64 sum = 0;
+    int cpu;
+
+    for_each_possible_cpu (cpu)
+        sum += per_cpu_ptr(sbi->stats, cpu)->count[stat];
+    return sum;
+}
+
+/* num / den with two decimals, 0 when there is nothing to divide */
+static ssize_t lolelffs_show_ratio(char *buf, u64 num, u64 den)
+{
+    u64 hundredths = den ? div64_u64(num * 100, den) : 0;
+
+    return sysfs_emit(buf, "%llu.%02llu\n", hundredths / 100, hundredths % 100);
+}
+
+static ssize_t counter_show(struct lolelffs_sb_info *sbi,
+                            const struct lolelffs_attr *a,
+                            char *buf)
+{
+    return sysfs_emit(buf, "%llu\n", lolelffs_stat_sum(sbi, a->stat));
+}
+
+static ssize_t ext_cache_hit_rate_show(struct lolelffs_sb_info *sbi,
+                                       const struct lolelffs_attr *a,
+                                       char *buf)
+{
+    u64 hits = lolelffs_stat_sum(sbi, LOLELFFS_STAT_EXT_CACHE_HITS);
+    u64 misses = lolelffs_stat_sum(sbi, LOLELFFS_STAT_EXT_CACHE_MISSES);
+
+    return lolelffs_show_ratio(buf, hits * 100, hits + misses);
+}
+
+static ssize_t alloc_groups_per_search_show(struct lolelffs_sb_info *sbi,
+                                            const struct lolelffs_attr *a,
+                                            char *buf)
+{
+    return lolelffs_show_ratio(buf,
+                               lolelffs_stat_sum(sbi, LOLELFFS_STAT_ALLOC_GROUPS),
+                               lolelffs_stat_sum(sbi, LOLELFFS_STAT_ALLOC_SEARCHES));
+}
+
+#define LOLELFFS_COUNTER_ATTR(_name, _stat)                                \
+    static struct lolelffs_attr lolelffs_attr_##_name = {                  \
+        .attr = { .name = #_name, .mode = 0444 },                          \
+        .show = counter_show,                                              \
+        .stat = (_stat),                                                   \
+    }
+
+#define LOLELFFS_RATIO_ATTR(_name)                                         \
+    static struct lolelffs_attr lolelffs_attr_##_name = {                  \
+        .attr = { .name = #_name, .mode = 0444 },                          \
+        .show = _name##_show,                                              \
+    }
+
+LOLELFFS_COUNTER_ATTR(blocks_read, LOLELFFS_STAT_BLOCKS_READ);
+LOLELFFS_COUNTER_ATTR(blocks_written, LOLELFFS_STAT_BLOCKS_WRITTEN);
+LOLELFFS_COUNTER_ATTR(ext_cache_hits, LOLELFFS_STAT_EXT_CACHE_HITS);
+LOLELFFS_COUNTER_ATTR(ext_cache_misses, LOLELFFS_STAT_EXT_CACHE_MISSES);
+LOLELFFS_COUNTER_ATTR(alloc_searches, LOLELFFS_STAT_ALLOC_SEARCHES);
+LOLELFFS_COUNTER_ATTR(alloc_groups_scanned, LOLELFFS_STAT_ALLOC_GROUPS);
+LOLELFFS_COUNTER_ATTR(lock_waits, LOLELFFS_STAT_LOCK_WAITS);
+LOLELFFS_COUNTER_ATTR(lock_wait_ns, LOLELFFS_STAT_LOCK_WAIT_NS);
+LOLELFFS_COUNTER_ATTR(alloc_lock_waits, LOLELFFS_STAT_ALLOC_LOCK_WAITS);
+LOLELFFS_COUNTER_ATTR(alloc_lock_wait_ns, LOLELFFS_STAT_ALLOC_LOCK_WAIT_NS);
+LOLELFFS_RATIO_ATTR(ext_cache_hit_rate);
+LOLELFFS_RATIO_ATTR(alloc_groups_per_search);
+
+static struct attribute *lolelffs_attrs[] = {
+    &lolelffs_attr_blocks_read.attr,
+    &lolelffs_attr_blocks_written.attr,
+    &lolelffs_attr_ext_cache_hits.attr,
+    &lolelffs_attr_ext_cache_misses.attr,
+    &lolelffs_attr_ext_cache_hit_rate.attr,
+    &lolelffs_attr_alloc_searches.attr,
+    &lolelffs_attr_alloc_groups_scanned.attr,
+    &lolelffs_attr_alloc_groups_per_search.attr,
+    &lolelffs_attr_lock_waits.attr,
+    &lolelffs_attr_lock_wait_ns.attr,
+    &lolelffs_attr_alloc_lock_waits.attr,
+    &lolelffs_attr_alloc_lock_wait_ns.attr,
+    NULL,
+};
+ATTRIBUTE_GROUPS(lolelffs);
+
+static ssize_t lolelffs_attr_show(struct kobject *kobj,
+                                  struct attribute *attr,
+                                  char *buf)
+{
+    struct lolelffs_sb_info *sbi =
+        container_of(kobj, struct lolelffs_sb_info, s_kobj);
+    const struct lolelffs_attr *a =
+        container_of(attr, struct lolelffs_attr, attr);
+
+    return a->show(sbi, a, buf);
+}
+
+static const struct sysfs_ops lolelffs_attr_ops = {
+    .show = lolelffs_attr_show,
+};
+
+/* The last reference to s_kobj is gone, the mount can free sbi */
+static void lolelffs_sb_release(struct kobject *kobj)
+{
+    struct lolelffs_sb_info *sbi =
+        container_of(kobj, struct lolelffs_sb_info, s_kobj);
+
+    complete(&sbi->s_kobj_unregister);
+}
+
+static const struct kobj_type lolelffs_sb_ktype = {
+    .default_groups = lolelffs_groups,
+    .sysfs_ops = &lolelffs_attr_ops,
+    .release = lolelffs_sb_release,
+};
+
+/* Add the directory of the mount of sb, named after its device */
+int lolelffs_register_sysfs(struct super_block *sb)
+{
+    struct lolelffs_sb_info *sbi = LOLELFFS_SB(sb);
+    int ret;
+
+    init_completion(&sbi->s_kobj_unregister);
+    sbi->s_kobj.kset = lolelffs_kset;
+    ret = kobject_init_and_add(&sbi->s_kobj, &lolelffs_sb_ktype, NULL, "%s",
+                               sb->s_id);
+    if (ret) {
+        kobject_put(&sbi->s_kobj);
+        wait_for_completion(&sbi->s_kobj_unregister);
+    }
+    return ret;
+}
+
+/* Remove the directory of the mount, waiting for its readers to finish */
+void lolelffs_unregister_sysfs(struct super_block *sb)
+{
+    struct lolelffs_sb_info *sbi = LOLELFFS_SB(sb);
+
+    kobject_del(&sbi->s_kobj);
+    kobject_put(&sbi->s_kobj);
+    wait_for_completion(&sbi->s_kobj_unregister);
+}
+
+/* Create /sys/fs/lolelffs */
+int lolelffs_sysfs_init(void)
+{
+    lolelffs_kset = kset_create_and_add("lolelffs", NULL, fs_kobj);
+    if (!lolelffs_kset)
+        return -ENOMEM;
+    return 0;
+}
+
+void lolelffs_sysfs_exit(void)
+{
+    kset_unregister(lolelffs_kset);
+}
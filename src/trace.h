@@ -0,0 +1,241 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * lolelffs - Tracepoints
+ *
+ * Events of the read, writeback, allocation and extent lookup paths, and of
+ * the decompression and encryption of blocks. Each one carries its latency in
+ * nanoseconds and the size of the data it worked on. The callers only time
+ * an event while it is enabled, see lolelffs_trace_start(). Enable them with:
+ *
+ *   echo 1 > /sys/kernel/tracing/events/lolelffs/enable
+ *
+ * CREATE_TRACE_POINTS is defined by fs.c only.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM lolelffs
+
+#if !defined(_LOLELFFS_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _LOLELFFS_TRACE_H
+
+#include <linux/fs.h>
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(lolelffs_read_folio,
+    TP_PROTO(struct inode *inode, u64 iblock, size_t size, int ret, u64 latency_ns),
+    TP_ARGS(inode, iblock, size, ret, latency_ns),
+
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(unsigned long, ino)
+        __field(u64, iblock)
+        __field(size_t, size)
+        __field(int, ret)
+        __field(u64, latency_ns)
+    ),
+
+    TP_fast_assign(
+        __entry->dev = inode->i_sb->s_dev;
+        __entry->ino = inode->i_ino;
+        __entry->iblock = iblock;
+        __entry->size = size;
+        __entry->ret = ret;
+        __entry->latency_ns = latency_ns;
+    ),
+
+    TP_printk("dev %d:%d ino %lu iblock %llu size %zu ret %d latency_ns %llu",
+              MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino,
+              __entry->iblock, __entry->size, __entry->ret, __entry->latency_ns)
+);
+
+/* One folio queued for writing, encrypted and allocated if needed */
+TRACE_EVENT(lolelffs_writepage,
+    TP_PROTO(struct inode *inode, u64 iblock, size_t size, u8 enc_algo,
+             int ret, u64 latency_ns),
+    TP_ARGS(inode, iblock, size, enc_algo, ret, latency_ns),
+
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(unsigned long, ino)
+        __field(u64, iblock)
+        __field(size_t, size)
+        __field(u8, enc_algo)
+        __field(int, ret)
+        __field(u64, latency_ns)
+    ),
+
+    TP_fast_assign(
+        __entry->dev = inode->i_sb->s_dev;
+        __entry->ino = inode->i_ino;
+        __entry->iblock = iblock;
+        __entry->size = size;
+        __entry->enc_algo = enc_algo;
+        __entry->ret = ret;
+        __entry->latency_ns = latency_ns;
+    ),
+
+    TP_printk("dev %d:%d ino %lu iblock %llu size %zu enc %u ret %d latency_ns %llu",
+              MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino,
+              __entry->iblock, __entry->size, __entry->enc_algo, __entry->ret,
+              __entry->latency_ns)
+);
+
+/* Extents given at writeback to the delayed blocks of get_block */
+TRACE_EVENT(lolelffs_get_block_alloc,
+    TP_PROTO(struct inode *inode, u32 iblock, u32 nr_blocks, int ret, u64 latency_ns),
+    TP_ARGS(inode, iblock, nr_blocks, ret, latency_ns),
+
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(unsigned long, ino)
+        __field(u32, iblock)
+        __field(u32, nr_blocks)
+        __field(int, ret)
+        __field(u64, latency_ns)
+    ),
+
+    TP_fast_assign(
+        __entry->dev = inode->i_sb->s_dev;
+        __entry->ino = inode->i_ino;
+        __entry->iblock = iblock;
+        __entry->nr_blocks = nr_blocks;
+        __entry->ret = ret;
+        __entry->latency_ns = latency_ns;
+    ),
+
+    TP_printk("dev %d:%d ino %lu iblock %u nr_blocks %u ret %d latency_ns %llu",
+              MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino,
+              __entry->iblock, __entry->nr_blocks, __entry->ret,
+              __entry->latency_ns)
+);
+
+/* One search of the block allocator, with the bitmap groups it scanned */
+TRACE_EVENT(lolelffs_new_blocks,
+    TP_PROTO(struct super_block *sb, u32 goal, u32 len, u32 bno, u32 groups,
+             u64 latency_ns),
+    TP_ARGS(sb, goal, len, bno, groups, latency_ns),
+
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(u32, goal)
+        __field(u32, len)
+        __field(u32, bno)
+        __field(u32, groups)
+        __field(u64, latency_ns)
+    ),
+
+    TP_fast_assign(
+        __entry->dev = sb->s_dev;
+        __entry->goal = goal;
+        __entry->len = len;
+        __entry->bno = bno;
+        __entry->groups = groups;
+        __entry->latency_ns = latency_ns;
+    ),
+
+    TP_printk("dev %d:%d goal %u len %u bno %u groups %u latency_ns %llu",
+              MAJOR(__entry->dev), MINOR(__entry->dev), __entry->goal,
+              __entry->len, __entry->bno, __entry->groups, __entry->latency_ns)
+);
+
+/* Extent lookup, through the extent cache (hit) or the extent blocks */
+TRACE_EVENT(lolelffs_ext_search,
+    TP_PROTO(struct inode *inode, u32 iblock, u32 nr_extents, bool hit, int ret,
+             u64 latency_ns),
+    TP_ARGS(inode, iblock, nr_extents, hit, ret, latency_ns),
+
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(unsigned long, ino)
+        __field(u32, iblock)
+        __field(u32, nr_extents)
+        __field(bool, hit)
+        __field(int, ret)
+        __field(u64, latency_ns)
+    ),
+
+    TP_fast_assign(
+        __entry->dev = inode->i_sb->s_dev;
+        __entry->ino = inode->i_ino;
+        __entry->iblock = iblock;
+        __entry->nr_extents = nr_extents;
+        __entry->hit = hit;
+        __entry->ret = ret;
+        __entry->latency_ns = latency_ns;
+    ),
+
+    TP_printk("dev %d:%d ino %lu iblock %u nr_extents %u hit %d ret %d latency_ns %llu",
+              MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino,
+              __entry->iblock, __entry->nr_extents, __entry->hit, __entry->ret,
+              __entry->latency_ns)
+);
+
+/* One block decompressed by the read paths */
+TRACE_EVENT(lolelffs_decompress,
+    TP_PROTO(u8 algo, size_t src_len, size_t dst_len, int ret, u64 latency_ns),
+    TP_ARGS(algo, src_len, dst_len, ret, latency_ns),
+
+    TP_STRUCT__entry(
+        __field(u8, algo)
+        __field(size_t, src_len)
+        __field(size_t, dst_len)
+        __field(int, ret)
+        __field(u64, latency_ns)
+    ),
+
+    TP_fast_assign(
+        __entry->algo = algo;
+        __entry->src_len = src_len;
+        __entry->dst_len = dst_len;
+        __entry->ret = ret;
+        __entry->latency_ns = latency_ns;
+    ),
+
+    TP_printk("algo %u src_len %zu dst_len %zu ret %d latency_ns %llu",
+              __entry->algo, __entry->src_len, __entry->dst_len, __entry->ret,
+              __entry->latency_ns)
+);
+
+DECLARE_EVENT_CLASS(lolelffs_crypt_class,
+    TP_PROTO(u8 algo, u64 block, size_t size, int ret, u64 latency_ns),
+    TP_ARGS(algo, block, size, ret, latency_ns),
+
+    TP_STRUCT__entry(
+        __field(u8, algo)
+        __field(u64, block)
+        __field(size_t, size)
+        __field(int, ret)
+        __field(u64, latency_ns)
+    ),
+
+    TP_fast_assign(
+        __entry->algo = algo;
+        __entry->block = block;
+        __entry->size = size;
+        __entry->ret = ret;
+        __entry->latency_ns = latency_ns;
+    ),
+
+    TP_printk("algo %u block %llu size %zu ret %d latency_ns %llu",
+              __entry->algo, __entry->block, __entry->size, __entry->ret,
+              __entry->latency_ns)
+);
+
+DEFINE_EVENT(lolelffs_crypt_class, lolelffs_encrypt,
+    TP_PROTO(u8 algo, u64 block, size_t size, int ret, u64 latency_ns),
+    TP_ARGS(algo, block, size, ret, latency_ns)
+);
+
+DEFINE_EVENT(lolelffs_crypt_class, lolelffs_decrypt,
+    TP_PROTO(u8 algo, u64 block, size_t size, int ret, u64 latency_ns),
+    TP_ARGS(algo, block, size, ret, latency_ns)
+);
+
+#endif /* _LOLELFFS_TRACE_H */
+
+/* The header is found through the -I of the module sources, see Makefile */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE trace
+#include <trace/define_trace.h>
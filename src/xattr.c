@@ -16,7 +16,13 @@ static const char *xattr_prefixes[] = {
     [LOLELFFS_XATTR_INDEX_SECURITY] = XATTR_SECURITY_PREFIX,
 };
 
-/* Read xattr data from extent blocks */
+/* Whether the entries of a set of xattrs are stored in its index block */
+static inline bool lolelffs_xattr_is_inline(struct lolelffs_xattr_ei_block *ei)
+{
+    return ei->extents[0].ee_start == 0 && ei->total_size != 0;
+}
+
+/* Read xattr data from the index block or its extent blocks */
 static int lolelffs_xattr_read_data(struct super_block *sb,
                                     struct lolelffs_xattr_ei_block *ei,
                                     char **data_out, size_t *size_out)
@@ -30,6 +36,20 @@ static int lolelffs_xattr_read_data(struct super_block *sb,
         *size_out = 0;
         return 0;
     }
+    if (ei->total_size > LOLELFFS_XATTR_MAX_SIZE)
+        return -EUCLEAN;
+
+    if (lolelffs_xattr_is_inline(ei)) {
+        if (ei->total_size > LOLELFFS_XATTR_INLINE_SIZE)
+            return -EUCLEAN;
+        data = kmemdup((char *)ei + LOLELFFS_XATTR_INLINE_OFFSET,
+                       ei->total_size, GFP_KERNEL);
+        if (!data)
+            return -ENOMEM;
+        *data_out = data;
+        *size_out = ei->total_size;
+        return 0;
+    }
 
     data = kmalloc(ei->total_size, GFP_KERNEL);
     if (!data)
@@ -70,6 +90,91 @@ done:
     return 0;
 }
 
+/*
+ * Store size bytes of xattr data for the index block ei: in the block itself
+ * if it fits and the filesystem allows it, in the data blocks already mapped
+ * if there are enough of them, or in a new extent otherwise. The caller
+ * updates total_size and count.
+ */
+static int lolelffs_xattr_write_data(struct super_block *sb,
+                                     struct lolelffs_xattr_ei_block *ei,
+                                     const char *data, size_t size)
+{
+    struct lolelffs_sb_info *sbi = LOLELFFS_SB(sb);
+    uint32_t blocks_needed = DIV_ROUND_UP(size, LOLELFFS_BLOCK_SIZE);
+    uint32_t mapped = 0;
+    size_t written = 0;
+    int ei_idx, bi;
+
+    if (!lolelffs_xattr_is_inline(ei)) {
+        for (ei_idx = 0; ei_idx < LOLELFFS_MAX_EXTENTS; ei_idx++) {
+            if (ei->extents[ei_idx].ee_start == 0)
+                break;
+            mapped += ei->extents[ei_idx].ee_len;
+        }
+    }
+
+    if ((sbi->comp_features & LOLELFFS_FEATURE_XATTR_INLINE) &&
+        size <= LOLELFFS_XATTR_INLINE_SIZE) {
+        for (ei_idx = 0; mapped && ei_idx < LOLELFFS_MAX_EXTENTS; ei_idx++) {
+            if (ei->extents[ei_idx].ee_start == 0)
+                break;
+            put_blocks(sbi, ei->extents[ei_idx].ee_start,
+                       ei->extents[ei_idx].ee_len);
+        }
+        memset(ei->extents, 0, sizeof(ei->extents));
+        memcpy((char *)ei + LOLELFFS_XATTR_INLINE_OFFSET, data, size);
+        return 0;
+    }
+
+    if (mapped < blocks_needed) {
+        uint32_t new_blocks = get_free_blocks(sbi, blocks_needed);
+        if (!new_blocks)
+            return -ENOSPC;
+
+        /* Free old blocks if any */
+        for (ei_idx = 0; mapped && ei_idx < LOLELFFS_MAX_EXTENTS; ei_idx++) {
+            if (ei->extents[ei_idx].ee_start == 0)
+                break;
+            put_blocks(sbi, ei->extents[ei_idx].ee_start,
+                       ei->extents[ei_idx].ee_len);
+        }
+
+        /* Also drops the entries of an inline set */
+        memset(ei->extents, 0, sizeof(ei->extents));
+        ei->extents[0].ee_block = 0;
+        ei->extents[0].ee_start = new_blocks;
+        ei->extents[0].ee_len = blocks_needed;
+    }
+
+    /* Write new data to blocks */
+    for (ei_idx = 0; ei_idx < LOLELFFS_MAX_EXTENTS && written < size; ei_idx++) {
+        struct lolelffs_extent *extent = &ei->extents[ei_idx];
+
+        if (extent->ee_start == 0)
+            break;
+
+        for (bi = 0; bi < extent->ee_len && written < size; bi++) {
+            size_t write_size = min_t(size_t, LOLELFFS_BLOCK_SIZE, size - written);
+            struct buffer_head *bh;
+
+            bh = LOLELFFS_SB_BREAD(sb, extent->ee_start + bi);
+            if (!bh)
+                return -EIO;
+
+            memcpy(bh->b_data, data + written, write_size);
+            if (write_size < LOLELFFS_BLOCK_SIZE)
+                memset(bh->b_data + write_size, 0, LOLELFFS_BLOCK_SIZE - write_size);
+
+            mark_buffer_dirty(bh);
+            brelse(bh);
+            written += write_size;
+        }
+    }
+
+    return 0;
+}
+
 /* Find an xattr entry by name */
 static struct lolelffs_xattr_entry *
 lolelffs_xattr_find_entry(char *data, size_t data_size,
@@ -96,6 +201,10 @@ lolelffs_xattr_find_entry(char *data, size_t data_size,
         if (entry->name_index == name_index &&
             entry->name_len == name_len &&
             memcmp(entry_name, name, name_len) == 0) {
+            /* The value must be within the set */
+            if ((size_t)entry->value_offset + entry->value_len >
+                data_size - offset)
+                return NULL;
             if (entry_offset_out)
                 *entry_offset_out = offset;
             return entry;
@@ -113,16 +222,77 @@ lolelffs_xattr_find_entry(char *data, size_t data_size,
     return NULL;
 }
 
-/* Get an extended attribute value */
-static int lolelffs_xattr_get(struct inode *inode, int name_index,
-                              const char *name, void *buffer, size_t size)
+/*
+ * Load the xattrs of inode into its cache if they are not there yet. Called
+ * with xattr_sem held for writing.
+ */
+static int lolelffs_xattr_load(struct inode *inode)
 {
-    struct super_block *sb = inode->i_sb;
     struct lolelffs_inode_info *ci = LOLELFFS_INODE(inode);
-    struct buffer_head *bh = NULL;
     struct lolelffs_xattr_ei_block *ei;
+    struct buffer_head *bh;
     char *data = NULL;
-    size_t data_size;
+    size_t data_size = 0;
+    int ret;
+
+    if (ci->xattr_cached)
+        return 0;
+
+    if (ci->xattr_block) {
+        bh = LOLELFFS_SB_BREAD(inode->i_sb, ci->xattr_block);
+        if (!bh)
+            return -EIO;
+        ei = (struct lolelffs_xattr_ei_block *)bh->b_data;
+        ret = lolelffs_xattr_read_data(inode->i_sb, ei, &data, &data_size);
+        brelse(bh);
+        if (ret)
+            return ret;
+    }
+
+    ci->xattr_data = data;
+    ci->xattr_size = data_size;
+    ci->xattr_cached = true;
+    return 0;
+}
+
+/* Drop the cached xattrs of inode. Called with xattr_sem held for writing. */
+static void lolelffs_xattr_drop(struct inode *inode)
+{
+    struct lolelffs_inode_info *ci = LOLELFFS_INODE(inode);
+
+    kfree(ci->xattr_data);
+    ci->xattr_data = NULL;
+    ci->xattr_size = 0;
+    ci->xattr_cached = false;
+}
+
+/*
+ * Take xattr_sem for reading, with the xattrs of inode in its cache. On
+ * success, the caller releases xattr_sem with up_read().
+ */
+static int lolelffs_xattr_lock_cached(struct inode *inode)
+{
+    struct lolelffs_inode_info *ci = LOLELFFS_INODE(inode);
+    int ret;
+
+    down_read(&ci->xattr_sem);
+    if (ci->xattr_cached)
+        return 0;
+    up_read(&ci->xattr_sem);
+
+    down_write(&ci->xattr_sem);
+    ret = lolelffs_xattr_load(inode);
+    downgrade_write(&ci->xattr_sem);
+    if (ret)
+        up_read(&ci->xattr_sem);
+    return ret;
+}
+
+/* Get an extended attribute value, from the xattr cache of the inode */
+static int lolelffs_xattr_get(struct inode *inode, int name_index,
+                              const char *name, void *buffer, size_t size)
+{
+    struct lolelffs_inode_info *ci = LOLELFFS_INODE(inode);
     struct lolelffs_xattr_entry *entry;
     char *value;
     int ret;
@@ -131,28 +301,18 @@ static int lolelffs_xattr_get(struct inode *inode, int name_index,
     if (ci->xattr_block == 0)
         return -ENODATA;
 
-    /* Read xattr extent index */
-    bh = LOLELFFS_SB_BREAD(sb, ci->xattr_block);
-    if (!bh)
-        return -EIO;
-
-    ei = (struct lolelffs_xattr_ei_block *)bh->b_data;
-
-    /* Read xattr data */
-    ret = lolelffs_xattr_read_data(sb, ei, &data, &data_size);
-    brelse(bh);
-
+    ret = lolelffs_xattr_lock_cached(inode);
     if (ret)
         return ret;
 
-    if (!data || data_size == 0)
-        return -ENODATA;
-
     /* Find the entry */
-    entry = lolelffs_xattr_find_entry(data, data_size, name_index, name, NULL);
+    entry = NULL;
+    if (ci->xattr_data)
+        entry = lolelffs_xattr_find_entry(ci->xattr_data, ci->xattr_size,
+                                          name_index, name, NULL);
     if (!entry) {
-        kfree(data);
-        return -ENODATA;
+        ret = -ENODATA;
+        goto out;
     }
 
     /* Get value */
@@ -168,26 +328,27 @@ static int lolelffs_xattr_get(struct inode *inode, int name_index,
         ret = entry->value_len;
     }
 
-    kfree(data);
+out:
+    up_read(&ci->xattr_sem);
     return ret;
 }
 
-/* Set an extended attribute value */
-static int lolelffs_xattr_set(struct inode *inode, int name_index,
-                              const char *name, const void *value,
-                              size_t value_len, int flags)
+/* Set an extended attribute value. Called with xattr_sem held for writing. */
+static int __lolelffs_xattr_set(struct inode *inode, int name_index,
+                                const char *name, const void *value,
+                                size_t value_len, int flags)
 {
     struct super_block *sb = inode->i_sb;
     struct lolelffs_sb_info *sbi = LOLELFFS_SB(sb);
     struct lolelffs_inode_info *ci = LOLELFFS_INODE(inode);
-    struct buffer_head *bh = NULL, *bh2;
+    struct buffer_head *bh = NULL;
     struct lolelffs_xattr_ei_block *ei;
     char *data = NULL, *new_data = NULL;
     size_t data_size, new_data_size;
     struct lolelffs_xattr_entry *entry;
     size_t entry_offset, name_len;
     uint32_t xattr_block;
-    int ret = 0, ei_idx, bi;
+    int ret = 0;
 
     name_len = strlen(name);
 
@@ -210,18 +371,14 @@ static int lolelffs_xattr_set(struct inode *inode, int name_index,
 
         ei = (struct lolelffs_xattr_ei_block *)bh->b_data;
         ret = lolelffs_xattr_read_data(sb, ei, &data, &data_size);
-
-        if (ret) {
-            brelse(bh);
-            return ret;
-        }
+        if (ret)
+            goto out;
 
         /* Find the entry */
         entry = lolelffs_xattr_find_entry(data, data_size, name_index, name, &entry_offset);
         if (!entry) {
-            kfree(data);
-            brelse(bh);
-            return -ENODATA;
+            ret = -ENODATA;
+            goto out;
         }
 
         /* Calculate entry size */
@@ -236,44 +393,17 @@ static int lolelffs_xattr_set(struct inode *inode, int name_index,
                    data_size - entry_offset - entry_size);
         }
 
+        /* Write back data */
         new_data_size = data_size - entry_size;
+        ret = lolelffs_xattr_write_data(sb, ei, data, new_data_size);
+        if (ret)
+            goto out;
         ei->total_size = new_data_size;
         ei->count--;
 
-        /* Write back data */
-        size_t written = 0;
-        for (ei_idx = 0; ei_idx < LOLELFFS_MAX_EXTENTS; ei_idx++) {
-            struct lolelffs_extent *extent = &ei->extents[ei_idx];
-
-            if (extent->ee_start == 0)
-                break;
-
-            for (bi = 0; bi < extent->ee_len && written < new_data_size; bi++) {
-                size_t write_size = min_t(size_t, LOLELFFS_BLOCK_SIZE,
-                                         new_data_size - written);
-
-                bh2 = LOLELFFS_SB_BREAD(sb, extent->ee_start + bi);
-                if (!bh2) {
-                    ret = -EIO;
-                    goto out;
-                }
-
-                memcpy(bh2->b_data, data + written, write_size);
-                if (write_size < LOLELFFS_BLOCK_SIZE)
-                    memset(bh2->b_data + write_size, 0, LOLELFFS_BLOCK_SIZE - write_size);
-
-                mark_buffer_dirty(bh2);
-                brelse(bh2);
-                written += write_size;
-            }
-        }
-
         mark_buffer_dirty(bh);
-        brelse(bh);
-        kfree(data);
-
         mark_inode_dirty(inode);
-        return 0;
+        goto out;
     }
 
     /* Allocate xattr block if needed */
@@ -350,7 +480,7 @@ static int lolelffs_xattr_set(struct inode *inode, int name_index,
     new_data_size = data_size + new_entry_size;
 
     /* Check if we have space (simple check for now) */
-    if (new_data_size > LOLELFFS_BLOCK_SIZE * 8) {
+    if (new_data_size > LOLELFFS_XATTR_MAX_SIZE) {
         ret = -ENOSPC;
         goto out;
     }
@@ -386,46 +516,10 @@ static int lolelffs_xattr_set(struct inode *inode, int name_index,
            name_len + 1 + value_len, 0,
            new_entry_size - (sizeof(struct lolelffs_xattr_entry) + name_len + 1 + value_len));
 
-    /* Allocate data blocks if needed */
-    uint32_t blocks_needed = (new_data_size + LOLELFFS_BLOCK_SIZE - 1) / LOLELFFS_BLOCK_SIZE;
-
-    if (ei->extents[0].ee_start == 0 || ei->extents[0].ee_len < blocks_needed) {
-        /* Need to allocate or expand */
-        uint32_t new_blocks = get_free_blocks(sbi, blocks_needed);
-        if (!new_blocks) {
-            ret = -ENOSPC;
-            goto out;
-        }
-
-        /* Free old blocks if any */
-        if (ei->extents[0].ee_start != 0) {
-            put_blocks(sbi, ei->extents[0].ee_start, ei->extents[0].ee_len);
-        }
-
-        ei->extents[0].ee_block = 0;
-        ei->extents[0].ee_start = new_blocks;
-        ei->extents[0].ee_len = blocks_needed;
-    }
-
-    /* Write new data to blocks */
-    size_t written = 0;
-    for (bi = 0; bi < ei->extents[0].ee_len && written < new_data_size; bi++) {
-        size_t write_size = min_t(size_t, LOLELFFS_BLOCK_SIZE, new_data_size - written);
-
-        bh2 = LOLELFFS_SB_BREAD(sb, ei->extents[0].ee_start + bi);
-        if (!bh2) {
-            ret = -EIO;
-            goto out;
-        }
-
-        memcpy(bh2->b_data, new_data + written, write_size);
-        if (write_size < LOLELFFS_BLOCK_SIZE)
-            memset(bh2->b_data + write_size, 0, LOLELFFS_BLOCK_SIZE - write_size);
-
-        mark_buffer_dirty(bh2);
-        brelse(bh2);
-        written += write_size;
-    }
+    /* Store the new set, in the index block if it is small */
+    ret = lolelffs_xattr_write_data(sb, ei, new_data, new_data_size);
+    if (ret)
+        goto out;
 
     /* Update extent index */
     ei->total_size = new_data_size;
@@ -443,41 +537,45 @@ out:
     return ret;
 }
 
-/* List extended attributes */
+/*
+ * Set an extended attribute value. The xattr cache is dropped, even on
+ * failure: the set on disk may have been partly rewritten.
+ */
+static int lolelffs_xattr_set(struct inode *inode, int name_index,
+                              const char *name, const void *value,
+                              size_t value_len, int flags)
+{
+    struct lolelffs_inode_info *ci = LOLELFFS_INODE(inode);
+    int ret;
+
+    down_write(&ci->xattr_sem);
+    ret = __lolelffs_xattr_set(inode, name_index, name, value, value_len, flags);
+    lolelffs_xattr_drop(inode);
+    up_write(&ci->xattr_sem);
+    return ret;
+}
+
+/* List extended attributes, from the xattr cache of the inode */
 ssize_t lolelffs_listxattr(struct dentry *dentry, char *buffer, size_t size)
 {
     struct inode *inode = d_inode(dentry);
-    struct super_block *sb = inode->i_sb;
     struct lolelffs_inode_info *ci = LOLELFFS_INODE(inode);
-    struct buffer_head *bh;
-    struct lolelffs_xattr_ei_block *ei;
-    char *data = NULL;
     size_t data_size, offset = 0, total_size = 0;
+    char *data;
     int ret;
 
     /* No xattrs? */
     if (ci->xattr_block == 0)
         return 0;
 
-    /* Read xattr extent index */
-    bh = LOLELFFS_SB_BREAD(sb, ci->xattr_block);
-    if (!bh)
-        return -EIO;
-
-    ei = (struct lolelffs_xattr_ei_block *)bh->b_data;
-
-    /* Read xattr data */
-    ret = lolelffs_xattr_read_data(sb, ei, &data, &data_size);
-    brelse(bh);
-
+    ret = lolelffs_xattr_lock_cached(inode);
     if (ret)
         return ret;
-
-    if (!data || data_size == 0)
-        return 0;
+    data = ci->xattr_data;
+    data_size = ci->xattr_size;
 
     /* Iterate through entries */
-    while (offset + sizeof(struct lolelffs_xattr_entry) <= data_size) {
+    while (data && offset + sizeof(struct lolelffs_xattr_entry) <= data_size) {
         struct lolelffs_xattr_entry *entry;
         const char *prefix;
         size_t prefix_len, name_len, full_len;
@@ -486,6 +584,10 @@ ssize_t lolelffs_listxattr(struct dentry *dentry, char *buffer, size_t size)
 
         if (entry->name_len == 0)
             break;
+        if (entry->name_index > LOLELFFS_XATTR_INDEX_SECURITY) {
+            ret = -EUCLEAN;
+            goto out;
+        }
 
         prefix = xattr_prefixes[entry->name_index];
         prefix_len = strlen(prefix);
@@ -517,7 +619,7 @@ ssize_t lolelffs_listxattr(struct dentry *dentry, char *buffer, size_t size)
     ret = total_size;
 
 out:
-    kfree(data);
+    up_read(&ci->xattr_sem);
     return ret;
 }
 
@@ -532,14 +634,17 @@ void lolelffs_xattr_free_blocks(struct lolelffs_sb_info *sbi, struct inode *inod
     if (ci->xattr_block == 0)
         return;
 
+    down_write(&ci->xattr_sem);
+    lolelffs_xattr_drop(inode);
+
     /* Read xattr extent index */
     bh = LOLELFFS_SB_BREAD(inode->i_sb, ci->xattr_block);
     if (!bh)
-        return;
+        goto out;
 
     ei = (struct lolelffs_xattr_ei_block *)bh->b_data;
 
-    /* Free all extent blocks */
+    /* Free all extent blocks, none for an inline set */
     for (ei_idx = 0; ei_idx < LOLELFFS_MAX_EXTENTS; ei_idx++) {
         if (ei->extents[ei_idx].ee_start == 0)
             break;
@@ -552,6 +657,9 @@ void lolelffs_xattr_free_blocks(struct lolelffs_sb_info *sbi, struct inode *inod
     /* Free the xattr index block itself */
     put_blocks(sbi, ci->xattr_block, 1);
     ci->xattr_block = 0;
+
+out:
+    up_write(&ci->xattr_sem);
 }
 
 /* Xattr handler get function */
@@ -0,0 +1,284 @@
+/*
+ * I/O workloads for the lolelffs end-to-end benchmarks
+ *
+ * Runs one workload against a directory of a mounted lolelffs filesystem
+ * and prints its measurements as the members of a JSON object, for
+ * tests/benchmark_io.sh to wrap with the configuration they were taken in:
+ * - seq_write: write bench.dat with 1 MiB writes, then fsync
+ * - seq_read: read bench.dat back with 1 MiB reads
+ * - rand_read: read 4 KiB blocks at random offsets of bench.dat
+ * - rand_write: write 4 KiB blocks at random offsets of bench.dat, then fsync
+ * - create: create files of 1 KiB in a new directory, then syncfs
+ * - lookup: stat the files of a directory made by create, in random order
+ *
+ * Written data is text-like, so that compression has something to do. When
+ * LOLELFFS_COMP is set, new files get it as their compression hint.
+ */
+
+#define _GNU_SOURCE /* syncfs */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+
+#define CHUNK_SIZE (1024 * 1024)
+#define IO_SIZE 4096
+#define SMALL_FILE_SIZE 1024
+#define COMP_HINT_XATTR "user.lolelffs.compress"
+
+static char path[4096];
+
+static inline uint64_t get_time_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* xorshift64, for offsets and names that do not depend on libc */
+static uint64_t rng_state = 0x9E3779B97F4A7C15ULL;
+
+static uint64_t rng_next(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+/* Fill buf with words from a small vocabulary, compressing about 3:1 */
+static void fill_text(char *buf, size_t len)
+{
+    static const char *words[] = {
+        "extent", "block", "inode", "lolelffs", "bitmap", "superblock",
+        "directory", "compress", "encrypt", "folio", "writeback", "cache",
+    };
+    size_t pos = 0;
+
+    while (pos < len) {
+        const char *w = words[rng_next() % (sizeof(words) / sizeof(words[0]))];
+        size_t n = strlen(w);
+
+        if (n > len - pos)
+            n = len - pos;
+        memcpy(buf + pos, w, n);
+        pos += n;
+        if (pos < len)
+            buf[pos++] = (rng_next() & 7) ? ' ' : '\n';
+    }
+}
+
+static void die(const char *what)
+{
+    fprintf(stderr, "bench_io: %s: %s\n", what, strerror(errno));
+    exit(1);
+}
+
+/* Create a file, with the compression hint of the run if there is one */
+static int create_file(const char *name)
+{
+    const char *hint = getenv("LOLELFFS_COMP");
+    int fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    if (fd < 0)
+        die(name);
+    if (hint && *hint && fsetxattr(fd, COMP_HINT_XATTR, hint, strlen(hint), 0) < 0)
+        die("setting the compression hint");
+    return fd;
+}
+
+static void report(uint64_t bytes, uint64_t ops, uint64_t ns)
+{
+    double seconds = ns / 1e9;
+
+    printf("\"bytes\": %lu, \"ops\": %lu, \"seconds\": %.6f, "
+           "\"mb_per_s\": %.2f, \"ops_per_s\": %.1f\n",
+           (unsigned long)bytes, (unsigned long)ops, seconds,
+           seconds > 0 ? bytes / seconds / (1024 * 1024) : 0,
+           seconds > 0 ? ops / seconds : 0);
+}
+
+static void seq_write(const char *dir, uint64_t mb)
+{
+    char *buf = malloc(CHUNK_SIZE);
+    uint64_t start;
+    int fd;
+
+    if (!buf)
+        die("malloc");
+    fill_text(buf, CHUNK_SIZE);
+    snprintf(path, sizeof(path), "%s/bench.dat", dir);
+    fd = create_file(path);
+
+    start = get_time_ns();
+    for (uint64_t i = 0; i < mb; i++) {
+        /* Vary the chunks, as identical ones would all share one pattern */
+        memcpy(buf, &i, sizeof(i));
+        if (write(fd, buf, CHUNK_SIZE) != CHUNK_SIZE)
+            die("write");
+    }
+    if (fsync(fd) < 0)
+        die("fsync");
+    report(mb * CHUNK_SIZE, mb, get_time_ns() - start);
+    close(fd);
+    free(buf);
+}
+
+static void seq_read(const char *dir)
+{
+    char *buf = malloc(CHUNK_SIZE);
+    uint64_t start, bytes = 0, ops = 0;
+    ssize_t n;
+    int fd;
+
+    if (!buf)
+        die("malloc");
+    snprintf(path, sizeof(path), "%s/bench.dat", dir);
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        die(path);
+
+    start = get_time_ns();
+    while ((n = read(fd, buf, CHUNK_SIZE)) > 0) {
+        bytes += n;
+        ops++;
+    }
+    if (n < 0)
+        die("read");
+    report(bytes, ops, get_time_ns() - start);
+    close(fd);
+    free(buf);
+}
+
+/* Read or write ops blocks of IO_SIZE at random offsets of bench.dat */
+static void rand_io(const char *dir, uint64_t ops, int writing)
+{
+    char buf[IO_SIZE];
+    uint64_t start, nr_blocks;
+    struct stat st;
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/bench.dat", dir);
+    fd = open(path, writing ? O_RDWR : O_RDONLY);
+    if (fd < 0)
+        die(path);
+    if (fstat(fd, &st) < 0)
+        die("fstat");
+    nr_blocks = st.st_size / IO_SIZE;
+    if (nr_blocks == 0) {
+        fprintf(stderr, "bench_io: %s is empty, run seq_write first\n", path);
+        exit(1);
+    }
+    fill_text(buf, sizeof(buf));
+
+    start = get_time_ns();
+    for (uint64_t i = 0; i < ops; i++) {
+        off_t off = (off_t)(rng_next() % nr_blocks) * IO_SIZE;
+        ssize_t n = writing ? pwrite(fd, buf, IO_SIZE, off) : pread(fd, buf, IO_SIZE, off);
+
+        if (n != IO_SIZE)
+            die(writing ? "pwrite" : "pread");
+    }
+    if (writing && fsync(fd) < 0)
+        die("fsync");
+    report(ops * IO_SIZE, ops, get_time_ns() - start);
+    close(fd);
+}
+
+static void create_files(const char *dir, uint64_t count)
+{
+    char buf[SMALL_FILE_SIZE];
+    uint64_t start;
+    int fd;
+
+    fill_text(buf, sizeof(buf));
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST)
+        die(dir);
+
+    start = get_time_ns();
+    for (uint64_t i = 0; i < count; i++) {
+        snprintf(path, sizeof(path), "%s/file_%06lu", dir, (unsigned long)i);
+        fd = create_file(path);
+        if (write(fd, buf, sizeof(buf)) != sizeof(buf))
+            die("write");
+        close(fd);
+    }
+    fd = open(dir, O_RDONLY);
+    if (fd < 0 || syncfs(fd) < 0)
+        die("syncfs");
+    close(fd);
+    report(count * SMALL_FILE_SIZE, count, get_time_ns() - start);
+}
+
+static void lookup_files(const char *dir, uint64_t count)
+{
+    struct stat st;
+    uint64_t start;
+
+    start = get_time_ns();
+    for (uint64_t i = 0; i < count; i++) {
+        snprintf(path, sizeof(path), "%s/file_%06lu", dir,
+                 (unsigned long)(rng_next() % count));
+        if (stat(path, &st) < 0)
+            die(path);
+    }
+    report(0, count, get_time_ns() - start);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s <workload> <dir> [count]\n", prog);
+    fprintf(stderr, "\nWorkloads:\n");
+    fprintf(stderr, "  seq_write <dir> <MiB>     Write <dir>/bench.dat\n");
+    fprintf(stderr, "  seq_read <dir>            Read <dir>/bench.dat\n");
+    fprintf(stderr, "  rand_read <dir> <ops>     Read 4 KiB blocks of <dir>/bench.dat\n");
+    fprintf(stderr, "  rand_write <dir> <ops>    Write 4 KiB blocks of <dir>/bench.dat\n");
+    fprintf(stderr, "  create <dir> <files>      Create files of 1 KiB in <dir>\n");
+    fprintf(stderr, "  lookup <dir> <files>      Look up files made by create\n");
+}
+
+int main(int argc, char *argv[])
+{
+    const char *workload, *dir;
+    uint64_t count = 0;
+
+    if (argc < 3) {
+        usage(argv[0]);
+        return 1;
+    }
+    workload = argv[1];
+    dir = argv[2];
+    if (argc > 3)
+        count = strtoull(argv[3], NULL, 10);
+
+    if (strcmp(workload, "seq_read") == 0) {
+        seq_read(dir);
+        return 0;
+    }
+    if (count == 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (strcmp(workload, "seq_write") == 0)
+        seq_write(dir, count);
+    else if (strcmp(workload, "rand_read") == 0)
+        rand_io(dir, count, 0);
+    else if (strcmp(workload, "rand_write") == 0)
+        rand_io(dir, count, 1);
+    else if (strcmp(workload, "create") == 0)
+        create_files(dir, count);
+    else if (strcmp(workload, "lookup") == 0)
+        lookup_files(dir, count);
+    else {
+        usage(argv[0]);
+        return 1;
+    }
+    return 0;
+}
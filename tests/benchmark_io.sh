@@ -0,0 +1,252 @@
+#!/usr/bin/env bash
+#
+# End-to-end I/O benchmarks for lolelffs
+#
+# Creates an image for each compression algorithm and encryption mode, and
+# runs sequential and random reads and writes, small file creation, lookups
+# in a large directory and mounting against the kernel module and against
+# lolelffs-fuse. Reads are taken after a remount, so that they go to the
+# image rather than to the page cache.
+#
+# Results are written as JSON: the configuration of the run, then one record
+# per backend, image and workload. A combination that cannot run (kernel
+# module without root, FUSE without the driver or on an encrypted image,
+# which lolelffs-fuse cannot unlock) is recorded with the reason it was
+# skipped.
+#
+# Usage: tests/benchmark_io.sh [output.json]   (from the top of the tree)
+#
+# Environment:
+#   BENCH_BACKENDS   Backends to run (default: "kernel fuse")
+#   BENCH_COMP       Compression hints (default: "none lz4 zlib zstd")
+#   BENCH_ENC        Encryption modes (default: "none aes-256-xts chacha20-poly1305")
+#   BENCH_SIZE_MB    Image size in MiB (default: 512)
+#   BENCH_FILE_MB    Size of the sequential file in MiB (default: 128)
+#   BENCH_RAND_OPS   Random 4 KiB reads and writes (default: 4096)
+#   BENCH_FILES      Small files created (default: 2000)
+#   BENCH_DIR_FILES  Files in the lookup directory (default: 5000)
+#   BENCH_MOUNTS     Mounts timed per image (default: 5)
+#
+
+set -e
+
+OUTPUT=${1:-benchmark-io.json}
+BACKENDS=${BENCH_BACKENDS:-"kernel fuse"}
+COMP_MODES=${BENCH_COMP:-"none lz4 zlib zstd"}
+ENC_MODES=${BENCH_ENC:-"none aes-256-xts chacha20-poly1305"}
+SIZE_MB=${BENCH_SIZE_MB:-512}
+FILE_MB=${BENCH_FILE_MB:-128}
+RAND_OPS=${BENCH_RAND_OPS:-4096}
+NR_FILES=${BENCH_FILES:-2000}
+DIR_FILES=${BENCH_DIR_FILES:-5000}
+NR_MOUNTS=${BENCH_MOUNTS:-5}
+
+LOLELFFS_MOD=./lolelffs.ko
+LOLELFFS=./lolelffs
+FUSE_BIN=./lolelffs-fuse
+UNLOCK=./unlock_lolelffs
+BENCH_IO=./bench_io
+
+WORKDIR=$(mktemp -d /tmp/lolelffs-bench.XXXXXX)
+IMAGE=$WORKDIR/bench.img
+MNT=$WORKDIR/mnt
+PASSWORD="BenchPassword123"
+FUSE_PID=
+
+RECORDS=()
+
+now_ns() {
+    date +%s%N
+}
+
+cleanup() {
+    unmount_fs 2>/dev/null || true
+    rm -rf "$WORKDIR"
+}
+trap cleanup EXIT
+
+# Append a record for backend $1, compression $2, encryption $3, workload $4,
+# with the JSON members $5
+record() {
+    RECORDS+=("{\"backend\": \"$1\", \"compression\": \"$2\", \"encryption\": \"$3\", \"workload\": \"$4\", $5}")
+}
+
+# Why backend $1 cannot run on images with encryption $2, if it cannot
+unavailable() {
+    case $1 in
+    kernel)
+        if [ "$EUID" -ne 0 ]; then
+            echo "kernel mounts require root"
+        elif [ ! -f "$LOLELFFS_MOD" ] && ! grep -q lolelffs /proc/filesystems; then
+            echo "$LOLELFFS_MOD not built"
+        fi
+        ;;
+    fuse)
+        if [ ! -x "$FUSE_BIN" ]; then
+            echo "$FUSE_BIN not built"
+        elif [ ! -e /dev/fuse ]; then
+            echo "/dev/fuse not available"
+        elif [ "$2" != none ]; then
+            echo "lolelffs-fuse cannot unlock encrypted images"
+        fi
+        ;;
+    *)
+        echo "unknown backend"
+        ;;
+    esac
+}
+
+mount_fs() {
+    local backend=$1 enc=$2
+
+    if [ "$backend" = kernel ]; then
+        mount -t lolelffs -o loop "$IMAGE" "$MNT"
+        if [ "$enc" != none ]; then
+            "$UNLOCK" "$MNT" "$PASSWORD" >/dev/null
+        fi
+    else
+        "$FUSE_BIN" "$IMAGE" "$MNT" --foreground >"$WORKDIR/fuse.log" 2>&1 &
+        FUSE_PID=$!
+        for _ in $(seq 1 500); do
+            if mountpoint -q "$MNT"; then
+                return 0
+            fi
+            if ! kill -0 "$FUSE_PID" 2>/dev/null; then
+                cat "$WORKDIR/fuse.log" >&2
+                return 1
+            fi
+            sleep 0.01
+        done
+        return 1
+    fi
+}
+
+unmount_fs() {
+    if [ -n "$FUSE_PID" ]; then
+        fusermount3 -u "$MNT" 2>/dev/null || fusermount -u "$MNT"
+        wait "$FUSE_PID" 2>/dev/null || true
+        FUSE_PID=
+    elif mountpoint -q "$MNT"; then
+        umount "$MNT"
+    fi
+}
+
+# Run workload $4 of bench_io with arguments $5..., and record it
+run() {
+    local backend=$1 comp=$2 enc=$3 workload=$4 result
+    shift 4
+
+    echo -n "  $workload... "
+    result=$(LOLELFFS_COMP=$comp "$BENCH_IO" "$workload" "$@")
+    echo "$result" | sed 's/.*"mb_per_s": \([0-9.]*\), "ops_per_s": \([0-9.]*\)/\1 MiB\/s, \2 ops\/s/'
+    record "$backend" "$comp" "$enc" "$workload" "$result"
+}
+
+# Time NR_MOUNTS mounts of an image holding the files of the other workloads
+time_mounts() {
+    local backend=$1 comp=$2 enc=$3 start total=0
+
+    echo -n "  mount... "
+    for _ in $(seq 1 "$NR_MOUNTS"); do
+        start=$(now_ns)
+        mount_fs "$backend" "$enc"
+        # The FUSE driver has mounted once the mount point answers
+        stat "$MNT/lookup" >/dev/null
+        total=$((total + $(now_ns) - start))
+        unmount_fs
+    done
+    local seconds
+    seconds=$(awk "BEGIN { printf \"%.6f\", $total / 1e9 / $NR_MOUNTS }")
+    echo "$seconds s"
+    record "$backend" "$comp" "$enc" "mount" \
+        "\"bytes\": 0, \"ops\": $NR_MOUNTS, \"seconds\": $seconds"
+}
+
+bench_image() {
+    local backend=$1 comp=$2 enc=$3 reason
+
+    echo ""
+    echo "=== $backend, compression $comp, encryption $enc ==="
+
+    reason=$(unavailable "$backend" "$enc")
+    if [ -n "$reason" ]; then
+        for w in seq_write seq_read rand_read rand_write create lookup mount; do
+            record "$backend" "$comp" "$enc" "$w" "\"skipped\": \"$reason\""
+        done
+        echo "  Skipped: $reason"
+        return 0
+    fi
+
+    rm -f "$IMAGE"
+    if [ "$enc" = none ]; then
+        "$LOLELFFS" mkfs "$IMAGE" --size "${SIZE_MB}M" >/dev/null
+    else
+        # The KDF only runs at unlock: keep it short, it is not measured
+        "$LOLELFFS" mkfs "$IMAGE" --size "${SIZE_MB}M" --encrypt \
+            --password "$PASSWORD" --algo "$enc" --iterations 1000 >/dev/null
+    fi
+
+    mount_fs "$backend" "$enc"
+    run "$backend" "$comp" "$enc" seq_write "$MNT" "$FILE_MB"
+    run "$backend" "$comp" "$enc" create "$MNT/small" "$NR_FILES"
+    # Made untimed, for the lookups to start from a cold cache
+    LOLELFFS_COMP=$comp "$BENCH_IO" create "$MNT/lookup" "$DIR_FILES" >/dev/null
+    unmount_fs
+
+    mount_fs "$backend" "$enc"
+    run "$backend" "$comp" "$enc" seq_read "$MNT"
+    unmount_fs
+
+    mount_fs "$backend" "$enc"
+    run "$backend" "$comp" "$enc" rand_read "$MNT" "$RAND_OPS"
+    run "$backend" "$comp" "$enc" rand_write "$MNT" "$RAND_OPS"
+    unmount_fs
+
+    mount_fs "$backend" "$enc"
+    run "$backend" "$comp" "$enc" lookup "$MNT/lookup" "$DIR_FILES"
+    unmount_fs
+
+    time_mounts "$backend" "$comp" "$enc"
+}
+
+for bin in "$LOLELFFS" "$BENCH_IO"; do
+    if [ ! -x "$bin" ]; then
+        echo "Error: $bin not found, run make benchmark-io from the top of the tree"
+        exit 1
+    fi
+done
+
+mkdir -p "$MNT"
+if [ "$EUID" -eq 0 ] && [ -f "$LOLELFFS_MOD" ] && ! grep -q lolelffs /proc/filesystems; then
+    insmod "$LOLELFFS_MOD"
+fi
+
+for backend in $BACKENDS; do
+    for enc in $ENC_MODES; do
+        for comp in $COMP_MODES; do
+            bench_image "$backend" "$comp" "$enc"
+        done
+    done
+done
+
+{
+    echo "{"
+    echo "  \"date\": \"$(date -u +%Y-%m-%dT%H:%M:%SZ)\","
+    echo "  \"commit\": \"$(git rev-parse --short HEAD 2>/dev/null || echo unknown)\","
+    echo "  \"kernel\": \"$(uname -r)\","
+    echo "  \"cpus\": $(nproc),"
+    echo "  \"config\": {\"image_mb\": $SIZE_MB, \"file_mb\": $FILE_MB, \"rand_ops\": $RAND_OPS, \"files\": $NR_FILES, \"dir_files\": $DIR_FILES, \"mounts\": $NR_MOUNTS},"
+    echo "  \"results\": ["
+    for i in "${!RECORDS[@]}"; do
+        if [ "$i" -lt $((${#RECORDS[@]} - 1)) ]; then
+            echo "    ${RECORDS[$i]},"
+        else
+            echo "    ${RECORDS[$i]}"
+        fi
+    done
+    echo "  ]"
+    echo "}"
+} >"$OUTPUT"
+
+echo ""
+echo "Results written to $OUTPUT"
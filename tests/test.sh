@@ -297,6 +297,68 @@ check_file_content overwrite_test "second"
 test_op 'ls -la' 0 "List directory"
 test_op 'ls -lR' 0 "Recursive list"
 
+print_header "Truncation"
+
+# Shrinking a file must give back the blocks past its new end, reserved or
+# allocated: 1 MiB truncated to 6000 bytes keeps 2 blocks. Even runs
+# truncate before the data is written back.
+for i in $(seq 1 10); do
+    wb=""
+    [ $((i % 2)) -eq 1 ] && wb="sync &&"
+    test_op "touch shrink_$i && sync && before=\$(stat -f -c %f .) && \
+             dd if=/dev/urandom of=shrink_$i bs=64K count=16 status=none && \
+             $wb truncate -s 6000 shrink_$i && sync && \
+             [ \$(stat -c %s shrink_$i) -eq 6000 ] && \
+             [ \$(stat -f -c %f .) -eq \$((before - 2)) ]" 0 "Shrink file $i, then count free blocks"
+done
+test_op "before=\$(stat -f -c %f .) && truncate -s 0 shrink_1 && sync && \
+         [ \$(stat -f -c %f .) -eq \$((before + 2)) ]" 0 "Truncate file to 0, then count free blocks"
+
+print_header "Inline File Truncation"
+
+# Inline files are only created by mkfs --from-dir: format a second image
+# whose files are stored in their inode (10 bytes) or in a shared tail block
+# (200 bytes), and compare each truncation with the same one on the host
+popd >/dev/null
+sudo umount test
+rm -rf inline_seed inline_expect
+mkdir inline_seed inline_expect
+for f in inline_up inline_down tail_down tail_up tail_otrunc tail_zero tail_kept; do
+    case $f in
+        inline_*) head -c 10 /dev/urandom > inline_seed/$f ;;
+        *) head -c 200 /dev/urandom > inline_seed/$f ;;
+    esac
+    cp inline_seed/$f inline_expect/$f
+done
+truncate -s 100 inline_expect/inline_up
+truncate -s 4 inline_expect/inline_down
+truncate -s 20 inline_expect/tail_down
+truncate -s 5000 inline_expect/tail_up
+echo "second" > inline_expect/tail_otrunc
+truncate -s 0 inline_expect/tail_zero
+EXPECT=$PWD/inline_expect
+cp "$IMAGE" fs_inline.elf
+./$MKFS -d inline_seed fs_inline.elf
+sudo mount -t lolelffs -o loop fs_inline.elf test
+pushd test >/dev/null
+
+test_op "truncate -s 100 inline_up && cmp inline_up $EXPECT/inline_up" 0 "Grow inline file past i_data"
+test_op "truncate -s 4 inline_down && cmp inline_down $EXPECT/inline_down" 0 "Shrink inline file"
+test_op "truncate -s 20 tail_down && cmp tail_down $EXPECT/tail_down" 0 "Shrink tail file into i_data"
+test_op "truncate -s 5000 tail_up && cmp tail_up $EXPECT/tail_up" 0 "Grow tail file"
+test_op "echo second > tail_otrunc && cmp tail_otrunc $EXPECT/tail_otrunc" 0 "Rewrite tail file with O_TRUNC"
+test_op "truncate -s 0 tail_zero && cmp tail_zero $EXPECT/tail_zero" 0 "Truncate tail file to 0"
+test_op "cmp tail_kept $EXPECT/tail_kept" 0 "Other file of the tail block is intact"
+
+# The same contents must come back from the disk
+popd >/dev/null
+sudo umount test
+sudo mount -t lolelffs -o loop fs_inline.elf test
+pushd test >/dev/null
+for f in inline_up inline_down tail_down tail_up tail_otrunc tail_zero tail_kept; do
+    test_op "cmp $f $EXPECT/$f" 0 "Remounted $f"
+done
+
 print_header "Cleanup and Verify"
 
 # Final listing
@@ -316,7 +378,8 @@ popd >/dev/null
 sleep 1
 sudo umount test
 sudo rmmod lolelffs
-sudo rm -f fs.elf
+sudo rm -f fs.elf fs_inline.elf
+rm -rf inline_seed inline_expect
 
 echo ""
 echo "Tests run:    $TESTS_RUN"
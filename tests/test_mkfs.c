@@ -67,6 +67,73 @@ static int run_mkfs(const char *filename)
     return system(cmd);
 }
 
+/* Helper function to run mkfs --from-dir on an image */
+static int run_mkfs_from_dir(const char *dir, const char *filename)
+{
+    char cmd[512];
+    snprintf(cmd, sizeof(cmd), "./mkfs.lolelffs --from-dir %s %s > /dev/null 2>&1",
+             dir, filename);
+    return system(cmd);
+}
+
+/* Helper function to read a block */
+static int read_block(const char *filename, uint32_t block, void *buf)
+{
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return -1;
+
+    ssize_t ret = pread(fd, buf, LOLELFFS_BLOCK_SIZE,
+                        (off_t) block * LOLELFFS_BLOCK_SIZE);
+    close(fd);
+
+    return (ret == LOLELFFS_BLOCK_SIZE) ? 0 : -1;
+}
+
+/* Helper function to write a block */
+static int write_block(const char *filename, uint32_t block, const void *buf)
+{
+    int fd = open(filename, O_WRONLY);
+    if (fd < 0)
+        return -1;
+
+    ssize_t ret = pwrite(fd, buf, LOLELFFS_BLOCK_SIZE,
+                         (off_t) block * LOLELFFS_BLOCK_SIZE);
+    close(fd);
+
+    return (ret == LOLELFFS_BLOCK_SIZE) ? 0 : -1;
+}
+
+/* Helper function to flip bit nr of the bitmap starting at block start */
+static int flip_bitmap_bit(const char *filename, uint32_t start, uint32_t nr)
+{
+    uint8_t block[LOLELFFS_BLOCK_SIZE];
+    uint32_t b = start + nr / (LOLELFFS_BLOCK_SIZE * 8);
+
+    if (read_block(filename, b, block) < 0)
+        return -1;
+    nr %= LOLELFFS_BLOCK_SIZE * 8;
+    block[nr / 8] ^= 1 << (nr % 8);
+    return write_block(filename, b, block);
+}
+
+/* Helper function to run fsck.lolelffs with options, its output to out */
+static int run_fsck(const char *options, const char *filename, const char *out)
+{
+    char cmd[512];
+    snprintf(cmd, sizeof(cmd), "./fsck.lolelffs %s %s > %s 2>&1",
+             options, filename, out);
+    return system(cmd);
+}
+
+/* Helper function to look for a line in the output of run_fsck() */
+static int output_has(const char *out, const char *text)
+{
+    char cmd[512];
+    snprintf(cmd, sizeof(cmd), "grep -q '%s' %s", text, out);
+    return system(cmd) == 0;
+}
+
 /* Helper function to read superblock */
 static int read_superblock(const char *filename, struct superblock *sb)
 {
@@ -483,6 +550,318 @@ static int test_block_sum(void)
     return 1;
 }
 
+/* Test populating a new image from a directory tree */
+static int test_from_dir_sized(void)
+{
+    const char *img = "test/test_fromdir.img";
+    const char *dir = "test/fromdir";
+    char cmd[512];
+
+    /* 20 files in the root, only the first one with data */
+    snprintf(cmd, sizeof(cmd),
+             "rm -rf %s && mkdir -p %s/sub && "
+             "head -c 10000 /dev/zero > %s/data && "
+             "for i in $(seq 1 19); do : > %s/f$i; done", dir, dir, dir, dir);
+    ASSERT(system(cmd) == 0);
+    unlink(img);
+    ASSERT(run_mkfs_from_dir(dir, img) == 0);
+
+    struct superblock sb;
+    ASSERT(read_superblock(img, &sb) == 0);
+    ASSERT_EQ(le32toh(sb.info.magic), LOLELFFS_MAGIC);
+
+    /* root, sub, data and f1..f19 in a single block of inodes */
+    uint32_t nr_inodes = le32toh(sb.info.nr_inodes);
+    ASSERT_EQ(nr_inodes, LOLELFFS_INODES_PER_BLOCK);
+    ASSERT_EQ(le32toh(sb.info.nr_free_inodes), nr_inodes - 22);
+
+    /* Root: ei + 2 entry blocks + index root and leaf, and its files */
+    struct stat st;
+    ASSERT(stat(img, &st) == 0);
+    uint32_t nr_blocks = le32toh(sb.info.nr_blocks);
+    ASSERT_EQ((uint64_t) st.st_size, (uint64_t) nr_blocks * LOLELFFS_BLOCK_SIZE);
+
+    uint32_t first_data = 1 + le32toh(sb.info.nr_istore_blocks) +
+                          le32toh(sb.info.nr_ifree_blocks) +
+                          le32toh(sb.info.nr_bfree_blocks);
+    uint32_t nr_data = 5 + (1 + 3) + 1;
+    ASSERT(nr_blocks > 100);
+    ASSERT_EQ(le32toh(sb.info.nr_free_blocks), nr_blocks - first_data - nr_data);
+
+    uint8_t block[LOLELFFS_BLOCK_SIZE];
+    ASSERT(read_block(img, 1, block) == 0);
+    struct lolelffs_inode *inodes = (struct lolelffs_inode *) block;
+    ASSERT_EQ(le32toh(inodes[0].ei_block), first_data);
+    ASSERT_EQ(le32toh(inodes[0].i_nlink), 3);
+
+    /* Root entries are sorted, and indexed past one block */
+    ASSERT(read_block(img, first_data, block) == 0);
+    uint32_t *ei = (uint32_t *) block;
+    ASSERT_EQ(le32toh(ei[0]), 21);
+    struct lolelffs_extent *ext = (struct lolelffs_extent *) (block + 4);
+    ASSERT_EQ(le32toh(ext[0].ee_start), first_data + 1);
+    ASSERT_EQ(le32toh(ext[0].ee_len), 2);
+    uint32_t dx_block = le32toh(ei[1 + LOLELFFS_MAX_EXTENTS *
+                                   sizeof(struct lolelffs_extent) / 4]);
+    ASSERT_EQ(dx_block, first_data + 3);
+
+    ASSERT(read_block(img, first_data + 1, block) == 0);
+    struct lolelffs_file *files = (struct lolelffs_file *) block;
+    ASSERT(strcmp(files[0].filename, "data") == 0);
+    ASSERT(strcmp(files[1].filename, "f1") == 0);
+
+    /* "data" is laid out right after the root, in one extent */
+    uint32_t data_ino = le32toh(files[0].inode);
+    ASSERT_EQ(data_ino, 1);
+    ASSERT(read_block(img, 1, block) == 0);
+    ASSERT_EQ(le32toh(inodes[1].i_size), 10000);
+    ASSERT_EQ(le32toh(inodes[1].ei_block), first_data + 5);
+    ASSERT(read_block(img, first_data + 5, block) == 0);
+    ASSERT_EQ(le32toh(ext[0].ee_start), first_data + 6);
+    ASSERT_EQ(le32toh(ext[0].ee_len), 3);
+    ASSERT_EQ(le32toh(ext[1].ee_len), 0);
+
+    /* The empty files are inline, without any block */
+    ASSERT(read_block(img, 1, block) == 0);
+    ASSERT_EQ(le32toh(inodes[2].i_size), 0);
+    ASSERT_EQ(le32toh(inodes[2].ei_block), 0);
+    ASSERT_EQ(le32toh(inodes[2].i_blocks), 0);
+
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+    ASSERT(system(cmd) == 0);
+    unlink(img);
+    return 1;
+}
+
+/* Test populating an image large enough for the tree */
+static int test_from_dir_existing_image(void)
+{
+    const char *img = "test/test_fromdir_fixed.img";
+    const char *dir = "test/fromdir_fixed";
+    char cmd[512];
+
+    snprintf(cmd, sizeof(cmd), "rm -rf %s && mkdir -p %s && echo hi > %s/hello",
+             dir, dir, dir);
+    ASSERT(system(cmd) == 0);
+    ASSERT(create_test_image(img, 10) == 0);
+    ASSERT(run_mkfs_from_dir(dir, img) == 0);
+
+    struct superblock sb;
+    ASSERT(read_superblock(img, &sb) == 0);
+
+    /* Same geometry as a plain mkfs, with two inodes and two blocks used */
+    uint32_t nr_inodes = le32toh(sb.info.nr_inodes);
+    ASSERT_EQ(le32toh(sb.info.nr_blocks), 2560);
+    ASSERT_EQ(nr_inodes % LOLELFFS_INODES_PER_BLOCK, 0);
+    ASSERT(nr_inodes >= 2560);
+    ASSERT_EQ(le32toh(sb.info.nr_free_inodes), nr_inodes - 2);
+
+    uint32_t metadata = 1 + le32toh(sb.info.nr_istore_blocks) +
+                        le32toh(sb.info.nr_ifree_blocks) +
+                        le32toh(sb.info.nr_bfree_blocks);
+    ASSERT_EQ(le32toh(sb.info.nr_free_blocks), 2560 - metadata - 2);
+
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+    ASSERT(system(cmd) == 0);
+    unlink(img);
+    return 1;
+}
+
+/* Test that small files are stored inline or packed into tail blocks */
+static int test_from_dir_inline(void)
+{
+    const char *img = "test/test_fromdir_inline.img";
+    const char *dir = "test/fromdir_inline";
+    char cmd[512];
+
+    /* "b" does not fit in the tail block opened by "a", "c" goes with "b" */
+    snprintf(cmd, sizeof(cmd),
+             "rm -rf %s && mkdir -p %s && echo tiny > %s/tiny && "
+             "head -c 3000 /dev/zero | tr '\\0' a > %s/a && "
+             "head -c 2000 /dev/zero | tr '\\0' b > %s/b && "
+             "head -c 1000 /dev/zero | tr '\\0' c > %s/c",
+             dir, dir, dir, dir, dir, dir);
+    ASSERT(system(cmd) == 0);
+    unlink(img);
+    ASSERT(run_mkfs_from_dir(dir, img) == 0);
+
+    struct superblock sb;
+    ASSERT(read_superblock(img, &sb) == 0);
+    ASSERT(le32toh(sb.info.comp_features) & LOLELFFS_FEATURE_INLINE_DATA);
+
+    /* Root ei and entry block, then the two tail blocks */
+    uint32_t nr_blocks = le32toh(sb.info.nr_blocks);
+    uint32_t first_data = 1 + le32toh(sb.info.nr_istore_blocks) +
+                          le32toh(sb.info.nr_ifree_blocks) +
+                          le32toh(sb.info.nr_bfree_blocks);
+    ASSERT_EQ(le32toh(sb.info.nr_free_blocks), nr_blocks - first_data - 4);
+    ASSERT_EQ(le32toh(sb.info.tail_block), first_data + 3);
+
+    /* Entries are sorted: a, b, c, tiny */
+    uint8_t block[LOLELFFS_BLOCK_SIZE];
+    struct lolelffs_inode inodes[5];
+    struct lolelffs_tail_ref ref;
+    ASSERT(read_block(img, 1, block) == 0);
+    memcpy(inodes, block, sizeof(inodes));
+
+    ASSERT_EQ(le32toh(inodes[4].i_size), 5);
+    ASSERT_EQ(le32toh(inodes[4].ei_block), 0);
+    ASSERT(memcmp(inodes[4].i_data, "tiny\n", 5) == 0);
+
+    const uint32_t sizes[] = {3000, 2000, 1000};
+    const uint32_t blocks[] = {first_data + 2, first_data + 3, first_data + 3};
+    const uint32_t offsets[] = {16, 16, 16 + 2000};
+    for (int i = 0; i < 3; i++) {
+        ASSERT_EQ(le32toh(inodes[1 + i].i_size), sizes[i]);
+        ASSERT_EQ(le32toh(inodes[1 + i].ei_block), 0);
+        ASSERT_EQ(le32toh(inodes[1 + i].i_blocks), 0);
+        memcpy(&ref, inodes[1 + i].i_data, sizeof(ref));
+        ASSERT_EQ(le32toh(ref.tr_block), blocks[i]);
+        ASSERT_EQ(le32toh(ref.tr_offset), offsets[i]);
+
+        ASSERT(read_block(img, blocks[i], block) == 0);
+        for (uint32_t b = 0; b < sizes[i]; b++)
+            ASSERT_EQ(block[offsets[i] + b], 'a' + i);
+    }
+
+    struct lolelffs_tail_header *th = (struct lolelffs_tail_header *) block;
+    ASSERT_EQ(le32toh(th->th_magic), LOLELFFS_TAIL_MAGIC);
+    ASSERT_EQ(le32toh(th->th_nr_tails), 2);
+    ASSERT_EQ(le32toh(th->th_used), 16 + 2000 + 1000);
+
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+    ASSERT(system(cmd) == 0);
+    unlink(img);
+    return 1;
+}
+
+/* Test that --from-dir rejects a source that is not a directory */
+static int test_from_dir_not_a_directory(void)
+{
+    const char *img = "test/test_fromdir_bad.img";
+
+    ASSERT(create_test_image(img, 1) == 0);
+    ASSERT(run_mkfs_from_dir(img, img) != 0);
+
+    unlink(img);
+    return 1;
+}
+
+/*
+ * Test that fsck.lolelffs -f reports counters that disagree with the
+ * bitmaps, on an image with tail blocks, shared extents and an orphan, and
+ * that -r repairs them so that another full check is clean
+ */
+static int test_fsck_full_repair(void)
+{
+    const char *img = "test/test_fsck.img";
+    const char *dir = "test/fsck";
+    const char *out = "test/test_fsck.out";
+    char cmd[512];
+
+    /* "a" and "b" share a tail block, "dup1" and "dup2" hold the same data */
+    snprintf(cmd, sizeof(cmd),
+             "rm -rf %s && mkdir -p %s && "
+             "head -c 3000 /dev/zero | tr '\\0' a > %s/a && "
+             "head -c 1000 /dev/zero | tr '\\0' b > %s/b && "
+             "head -c 16384 /dev/urandom > %s/dup1 && cp %s/dup1 %s/dup2",
+             dir, dir, dir, dir, dir, dir, dir);
+    ASSERT(system(cmd) == 0);
+    unlink(img);
+    ASSERT(run_mkfs_from_dir(dir, img) == 0);
+    ASSERT(run_fsck("-f", img, out) == 0);
+
+    struct superblock sb;
+    ASSERT(read_superblock(img, &sb) == 0);
+    uint32_t ifree_start = 1 + le32toh(sb.info.nr_istore_blocks);
+    uint32_t bfree_start = ifree_start + le32toh(sb.info.nr_ifree_blocks);
+    uint32_t nr_used_inodes = le32toh(sb.info.nr_inodes) -
+                              le32toh(sb.info.nr_free_inodes);
+
+    /* Entries are sorted: a, b, dup1, dup2 */
+    uint8_t block[LOLELFFS_BLOCK_SIZE];
+    struct lolelffs_inode *inodes = (struct lolelffs_inode *) block;
+    struct lolelffs_extent *ext = (struct lolelffs_extent *) (block + 4);
+    ASSERT_EQ(nr_used_inodes, 5);
+    ASSERT(read_block(img, 1, block) == 0);
+    ASSERT_EQ(le32toh(inodes[1].ei_block), 0);
+    ASSERT_EQ(le32toh(inodes[2].ei_block), 0);
+    uint32_t ei1 = le32toh(inodes[3].ei_block);
+    uint32_t ei2 = le32toh(inodes[4].ei_block);
+
+    /* Map the blocks of dup1 from dup2 too, as dedup does, and free its own */
+    struct lolelffs_extent shared;
+    ASSERT(read_block(img, ei1, block) == 0);
+    ASSERT_EQ(le32toh(ext[0].ee_len), 4);
+    ASSERT_EQ(le16toh(ext[0].ee_flags), 0);
+    ext[0].ee_flags = htole16(LOLELFFS_EXT_SHARED);
+    shared = ext[0];
+    ASSERT(write_block(img, ei1, block) == 0);
+
+    ASSERT(read_block(img, ei2, block) == 0);
+    ASSERT_EQ(le32toh(ext[0].ee_len), 4);
+    uint32_t old_start = le32toh(ext[0].ee_start);
+    ext[0] = shared;
+    ASSERT(write_block(img, ei2, block) == 0);
+    for (uint32_t i = 0; i < 4; i++)
+        ASSERT(flip_bitmap_bit(img, bfree_start, old_start + i) == 0);
+
+    /*
+     * Give them an orphan, as the kernel module leaves when dup2 stops
+     * mapping the shared blocks: an inode with no link, in the old first
+     * block of dup2, mapping them too
+     */
+    uint32_t orphan_ino = nr_used_inodes, orphan_ei = old_start;
+    ASSERT(flip_bitmap_bit(img, ifree_start, orphan_ino) == 0);
+    ASSERT(flip_bitmap_bit(img, bfree_start, orphan_ei) == 0);
+    memset(block, 0, sizeof(block));
+    ext[0] = shared;
+    ASSERT(write_block(img, orphan_ei, block) == 0);
+    ASSERT(read_block(img, 1, block) == 0);
+    inodes[orphan_ino].i_mode = htole32(S_IFREG);
+    inodes[orphan_ino].i_size = htole32(4 * LOLELFFS_BLOCK_SIZE);
+    inodes[orphan_ino].i_blocks = htole32(4 + 1);
+    inodes[orphan_ino].i_nlink = 0;
+    inodes[orphan_ino].ei_block = htole32(orphan_ei);
+    ASSERT(write_block(img, 1, block) == 0);
+
+    struct lolelffs_sb_info *info = (struct lolelffs_sb_info *) block;
+    ASSERT(read_block(img, 0, block) == 0);
+    info->comp_features |= htole32(LOLELFFS_FEATURE_SHARED_EXTENTS);
+    ASSERT(write_block(img, 0, block) == 0);
+
+    /* The counters were left as mkfs wrote them: 3 blocks, 1 inode off */
+    uint32_t free_blocks = le32toh(sb.info.nr_free_blocks);
+    uint32_t free_inodes = le32toh(sb.info.nr_free_inodes);
+
+    ASSERT(run_fsck("-f", img, out) != 0);
+    ASSERT(output_has(out, "Inode bitmap free count mismatch"));
+    ASSERT(output_has(out, "Block bitmap free count mismatch"));
+    ASSERT(!output_has(out, "also used by"));
+    ASSERT(output_has(out, "1 orphans"));
+
+    /* A check alone leaves the image as it is */
+    struct superblock after;
+    ASSERT(read_superblock(img, &after) == 0);
+    ASSERT_EQ(le32toh(after.info.nr_free_blocks), free_blocks);
+
+    /* The repairing run still fails, for the errors it found first */
+    ASSERT(run_fsck("-f -r", img, out) != 0);
+    ASSERT(output_has(out, "Repaired superblock"));
+    ASSERT(read_superblock(img, &after) == 0);
+    ASSERT_EQ(le32toh(after.info.nr_free_blocks), free_blocks + 3);
+    ASSERT_EQ(le32toh(after.info.nr_free_inodes), free_inodes - 1);
+
+    ASSERT(run_fsck("-f", img, out) == 0);
+    ASSERT(output_has(out, "Filesystem OK"));
+
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+    ASSERT(system(cmd) == 0);
+    unlink(out);
+    unlink(img);
+    return 1;
+}
+
 int main(void)
 {
     printf("Running mkfs.lolelffs tests...\n\n");
@@ -520,6 +899,15 @@ int main(void)
     TEST(multiple_mkfs);
     TEST(various_sizes);
 
+    printf("\nPopulate Tests:\n");
+    TEST(from_dir_sized);
+    TEST(from_dir_existing_image);
+    TEST(from_dir_inline);
+    TEST(from_dir_not_a_directory);
+
+    printf("\nfsck Tests:\n");
+    TEST(fsck_full_repair);
+
     printf("\n========================================\n");
     printf("Tests passed: %d/%d\n", tests_passed, tests_run);
     printf("========================================\n");
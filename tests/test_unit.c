@@ -268,6 +268,24 @@ static int test_extent_structure(void)
     return 1;
 }
 
+/* Test compression metadata block layout */
+static int test_comp_metadata_structure(void)
+{
+    struct lolelffs_comp_metadata meta;
+
+    ASSERT_EQ(sizeof(struct lolelffs_comp_block_meta), 4);
+    ASSERT_EQ(sizeof(meta), LOLELFFS_BLOCK_SIZE);
+
+    /* A full extent with metadata must be described by a single block */
+    ASSERT(LOLELFFS_MAX_BLOCKS_PER_EXTENT / LOLELFFS_COMP_CLUSTER_BLOCKS <=
+           LOLELFFS_COMP_META_ENTRIES);
+
+    /* Cluster compressed sizes must fit the 16-bit comp_size field */
+    ASSERT(LOLELFFS_COMP_CLUSTER_SIZE <= 65536);
+
+    return 1;
+}
+
 /* Test file entry structure */
 static int test_file_entry_structure(void)
 {
@@ -285,6 +303,38 @@ static int test_file_entry_structure(void)
     return 1;
 }
 
+/* Test hashed directory index structures */
+static int test_dx_structures(void)
+{
+    ASSERT_EQ(sizeof(struct lolelffs_dx_entry), 8);
+    ASSERT_EQ(sizeof(struct lolelffs_dx_root), LOLELFFS_BLOCK_SIZE);
+    ASSERT_EQ(sizeof(struct lolelffs_dx_leaf), LOLELFFS_BLOCK_SIZE);
+
+    /* Index is only built once a directory outgrows one block */
+    ASSERT_EQ(LOLELFFS_DX_MIN_FILES, LOLELFFS_FILES_PER_BLOCK);
+    return 1;
+}
+
+/* Test extent tree structures */
+static int test_ext_tree_structures(void)
+{
+    ASSERT_EQ(sizeof(struct lolelffs_ext_tree_header), 8);
+    ASSERT_EQ(sizeof(struct lolelffs_ext_tree_idx), 8);
+    ASSERT(sizeof(struct lolelffs_ext_tree_node) <= LOLELFFS_BLOCK_SIZE);
+
+    /* A leaf holds as many extents as a plain extent index block */
+    ASSERT_EQ(LOLELFFS_EXT_TREE_LEAF_ENTRIES, LOLELFFS_MAX_EXTENTS);
+    ASSERT_EQ(LOLELFFS_EXT_TREE_IDX_ENTRIES, 511);
+
+    /* A plain extent index of a regular file has no file count */
+    struct lolelffs_ext_tree_node node;
+    memset(&node, 0, sizeof(node));
+    ASSERT(!lolelffs_ext_is_tree(&node));
+    node.eh.eh_magic = LOLELFFS_EXT_TREE_MAGIC;
+    ASSERT(lolelffs_ext_is_tree(&node));
+    return 1;
+}
+
 /* Test superblock padding */
 static int test_superblock_padding(void)
 {
@@ -410,6 +460,20 @@ static int test_dir_entries_per_extent(void)
     return 1;
 }
 
+/* Test directory index name hash (32-bit FNV-1a) */
+static int test_dx_hash(void)
+{
+    ASSERT_EQ(lolelffs_dx_hash("", 0), 0x811c9dc5);
+    ASSERT_EQ(lolelffs_dx_hash("a", 1), 0xe40c292c);
+    ASSERT_EQ(lolelffs_dx_hash("foobar", 6), 0xbf9cf968);
+
+    /* On-disk names are NUL padded: hashing stops at the NUL or at len */
+    ASSERT_EQ(lolelffs_dx_hash("ab\0cd", 5), lolelffs_dx_hash("ab", 2));
+    ASSERT_EQ(lolelffs_dx_hash("abc", 2), lolelffs_dx_hash("ab", 2));
+    ASSERT(lolelffs_dx_hash("ab", 2) != lolelffs_dx_hash("ba", 2));
+    return 1;
+}
+
 /* Test symlink data size limit */
 static int test_symlink_data_limit(void)
 {
@@ -427,6 +491,70 @@ static int test_symlink_data_limit(void)
     return 1;
 }
 
+/* Test inline data limits */
+static int test_inline_data_limits(void)
+{
+    struct lolelffs_inode inode;
+
+    /* Inline data fills i_data, which also holds a tail reference */
+    ASSERT_EQ(LOLELFFS_INLINE_DATA_SIZE, sizeof(inode.i_data));
+    ASSERT(sizeof(struct lolelffs_tail_ref) <= sizeof(inode.i_data));
+
+    /* A tail block holds one file of up to the block minus its header */
+    ASSERT_EQ(sizeof(struct lolelffs_tail_header), 16);
+    ASSERT_EQ(LOLELFFS_TAIL_MAX_SIZE, 4080);
+    ASSERT(LOLELFFS_TAIL_MAX_SIZE > LOLELFFS_INLINE_DATA_SIZE);
+
+    return 1;
+}
+
+/* Test the room for xattr sets stored in their index block */
+static int test_xattr_inline_limits(void)
+{
+    /* Entries start after the first extent, left empty */
+    ASSERT_EQ(sizeof(struct lolelffs_xattr_entry), 12);
+    ASSERT_EQ(LOLELFFS_XATTR_INLINE_OFFSET, 32);
+    ASSERT_EQ(LOLELFFS_XATTR_INLINE_SIZE, 4064);
+    ASSERT(sizeof(struct lolelffs_xattr_ei_block) <= LOLELFFS_BLOCK_SIZE);
+    ASSERT(LOLELFFS_XATTR_INLINE_SIZE < LOLELFFS_XATTR_MAX_SIZE);
+
+    return 1;
+}
+
+/* Test the adaptive compression policy limits */
+static int test_comp_policy_limits(void)
+{
+    uint64_t n = LOLELFFS_COMP_SAMPLE_SIZE;
+
+    /* Entropy is estimated in quarter bits per byte, 32 at most */
+    ASSERT(LOLELFFS_COMP_ENTROPY_MAX < 32);
+    /* The squared squares of sample counts fit in 64 bits */
+    ASSERT(n * n * n * n / n / n / n == n);
+    ASSERT(LOLELFFS_COMP_SAMPLE_SIZE <= LOLELFFS_BLOCK_SIZE);
+    /* The sample is made of whole runs */
+    ASSERT(LOLELFFS_COMP_SAMPLE_SIZE % LOLELFFS_COMP_SAMPLE_RUN == 0);
+    ASSERT(LOLELFFS_COMP_MAX_FAILS < LOLELFFS_COMP_RETRY_INTERVAL);
+
+    return 1;
+}
+
+/* Test that the shared extent flag and feature take bits of their own */
+static int test_shared_extent_flags(void)
+{
+    uint32_t flags = LOLELFFS_EXT_COMPRESSED | LOLELFFS_EXT_ENCRYPTED |
+                     LOLELFFS_EXT_HAS_META | LOLELFFS_EXT_MIXED;
+    uint32_t features = LOLELFFS_FEATURE_LARGE_EXTENTS | LOLELFFS_FEATURE_DIR_INDEX |
+                        LOLELFFS_FEATURE_EXTENT_TREE | LOLELFFS_FEATURE_INLINE_DATA |
+                        LOLELFFS_FEATURE_XATTR_INLINE;
+
+    ASSERT_EQ(flags & LOLELFFS_EXT_SHARED, 0);
+    ASSERT_EQ(features & LOLELFFS_FEATURE_SHARED_EXTENTS, 0);
+    /* ee_flags is 16 bits wide */
+    ASSERT(LOLELFFS_EXT_SHARED <= 0xffff);
+
+    return 1;
+}
+
 /* Test inode block calculation */
 static int test_inode_block_calculation(void)
 {
@@ -468,7 +596,10 @@ int main(void)
     TEST(inode_structure);
     TEST(sb_info_size);
     TEST(extent_structure);
+    TEST(comp_metadata_structure);
     TEST(file_entry_structure);
+    TEST(dx_structures);
+    TEST(ext_tree_structures);
     TEST(superblock_padding);
 
     printf("\nCalculations:\n");
@@ -487,11 +618,16 @@ int main(void)
     TEST(adaptive_alloc_sizing);
     TEST(extent_search_edge_cases);
     TEST(dir_entries_per_extent);
+    TEST(dx_hash);
     TEST(inode_block_calculation);
 
     printf("\nMiscellaneous:\n");
     TEST(endianness);
     TEST(symlink_data_limit);
+    TEST(inline_data_limits);
+    TEST(xattr_inline_limits);
+    TEST(comp_policy_limits);
+    TEST(shared_extent_flags);
 
     printf("\n========================================\n");
     printf("Tests passed: %d/%d\n", tests_passed, tests_run);